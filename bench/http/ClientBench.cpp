@@ -0,0 +1,82 @@
+#include <memory>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include <http/lwhttp.h>
+
+#include "LoopbackServer.h"
+
+/* One loopback origin and one client shared by every benchmark thread, as an application would share them */
+struct SharedClient
+{
+	explicit SharedClient(bool tls) : server(serverOptions(tls)), url(server.getOrigin() + "/bench")
+	{
+		signal(SIGPIPE, SIG_IGN);
+		client = HttpClientBuilder::newBuilder().userAgent("lwhttp-bench").build();
+		request = HttpRequestBuilder::newBuilder().url(url).GET().build();
+	}
+
+	static LoopbackServer::Options serverOptions(bool tls)
+	{
+		LoopbackServer::Options options;
+		options.tls = tls;
+		options.bodySize = 256;
+		return options;
+	}
+
+	LoopbackServer server;
+	URL url;
+	std::shared_ptr<HttpClient> client;
+	HttpRequest request;
+};
+
+/*********************** HttpClient ***********************/
+/* Keep-alive GETs through one client from 1 to 64 threads, items/s should grow with the cores available */
+static void BM_HttpClientSend(benchmark::State &state)
+{
+	static SharedClient plain(false);
+	static SharedClient tls(true);
+	SharedClient &shared = (state.range(0) != 0) ? tls : plain;
+	for (auto _: state)
+	{
+		HttpResponse response;
+		if (0 == shared.client->send(shared.request, response))
+		{
+			state.SkipWithError("send failed");
+			break;
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+BENCHMARK(BM_HttpClientSend)->ArgName("tls")->Arg(0)->Arg(1)->ThreadRange(1, 64)->UseRealTime();
+
+/* Keep-alive GETs from one thread over a loopback port and over a Unix socket, the gap is the TCP stack's share */
+static void BM_HttpClientTransport(benchmark::State &state)
+{
+	LoopbackServer::Options options;
+	options.bodySize = static_cast<size_t>(state.range(1));
+	if (state.range(0) != 0)
+	{
+		options.unixPath = "/tmp/lwhttp-bench-" + std::to_string(getpid()) + ".sock";
+	}
+	LoopbackServer server(options);
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().userAgent("lwhttp-bench").build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.getOrigin() + "/bench")).GET().build();
+	for (auto _: state)
+	{
+		HttpResponse response;
+		if (0 == client->send(request, response))
+		{
+			state.SkipWithError("send failed");
+			break;
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(1));
+}
+
+BENCHMARK(BM_HttpClientTransport)->ArgNames({"unix", "body"})->ArgsProduct({{0, 1}, {256, 64 * 1024}})->UseRealTime();
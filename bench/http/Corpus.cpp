@@ -0,0 +1,60 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "Corpus.h"
+
+static std::vector<std::string> readEntries(const std::string &fileName)
+{
+	std::ifstream ifs(std::string(LWHTTP_BENCH_CORPUS_DIR) + "/" + fileName);
+	if (!ifs)
+	{
+		throw std::runtime_error("Can not open corpus file " + fileName);
+	}
+	std::vector<std::string> entries;
+	std::string entry;
+	std::string line;
+	while (std::getline(ifs, line))
+	{
+		if (line == "%%")
+		{
+			entries.push_back(entry);
+			entry.clear();
+			continue;
+		}
+		entry += line + "\r\n";
+	}
+	if (!entry.empty())
+	{
+		entries.push_back(entry);
+	}
+	return entries;
+}
+
+const Corpus &Corpus::instance()
+{
+	static const Corpus corpus = []()
+	{
+		Corpus tmp;
+		tmp.responses = readEntries("responses.txt");
+		tmp.requests = readEntries("requests.txt");
+		for (auto &url: readEntries("urls.txt"))
+		{
+			std::stringstream ss(url);
+			std::string line;
+			while (std::getline(ss, line))
+			{
+				if (!line.empty() && (line.back() == '\r'))
+				{
+					line.pop_back();
+				}
+				if (!line.empty())
+				{
+					tmp.urls.push_back(line);
+				}
+			}
+		}
+		return tmp;
+	}();
+	return corpus;
+}
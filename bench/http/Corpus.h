@@ -0,0 +1,19 @@
+#ifndef LWHTTP_BENCH_CORPUS_H
+#define LWHTTP_BENCH_CORPUS_H
+
+#include <string>
+#include <vector>
+
+/* Checked-in message heads under bench/corpus, stored with LF line ends and a "%%" line between entries */
+struct Corpus
+{
+	/* Complete response heads with CRLF line ends, each ends with an empty line */
+	std::vector<std::string> responses;
+	/* Request heads, the first line is "METHOD absolute-url" */
+	std::vector<std::string> requests;
+	std::vector<std::string> urls;
+
+	static const Corpus &instance();
+};
+
+#endif //LWHTTP_BENCH_CORPUS_H
@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+
+#include <http/lwhttp.h>
+
+#include "LoopbackServer.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* Drives HttpClient against the embedded loopback server and reports throughput and latency as JSON.
+ *
+ * Fixed concurrency (closed loop): --concurrency workers send back to back.
+ * Fixed rate (open loop): --rate requests per second are scheduled up front and latency is measured from the
+ * scheduled start, so a stalled request does not hide the queueing it causes (coordinated omission).
+ * Async (closed loop): --concurrency requests stay in flight on the client's event loops, each completion sends the
+ * next one from the loop thread. */
+struct LoadOptions
+{
+	unsigned int concurrency = 16;
+	double rate = 0;
+	double duration = 10;
+	double warmup = 1;
+	size_t bodySize = 1024;
+	size_t requestBodySize = 0;
+	bool keepAlive = true;
+	bool tls = false;
+	bool chunked = false;
+	bool prepared = false;
+	bool async = false;
+	/* Event loops of the async client, 0 for one per CPU */
+	unsigned int loops = 0;
+	bool pin = false;
+	/* Adaptive per-origin concurrency limit, 0 for none */
+	unsigned int limit = 0;
+	/* Hedge GETs at the rolling p95 */
+	bool hedge = false;
+	/* none, pool (per thread) or monotonic (per request) */
+	std::string arena = "none";
+	std::string out;
+};
+
+static void usage()
+{
+	std::cerr << "usage: lwhttp-loadgen [--concurrency=N] [--rate=RPS] [--duration=SEC] [--warmup=SEC]\n"
+	             "                      [--body-size=BYTES] [--request-body-size=BYTES] [--keep-alive=0|1]\n"
+	             "                      [--tls=0|1] [--chunked=0|1] [--prepared=0|1]\n"
+	             "                      [--async=0|1] [--loops=N] [--pin=0|1] [--limit=N]\n"
+	             "                      [--hedge=0|1]\n"
+	             "                      [--arena=none|pool|monotonic] [--out=FILE]\n";
+}
+
+static bool parseOptions(int argc, char **argv, LoadOptions &options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t delimiter = arg.find('=');
+		if ((arg.compare(0, 2, "--") != 0) || (delimiter == std::string::npos))
+		{
+			return false;
+		}
+		std::string name = arg.substr(2, delimiter - 2);
+		std::string value = arg.substr(delimiter + 1);
+		if (name == "concurrency")
+		{
+			options.concurrency = std::max(1, std::stoi(value));
+		}
+		else if (name == "rate")
+		{
+			options.rate = std::stod(value);
+		}
+		else if (name == "duration")
+		{
+			options.duration = std::stod(value);
+		}
+		else if (name == "warmup")
+		{
+			options.warmup = std::stod(value);
+		}
+		else if (name == "body-size")
+		{
+			options.bodySize = std::stoul(value);
+		}
+		else if (name == "request-body-size")
+		{
+			options.requestBodySize = std::stoul(value);
+		}
+		else if (name == "keep-alive")
+		{
+			options.keepAlive = (value != "0");
+		}
+		else if (name == "tls")
+		{
+			options.tls = (value != "0");
+		}
+		else if (name == "chunked")
+		{
+			options.chunked = (value != "0");
+		}
+		else if (name == "prepared")
+		{
+			options.prepared = (value != "0");
+		}
+		else if (name == "async")
+		{
+			options.async = (value != "0");
+		}
+		else if (name == "loops")
+		{
+			options.loops = std::stoul(value);
+		}
+		else if (name == "pin")
+		{
+			options.pin = (value != "0");
+		}
+		else if (name == "limit")
+		{
+			options.limit = std::stoul(value);
+		}
+		else if (name == "hedge")
+		{
+			options.hedge = (value != "0");
+		}
+		else if (name == "arena")
+		{
+			if ((value != "none") && (value != "pool") && (value != "monotonic"))
+			{
+				return false;
+			}
+			options.arena = value;
+		}
+		else if (name == "out")
+		{
+			options.out = value;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	/* Neither a fixed rate nor a prepared request is driven on the event loops */
+	return !options.async || ((options.rate <= 0) && !options.prepared);
+}
+
+struct WorkerResult
+{
+	std::vector<uint64_t> latencies;
+	uint64_t errors = 0;
+	uint64_t bytes = 0;
+};
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double q)
+{
+	if (sorted.empty())
+	{
+		return 0;
+	}
+	auto index = static_cast<size_t>(q * static_cast<double>(sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+int main(int argc, char **argv)
+{
+	LoadOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		usage();
+		return 1;
+	}
+	/* Either side may write to a connection the peer already closed */
+	signal(SIGPIPE, SIG_IGN);
+
+	LoopbackServer::Options serverOptions;
+	serverOptions.tls = options.tls;
+	serverOptions.keepAlive = options.keepAlive;
+	serverOptions.chunked = options.chunked;
+	serverOptions.bodySize = options.bodySize;
+	LoopbackServer server(serverOptions);
+
+	auto builder = HttpClientBuilder::newBuilder().userAgent("lwhttp-loadgen").eventLoops(options.loops, options.pin);
+	if (options.limit > 0)
+	{
+		ConcurrencyLimitConfig limit;
+		limit.initialLimit = options.limit;
+		limit.maxQueue = options.concurrency;
+		builder.concurrencyLimit(limit);
+	}
+	if (options.hedge)
+	{
+		builder.hedge();
+	}
+	std::shared_ptr<HttpClient> client = builder.build();
+	URL url(server.getOrigin() + "/load");
+	std::shared_ptr<HttpBody> requestBody;
+	if (options.requestBodySize > 0)
+	{
+		std::string payload(options.requestBodySize, 'y');
+		requestBody = std::make_shared<HttpBodyImpl>(payload.c_str(), payload.length());
+		requestBody->setBodyLength(payload.length());
+	}
+	HttpRequest request = (requestBody != nullptr) ?
+	                      HttpRequestBuilder::newBuilder().url(url).POST(requestBody).build() :
+	                      HttpRequestBuilder::newBuilder().url(url).GET().build();
+
+	/* The prepared variant patches the path and a request id into a pre-serialized head */
+	PreparedRequest prepared = PreparedRequest::newBuilder().request(request).pathSlot().headerSlot("X-Request-ID")
+	                                                        .build();
+
+	auto begin = Clock::now();
+	auto measureFrom = begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.warmup));
+	auto end = measureFrom + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+	std::atomic<uint64_t> nextTicket{0};
+	std::vector<WorkerResult> results(options.concurrency);
+	std::vector<std::thread> workers;
+	std::mutex doneMutex;
+	std::condition_variable doneCondition;
+	unsigned int running = options.concurrency;
+	/* Each chain only touches its own result, one request of it is in flight at a time */
+	std::function<void(unsigned int)> sendNext = [&](unsigned int w)
+	{
+		Clock::time_point start = Clock::now();
+		if (start >= end)
+		{
+			std::lock_guard<std::mutex> lock(doneMutex);
+			--running;
+			doneCondition.notify_all();
+			return;
+		}
+		client->sendAsync(request, [&, w, start](size_t len, HttpResponse &response)
+		{
+			Clock::time_point finish = Clock::now();
+			WorkerResult &result = results[w];
+			if (start >= measureFrom)
+			{
+				if ((len == 0) || (response.getStatusCode() != HttpStatus::OK) ||
+				    (response.getBodyLength() < options.bodySize))
+				{
+					++result.errors;
+				}
+				else
+				{
+					result.bytes += len;
+					result.latencies.push_back(static_cast<uint64_t>(
+							std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count()));
+				}
+			}
+			sendNext(w);
+		});
+	};
+	for (unsigned int w = 0; options.async && (w < options.concurrency); ++w)
+	{
+		sendNext(w);
+	}
+	if (options.async)
+	{
+		std::unique_lock<std::mutex> lock(doneMutex);
+		doneCondition.wait(lock, [&running]()
+		{ return running == 0; });
+	}
+	for (unsigned int w = 0; !options.async && (w < options.concurrency); ++w)
+	{
+		workers.emplace_back([&, w]()
+		                     {
+			                     WorkerResult &result = results[w];
+			                     std::pmr::unsynchronized_pool_resource pool;
+			                     std::vector<char> storage(256 * 1024);
+			                     std::pmr::monotonic_buffer_resource monotonic(storage.data(), storage.size());
+			                     std::pmr::memory_resource *resource =
+					                     (options.arena == "pool") ? static_cast<std::pmr::memory_resource *>(&pool) :
+					                     (options.arena == "monotonic") ? &monotonic : getMemoryResource();
+			                     MemoryScope scope(resource);
+			                     while (true)
+			                     {
+				                     Clock::time_point start = Clock::now();
+				                     if (options.rate > 0)
+				                     {
+					                     uint64_t ticket = nextTicket.fetch_add(1, std::memory_order_relaxed);
+					                     start = begin + std::chrono::duration_cast<Clock::duration>(
+							                     std::chrono::duration<double>(static_cast<double>(ticket) / options.rate));
+					                     std::this_thread::sleep_until(start);
+				                     }
+				                     if (start >= end)
+				                     {
+					                     break;
+				                     }
+				                     monotonic.release();
+				                     HttpResponse response{};
+				                     size_t len;
+				                     if (options.prepared)
+				                     {
+					                     std::string id = std::to_string(w) + "-" + std::to_string(result.latencies.size());
+					                     std::string path = "/load/" + id;
+					                     PreparedRequest::Values values;
+					                     values.path = path;
+					                     values.headers[0] = id;
+					                     len = client->send(prepared, values, response);
+				                     }
+				                     else
+				                     {
+					                     len = client->send(request, response);
+				                     }
+				                     Clock::time_point finish = Clock::now();
+				                     if (start < measureFrom)
+				                     {
+					                     continue;
+				                     }
+				                     if ((len == 0) || (response.getStatusCode() != HttpStatus::OK) ||
+				                         (response.getBodyLength() < options.bodySize))
+				                     {
+					                     ++result.errors;
+					                     continue;
+				                     }
+				                     result.bytes += len;
+				                     result.latencies.push_back(static_cast<uint64_t>(
+						                     std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count()));
+			                     }
+		                     });
+	}
+	for (auto &worker: workers)
+	{
+		worker.join();
+	}
+	server.stop();
+	MetricsSnapshot metrics = client->getMetrics();
+
+	std::vector<uint64_t> latencies;
+	uint64_t errors = 0;
+	uint64_t bytes = 0;
+	for (auto &result: results)
+	{
+		latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+		errors += result.errors;
+		bytes += result.bytes;
+	}
+	std::sort(latencies.begin(), latencies.end());
+	double mean = 0;
+	for (auto latency: latencies)
+	{
+		mean += static_cast<double>(latency);
+	}
+	mean = latencies.empty() ? 0 : mean / static_cast<double>(latencies.size());
+
+	std::stringstream json;
+	json << "{\n"
+	     << "  \"config\": {\"mode\": \"" << (options.rate > 0 ? "rate" : "concurrency") << "\", "
+	     << "\"concurrency\": " << options.concurrency << ", \"rate\": " << options.rate << ", "
+	     << "\"duration_s\": " << options.duration << ", \"body_size\": " << options.bodySize << ", "
+	     << "\"request_body_size\": " << options.requestBodySize << ", "
+	     << "\"keep_alive\": " << (options.keepAlive ? "true" : "false") << ", "
+	     << "\"tls\": " << (options.tls ? "true" : "false") << ", "
+	     << "\"chunked\": " << (options.chunked ? "true" : "false") << ", "
+	     << "\"prepared\": " << (options.prepared ? "true" : "false") << ", "
+	     << "\"async\": " << (options.async ? "true" : "false") << ", "
+	     << "\"arena\": \"" << options.arena << "\"},\n"
+	     << "  \"requests\": " << latencies.size() << ",\n"
+	     << "  \"errors\": " << errors << ",\n"
+	     << "  \"throughput_rps\": " << static_cast<double>(latencies.size()) / options.duration << ",\n"
+	     << "  \"throughput_bytes_per_s\": " << static_cast<double>(bytes) / options.duration << ",\n"
+	     << "  \"latency_us\": {\"mean\": " << mean << ", \"p50\": " << percentile(latencies, 0.5)
+	     << ", \"p99\": " << percentile(latencies, 0.99) << ", \"p999\": " << percentile(latencies, 0.999)
+	     << ", \"max\": " << (latencies.empty() ? 0 : latencies.back()) << "},\n"
+	     << "  \"pool_hit_ratio\": " << metrics.poolHitRatio() << ",\n"
+	     << "  \"tls_handshakes\": {\"total\": " << metrics.tlsHandshakes << ", \"resumed\": " << metrics.tlsResumed
+	     << "},\n"
+	     << "  \"limiter\": {\"rejected\": " << metrics.limiterRejected << ", \"limit\": "
+	     << (metrics.limits.empty() ? 0 : metrics.limits.front().limit) << "},\n"
+	     << "  \"hedges\": {\"sent\": " << metrics.hedgesSent << ", \"won\": " << metrics.hedgesWon << "}\n"
+	     << "}\n";
+	std::cout << json.str();
+	if (!options.out.empty())
+	{
+		std::ofstream(options.out) << json.str();
+	}
+	return 0;
+}
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+
+#include "LoopbackServer.h"
+#include "../../test/http/TestServer.h"
+
+LoopbackServer::LoopbackServer(const Options &opts) : options(opts)
+{
+	buildResponse();
+	if (options.tls)
+	{
+		sslCtx = newSelfSignedContext();
+	}
+
+	if (!options.unixPath.empty())
+	{
+		listenUnix();
+		acceptThread = std::thread(&LoopbackServer::acceptLoop, this);
+		return;
+	}
+	listenFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int on = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if ((0 != bind(listenFd, reinterpret_cast<sockaddr *>(&addr), len)) || (0 != listen(listenFd, 4096)) ||
+	    (0 != getsockname(listenFd, reinterpret_cast<sockaddr *>(&addr), &len)))
+	{
+		throw std::runtime_error(std::string("Loopback server listen failed: ") + strerror(errno));
+	}
+	port = ntohs(addr.sin_port);
+	acceptThread = std::thread(&LoopbackServer::acceptLoop, this);
+}
+
+void LoopbackServer::listenUnix()
+{
+	sockaddr_un addr{};
+	if (options.unixPath.length() >= sizeof(addr.sun_path))
+	{
+		throw std::runtime_error("Loopback server socket path too long: " + options.unixPath);
+	}
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, options.unixPath.data(), options.unixPath.length());
+	unlink(options.unixPath.c_str());
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((0 != bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) || (0 != listen(listenFd, 4096)))
+	{
+		throw std::runtime_error(std::string("Loopback server listen failed: ") + strerror(errno));
+	}
+}
+
+LoopbackServer::~LoopbackServer()
+{
+	stop();
+	if (sslCtx != nullptr)
+	{
+		SSL_CTX_free(sslCtx);
+	}
+}
+
+std::string LoopbackServer::getOrigin() const
+{
+	if (!options.unixPath.empty())
+	{
+		std::string origin = "http+unix://";
+		for (char ch: options.unixPath)
+		{
+			if (ch == '/')
+			{
+				origin += "%2F";
+			}
+			else
+			{
+				origin += ch;
+			}
+		}
+		return origin;
+	}
+	return std::string(options.tls ? "https" : "http") + "://127.0.0.1:" + std::to_string(port);
+}
+
+void LoopbackServer::stop()
+{
+	if (!running.exchange(false))
+	{
+		return;
+	}
+	shutdown(listenFd, SHUT_RDWR);
+	close(listenFd);
+	acceptThread.join();
+	if (!options.unixPath.empty())
+	{
+		unlink(options.unixPath.c_str());
+	}
+	std::unique_lock<std::mutex> lock(workerMutex);
+	for (int fd: clientFds)
+	{
+		shutdown(fd, SHUT_RDWR);
+	}
+	workerDone.wait(lock, [this]()
+	{ return clientFds.empty(); });
+}
+
+void LoopbackServer::buildResponse()
+{
+	std::string body(options.bodySize, 'x');
+	response = "HTTP/1.1 200 OK\r\nServer: lwhttp-loopback\r\nContent-Type: application/octet-stream\r\n";
+	if (!options.keepAlive)
+	{
+		response += "Connection: close\r\n";
+	}
+	if (options.chunked)
+	{
+		response += "Transfer-Encoding: chunked\r\n\r\n";
+		for (size_t offset = 0; offset < body.length(); offset += options.chunkSize)
+		{
+			size_t len = std::min(options.chunkSize, body.length() - offset);
+			char sizeLine[32];
+			snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", len);
+			response += sizeLine;
+			response.append(body, offset, len);
+			response += "\r\n";
+		}
+		response += "0\r\n\r\n";
+	}
+	else
+	{
+		response += "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n";
+		response += body;
+	}
+}
+
+void LoopbackServer::acceptLoop()
+{
+	while (running)
+	{
+		int fd = accept(listenFd, nullptr, nullptr);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (options.unixPath.empty())
+		{
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+		std::lock_guard<std::mutex> lock(workerMutex);
+		clientFds.insert(fd);
+		std::thread(&LoopbackServer::serve, this, fd).detach();
+	}
+}
+
+static size_t requestBodyLength(const std::string &head, bool &chunked, bool &expectContinue)
+{
+	std::string lower = head;
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c)
+	{ return std::tolower(c); });
+	chunked = std::string::npos != lower.find("transfer-encoding: chunked");
+	expectContinue = std::string::npos != lower.find("expect: 100-continue");
+	size_t pos = lower.find("content-length:");
+	if (pos == std::string::npos)
+	{
+		return 0;
+	}
+	return std::stoul(lower.substr(pos + strlen("content-length:")));
+}
+
+void LoopbackServer::serve(int fd)
+{
+	SSL *ssl = nullptr;
+	if (sslCtx != nullptr)
+	{
+		ssl = SSL_new(sslCtx);
+		SSL_set_fd(ssl, fd);
+		if (1 != SSL_accept(ssl))
+		{
+			SSL_free(ssl);
+			ssl = nullptr;
+		}
+	}
+	auto readSome = [fd, ssl](char *buffer, size_t len) -> long
+	{
+		if (ssl != nullptr)
+		{
+			size_t readBytes = 0;
+			return (1 == SSL_read_ex(ssl, buffer, len, &readBytes)) ? static_cast<long>(readBytes) : -1;
+		}
+		return recv(fd, buffer, len, 0);
+	};
+	auto writeAll = [fd, ssl](const char *data, size_t len) -> bool
+	{
+		size_t written = 0;
+		while (written < len)
+		{
+			size_t sent = 0;
+			if (ssl != nullptr)
+			{
+				if (1 != SSL_write_ex(ssl, data + written, len - written, &sent))
+				{
+					return false;
+				}
+			}
+			else
+			{
+				long ret = ::send(fd, data + written, len - written, MSG_NOSIGNAL);
+				if (ret <= 0)
+				{
+					return false;
+				}
+				sent = static_cast<size_t>(ret);
+			}
+			written += sent;
+		}
+		return true;
+	};
+
+	bool usable = (sslCtx == nullptr) || (ssl != nullptr);
+	std::string pending;
+	char buffer[16 * 1024];
+	while (usable && running)
+	{
+		size_t headEnd;
+		while ((headEnd = pending.find("\r\n\r\n")) == std::string::npos)
+		{
+			long len = readSome(buffer, sizeof(buffer));
+			if (len <= 0)
+			{
+				usable = false;
+				break;
+			}
+			pending.append(buffer, len);
+		}
+		if (!usable)
+		{
+			break;
+		}
+		bool chunked = false;
+		bool expectContinue = false;
+		size_t consumed = headEnd + 4;
+		size_t bodyLen = requestBodyLength(pending.substr(0, consumed), chunked, expectContinue);
+		const char continueLine[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		if (expectContinue && !writeAll(continueLine, strlen(continueLine)))
+		{
+			break;
+		}
+		if (chunked)
+		{
+			size_t end;
+			while ((end = pending.find("0\r\n\r\n", consumed)) == std::string::npos)
+			{
+				long len = readSome(buffer, sizeof(buffer));
+				if (len <= 0)
+				{
+					usable = false;
+					break;
+				}
+				pending.append(buffer, len);
+			}
+			consumed = (end == std::string::npos) ? pending.length() : end + 5;
+		}
+		else
+		{
+			while (usable && (pending.length() < consumed + bodyLen))
+			{
+				long len = readSome(buffer, sizeof(buffer));
+				if (len <= 0)
+				{
+					usable = false;
+					break;
+				}
+				pending.append(buffer, len);
+			}
+			consumed += bodyLen;
+		}
+		if (!usable || !writeAll(response.c_str(), response.length()))
+		{
+			break;
+		}
+		pending.erase(0, consumed);
+		if (!options.keepAlive)
+		{
+			break;
+		}
+	}
+
+	if (ssl != nullptr)
+	{
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+	std::lock_guard<std::mutex> lock(workerMutex);
+	close(fd);
+	clientFds.erase(fd);
+	workerDone.notify_all();
+}
@@ -0,0 +1,68 @@
+#ifndef LWHTTP_BENCH_LOOPBACKSERVER_H
+#define LWHTTP_BENCH_LOOPBACKSERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+/* Minimal HTTP/1.1 origin on 127.0.0.1 or a Unix socket for hermetic benchmarks, one thread per accepted connection */
+class LoopbackServer
+{
+public:
+	struct Options
+	{
+		bool tls = false;
+		bool keepAlive = true;
+		bool chunked = false;
+		size_t bodySize = 1024;
+		size_t chunkSize = 16 * 1024;
+		/* Listens on this Unix socket instead of a loopback port */
+		std::string unixPath;
+	};
+
+	explicit LoopbackServer(const Options &opts);
+
+	LoopbackServer(const LoopbackServer &other) = delete;
+
+	LoopbackServer &operator=(const LoopbackServer &other) = delete;
+
+	~LoopbackServer();
+
+	[[nodiscard]] unsigned short getPort() const
+	{
+		return port;
+	}
+
+	/* http://127.0.0.1:port, https://127.0.0.1:port or http+unix://<encoded path> */
+	[[nodiscard]] std::string getOrigin() const;
+
+	void stop();
+
+private:
+	void listenUnix();
+
+	void acceptLoop();
+
+	void serve(int fd);
+
+	void buildResponse();
+
+private:
+	Options options;
+	int listenFd = -1;
+	unsigned short port = 0;
+	SSL_CTX *sslCtx = nullptr;
+	std::string response;
+	std::atomic<bool> running{true};
+	std::thread acceptThread;
+	std::mutex workerMutex;
+	std::condition_variable workerDone;
+	std::set<int> clientFds;
+};
+
+#endif //LWHTTP_BENCH_LOOPBACKSERVER_H
@@ -0,0 +1,372 @@
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <http/lwhttp.h>
+#include <http/utils.h>
+
+#include "Corpus.h"
+
+static size_t totalLength(const std::vector<std::string> &entries)
+{
+	size_t len = 0;
+	for (const auto &entry: entries)
+	{
+		len += entry.length();
+	}
+	return len;
+}
+
+/* Header block of a response head, without the status line */
+static std::vector<std::string> responseHeaderBlocks()
+{
+	std::vector<std::string> blocks;
+	for (const auto &response: Corpus::instance().responses)
+	{
+		blocks.push_back(response.substr(response.find("\r\n") + 2));
+	}
+	return blocks;
+}
+
+static HttpRequest requestFromCorpus(const std::string &entry)
+{
+	size_t lineEnd = entry.find("\r\n");
+	std::string requestLine = entry.substr(0, lineEnd);
+	size_t delimiter = requestLine.find(' ');
+	std::string method = requestLine.substr(0, delimiter);
+	URL url(requestLine.substr(delimiter + 1));
+
+	HttpRequest request;
+	request.uri = url;
+	request.method = (method == "POST") ? HttpMethod::POST : (method == "PUT") ? HttpMethod::PUT : HttpMethod::GET;
+	request.header.deserialize(entry.substr(lineEnd + 2));
+	request.header.setField("Host", url.getAuthority());
+	return request;
+}
+
+/*********************** HttpHeader ***********************/
+static void BM_HttpHeaderDeserialize(benchmark::State &state)
+{
+	const std::vector<std::string> blocks = responseHeaderBlocks();
+	for (auto _: state)
+	{
+		for (const auto &block: blocks)
+		{
+			HttpHeader header;
+			header.deserialize(block);
+			benchmark::DoNotOptimize(header);
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * blocks.size()));
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * totalLength(blocks)));
+}
+
+BENCHMARK(BM_HttpHeaderDeserialize);
+
+static void BM_HttpHeaderSerialize(benchmark::State &state)
+{
+	std::vector<HttpHeader> headers;
+	for (const auto &block: responseHeaderBlocks())
+	{
+		headers.emplace_back();
+		headers.back().deserialize(block);
+	}
+	size_t bytes = 0;
+	for (auto _: state)
+	{
+		for (const auto &header: headers)
+		{
+			std::string str = header.serialize();
+			bytes += str.length();
+			benchmark::DoNotOptimize(str);
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * headers.size()));
+	state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+BENCHMARK(BM_HttpHeaderSerialize);
+
+/* Into one reused buffer, as the client writes a request head */
+static void BM_HttpHeaderAppendTo(benchmark::State &state)
+{
+	std::vector<HttpHeader> headers;
+	for (const auto &block: responseHeaderBlocks())
+	{
+		headers.emplace_back();
+		headers.back().deserialize(block);
+	}
+	Buffer buffer;
+	size_t bytes = 0;
+	for (auto _: state)
+	{
+		for (const auto &header: headers)
+		{
+			buffer.clear();
+			header.appendTo(buffer);
+			bytes += buffer.size();
+			benchmark::DoNotOptimize(buffer.data());
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * headers.size()));
+	state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+BENCHMARK(BM_HttpHeaderAppendTo);
+
+static void BM_ToUpCamelCase(benchmark::State &state)
+{
+	std::vector<std::string> names{"content-type", "content-length", "transfer-encoding", "user-agent",
+	                               "x-content-type-options", "strict-transport-security", "host", "etag",
+	                               "access-control-allow-credentials", "content-security-policy-report-only"};
+	for (auto _: state)
+	{
+		for (const auto &name: names)
+		{
+			std::string str = name;
+			toUpCamelCase(str);
+			benchmark::DoNotOptimize(str);
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * names.size()));
+}
+
+BENCHMARK(BM_ToUpCamelCase);
+
+/*********************** HttpResponse *********************/
+static void BM_StatusLineBuild(benchmark::State &state)
+{
+	const auto &responses = Corpus::instance().responses;
+	for (auto _: state)
+	{
+		for (const auto &response: responses)
+		{
+			StatusLine statusLine;
+			benchmark::DoNotOptimize(statusLine.build(response.c_str(), response.length()));
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * responses.size()));
+}
+
+BENCHMARK(BM_StatusLineBuild);
+
+static void BM_HttpResponseBuildHeader(benchmark::State &state)
+{
+	const auto &responses = Corpus::instance().responses;
+	for (auto _: state)
+	{
+		for (const auto &response: responses)
+		{
+			HttpResponse httpResponse;
+			benchmark::DoNotOptimize(httpResponse.buildHeader(response.c_str(), response.length()));
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * responses.size()));
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * totalLength(responses)));
+}
+
+BENCHMARK(BM_HttpResponseBuildHeader)->ThreadRange(1, 8);
+
+/* Same parse with every allocation of a response served from a per-response monotonic arena */
+static void BM_HttpResponseBuildHeaderArena(benchmark::State &state)
+{
+	const auto &responses = Corpus::instance().responses;
+	std::vector<char> storage(16 * 1024);
+	std::pmr::monotonic_buffer_resource arena(storage.data(), storage.size());
+	MemoryScope scope(&arena);
+	for (auto _: state)
+	{
+		for (const auto &response: responses)
+		{
+			{
+				HttpResponse httpResponse;
+				benchmark::DoNotOptimize(httpResponse.buildHeader(response.c_str(), response.length()));
+			}
+			arena.release();
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * responses.size()));
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * totalLength(responses)));
+}
+
+BENCHMARK(BM_HttpResponseBuildHeaderArena)->ThreadRange(1, 8);
+
+/************************ HttpRequest *********************/
+static void BM_URLParse(benchmark::State &state)
+{
+	const auto &urls = Corpus::instance().urls;
+	for (auto _: state)
+	{
+		for (const auto &str: urls)
+		{
+			URL url(str);
+			benchmark::DoNotOptimize(url);
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * urls.size()));
+}
+
+BENCHMARK(BM_URLParse);
+
+static void BM_HttpRequestGetRequestLine(benchmark::State &state)
+{
+	std::vector<HttpRequest> requests;
+	for (const auto &entry: Corpus::instance().requests)
+	{
+		requests.push_back(requestFromCorpus(entry));
+	}
+	for (auto _: state)
+	{
+		for (const auto &request: requests)
+		{
+			std::string line = request.getRequestLine();
+			benchmark::DoNotOptimize(line);
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * requests.size()));
+}
+
+BENCHMARK(BM_HttpRequestGetRequestLine);
+
+static void BM_HttpRequestAppendTo(benchmark::State &state)
+{
+	std::vector<HttpRequest> requests;
+	for (const auto &entry: Corpus::instance().requests)
+	{
+		requests.push_back(requestFromCorpus(entry));
+	}
+	Buffer buffer;
+	size_t bytes = 0;
+	for (auto _: state)
+	{
+		for (const auto &request: requests)
+		{
+			buffer.clear();
+			request.appendTo(buffer);
+			bytes += buffer.size();
+			benchmark::DoNotOptimize(buffer.data());
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * requests.size()));
+	state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+BENCHMARK(BM_HttpRequestAppendTo);
+
+/* Only the target and one header change, compare with BM_HttpRequestAppendTo */
+static void BM_PreparedRequestGather(benchmark::State &state)
+{
+	std::vector<PreparedRequest> prepared;
+	for (const auto &entry: Corpus::instance().requests)
+	{
+		prepared.push_back(PreparedRequest::newBuilder().request(requestFromCorpus(entry)).pathSlot()
+		                                                .headerSlot("X-Request-ID").build());
+	}
+	PreparedRequest::Values values;
+	values.path = "/api/v1/items/42?fields=name";
+	values.headers[0] = "5f0c6a3e-42";
+	IoSlice slices[PreparedRequest::MAX_SLICES];
+	char digits[20];
+	for (auto _: state)
+	{
+		for (const auto &request: prepared)
+		{
+			size_t count = request.gather(values, slices, digits);
+			benchmark::DoNotOptimize(count);
+			benchmark::DoNotOptimize(slices);
+		}
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * prepared.size()));
+}
+
+BENCHMARK(BM_PreparedRequestGather);
+
+/************************** utils *************************/
+static void BM_FindFirstOfHeadEnd(benchmark::State &state)
+{
+	const auto &responses = Corpus::instance().responses;
+	const char pattern[] = "\r\n\r\n";
+	for (auto _: state)
+	{
+		for (const auto &response: responses)
+		{
+			benchmark::DoNotOptimize(findFirstOf(pattern, strlen(pattern), response.c_str(), response.length()));
+		}
+	}
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * totalLength(responses)));
+}
+
+BENCHMARK(BM_FindFirstOfHeadEnd);
+
+/* Large body full of near misses for the chunk terminator "0\r\n\r\n" */
+static std::string chunkedLikeData(size_t len)
+{
+	std::string data;
+	while (data.length() < len)
+	{
+		data += "1a0\r\n<p>0\r\nsome chunked content</p>\r\n";
+	}
+	data.resize(len);
+	return data;
+}
+
+/* Chunked-body terminator at the very end of a large body */
+static void BM_FindFirstOfChunkEnd(benchmark::State &state)
+{
+	auto len = static_cast<size_t>(state.range(0));
+	std::string data = chunkedLikeData(len - 5) + "0\r\n\r\n";
+	const char pattern[] = "0\r\n\r\n";
+	for (auto _: state)
+	{
+		benchmark::DoNotOptimize(findFirstOf(pattern, strlen(pattern), data.c_str(), data.length()));
+	}
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * data.length()));
+}
+
+BENCHMARK(BM_FindFirstOfChunkEnd)->Arg(256)->Arg(4 << 10)->Arg(64 << 10)->Arg(1 << 20);
+
+/* Per-kernel comparison: range(0) is the SearchKernel, range(1) the buffer size, the match is the farthest one */
+static const char *const kernelNames[] = {"scalar", "sse2", "avx2"};
+
+static void BM_FindFirstOfKernel(benchmark::State &state)
+{
+	auto kernel = static_cast<SearchKernel>(state.range(0));
+	if (!isSearchKernelSupported(kernel))
+	{
+		state.SkipWithError("kernel not supported on this CPU");
+		return;
+	}
+	std::string data = chunkedLikeData(static_cast<size_t>(state.range(1)) - 5) + "0\r\n\r\n";
+	const char pattern[] = "0\r\n\r\n";
+	for (auto _: state)
+	{
+		benchmark::DoNotOptimize(findFirstOf(kernel, pattern, strlen(pattern), data.c_str(), data.length()));
+	}
+	state.SetLabel(kernelNames[state.range(0)]);
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * data.length()));
+}
+
+BENCHMARK(BM_FindFirstOfKernel)->ArgsProduct({{0, 1, 2}, {4 << 10, 64 << 10, 1 << 20}});
+
+static void BM_FindLastOfKernel(benchmark::State &state)
+{
+	auto kernel = static_cast<SearchKernel>(state.range(0));
+	if (!isSearchKernelSupported(kernel))
+	{
+		state.SkipWithError("kernel not supported on this CPU");
+		return;
+	}
+	std::string data = "\r\n\r\n" + chunkedLikeData(static_cast<size_t>(state.range(1)) - 4);
+	const char pattern[] = "\r\n\r\n";
+	for (auto _: state)
+	{
+		benchmark::DoNotOptimize(findLastOf(kernel, pattern, strlen(pattern), data.c_str(), data.length()));
+	}
+	state.SetLabel(kernelNames[state.range(0)]);
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * data.length()));
+}
+
+BENCHMARK(BM_FindLastOfKernel)->ArgsProduct({{0, 1, 2}, {4 << 10, 64 << 10, 1 << 20}});
@@ -0,0 +1,119 @@
+#ifndef LWHTTP_BUFFER_H
+#define LWHTTP_BUFFER_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/************************** IoSlice **************************/
+/* One piece of a message written with a single vectored write */
+struct IoSlice
+{
+	const char *data;
+	size_t len;
+};
+
+/************************** Buffer ***************************/
+/* Growable output buffer for serializers. clear() keeps the storage, so a buffer reused across requests stops
+ * allocating once it has grown to the largest request. */
+class Buffer
+{
+public:
+	Buffer() = default;
+
+	explicit Buffer(size_t capacity);
+
+	Buffer(const Buffer &other) = delete;
+
+	Buffer &operator=(const Buffer &other) = delete;
+
+	Buffer(Buffer &&other) noexcept = default;
+
+	Buffer &operator=(Buffer &&other) noexcept = default;
+
+	~Buffer() = default;
+
+	void append(const char *str, size_t len)
+	{
+		if (len > capability - length)
+		{
+			grow(len);
+		}
+		memcpy(storage.get() + length, str, len);
+		length += len;
+	}
+
+	void append(std::string_view str)
+	{
+		append(str.data(), str.length());
+	}
+
+	void append(char ch)
+	{
+		if (length == capability)
+		{
+			grow(1);
+		}
+		storage[length++] = ch;
+	}
+
+	void appendDecimal(uint64_t value);
+
+	void reserve(size_t len);
+
+	void clear()
+	{
+		length = 0;
+	}
+
+	/* Drops the data beyond len */
+	void truncate(size_t len)
+	{
+		length = (len < length) ? len : length;
+	}
+
+	/* Drops the storage when a rare large message left it above limit, so a long-lived buffer stays small */
+	void shrink(size_t limit);
+
+	[[nodiscard]] const char *data() const
+	{
+		return storage.get();
+	}
+
+	[[nodiscard]] char *data()
+	{
+		return storage.get();
+	}
+
+	[[nodiscard]] size_t size() const
+	{
+		return length;
+	}
+
+	[[nodiscard]] size_t capacity() const
+	{
+		return capability;
+	}
+
+	[[nodiscard]] bool empty() const
+	{
+		return length == 0;
+	}
+
+	[[nodiscard]] std::string toString() const
+	{
+		return {storage.get(), length};
+	}
+
+private:
+	void grow(size_t len);
+
+private:
+	std::unique_ptr<char[]> storage;
+	size_t length = 0;
+	size_t capability = 0;
+};
+
+#endif //LWHTTP_BUFFER_H
@@ -0,0 +1,597 @@
+#ifndef LWHTTP_COROUTINE_H
+#define LWHTTP_COROUTINE_H
+
+/* Coroutine API, available when the including code is compiled as C++20. The library itself stays C++17, so
+ * everything here is header only and built on HttpClient::sendAsync() and streamAsync(). */
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LWHTTP_HAS_COROUTINES 1
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "HttpClient.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+
+/************************* FramePool *************************/
+/* Recycles coroutine frames per thread in 64 byte size classes, so a request does not hit the global heap for
+ * its frames. A frame freed on another thread (e.g. the event loop that resumed it) goes to that thread's cache. */
+class FramePool
+{
+public:
+	static void *allocate(size_t size)
+	{
+		size_t sizeClass = (size + GRANULE - 1) / GRANULE;
+		if (sizeClass < CLASSES)
+		{
+			Cache &cache = local();
+			if (cache.heads[sizeClass] != nullptr)
+			{
+				FreeFrame *frame = cache.heads[sizeClass];
+				cache.heads[sizeClass] = frame->next;
+				--cache.counts[sizeClass];
+				return frame;
+			}
+			return ::operator new(sizeClass * GRANULE);
+		}
+		return ::operator new(size);
+	}
+
+	static void deallocate(void *pointer, size_t size) noexcept
+	{
+		size_t sizeClass = (size + GRANULE - 1) / GRANULE;
+		if (sizeClass < CLASSES)
+		{
+			Cache &cache = local();
+			if (cache.counts[sizeClass] < MAX_CACHED_PER_CLASS)
+			{
+				auto *frame = static_cast<FreeFrame *>(pointer);
+				frame->next = cache.heads[sizeClass];
+				cache.heads[sizeClass] = frame;
+				++cache.counts[sizeClass];
+				return;
+			}
+		}
+		::operator delete(pointer);
+	}
+
+	static constexpr size_t GRANULE = 64;
+	static constexpr size_t CLASSES = 65;
+	static constexpr size_t MAX_CACHED_PER_CLASS = 256;
+
+private:
+	struct FreeFrame
+	{
+		FreeFrame *next;
+	};
+
+	struct Cache
+	{
+		FreeFrame *heads[CLASSES]{};
+		size_t counts[CLASSES]{};
+
+		~Cache()
+		{
+			for (FreeFrame *head: heads)
+			{
+				while (head != nullptr)
+				{
+					FreeFrame *next = head->next;
+					::operator delete(head);
+					head = next;
+				}
+			}
+		}
+	};
+
+	static Cache &local()
+	{
+		static thread_local Cache cache;
+		return cache;
+	}
+};
+
+/**************************** Task ***************************/
+template<typename T>
+class Task;
+
+struct TaskPromiseBase
+{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	static void *operator new(size_t size)
+	{
+		return FramePool::allocate(size);
+	}
+
+	static void operator delete(void *pointer, size_t size) noexcept
+	{
+		FramePool::deallocate(pointer, size);
+	}
+
+	/* Hands over to the awaiting coroutine, or returns to whoever resumed this one */
+	struct FinalAwaiter
+	{
+		[[nodiscard]] bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			std::coroutine_handle<> next = handle.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept
+		{
+		}
+	};
+
+	std::suspend_always initial_suspend() noexcept
+	{
+		return {};
+	}
+
+	FinalAwaiter final_suspend() noexcept
+	{
+		return {};
+	}
+
+	void unhandled_exception() noexcept
+	{
+		error = std::current_exception();
+	}
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase
+{
+	std::optional<T> value;
+
+	Task<T> get_return_object() noexcept;
+
+	template<typename U>
+	void return_value(U &&result)
+	{
+		value.emplace(std::forward<U>(result));
+	}
+
+	T take()
+	{
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+		return std::move(*value);
+	}
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase
+{
+	Task<void> get_return_object() noexcept;
+
+	void return_void() noexcept
+	{
+	}
+
+	void take() const
+	{
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+/* Started right away and destroys itself when done */
+struct DetachedTask
+{
+	struct promise_type
+	{
+		static void *operator new(size_t size)
+		{
+			return FramePool::allocate(size);
+		}
+
+		static void operator delete(void *pointer, size_t size) noexcept
+		{
+			FramePool::deallocate(pointer, size);
+		}
+
+		DetachedTask get_return_object() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() noexcept
+		{
+		}
+
+		void unhandled_exception() noexcept
+		{
+			std::terminate();
+		}
+	};
+};
+
+/* Lazy coroutine: starts when awaited and resumes its awaiter when it finishes, on whatever thread that is */
+template<typename T = void>
+class Task
+{
+public:
+	using promise_type = TaskPromise<T>;
+
+	Task(const Task &other) = delete;
+
+	Task &operator=(const Task &other) = delete;
+
+	Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr))
+	{
+	}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other)
+		{
+			if (handle)
+			{
+				handle.destroy();
+			}
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+
+	~Task()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	[[nodiscard]] bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume()
+	{
+		return handle.promise().take();
+	}
+
+private:
+	friend struct TaskPromise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> coroutine) : handle(coroutine)
+	{
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/* Runs task without waiting for it, it must not throw */
+inline void spawn(Task<void> task)
+{
+	[](Task<void> owned) -> DetachedTask
+	{
+		co_await std::move(owned);
+	}(std::move(task));
+}
+
+template<typename T>
+struct WaitState
+{
+	std::mutex doneMutex;
+	std::condition_variable doneCondition;
+	bool done = false;
+	std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+	std::exception_ptr error;
+};
+
+template<typename T>
+DetachedTask runAndNotify(Task<T> task, WaitState<T> &state)
+{
+	try
+	{
+		if constexpr (std::is_void_v<T>)
+		{
+			co_await std::move(task);
+			state.result.emplace(true);
+		}
+		else
+		{
+			state.result.emplace(co_await std::move(task));
+		}
+	}
+	catch (...)
+	{
+		state.error = std::current_exception();
+	}
+	std::lock_guard<std::mutex> lock(state.doneMutex);
+	state.done = true;
+	state.doneCondition.notify_all();
+}
+
+/* Runs task and blocks the calling thread until it finished, never call it on an event loop thread */
+template<typename T>
+T syncWait(Task<T> task)
+{
+	WaitState<T> state;
+	runAndNotify(std::move(task), state);
+	std::unique_lock<std::mutex> lock(state.doneMutex);
+	state.doneCondition.wait(lock, [&state]()
+	{ return state.done; });
+	if (state.error)
+	{
+		std::rethrow_exception(state.error);
+	}
+	if constexpr (!std::is_void_v<T>)
+	{
+		return std::move(*state.result);
+	}
+}
+
+/************************* co_send ***************************/
+/* Awaits one sendAsync() exchange. The awaiting coroutine resumes on the event loop that read the response, or
+ * right away if the call ended before sendAsync() returned or was not taken. */
+class SendAwaiter
+{
+public:
+	SendAwaiter(HttpClient &httpClient, const HttpRequest &httpRequest) : client(httpClient), request(httpRequest)
+	{
+	}
+
+	[[nodiscard]] bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> awaiting)
+	{
+		handle = awaiting;
+		bool taken = client.sendAsync(request, [this](size_t len, HttpResponse &received)
+		{
+			receivedLen = len;
+			response = std::move(received);
+			/* Whoever comes second resumes: the handler, or await_suspend below when the call was synchronous */
+			if (ready.exchange(true, std::memory_order_acq_rel))
+			{
+				handle.resume();
+			}
+		});
+		/* A call that was not taken never gets its handler, it fails right away */
+		return taken && !ready.exchange(true, std::memory_order_acq_rel);
+	}
+
+	HttpResponse await_resume()
+	{
+		if (receivedLen == 0)
+		{
+			throw std::runtime_error("HTTP request failed: " + request.uri.serialize());
+		}
+		return std::move(response);
+	}
+
+private:
+	HttpClient &client;
+	const HttpRequest &request;
+	std::coroutine_handle<> handle;
+	std::atomic<bool> ready{false};
+	size_t receivedLen = 0;
+	HttpResponse response{};
+};
+
+/* Sends request and completes with its response, throws std::runtime_error if the call failed. Code after the
+ * co_await runs on an event loop thread of client, so it must not block (e.g. with HttpClient::send()). */
+inline Task<HttpResponse> co_send(HttpClient &client, HttpRequest request)
+{
+	co_return co_await SendAwaiter(client, request);
+}
+
+/*********************** ChunkReader *************************/
+/* Reads the body of one streamAsync() exchange piece by piece as the event loop receives it:
+ *
+ *     ChunkReader reader(client, request);
+ *     while (std::optional<std::string_view> chunk = co_await reader.next()) { ... }
+ *
+ * A coroutine waiting in next() is resumed by the sink on the loop thread, which reads on only once the coroutine
+ * suspends again, so the connection is read no faster than the chunks are taken. Chunks that arrive while it is
+ * busy elsewhere are queued. A reader destroyed before the end aborts the exchange. */
+class ChunkReader
+{
+	struct State;
+
+public:
+	ChunkReader(HttpClient &client, const HttpRequest &request) : state(std::make_shared<State>())
+	{
+		std::shared_ptr<State> shared = state;
+		bool taken = client.streamAsync(request, [shared](const char *data, size_t len)
+		{
+			return shared->deliver(data, len);
+		}, [shared](size_t len, HttpResponse &received)
+		                                {
+			                                shared->finish(len, received);
+		                                });
+		if (!taken)
+		{
+			HttpResponse none{};
+			state->finish(0, none);
+		}
+	}
+
+	ChunkReader(const ChunkReader &other) = delete;
+
+	ChunkReader &operator=(const ChunkReader &other) = delete;
+
+	~ChunkReader()
+	{
+		std::lock_guard<std::mutex> lock(state->stateMutex);
+		state->abandoned = true;
+	}
+
+	class ChunkAwaiter
+	{
+	public:
+		explicit ChunkAwaiter(State &readerState) : state(readerState)
+		{
+		}
+
+		[[nodiscard]] bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		bool await_suspend(std::coroutine_handle<> awaiting)
+		{
+			std::lock_guard<std::mutex> lock(state.stateMutex);
+			if (!state.queued.empty() || state.finished)
+			{
+				return false;
+			}
+			state.waiting = awaiting;
+			return true;
+		}
+
+		/* The chunk stays valid until the next call of next(), an empty optional once the body ended. Throws
+		 * std::runtime_error if the call failed. */
+		std::optional<std::string_view> await_resume()
+		{
+			std::lock_guard<std::mutex> lock(state.stateMutex);
+			if (state.inPlace.data() != nullptr)
+			{
+				/* The read buffer is reused as soon as the coroutine suspends again */
+				state.current.assign(state.inPlace.data(), state.inPlace.length());
+				state.inPlace = std::string_view();
+				return std::string_view(state.current);
+			}
+			if (!state.queued.empty())
+			{
+				state.current = std::move(state.queued.front());
+				state.queued.pop_front();
+				return std::string_view(state.current);
+			}
+			if (state.receivedLen == 0)
+			{
+				throw std::runtime_error("HTTP request failed");
+			}
+			return std::nullopt;
+		}
+
+	private:
+		State &state;
+	};
+
+	ChunkAwaiter next()
+	{
+		return ChunkAwaiter(*state);
+	}
+
+	/* Head and timing of the response once next() gave the end, with the whole body unless it was a 2xx */
+	HttpResponse &getResponse()
+	{
+		return state->response;
+	}
+
+private:
+	struct State
+	{
+		/* From the loop thread, false aborts the exchange */
+		bool deliver(const char *data, size_t len)
+		{
+			std::unique_lock<std::mutex> lock(stateMutex);
+			if (abandoned)
+			{
+				return false;
+			}
+			if (!waiting)
+			{
+				queued.emplace_back(data, len);
+				return true;
+			}
+			inPlace = std::string_view(data, len);
+			std::coroutine_handle<> resumed = std::exchange(waiting, nullptr);
+			lock.unlock();
+			resumed.resume();
+			lock.lock();
+			/* The reader may have stopped before it took the chunk */
+			inPlace = std::string_view();
+			return !abandoned;
+		}
+
+		void finish(size_t len, HttpResponse &received)
+		{
+			std::unique_lock<std::mutex> lock(stateMutex);
+			receivedLen = len;
+			/* The sink holds this state, kept in the response it would never be freed */
+			received.setBodySink(nullptr);
+			response = std::move(received);
+			finished = true;
+			std::coroutine_handle<> resumed = std::exchange(waiting, nullptr);
+			lock.unlock();
+			if (resumed)
+			{
+				resumed.resume();
+			}
+		}
+
+		std::mutex stateMutex;
+		std::coroutine_handle<> waiting;
+		std::string_view inPlace;
+		std::deque<std::string> queued;
+		std::string current;
+		bool finished = false;
+		bool abandoned = false;
+		size_t receivedLen = 0;
+		HttpResponse response{};
+	};
+
+	std::shared_ptr<State> state;
+};
+
+#endif
+
+#endif //LWHTTP_COROUTINE_H
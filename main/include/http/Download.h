@@ -0,0 +1,120 @@
+#ifndef LWHTTP_DOWNLOAD_H
+#define LWHTTP_DOWNLOAD_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "HttpClient.h"
+#include "HttpRequest.h"
+
+class WorkStealingPool;
+
+/*********************** DownloadTarget **********************/
+/* Where a segmented download puts the object, write() is called from several threads for disjoint ranges */
+class DownloadTarget
+{
+public:
+	virtual ~DownloadTarget() = default;
+
+	/* Called once the size of the object is known, before any write. A persistent target must keep data already
+	 * written there so that a resumed download can skip it. */
+	virtual bool allocate(size_t size) = 0;
+
+	virtual bool write(size_t offset, const char *data, size_t len) = 0;
+
+	/* Data written stays there for a later download, a journal can only be resumed into such a target */
+	[[nodiscard]] virtual bool isPersistent() const
+	{
+		return false;
+	}
+};
+
+/* The whole object in memory */
+class BufferTarget : public DownloadTarget
+{
+public:
+	bool allocate(size_t size) override;
+
+	bool write(size_t offset, const char *data, size_t len) override;
+
+	[[nodiscard]] const std::vector<char> &getData() const
+	{
+		return data;
+	}
+
+private:
+	std::vector<char> data;
+};
+
+/* A file written with positioned writes, created if missing and never truncated */
+class FileTarget : public DownloadTarget
+{
+public:
+	/* Throws std::runtime_error if the file cannot be opened */
+	explicit FileTarget(const std::string &path);
+
+	FileTarget(const FileTarget &other) = delete;
+
+	FileTarget &operator=(const FileTarget &other) = delete;
+
+	~FileTarget() override;
+
+	bool allocate(size_t size) override;
+
+	bool write(size_t offset, const char *data, size_t len) override;
+
+	[[nodiscard]] bool isPersistent() const override
+	{
+		return true;
+	}
+
+private:
+	int fd = -1;
+#if defined(_WIN32) || defined(_WIN64)
+	/* No positioned write there, seek and write go under one lock */
+	std::mutex fileMutex;
+#endif
+};
+
+/********************* SegmentedDownload *********************/
+constexpr size_t DEFAULT_SEGMENT_SIZE = 4 * 1024 * 1024;
+
+struct DownloadOptions
+{
+	size_t segmentSize = DEFAULT_SEGMENT_SIZE;
+	/* Segments fetched at once, each over its own pooled connection */
+	unsigned int connections = 4;
+	/* Further attempts of a segment, the first one too, each resumes where the last one stopped */
+	unsigned int retries = 3;
+	/* File recording the finished segments. A later download of the same, unchanged object with the same journal
+	 * skips them. Empty for none, ignored unless the target is persistent. */
+	std::string journal;
+};
+
+/* Fetches a large object as byte ranges over several connections at once, the parts go straight to their offset
+ * in the target. The first range request tells the size, a server that ignores Range sends it all in one go. */
+class SegmentedDownload
+{
+public:
+	SegmentedDownload(std::shared_ptr<HttpClient> httpClient, DownloadOptions downloadOptions);
+
+	SegmentedDownload(const SegmentedDownload &other) = delete;
+
+	SegmentedDownload &operator=(const SegmentedDownload &other) = delete;
+
+	~SegmentedDownload();
+
+	/* Returns the size of the object, throws std::runtime_error if it could not be downloaded completely. The
+	 * journal is removed after success. */
+	size_t download(const HttpRequest &request, DownloadTarget &target);
+
+private:
+	std::shared_ptr<HttpClient> client;
+	DownloadOptions options;
+	/* Fetches the segments next to the calling thread, null with a single connection */
+	std::unique_ptr<WorkStealingPool> pool;
+};
+
+#endif //LWHTTP_DOWNLOAD_H
@@ -0,0 +1,154 @@
+#ifndef LWHTTP_EVENTSOURCE_H
+#define LWHTTP_EVENTSOURCE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "HttpClient.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+
+/********************* EventStreamParser *********************/
+constexpr size_t DEFAULT_MAX_EVENT_SIZE = 1024 * 1024;
+
+struct ServerSentEvent
+{
+	/* "message" unless the event named one */
+	std::string type;
+	std::string data;
+	/* The last event ID as of this event */
+	std::string id;
+};
+
+/* Parses text/event-stream as the bytes arrive, each byte is looked at once. Memory stays within the largest
+ * event, a longer one is dropped. */
+class EventStreamParser
+{
+public:
+	/* The event is reused for the next one. Returns false to stop the stream. */
+	using EventHandler = std::function<bool(const ServerSentEvent &event)>;
+
+	explicit EventStreamParser(size_t maxEventSize = DEFAULT_MAX_EVENT_SIZE);
+
+	/* Returns false once handler stopped the stream, the rest of data is then ignored */
+	bool feed(const char *data, size_t len, const EventHandler &handler);
+
+	/* Forgets a partial event for a new connection, the last event ID and retry are kept */
+	void reset();
+
+	[[nodiscard]] const std::string &getLastEventId() const
+	{
+		return lastEventId;
+	}
+
+	void setLastEventId(const std::string &id)
+	{
+		lastEventId = id;
+		idBuffer = id;
+	}
+
+	/* The reconnection time of the last retry field, negative if there was none */
+	[[nodiscard]] long getRetry() const
+	{
+		return retry;
+	}
+
+	[[nodiscard]] size_t getDroppedEvents() const
+	{
+		return droppedEvents;
+	}
+
+private:
+	/* false if handler stopped the stream */
+	bool processLine(const char *line, size_t len, const EventHandler &handler);
+
+	size_t maxEvent;
+	/* A line split between two feeds */
+	std::string pending;
+	ServerSentEvent event;
+	bool hasData = false;
+	std::string lastEventId;
+	long retry = -1;
+	/* Becomes the last event ID when the event is complete */
+	std::string idBuffer;
+	/* The event went beyond maxEvent, the rest of it is skipped */
+	bool oversized = false;
+	/* The line at hand went beyond maxEvent, it is skipped up to its end */
+	bool longLine = false;
+	/* The last feed ended with CR, an LF starting the next one belongs to it */
+	bool skipLf = false;
+	bool streamStart = true;
+	size_t droppedEvents = 0;
+};
+
+/************************ EventSource ************************/
+struct EventSourceConfig
+{
+	/* Delay before reconnecting until the server sends retry */
+	std::chrono::milliseconds retry{3000};
+	/* Failed connection attempts in a row double the delay up to this */
+	std::chrono::milliseconds maxRetry{60000};
+	/* Failed connection attempts in a row before run() gives up, 0 for never */
+	unsigned int maxAttempts = 0;
+	size_t maxEventSize = DEFAULT_MAX_EVENT_SIZE;
+	/* Sent as Last-Event-ID on the first connection, e.g. saved by an earlier run */
+	std::string lastEventId;
+};
+
+/* A text/event-stream consumer. Events go to the handler as they arrive through the client's body sink, a
+ * connection that ends is opened again with Last-Event-ID after the retry delay. A quiet stream is reconnected
+ * once a read exceeds the client's timeout. */
+class EventSource
+{
+public:
+	EventSource(std::shared_ptr<HttpClient> httpClient, HttpRequest eventRequest, EventSourceConfig sourceConfig = {});
+
+	EventSource(const EventSource &other) = delete;
+
+	EventSource &operator=(const EventSource &other) = delete;
+
+	~EventSource();
+
+	/* Streams events on the calling thread. Returns true once handler returned false, stop() was called or the
+	 * server answered 204, false if it answered anything but a 200 event stream or the attempts ran out. A failed
+	 * connection, 429 and 5xx count as failed attempts. */
+	bool run(const EventStreamParser::EventHandler &handler);
+
+	/* From any thread, run() returns after the event at hand or at once while waiting to reconnect. A read
+	 * waiting on a quiet stream is aborted, unless the client is not one of HttpClientBuilder's: then run() returns
+	 * once the read times out. */
+	void stop();
+
+	[[nodiscard]] const std::string &getLastEventId() const
+	{
+		return parser.getLastEventId();
+	}
+
+	/* Of the last response, e.g. to tell why run() returned false */
+	[[nodiscard]] HttpStatus getStatus() const
+	{
+		return status;
+	}
+
+private:
+	/* Waits for delay unless stop() comes first, returns false then */
+	bool waitFor(std::chrono::milliseconds delay);
+
+	std::shared_ptr<HttpClient> client;
+	HttpRequest request;
+	EventSourceConfig config;
+	EventStreamParser parser;
+	HttpStatus status{};
+	std::mutex stopMutex;
+	std::condition_variable stopSignal;
+	std::atomic<bool> stopped{false};
+	/* Aborts the call in flight on stop() */
+	std::unique_ptr<CancelToken> cancelToken;
+};
+
+#endif //LWHTTP_EVENTSOURCE_H
@@ -2,10 +2,16 @@
 #define LWHTTP_HTTPBASE_H
 
 #include <cstring>
+#include <initializer_list>
 #include <iostream>
 #include <map>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <utility>
 
+#include "Buffer.h"
+#include "Memory.h"
 
 class Serializable
 {
@@ -26,6 +32,8 @@ enum class HttpVersion
 
 std::string HttpVersionSerialize(HttpVersion version);
 
+void HttpVersionAppendTo(HttpVersion version, Buffer &buffer);
+
 HttpVersion HttpVersionDeserialize(const std::string &str);
 
 enum class Redirect
@@ -50,16 +58,50 @@ enum class HttpMethod
 class HttpHeader : public Serializable
 {
 public:
+	HttpHeader() = default;
+
+	/* A copy allocates from the current thread's resource, not from the one of other */
+	HttpHeader(const HttpHeader &other);
+
+	HttpHeader(HttpHeader &&other) noexcept = default;
+
+	HttpHeader &operator=(const HttpHeader &other) = default;
+
+	HttpHeader &operator=(HttpHeader &&other) = default;
+
+	~HttpHeader() override = default;
+
 	[[nodiscard]] std::string serialize() const override;
 
 	void deserialize(const std::string &str) override;
 
-	[[nodiscard]] std::string getField(const std::string &name) const;
+	/* Parses "name: value\r\n" lines up to the blank line or the end of data */
+	void deserialize(const char *data, size_t len);
+
+	/* Writes the fields and the blank line ending the header, names in their canonical spelling */
+	void appendTo(Buffer &buffer) const;
+
+	/* Same as appendTo(buffer), with the field name (lower case) written as value whether it is set or not */
+	void appendTo(Buffer &buffer, std::string_view name, std::string_view value) const;
+
+	/* The same for several fields, given in ascending order of their names */
+	void appendTo(Buffer &buffer, std::initializer_list<std::pair<std::string_view, std::string_view>> fields) const;
+
+	/* The value stays valid until the field is set or removed, empty if there is no such field */
+	[[nodiscard]] std::string_view getField(std::string_view name) const;
 
-	void setField(const std::string &name, const std::string &value);
+	void setField(std::string_view name, std::string_view value);
+
+	void removeField(std::string_view name);
 
 private:
-	std::map<std::string, std::string> fieldsMap;
+	/* Lower case names, std::less<> allows lookups without building a key string */
+	using FieldsMap = std::pmr::map<std::pmr::string, std::pmr::string, std::less<>>;
+
+	[[nodiscard]] FieldsMap::const_iterator find(std::string_view name) const;
+
+private:
+	FieldsMap fieldsMap{getMemoryResource()};
 };
 
 /************************** HttpBody *************************/
@@ -76,62 +118,42 @@ public:
 };
 
 /************************ HttpBodyImpl ***********************/
+/* Content is allocated from the resource current at construction and stays NUL terminated */
 class HttpBodyImpl : public HttpBody
 {
 public:
 
-	HttpBodyImpl(const char *data, size_t len)
+	HttpBodyImpl(const char *data, size_t len) : resource(getMemoryResource())
 	{
-		contentPtr = nullptr;
-		bodyLength = 0;
-		contentPtr = new char[len + 1];
-		if (contentPtr != nullptr)
-		{
-			bodyLength = len + 1;
-			memcpy(contentPtr, data, len);
-			contentPtr[len] = '\0';
-		}
+		allocate(data, len);
+		bodyLength = len + 1;
 	}
 
-	HttpBodyImpl(const HttpBodyImpl &other)
+	HttpBodyImpl(const HttpBodyImpl &other) : resource(getMemoryResource())
 	{
-		try
-		{
-			this->contentPtr = new char[other.bodyLength];
-			this->bodyLength = other.bodyLength;
-			memcpy(this->contentPtr, other.contentPtr, bodyLength);
-		}
-		catch (std::bad_alloc &e)
-		{
-			std::cout << e.what() << std::endl;
-			throw e;
-		}
+		allocate(other.contentPtr, other.allocLength > 0 ? other.allocLength - 1 : 0);
+		bodyLength = other.bodyLength;
 	}
 
 	HttpBodyImpl &operator=(const HttpBodyImpl &other)
 	{
 		if (this != &other)
 		{
-			try
-			{
-				this->contentPtr = new char[other.bodyLength];
-				this->bodyLength = other.bodyLength;
-				memcpy(this->contentPtr, other.contentPtr, bodyLength);
-			}
-			catch (std::bad_alloc &e)
-			{
-				std::cout << e.what() << std::endl;
-				throw e;
-			}
+			release();
+			allocate(other.contentPtr, other.allocLength > 0 ? other.allocLength - 1 : 0);
+			bodyLength = other.bodyLength;
 		}
 		return *this;
 	}
 
 	HttpBodyImpl(HttpBodyImpl &&other) noexcept
 	{
+		this->resource = other.resource;
 		this->bodyLength = other.bodyLength;
+		this->allocLength = other.allocLength;
 		this->contentPtr = other.contentPtr;
 		other.bodyLength = 0;
+		other.allocLength = 0;
 		other.contentPtr = nullptr;
 	}
 
@@ -139,9 +161,13 @@ public:
 	{
 		if (this != &other)
 		{
+			release();
+			this->resource = other.resource;
 			this->bodyLength = other.bodyLength;
+			this->allocLength = other.allocLength;
 			this->contentPtr = other.contentPtr;
 			other.bodyLength = 0;
+			other.allocLength = 0;
 			other.contentPtr = nullptr;
 		}
 		return *this;
@@ -149,10 +175,7 @@ public:
 
 	~HttpBodyImpl() override
 	{
-		if (contentPtr != nullptr)
-		{
-			delete[] contentPtr;
-		}
+		release();
 	}
 
 	[[nodiscard]] size_t getBodyLength() const override
@@ -171,7 +194,30 @@ public:
 	}
 
 private:
-	size_t bodyLength;
+	void allocate(const char *data, size_t len)
+	{
+		contentPtr = static_cast<char *>(resource->allocate(len + 1, 1));
+		allocLength = len + 1;
+		if (len > 0)
+		{
+			memcpy(contentPtr, data, len);
+		}
+		contentPtr[len] = '\0';
+	}
+
+	void release()
+	{
+		if (contentPtr != nullptr)
+		{
+			resource->deallocate(contentPtr, allocLength, 1);
+			contentPtr = nullptr;
+		}
+	}
+
+private:
+	std::pmr::memory_resource *resource = nullptr;
+	size_t bodyLength = 0;
+	size_t allocLength = 0;
 	char *contentPtr = nullptr;
 };
 
@@ -179,6 +225,8 @@ void toUpCase(std::string &str);
 
 void toLowCase(std::string &str);
 
+void toLowCase(std::pmr::string &str);
+
 void toUpCamelCase(std::string &str);
 
 #endif //LWHTTP_HTTPBASE_H
@@ -1,17 +1,41 @@
 #ifndef LWHTTP_HTTPCLIENT_H
 #define LWHTTP_HTTPCLIENT_H
 
+#include <atomic>
 #include <functional>
-#include <mutex>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <string>
 
 #include "HttpBase.h"
+#include "HttpMetrics.h"
+#include "PreparedRequest.h"
 #include "TLSContext.h"
+#include "URL.h"
 
 class HttpRequest;
 
 class HttpResponse;
 
+class ConnectionPool;
+
+class RedirectCache;
+
+class EventLoopGroup;
+
+class WorkStealingPool;
+
+class ConcurrencyLimiter;
+
+class Connection;
+
+struct RequestTrace;
+
+class CancelToken;
+
+class Hedger;
+
 /************************ Common *************************/
 #if defined(_WIN32) || defined(_WIN64)
 
@@ -26,72 +50,317 @@ using SocketHandle = int;
 #error Unsupported OS
 #endif
 
+/*********************** EventListener ***********************/
+enum class HttpEvent
+{
+	CALL_START,
+	DNS_START,
+	DNS_END,
+	CONNECT_START,
+	CONNECT_END,
+	TLS_START,
+	TLS_END,
+	/* An idle pooled connection was taken instead of connecting */
+	CONNECTION_ACQUIRED,
+	REQUEST_WRITTEN,
+	RESPONSE_FIRST_BYTE,
+	RESPONSE_END,
+	CALL_FAILED
+};
+
+struct RequestTiming;
+
+/* Called synchronously on the sending thread at each phase, timing carries the reuse and resumption flags */
+class EventListener
+{
+public:
+	virtual ~EventListener() = default;
+
+	virtual void onEvent(HttpEvent event, const HttpRequest &request, const RequestTiming &timing) = 0;
+};
+
+/********************** HttpClientConfig *********************/
+constexpr unsigned int DEFAULT_TIMEOUT = 5;
+constexpr unsigned int DEFAULT_MAX_REDIRECTS = 5;
+constexpr size_t DEFAULT_EXECUTOR_QUEUE_LIMIT = 4096;
+constexpr size_t DEFAULT_EXPECT_CONTINUE_THRESHOLD = 1024 * 1024;
+constexpr unsigned int DEFAULT_EXPECT_CONTINUE_TIMEOUT = 1000;
+
+/* Adaptive limit on the calls in flight to one origin, see HttpClientBuilder::Builder::concurrencyLimit() */
+struct ConcurrencyLimitConfig
+{
+	unsigned int initialLimit = 20;
+	unsigned int minLimit = 1;
+	unsigned int maxLimit = 1000;
+	/* Calls that may wait for a slot, beyond that a call over the limit fails at once */
+	size_t maxQueue = 0;
+	/* A call slower than tolerance times the lowest latency seen counts as a sign of overload */
+	double tolerance = 2.0;
+	/* Factor the limit is cut by on overload */
+	double backoff = 0.9;
+};
+
+/* Second attempt of slow GETs, see HttpClientBuilder::Builder::hedge() */
+struct HedgeConfig
+{
+	/* Fixed delay before the second attempt, 0 for the rolling percentile of the origin's latency */
+	unsigned int delayMillis = 0;
+	double percentile = 0.95;
+	/* Extra requests as a fraction of the hedgeable ones */
+	double budget = 0.05;
+	unsigned int minDelayMillis = 1;
+};
+
+/* Settings of a built client. They never change afterwards and are shared read-only with the per-scheme clients
+ * it sends through, so no thread needs a lock to read them. */
+struct HttpClientConfig
+{
+	Redirect redirect = Redirect::NORMAL;
+	std::string userAgent = "lwhttp/0.0.1";
+	unsigned int timeout = DEFAULT_TIMEOUT;
+	unsigned int maxRedirects = DEFAULT_MAX_REDIRECTS;
+	std::shared_ptr<EventListener> listener;
+	/* Event loop threads of sendAsync(), 0 for one per usable CPU */
+	unsigned int eventLoops = 0;
+	/* Pin each loop thread to its own CPU */
+	bool pinEventLoops = false;
+	/* Worker threads of submit() and sendFuture(), 0 for one per hardware thread */
+	unsigned int executorThreads = 0;
+	/* Requests waiting for a worker, submit() fails beyond that */
+	size_t executorQueueLimit = DEFAULT_EXECUTOR_QUEUE_LIMIT;
+	bool limitConcurrency = false;
+	ConcurrencyLimitConfig concurrencyLimit;
+	bool hedgeRequests = false;
+	HedgeConfig hedge;
+	/* A body of at least this size waits for "100 Continue", SIZE_MAX never waits */
+	size_t expectContinueThreshold = DEFAULT_EXPECT_CONTINUE_THRESHOLD;
+	/* Milliseconds to wait for the interim response, the body goes out anyway afterwards */
+	unsigned int expectContinueTimeout = DEFAULT_EXPECT_CONTINUE_TIMEOUT;
+	/* Every connection goes to this Unix socket instead of the host of the URL, empty for TCP */
+	std::string unixSocket;
+	/* A GET goes out as TLS 1.3 early data on a resumed connection */
+	bool earlyData = false;
+};
+
 /************************ HttpClient *************************/
+/* Safe for concurrent use, one client is meant to be shared by all threads */
 class HttpClient
 {
 public:
-	HttpClient();
+	/* len is 0 if the call failed, like the return value of send() */
+	using ResponseHandler = std::function<void(size_t len, HttpResponse &response)>;
+	/* HttpResponse::BodySink */
+	using BodySink = std::function<bool(const char *data, size_t len)>;
 
-	virtual ~HttpClient() = default;
+	explicit HttpClient(std::shared_ptr<const HttpClientConfig> clientConfig);
 
-	friend class HttpClientBuilder;
+	virtual ~HttpClient() = default;
 
 	virtual size_t send(const HttpRequest &request, HttpResponse &response) = 0;
 
-	virtual size_t sendAsync(HttpRequest &request, std::function<HttpResponse> &responseBodyHandler) = 0;
+	/* Sends a prepared request with values in its slots, redirects are not followed. Throws std::invalid_argument
+	 * for a slot value with a line break (see PreparedRequest::check). */
+	virtual size_t send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+	                    HttpResponse &response);
+
+	/* Sends a copy of request and returns at once, handler gets the response on an event loop thread of this
+	 * client. HTTP and HTTPS each have their own loops, early data is not used there. A streamed body is still
+	 * sent synchronously on the calling thread. Redirects are not followed. A handler must not drop the last
+	 * reference to the client. */
+	virtual bool sendAsync(const HttpRequest &request, ResponseHandler handler);
+
+	/* sendAsync() that hands the body of a 2xx response to sink as it arrives instead of keeping it, see
+	 * HttpResponse::setBodySink(). sink runs on the same thread as handler, which comes last. */
+	virtual bool streamAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler);
+
+	/* Runs send() with a copy of request on a worker thread of this client, handler gets the response there.
+	 * Works for every scheme and follows redirects. Returns false, and never calls handler, if the queue of the
+	 * workers is full. A handler must not drop the last reference to the client. */
+	virtual bool submit(const HttpRequest &request, ResponseHandler handler);
+
+	/* submit() with the response delivered through a future, which holds a std::runtime_error if the call failed
+	 * or was rejected */
+	std::future<HttpResponse> sendFuture(const HttpRequest &request);
+
+	/* Counters, latency histograms and per-origin connection gauges of this client */
+	[[nodiscard]] virtual MetricsSnapshot getMetrics() const;
 
 protected:
-	Redirect redirect;
-	std::string userAgent;
-	unsigned int timeout;
+	friend class HttpClientProxy;
+
+	friend class EventSource;
+
+	/* send() reporting to eventListener and httpMetrics, either is null when not installed. cancelToken, if any,
+	 * can abort the exchange from another thread. */
+	virtual size_t dispatch(const HttpRequest &request, HttpResponse &response, EventListener *eventListener,
+	                        HttpMetrics *httpMetrics, CancelToken *cancelToken = nullptr);
+
+	virtual size_t dispatch(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+	                        HttpResponse &response, EventListener *eventListener, HttpMetrics *httpMetrics);
+
+	/* streamAsync() reporting to httpMetrics, which the call keeps alive until the handler returns */
+	virtual bool dispatchAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler,
+	                           const std::shared_ptr<HttpMetrics> &httpMetrics);
+
+	/* Runs task on a thread the handlers of dispatchAsync() run on, right away when there is no event loop */
+	virtual void executeAsync(std::function<void()> task);
+
+	virtual void collectConnections(std::vector<OriginConnections> &connections) const;
+
+protected:
+	std::shared_ptr<const HttpClientConfig> config;
+	std::shared_ptr<HttpMetrics> metrics;
 };
 
 /*********************** HttpClientProxy *********************/
+/* Follows redirects and sends each hop through the client of its scheme, both are owned by this proxy */
 class HttpClientProxy : public HttpClient
 {
 public:
+	explicit HttpClientProxy(const std::shared_ptr<const HttpClientConfig> &clientConfig);
+
+	/* Waits for the requests already submitted */
+	~HttpClientProxy() override;
+
 	size_t send(const HttpRequest &request, HttpResponse &response) override;
 
-	size_t sendAsync(HttpRequest &httpRequest, std::function<HttpResponse> &responseBodyHandler) override;
+	size_t send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+	            HttpResponse &response) override;
+
+	bool streamAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler) override;
+
+	bool submit(const HttpRequest &request, ResponseHandler handler) override;
+
+	[[nodiscard]] MetricsSnapshot getMetrics() const override;
+
+protected:
+	using HttpClient::dispatch;
+
+	/* send() with cancelToken passed to every hop, the proxy reports to its own listener and metrics */
+	size_t dispatch(const HttpRequest &request, HttpResponse &response, EventListener *eventListener,
+	                HttpMetrics *httpMetrics, CancelToken *cancelToken = nullptr) override;
+
+private:
+	[[nodiscard]] HttpClient *getClient(Scheme scheme) const;
+
+	/* dispatch() of one hop under the concurrency limit of its origin */
+	template<typename Dispatch>
+	size_t dispatchLimited(const URL &uri, HttpResponse &response, Dispatch dispatchHop);
+
+	/* dispatch() of one hop, a GET that is slower than the hedge delay gets a second attempt */
+	size_t dispatchHedged(HttpClient *client, const HttpRequest &request, HttpResponse &response,
+	                      CancelToken *cancelToken);
+
+	WorkStealingPool &getExecutor();
 
 private:
-	static std::shared_ptr<HttpClient> httpClient;
-	static std::shared_ptr<HttpClient> httpsClient;
-	static std::mutex clientMutex;
+	std::shared_ptr<RedirectCache> redirectCache;
+	/* Null unless the concurrency is limited */
+	std::unique_ptr<ConcurrencyLimiter> limiter;
+	/* Null unless GETs are hedged, stopped before the executor its timers submit to */
+	std::unique_ptr<Hedger> hedger;
+	std::shared_ptr<HttpClient> httpClient;
+	std::shared_ptr<HttpClient> httpsClient;
+	/* Started by the first submit(), last so that it stops before anything its workers use */
+	std::once_flag executorOnce;
+	std::unique_ptr<WorkStealingPool> executor;
 };
 
 /******************* HttpClientNonTlsImpl ********************/
 class HttpClientNonTlsImpl : public HttpClient
 {
 public:
-	HttpClientNonTlsImpl();
+	explicit HttpClientNonTlsImpl(std::shared_ptr<const HttpClientConfig> clientConfig);
 
 	~HttpClientNonTlsImpl() override;
 
 	size_t send(const HttpRequest &httpRequest, HttpResponse &response) override;
 
-	size_t sendAsync(HttpRequest &request, std::function<HttpResponse> &responseBodyHandler) override;
+	size_t send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+	            HttpResponse &response) override;
+
+protected:
+	size_t dispatch(const HttpRequest &request, HttpResponse &response, EventListener *eventListener,
+	                HttpMetrics *httpMetrics, CancelToken *cancelToken = nullptr) override;
+
+	size_t dispatch(const PreparedRequest &prepared, const PreparedRequest::Values &values, HttpResponse &response,
+	                EventListener *eventListener, HttpMetrics *httpMetrics) override;
+
+#ifdef __linux__
+	bool dispatchAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler,
+	                   const std::shared_ptr<HttpMetrics> &httpMetrics) override;
+
+	void executeAsync(std::function<void()> task) override;
+#endif
+
+	void collectConnections(std::vector<OriginConnections> &connections) const override;
+
+private:
+	std::unique_ptr<Connection> connect(const URL &uri, RequestTrace &trace);
+
+#ifdef __linux__
+	EventLoopGroup &getLoops();
+#endif
+
+	std::shared_ptr<ConnectionPool> pool;
+#ifdef __linux__
+	/* Started by the first sendAsync() */
+	std::once_flag loopsOnce;
+	std::unique_ptr<EventLoopGroup> loops;
+	/* Set once loops exists, getMetrics() does not start them */
+	std::atomic<bool> loopsStarted{false};
+#endif
 };
 
 /********************* HttpClientTlsImpl *********************/
 class HttpClientTlsImpl : public HttpClient
 {
 public:
-	HttpClientTlsImpl();
+	explicit HttpClientTlsImpl(std::shared_ptr<const HttpClientConfig> clientConfig);
 
 	~HttpClientTlsImpl() override;
 
 	size_t send(const HttpRequest &httpRequest, HttpResponse &response) override;
 
-	size_t sendAsync(HttpRequest &request, std::function<HttpResponse> &responseBodyHandler) override;
+	size_t send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+	            HttpResponse &response) override;
+
+protected:
+	size_t dispatch(const HttpRequest &request, HttpResponse &response, EventListener *eventListener,
+	                HttpMetrics *httpMetrics, CancelToken *cancelToken = nullptr) override;
+
+	size_t dispatch(const PreparedRequest &prepared, const PreparedRequest::Values &values, HttpResponse &response,
+	                EventListener *eventListener, HttpMetrics *httpMetrics) override;
+
+#ifdef __linux__
+	/* Handshakes and records run on event loops of this client, the TLS connections never block them */
+	bool dispatchAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler,
+	                   const std::shared_ptr<HttpMetrics> &httpMetrics) override;
+
+	void executeAsync(std::function<void()> task) override;
+#endif
+
+	void collectConnections(std::vector<OriginConnections> &connections) const override;
 
 private:
+	/* With earlyData an idempotent request may go out as early data of the handshake */
+	std::unique_ptr<Connection> connect(const URL &uri, RequestTrace &trace, bool earlyData);
+
+#ifdef __linux__
+	EventLoopGroup &getLoops();
+#endif
+
 	TLSContext tlsContext;
+	std::shared_ptr<ConnectionPool> pool;
+#ifdef __linux__
+	/* Started by the first sendAsync(), after tlsContext so that its connections are gone before it */
+	std::once_flag loopsOnce;
+	std::unique_ptr<EventLoopGroup> loops;
+	std::atomic<bool> loopsStarted{false};
+#endif
 };
 
 /********************* HttpClientBuilder *********************/
-constexpr unsigned int DEFAULT_TIMEOUT = 5;
-
 class HttpClientBuilder
 {
 	class Builder
@@ -100,14 +369,52 @@ class HttpClientBuilder
 		//location: https://www.google.com/xxx/
 		Builder &redirect(Redirect redirect);
 
+		Builder &maxRedirects(unsigned int hops = DEFAULT_MAX_REDIRECTS);
+
 		Builder &userAgent(const std::string &agent);
 
 		Builder &timeout(unsigned int seconds = DEFAULT_TIMEOUT);
 
+		Builder &eventListener(std::shared_ptr<EventListener> eventListener);
+
+		/* A request body of at least threshold bytes is announced with "Expect: 100-continue" and only sent once
+		 * the server agreed or timeoutMillis passed, a final status before that skips it. SIZE_MAX turns it off. */
+		Builder &expectContinue(size_t threshold = DEFAULT_EXPECT_CONTINUE_THRESHOLD,
+		                        unsigned int timeoutMillis = DEFAULT_EXPECT_CONTINUE_TIMEOUT);
+
+		/* Connects to the Unix socket at path whatever the host of the URL, e.g. to a local sidecar. The origin
+		 * still keys the pools and names the Host, an http+unix URL takes its own socket. Throws
+		 * std::invalid_argument if the path does not fit a socket address. */
+		Builder &unixSocket(const std::string &path);
+
+		/* A GET without a body that opens a connection with a resumable TLS 1.3 session of a server
+		 * allowing it is sent as early data (0-RTT), saving a round trip. Rejected early data is sent again after
+		 * the handshake, "425 Too Early" is retried without it. RequestTiming::earlyData tells if it was used.
+		 * Early data may be replayed by an attacker, only enable it for servers where GETs are safe to repeat. */
+		Builder &earlyData(bool enable = true);
+
+		/* Event loops of sendAsync(), threads == 0 starts one per usable CPU. With pin each loop stays on its own
+		 * CPU, spread over the NUMA nodes. */
+		Builder &eventLoops(unsigned int threads, bool pin = false);
+
+		/* Workers of submit() and sendFuture(), threads == 0 starts one per hardware thread. At most queueLimit
+		 * requests wait for a worker. */
+		Builder &executor(unsigned int threads, size_t queueLimit = DEFAULT_EXECUTOR_QUEUE_LIMIT);
+
+		/* Adapts a limit on the calls in flight per origin to their latency (AIMD). Calls over the limit wait up to
+		 * the timeout if the queue has room, otherwise they fail at once. Stats are in MetricsSnapshot::limits. */
+		Builder &concurrencyLimit(const ConcurrencyLimitConfig &limit = ConcurrencyLimitConfig{});
+
+		/* A GET with no response after the hedge delay is sent once more on another connection, the first
+		 * response wins and the other attempt is aborted. The budget caps the extra requests per origin. Hedges
+		 * run on the executor() workers. */
+		Builder &hedge(const HedgeConfig &hedgeConfig = HedgeConfig{});
+
+		/* Every call builds a new client with its own connection pools */
 		std::shared_ptr<HttpClient> build();
 
 	private:
-		std::shared_ptr<HttpClient> client;
+		HttpClientConfig config;
 	};
 
 public:
@@ -0,0 +1,166 @@
+#ifndef LWHTTP_HTTPMETRICS_H
+#define LWHTTP_HTTPMETRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/********************* HistogramSnapshot *********************/
+/* Log-linear (HDR style) latency histogram in microseconds, each power of two is split into 16 linear buckets */
+struct HistogramSnapshot
+{
+	static constexpr unsigned int SUB_BUCKET_BITS = 4;
+	static constexpr unsigned int SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+	static constexpr unsigned int BUCKETS = 32 * SUB_BUCKETS;
+
+	static unsigned int bucketIndex(uint64_t value);
+
+	static uint64_t bucketLowerBound(unsigned int index);
+
+	static uint64_t bucketUpperBound(unsigned int index);
+
+	/* Returns the upper bound of the bucket holding the q-th quantile, 0 < q <= 1 */
+	[[nodiscard]] uint64_t valueAtQuantile(double q) const;
+
+	[[nodiscard]] double mean() const
+	{
+		return count == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(count);
+	}
+
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS);
+};
+
+/******************** OriginConnections **********************/
+struct OriginConnections
+{
+	std::string origin;
+	size_t active = 0;
+	size_t idle = 0;
+};
+
+/************************ OriginLimit ************************/
+/* State of the adaptive concurrency limit of one origin */
+struct OriginLimit
+{
+	std::string origin;
+	size_t limit = 0;
+	size_t inFlight = 0;
+	size_t queued = 0;
+};
+
+/********************** MetricsSnapshot **********************/
+struct MetricsSnapshot
+{
+	[[nodiscard]] double poolHitRatio() const
+	{
+		uint64_t total = poolHits + poolMisses;
+		return total == 0 ? 0.0 : static_cast<double>(poolHits) / static_cast<double>(total);
+	}
+
+	[[nodiscard]] double dnsCacheHitRatio() const
+	{
+		uint64_t total = dnsCacheHits + dnsCacheMisses;
+		return total == 0 ? 0.0 : static_cast<double>(dnsCacheHits) / static_cast<double>(total);
+	}
+
+	/* Prometheus text exposition format (version 0.0.4) */
+	[[nodiscard]] std::string toPrometheus() const;
+
+	/* Responses by status class, statusClass[0] counts 1xx and statusClass[4] counts 5xx */
+	uint64_t statusClass[5]{};
+	uint64_t failures = 0;
+	uint64_t bytesSent = 0;
+	uint64_t bytesReceived = 0;
+	uint64_t poolHits = 0;
+	uint64_t poolMisses = 0;
+	uint64_t dnsCacheHits = 0;
+	uint64_t dnsCacheMisses = 0;
+	uint64_t tlsHandshakes = 0;
+	uint64_t tlsResumed = 0;
+	uint64_t tlsEarlyData = 0;
+	uint64_t limiterRejected = 0;
+	uint64_t hedgesSent = 0;
+	uint64_t hedgesWon = 0;
+	HistogramSnapshot latency;
+	HistogramSnapshot timeToFirstByte;
+	HistogramSnapshot connectTime;
+	HistogramSnapshot tlsHandshakeTime;
+	std::vector<OriginConnections> connections;
+	/* Empty unless the client limits concurrency */
+	std::vector<OriginLimit> limits;
+};
+
+/************************ HttpMetrics ************************/
+enum class MetricCounter
+{
+	STATUS_1XX,
+	STATUS_2XX,
+	STATUS_3XX,
+	STATUS_4XX,
+	STATUS_5XX,
+	FAILURES,
+	BYTES_SENT,
+	BYTES_RECEIVED,
+	POOL_HITS,
+	POOL_MISSES,
+	DNS_CACHE_HITS,
+	DNS_CACHE_MISSES,
+	TLS_HANDSHAKES,
+	TLS_RESUMED,
+	/* Handshakes that carried the request as accepted early data */
+	TLS_EARLY_DATA,
+	/* Calls refused by the concurrency limiter, also counted as failures */
+	LIMITER_REJECTED,
+	/* Second attempts of hedged GETs, and those that answered first */
+	HEDGES_SENT,
+	HEDGES_WON,
+	COUNT
+};
+
+enum class MetricHistogram
+{
+	LATENCY,
+	TIME_TO_FIRST_BYTE,
+	CONNECT_TIME,
+	TLS_HANDSHAKE_TIME,
+	COUNT
+};
+
+/* Client-wide registry. Every thread updates its own cache-line aligned shard with relaxed atomic adds, readers
+ * sum the shards when taking a snapshot, so recording never takes a lock. */
+class HttpMetrics
+{
+public:
+	HttpMetrics();
+
+	void add(MetricCounter counter, uint64_t value = 1)
+	{
+		localShard().counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+	}
+
+	void record(MetricHistogram histogram, uint64_t micros);
+
+	/* Connection gauges are not kept here, the owner of the pools fills snapshot.connections */
+	[[nodiscard]] MetricsSnapshot snapshot() const;
+
+	static constexpr size_t SHARDS = 16;
+
+private:
+	struct alignas(64) Shard
+	{
+		std::atomic<uint64_t> counters[static_cast<size_t>(MetricCounter::COUNT)]{};
+		std::atomic<uint64_t> sums[static_cast<size_t>(MetricHistogram::COUNT)]{};
+		std::atomic<uint64_t> buckets[static_cast<size_t>(MetricHistogram::COUNT)][HistogramSnapshot::BUCKETS]{};
+	};
+
+	Shard &localShard();
+
+private:
+	std::unique_ptr<Shard[]> shards;
+};
+
+#endif //LWHTTP_HTTPMETRICS_H
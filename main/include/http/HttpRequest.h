@@ -1,8 +1,11 @@
 #ifndef LWHTTP_HTTPREQUEST_H
 #define LWHTTP_HTTPREQUEST_H
 
+#include <functional>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <memory_resource>
 #include <unordered_map>
 
 #include "URL.h"
@@ -11,35 +14,109 @@
 /************************ HttpRequest ************************/
 class HttpRequestBuilder;
 
+/* Length of a produced body that is only known at its end, it is then sent chunked */
+constexpr size_t UNKNOWN_BODY_LENGTH = static_cast<size_t>(-1);
+
+/* Fills up to len bytes of buffer with the next piece of the body and returns how many, 0 at the end of the body,
+ * or a negative value to abort the call. It is called on the sending thread, the next time only once the previous
+ * piece was written, so a slow peer slows the producer down. */
+using BodyProducer = std::function<long(char *buffer, size_t len)>;
+
+/* Where a BodySource writes its body, the writer adds the transfer framing */
+class BodyWriter
+{
+public:
+	virtual ~BodyWriter() = default;
+
+	/* The slices only need to stay valid during the call */
+	virtual bool write(const IoSlice *slices, size_t count) = 0;
+
+	/* Writes len bytes of the file at offset, on a plain connection without copying them through user space */
+	virtual bool writeFile(int fd, size_t offset, size_t len) = 0;
+};
+
+/* A body written straight to the connection in pieces, e.g. a MultipartBody */
+class BodySource
+{
+public:
+	virtual ~BodySource() = default;
+
+	/* UNKNOWN_BODY_LENGTH if it is only known at the end, the body is then sent chunked */
+	[[nodiscard]] virtual size_t getLength() const = 0;
+
+	/* Empty to leave Content-Type alone */
+	[[nodiscard]] virtual std::string getContentType() const = 0;
+
+	/* False if writeTo() can only be called once, the request is then neither retried nor redirected with it */
+	[[nodiscard]] virtual bool isRepeatable() const = 0;
+
+	virtual bool writeTo(BodyWriter &writer) const = 0;
+};
+
 class HttpRequest
 {
 public:
 
 	HttpRequest() = default;
 
+	/* A copy allocates from the current thread's resource, not from the one of other */
+	HttpRequest(const HttpRequest &other);
+
+	HttpRequest(HttpRequest &&other) noexcept = default;
+
+	HttpRequest &operator=(const HttpRequest &other) = default;
+
+	HttpRequest &operator=(HttpRequest &&other) = default;
+
 	~HttpRequest();
 
 	[[nodiscard]] std::string getRequestLine() const;
 
-	[[nodiscard]] HttpHeader getHeader() const;
+	void appendRequestLineTo(Buffer &buffer) const;
 
-	[[nodiscard]] std::string getParameter(const std::string &name) const;
+	/* Request line and header, the body is written separately */
+	void appendTo(Buffer &buffer) const;
+
+	[[nodiscard]] const HttpHeader &getHeader() const
+	{
+		return header;
+	}
 
-	[[nodiscard]] std::unordered_map<std::string, std::string> getParameterMap() const;
+	/* Empty if there is no such parameter */
+	[[nodiscard]] std::string_view getParameter(std::string_view name) const;
+
+	using ParameterMap = std::pmr::unordered_map<std::pmr::string, std::pmr::string>;
+
+	[[nodiscard]] const ParameterMap &getParameterMap() const
+	{
+		return parameterMap;
+	}
+
+	/* False if the body is used up by sending it */
+	[[nodiscard]] bool hasRepeatableBody() const
+	{
+		return !producer && ((source == nullptr) || source->isRepeatable());
+	}
 
 public:
 	URL uri;
 	HttpMethod method = HttpMethod::GET;
 	HttpVersion version = HttpVersion::HTTP_1_1;
 	HttpHeader header;
-	std::unordered_map<std::string, std::string> parameterMap;
+	ParameterMap parameterMap{getMemoryResource()};
 	std::shared_ptr<HttpBody> body;
+	/* Set instead of body for a body generated while it is sent, the request can then be sent once */
+	BodyProducer producer;
+	/* Set instead of body for a body written in pieces */
+	std::shared_ptr<const BodySource> source;
 };
 
 /********************* HttpRequestBuilder *********************/
 class HttpRequestBuilder
 {
 public:
+	/* On a temporary builder (newBuilder().url(..)...build()) every call is an rvalue one, build() then moves the
+	 * request out instead of copying it. A named builder can be built more than once. */
 	class Builder
 	{
 	public:
@@ -47,21 +124,88 @@ public:
 
 		~Builder() = default;
 
-		Builder &url(URL &url);
+		Builder &url(URL url) &;
+
+		Builder &&url(URL target) &&
+		{
+			return std::move(this->url(std::move(target)));
+		}
+
+		Builder &header(HttpHeader header) &;
+
+		Builder &&header(HttpHeader fields) &&
+		{
+			return std::move(this->header(std::move(fields)));
+		}
+
+		Builder &GET() &;
+
+		Builder &&GET() &&
+		{
+			return std::move(this->GET());
+		}
+
+		Builder &POST(std::shared_ptr<HttpBody> body) &;
+
+		Builder &&POST(std::shared_ptr<HttpBody> content) &&
+		{
+			return std::move(this->POST(std::move(content)));
+		}
+
+		Builder &PUT(std::shared_ptr<HttpBody> body) &;
+
+		Builder &&PUT(std::shared_ptr<HttpBody> content) &&
+		{
+			return std::move(this->PUT(std::move(content)));
+		}
+
+		/* The body is pulled from producer while it is sent, with Content-Length if length is known */
+		Builder &POST(BodyProducer producer, size_t length = UNKNOWN_BODY_LENGTH) &;
+
+		Builder &&POST(BodyProducer source, size_t length = UNKNOWN_BODY_LENGTH) &&
+		{
+			return std::move(this->POST(std::move(source), length));
+		}
+
+		Builder &PUT(BodyProducer producer, size_t length = UNKNOWN_BODY_LENGTH) &;
+
+		Builder &&PUT(BodyProducer source, size_t length = UNKNOWN_BODY_LENGTH) &&
+		{
+			return std::move(this->PUT(std::move(source), length));
+		}
+
+		/* Content-Length and Content-Type are taken from source */
+		Builder &POST(std::shared_ptr<const BodySource> source) &;
+
+		Builder &&POST(std::shared_ptr<const BodySource> source) &&
+		{
+			return std::move(this->POST(std::move(source)));
+		}
+
+		Builder &PUT(std::shared_ptr<const BodySource> source) &;
 
-		Builder &header(HttpHeader &header);
+		Builder &&PUT(std::shared_ptr<const BodySource> source) &&
+		{
+			return std::move(this->PUT(std::move(source)));
+		}
 
-		Builder &GET();
+		Builder &DELETE() &;
 
-		Builder &POST(std::shared_ptr<HttpBody> body);
+		Builder &&DELETE() &&
+		{
+			return std::move(this->DELETE());
+		}
 
-		Builder &PUT(std::shared_ptr<HttpBody> body);
+		Builder &version(HttpVersion version) &;
 
-		Builder &DELETE();
+		Builder &&version(HttpVersion httpVersion) &&
+		{
+			return std::move(this->version(httpVersion));
+		}
 
-		Builder &version(HttpVersion version);
+		[[nodiscard]] HttpRequest build() const &;
 
-		HttpRequest build();
+		[[nodiscard]] HttpRequest build() &&;
 
 	private:
 		HttpRequest httpRequest{};
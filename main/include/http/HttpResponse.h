@@ -1,7 +1,11 @@
 #ifndef LWHTTP_HTTPRESPONSE_H
 #define LWHTTP_HTTPRESPONSE_H
 
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string_view>
 #include <unordered_map>
 
 #include "HttpBase.h"
@@ -87,6 +91,8 @@ class StatusLine : public Serializable
 public:
 	[[nodiscard]] std::string serialize() const override;
 
+	void appendTo(Buffer &buffer) const;
+
 	[[nodiscard]] HttpVersion getVersion() const
 	{ return version; }
 
@@ -95,7 +101,8 @@ public:
 		return status;
 	}
 
-	[[nodiscard]] std::string getReason() const;
+	/* The standard reason phrase of the status code, empty for an unknown code */
+	[[nodiscard]] std::string_view getReason() const;
 
 	size_t build(const char *buffer, size_t len);
 
@@ -107,13 +114,36 @@ private:
 	HttpStatus status{};
 };
 
+/*********************** RequestTiming ***********************/
+/* Phase timestamps of one exchange, a phase that did not happen (e.g. DNS on a reused connection) keeps the epoch */
+struct RequestTiming
+{
+	using Clock = std::chrono::steady_clock;
+
+	Clock::time_point start{};
+	Clock::time_point dnsStart{};
+	Clock::time_point dnsEnd{};
+	Clock::time_point connectStart{};
+	Clock::time_point connectEnd{};
+	Clock::time_point tlsStart{};
+	Clock::time_point tlsEnd{};
+	Clock::time_point requestWritten{};
+	Clock::time_point firstByte{};
+	Clock::time_point lastByte{};
+	bool connectionReused = false;
+	bool sessionResumed = false;
+	/* The request went out as TLS 1.3 early data and the server accepted it */
+	bool earlyData = false;
+};
+
 /************************ HttpResponse ***********************/
 class HttpResponse
 {
 public:
-	~HttpResponse();
+	/* Takes the next piece of the (de-chunked) body, returns false to abort the call */
+	using BodySink = std::function<bool(const char *data, size_t len)>;
 
-	[[nodiscard]] StatusLine getStatusLine() const
+	[[nodiscard]] const StatusLine &getStatusLine() const
 	{
 		return statusLine;
 	}
@@ -128,14 +158,17 @@ public:
 		return statusLine.getVersion();
 	}
 
-	[[nodiscard]] std::string getReason() const
+	[[nodiscard]] std::string_view getReason() const
 	{
 		return statusLine.getReason();
 	}
 
-	[[nodiscard]] HttpHeader getHeader() const;
+	[[nodiscard]] const HttpHeader &getHeader() const
+	{
+		return header;
+	}
 
-	[[nodiscard]] std::string getContentType() const
+	[[nodiscard]] std::string_view getContentType() const
 	{
 		return header.getField("Content-Type");
 	}
@@ -154,17 +187,48 @@ public:
 
 	[[nodiscard]] HttpBody *getResponseBody() const
 	{
-		return body;
+		return body.get();
+	}
+
+	[[nodiscard]] const RequestTiming &getTiming() const
+	{
+		return timing;
+	}
+
+	RequestTiming &getTiming()
+	{
+		return timing;
+	}
+
+	/* The body of a 2xx response goes to sink as it arrives instead of into getResponseBody(). Set it before the
+	 * call, it stays across redirects. */
+	void setBodySink(BodySink sink)
+	{
+		bodySink = std::move(sink);
+	}
+
+	[[nodiscard]] const BodySink &getBodySink() const
+	{
+		return bodySink;
 	}
 
 	size_t buildHeader(const char *buffer, size_t len);
 
+	/* Forgets the head of an interim (1xx) response, the final one is read into the same object */
+	void clearHead()
+	{
+		statusLine = StatusLine{};
+		header = HttpHeader{};
+	}
+
 	void build(const char *buffer, size_t bodyLen);
 
 private:
 	StatusLine statusLine{};
 	HttpHeader header{};
-	HttpBody *body = nullptr;
+	std::unique_ptr<HttpBody> body;
+	RequestTiming timing{};
+	BodySink bodySink;
 };
 
 #endif //LWHTTP_HTTPRESPONSE_H
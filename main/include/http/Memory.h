@@ -0,0 +1,38 @@
+#ifndef LWHTTP_MEMORY_H
+#define LWHTTP_MEMORY_H
+
+#include <memory_resource>
+
+/************************** Memory ***************************/
+/* The memory resource URL, HttpHeader, HttpRequest, HttpResponse and HttpBodyImpl objects constructed on this
+ * thread allocate from, std::pmr::get_default_resource() unless a MemoryScope is active. An object keeps the
+ * resource it was constructed with, so it must be destroyed before that resource. */
+std::pmr::memory_resource *getMemoryResource();
+
+/* Installs resource for the current thread until the scope ends, e.g. a monotonic_buffer_resource per request
+ * released in bulk afterwards, or an unsynchronized_pool_resource per thread to keep off the global heap. */
+class MemoryScope
+{
+public:
+	explicit MemoryScope(std::pmr::memory_resource *resource);
+
+	MemoryScope(const MemoryScope &other) = delete;
+
+	MemoryScope &operator=(const MemoryScope &other) = delete;
+
+	~MemoryScope();
+
+private:
+	std::pmr::memory_resource *previous;
+};
+
+/* A copy of object on std::pmr::get_default_resource(), e.g. of a request that outlives the caller's frame and with
+ * it the caller's per-request memory resource */
+template<typename T>
+T detachedCopy(const T &object)
+{
+	MemoryScope scope(std::pmr::get_default_resource());
+	return T(object);
+}
+
+#endif //LWHTTP_MEMORY_H
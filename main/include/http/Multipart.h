@@ -0,0 +1,93 @@
+#ifndef LWHTTP_MULTIPART_H
+#define LWHTTP_MULTIPART_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HttpRequest.h"
+
+/*********************** MultipartBody ***********************/
+/* multipart/form-data written part by part as the request is sent. Memory parts are referenced rather than copied
+ * and file parts go out with sendfile on plain HTTP. The Content-Length is known up front unless a producer part
+ * has no length. */
+class MultipartBody : public BodySource
+{
+public:
+	/* With a random boundary */
+	MultipartBody();
+
+	/* Throws std::invalid_argument unless boundary has 1 to 70 of the characters RFC 2046 allows */
+	explicit MultipartBody(std::string boundary);
+
+	MultipartBody(const MultipartBody &other) = delete;
+
+	MultipartBody &operator=(const MultipartBody &other) = delete;
+
+	~MultipartBody() override;
+
+	/* A text field, value is copied */
+	MultipartBody &addField(std::string_view name, std::string_view value);
+
+	/* data is not copied, it must stay valid as long as the request may be sent */
+	MultipartBody &addData(std::string_view name, const char *data, size_t len, std::string_view filename = {},
+	                       std::string_view contentType = DEFAULT_PART_TYPE);
+
+	/* The whole file of fd as it is now, fd is not closed. Throws std::runtime_error if its size is unknown. */
+	MultipartBody &addFile(std::string_view name, int fd, std::string_view filename,
+	                       std::string_view contentType = DEFAULT_PART_TYPE);
+
+	/* Opens path and closes it with the body, the filename sent is its last component. Throws std::runtime_error if
+	 * it cannot be opened. */
+	MultipartBody &addFile(std::string_view name, const std::string &path,
+	                       std::string_view contentType = DEFAULT_PART_TYPE);
+
+	/* Pulled while sending, the body can then be sent once. Without a length the whole body is sent chunked. */
+	MultipartBody &addProducer(std::string_view name, BodyProducer producer, size_t length = UNKNOWN_BODY_LENGTH,
+	                           std::string_view filename = {}, std::string_view contentType = DEFAULT_PART_TYPE);
+
+	[[nodiscard]] const std::string &getBoundary() const
+	{
+		return boundary;
+	}
+
+	[[nodiscard]] size_t getLength() const override;
+
+	[[nodiscard]] std::string getContentType() const override;
+
+	[[nodiscard]] bool isRepeatable() const override;
+
+	bool writeTo(BodyWriter &writer) const override;
+
+	static constexpr std::string_view DEFAULT_PART_TYPE = "application/octet-stream";
+
+private:
+	enum class PartKind
+	{
+		MEMORY,
+		DESCRIPTOR,
+		PRODUCER
+	};
+
+	struct Part
+	{
+		PartKind kind = PartKind::MEMORY;
+		/* Delimiter and part header */
+		std::string head;
+		/* Owns the data of a field */
+		std::string value;
+		/* Null for a field */
+		const char *data = nullptr;
+		size_t length = 0;
+		int fd = -1;
+		bool ownsFd = false;
+		BodyProducer producer;
+	};
+
+	Part &addPart(PartKind kind, std::string_view name, std::string_view filename, std::string_view contentType);
+
+	std::string boundary;
+	std::vector<Part> parts;
+};
+
+#endif //LWHTTP_MULTIPART_H
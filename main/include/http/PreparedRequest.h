@@ -0,0 +1,127 @@
+#ifndef LWHTTP_PREPAREDREQUEST_H
+#define LWHTTP_PREPAREDREQUEST_H
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Buffer.h"
+#include "HttpRequest.h"
+
+/********************** PreparedRequest **********************/
+/* A request whose line and header are serialized once. Only the slots (request-target, some header values and
+ * the body with its Content-Length) change per send, the cached bytes and the slot values are then written
+ * with one vectored write. The header goes out as built, the client's User-Agent is not substituted and
+ * redirects are not followed. */
+class PreparedRequest
+{
+public:
+	static constexpr size_t MAX_HEADER_SLOTS = 4;
+
+	/* The variable parts of one send, they are only referenced and must outlive the send */
+	struct Values
+	{
+		/* /path[?query] in origin form, used when the request has a path slot, "/" if empty */
+		std::string_view path;
+		/* In the order the header slots were declared */
+		std::array<std::string_view, MAX_HEADER_SLOTS> headers{};
+		/* Used when the request has a body slot, Content-Length follows its size */
+		std::string_view body;
+	};
+
+	/* Upper bound of the slices gather() produces */
+	static constexpr size_t MAX_SLICES = 2 * (MAX_HEADER_SLOTS + 2) + 2;
+
+	/* Throws std::invalid_argument if a path or header value holds a CR or LF, or the path is not in origin form:
+	 * it must start with a single '/' and hold no whitespace, fragment or dot segment */
+	void check(const Values &values) const;
+
+	/* Fills slices with the head and body for values. digits backs the Content-Length value. Returns the count,
+	 * throws like check(). */
+	size_t gather(const Values &values, IoSlice *slices, char (&digits)[20]) const;
+
+	[[nodiscard]] const HttpRequest &getRequest() const
+	{
+		return request;
+	}
+
+	/* The request as gather() would send it, for the clients without a prepared path. Throws like check(). */
+	[[nodiscard]] HttpRequest toRequest(const Values &values) const;
+
+	/* Rvalue calls chain on a temporary builder and let build() move the template request */
+	class Builder
+	{
+	public:
+		Builder &request(HttpRequest request) &;
+
+		Builder &&request(HttpRequest base) &&
+		{
+			return std::move(this->request(std::move(base)));
+		}
+
+		/* The request-target varies per send */
+		Builder &pathSlot() &;
+
+		Builder &&pathSlot() &&
+		{
+			return std::move(this->pathSlot());
+		}
+
+		/* The value of field name varies per send */
+		Builder &headerSlot(const std::string &name) &;
+
+		Builder &&headerSlot(const std::string &name) &&
+		{
+			return std::move(this->headerSlot(name));
+		}
+
+		/* The body varies per send, Content-Length is computed for each one */
+		Builder &bodySlot() &;
+
+		Builder &&bodySlot() &&
+		{
+			return std::move(this->bodySlot());
+		}
+
+		[[nodiscard]] PreparedRequest build() const &;
+
+		[[nodiscard]] PreparedRequest build() &&;
+
+	private:
+		HttpRequest templateRequest{};
+		bool hasPathSlot = false;
+		bool hasBodySlot = false;
+		std::vector<std::string> headerSlots;
+	};
+
+	static Builder newBuilder();
+
+private:
+	enum class Slot
+	{
+		NONE,
+		PATH,
+		HEADER,
+		CONTENT_LENGTH,
+		BODY
+	};
+
+	/* Cached bytes head[offset, offset + len) followed by a slot */
+	struct Part
+	{
+		size_t offset;
+		size_t len;
+		Slot slot;
+		size_t index;
+	};
+
+	HttpRequest request;
+	std::string head;
+	std::vector<Part> parts;
+	std::vector<std::string> headerSlots;
+	bool hasPathSlot = false;
+	bool hasBodySlot = false;
+};
+
+#endif //LWHTTP_PREPAREDREQUEST_H
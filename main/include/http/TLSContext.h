@@ -1,12 +1,15 @@
 #ifndef LWHTTP_TLSCONTEXT_H
 #define LWHTTP_TLSCONTEXT_H
 
+#include <memory>
 #include <string>
 #include <vector>
 
 typedef struct ssl_st SSL;
 typedef struct ssl_ctx_st SSL_CTX;
 
+class TlsSessionCache;
+
 struct ssl_ctx_st;
 struct ssl_st;
 
@@ -39,6 +42,19 @@ public:
 
 	[[nodiscard]] std::vector<std::string> getCiphers() const;
 
+	[[nodiscard]] bool isEarlyDataEnabled() const
+	{
+		return earlyData;
+	}
+
+	/* How much early data ssl may send, 0 unless early data is enabled and ssl resumes a TLS 1.3 session whose
+	 * server accepts it. Each ticket carries early data only once, newSSL() hands a TLS 1.3 session out once. */
+	[[nodiscard]] size_t takeEarlyData(SSL *ssl) const;
+
+	/* A connection object of this context, SNI is left to the caller. A client context resumes the newest session
+	 * cached for origin, taking a TLS 1.3 one out, and caches the sessions the server issues on it. */
+	[[nodiscard]] SSL *newSSL(const std::string &origin) const;
+
 private:
 	struct Initializer
 	{
@@ -48,10 +64,12 @@ private:
 	};
 
 public:
+	/* Shared by all connections, only read after the context is built */
 	SSL_CTX *sslCtx = nullptr;
-	SSL *ssl = nullptr;
+	std::shared_ptr<TlsSessionCache> sessionCache;
 	TLSProtocol tlsProtocol = TLSProtocol::TLSv1_2;
 	std::vector<std::string> ciphers;
+	bool earlyData = false;
 	static Initializer initializer;
 };
 
@@ -66,6 +84,9 @@ public:
 
 		Builder &setMinVersion(TLSProtocol protocol);
 
+		/* Lets connections send early data (0-RTT) with resumed TLS 1.3 sessions, see takeEarlyData() */
+		Builder &enableEarlyData(bool enable = true);
+
 		TLSContext build();
 
 	private:
@@ -1,7 +1,12 @@
 #ifndef LWHTTP_URI_H
 #define LWHTTP_URI_H
 
+#include <memory_resource>
 #include <string>
+#include <string_view>
+
+#include "Buffer.h"
+#include "Memory.h"
 
 enum class Scheme
 {
@@ -10,26 +15,55 @@ enum class Scheme
 	Https
 };
 
+/* sun_path holds 108 bytes on Linux, 104 on the BSDs, less the terminating NUL */
+constexpr size_t MAX_SOCKET_PATH = 103;
+
 class URL
 {
 public:
 	URL();
 
+	/* http://, https:// or http+unix:// with the socket path percent-encoded as the authority, e.g.
+	 * http+unix://%2Frun%2Fsidecar.sock/path. Throws std::invalid_argument for anything else. */
 	explicit URL(const std::string &str);
 
+	/* A copy allocates from the current thread's resource, not from the one of other */
+	URL(const URL &other);
+
+	URL(URL &&other) noexcept = default;
+
+	URL &operator=(const URL &other) = default;
+
+	URL &operator=(URL &&other) = default;
+
 	[[nodiscard]] std::string serialize() const;
 
+	void appendTo(Buffer &buffer) const;
+
+	/* path[?query], the request-target of the request line */
+	void appendRequestTargetTo(Buffer &buffer) const;
+
+	/* Resolves a reference such as a Location header value (absolute, "//host/..", "/path" or "path") */
+	[[nodiscard]] URL resolve(const std::string &reference) const;
+
+	/* scheme://host:port, identifies the server a connection can be reused for */
+	[[nodiscard]] std::string getOrigin() const;
+
+	/* host[:port], the port is omitted when it is the scheme's default. "localhost" for a Unix socket. */
+	[[nodiscard]] std::string getAuthority() const;
+
+	/* The views below stay valid as long as this URL is neither modified nor destroyed */
 	[[nodiscard]] Scheme getScheme() const
 	{
 		return scheme;
 	}
 
-	[[nodiscard]] std::string getAuthInfo() const
+	[[nodiscard]] std::string_view getAuthInfo() const
 	{
 		return authInfo;
 	}
 
-	[[nodiscard]] std::string getHost() const
+	[[nodiscard]] std::string_view getHost() const
 	{
 		return host;
 	}
@@ -39,26 +73,33 @@ public:
 		return port;
 	}
 
-	[[nodiscard]] std::string getPath() const
+	[[nodiscard]] std::string_view getPath() const
 	{
 		return path;
 	}
 
-	[[nodiscard]] std::string getQuery() const
+	[[nodiscard]] std::string_view getQuery() const
 	{
 		return query;
 	}
 
+	/* The Unix socket an http+unix URL connects to, empty for TCP */
+	[[nodiscard]] std::string_view getSocketPath() const
+	{
+		return socketPath;
+	}
+
 private:
 	void initialize();
 
 private:
 	Scheme scheme = Scheme::Null;
-	std::string authInfo;
-	std::string host;
+	std::pmr::string authInfo{getMemoryResource()};
+	std::pmr::string host{getMemoryResource()};
 	unsigned short port{};
-	std::string path;
-	std::string query;
+	std::pmr::string path{getMemoryResource()};
+	std::pmr::string query{getMemoryResource()};
+	std::pmr::string socketPath{getMemoryResource()};
 };
 
 #endif //LWHTTP_URI_H
@@ -0,0 +1,212 @@
+#ifndef LWHTTP_WEBSOCKET_H
+#define LWHTTP_WEBSOCKET_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HttpClient.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "TLSContext.h"
+
+class Connection;
+
+class FrameParser;
+
+class PerMessageDeflate;
+
+/************************* WebSocket *************************/
+enum class WebSocketOpcode : uint8_t
+{
+	CONTINUATION = 0x0,
+	TEXT = 0x1,
+	BINARY = 0x2,
+	CLOSE = 0x8,
+	PING = 0x9,
+	PONG = 0xA
+};
+
+/* Close codes of RFC 6455 */
+constexpr uint16_t WS_CLOSE_NORMAL = 1000;
+constexpr uint16_t WS_CLOSE_GOING_AWAY = 1001;
+constexpr uint16_t WS_CLOSE_PROTOCOL_ERROR = 1002;
+/* Never sent, the close frame had no code */
+constexpr uint16_t WS_CLOSE_NO_STATUS = 1005;
+/* Never sent, the connection broke without a close frame */
+constexpr uint16_t WS_CLOSE_ABNORMAL = 1006;
+constexpr uint16_t WS_CLOSE_INVALID_DATA = 1007;
+constexpr uint16_t WS_CLOSE_TOO_BIG = 1009;
+
+constexpr size_t DEFAULT_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+struct WebSocketConfig
+{
+	/* Offered in Sec-WebSocket-Protocol, the server picks one of them */
+	std::vector<std::string> protocols;
+	/* Offer permessage-deflate, ignored when the library is built without zlib */
+	bool deflate = false;
+	/* Smaller messages are sent uncompressed */
+	size_t deflateThreshold = 64;
+	/* A larger incoming message, compressed or not, closes the connection with WS_CLOSE_TOO_BIG */
+	size_t maxMessageSize = DEFAULT_MAX_MESSAGE_SIZE;
+	/* Seconds for connecting and the handshake, and for each send */
+	unsigned int timeout = DEFAULT_TIMEOUT;
+	std::string userAgent = "lwhttp/0.0.1";
+	/* Context of wss connections, null for a client context shared by all WebSockets */
+	std::shared_ptr<const TLSContext> tlsContext;
+};
+
+struct WebSocketMessage
+{
+	WebSocketOpcode opcode = WebSocketOpcode::TEXT;
+	std::string data;
+
+	[[nodiscard]] bool isText() const
+	{
+		return opcode == WebSocketOpcode::TEXT;
+	}
+};
+
+class WebSocket;
+
+/* Receives the messages of a listening WebSocket, see WebSocket::listen() */
+class WebSocketHandler
+{
+public:
+	virtual ~WebSocketHandler() = default;
+
+	/* message may be moved from */
+	virtual void onMessage(WebSocket &socket, WebSocketMessage &message) = 0;
+
+	/* The last call. reason is empty unless the server sent one. */
+	virtual void onClose(WebSocket &socket, uint16_t code, std::string_view reason) = 0;
+};
+
+/* A client connection after the HTTP upgrade handshake. Sends are safe from any thread, messages are read by one
+ * thread with receive() or delivered to a handler after listen(). Pings are answered and fragmented messages
+ * joined on the way. */
+class WebSocket : public std::enable_shared_from_this<WebSocket>
+{
+public:
+	/* Connects to the URL of request and does the handshake, further headers of request (e.g. Origin or
+	 * Authorization) go along. The URL has the http or https scheme. Throws std::runtime_error on failure. */
+	static std::shared_ptr<WebSocket> connect(const HttpRequest &request, const WebSocketConfig &config = {});
+
+	/* Same as above for a ws, wss, http or https URL */
+	static std::shared_ptr<WebSocket> connect(const std::string &url, const WebSocketConfig &config = {});
+
+	WebSocket(const WebSocket &other) = delete;
+
+	WebSocket &operator=(const WebSocket &other) = delete;
+
+	~WebSocket();
+
+	/* The send calls return false once the connection is closed or broken */
+	bool sendText(std::string_view text);
+
+	bool sendBinary(const char *data, size_t len);
+
+	bool ping(std::string_view payload = {});
+
+	/* Starts the closing handshake, the server's close then ends receive() or reaches the handler */
+	bool close(uint16_t code = WS_CLOSE_NORMAL, std::string_view reason = {});
+
+	/* Blocks for the next message. Returns false once the connection is closed, getCloseCode() tells why. Not to
+	 * be called after listen(). */
+	bool receive(WebSocketMessage &message);
+
+	/* Hands every further message to handler. The connection is read by an event loop thread shared by all
+	 * WebSockets, by a thread of its own where there are no event loops. The socket stays alive until it is
+	 * closed. */
+	void listen(std::shared_ptr<WebSocketHandler> handler);
+
+	[[nodiscard]] const HttpResponse &getHandshakeResponse() const
+	{
+		return handshakeResponse;
+	}
+
+	/* The subprotocol the server picked, empty if none */
+	[[nodiscard]] std::string_view getProtocol() const;
+
+	[[nodiscard]] bool isDeflateEnabled() const
+	{
+		return deflate != nullptr;
+	}
+
+	[[nodiscard]] bool isOpen() const
+	{
+		return !closed.load(std::memory_order_acquire);
+	}
+
+	[[nodiscard]] uint16_t getCloseCode() const
+	{
+		return closeCode;
+	}
+
+	[[nodiscard]] const std::string &getCloseReason() const
+	{
+		return closeReason;
+	}
+
+private:
+	friend class WebSocketReader;
+
+	WebSocket(std::unique_ptr<Connection> webSocketConnection, bool isTls, HttpResponse response,
+	          const WebSocketConfig &config, std::unique_ptr<PerMessageDeflate> messageDeflate);
+
+	bool sendFrame(WebSocketOpcode opcode, const char *data, size_t len);
+
+	/* Under writeMutex */
+	bool writeAll(const char *data, size_t len);
+
+	/* A control frame of the reading side, queued instead of written while an event loop reads the socket */
+	void sendControl(WebSocketOpcode opcode, const char *data, size_t len);
+
+	/* Writes what the socket takes of the queued control frames without waiting, true once none are left */
+	bool flushControl();
+
+	/* Feeds the frames buffered in the parser, returns true with a complete data message */
+	bool nextMessage(WebSocketMessage &message);
+
+	/* Reads once into the parser, false on EOF or error */
+	bool readSome(bool nonBlocking, bool &wouldBlock);
+
+	void fail(uint16_t code, std::string_view reason);
+
+	void shutdown();
+
+private:
+	std::unique_ptr<Connection> connection;
+	/* A TLS connection is not safe for a read and a write at once. Each step on its SSL goes under tlsMutex, the
+	 * waits for the socket do not (both go under writeMutex where there are no event loops). */
+	bool tls;
+	HttpResponse handshakeResponse;
+	std::unique_ptr<FrameParser> parser;
+	std::unique_ptr<PerMessageDeflate> deflate;
+	size_t deflateThreshold;
+	size_t maxMessageSize;
+	unsigned int timeout;
+	std::mutex writeMutex;
+	std::mutex tlsMutex;
+	/* Guards pendingControl and closeSent, never held while the socket blocks */
+	std::mutex controlMutex;
+	/* Control frames waiting for the socket, they go out before the next frame sent */
+	std::string pendingControl;
+	bool queueControl = false;
+	/* The message being joined from fragments */
+	WebSocketMessage partial;
+	bool inMessage = false;
+	bool partialCompressed = false;
+	bool closeSent = false;
+	std::atomic<bool> closed{false};
+	uint16_t closeCode = WS_CLOSE_ABNORMAL;
+	std::string closeReason;
+	bool listening = false;
+};
+
+#endif //LWHTTP_WEBSOCKET_H
@@ -1,11 +1,20 @@
 #ifndef LWHTTP_H
 #define LWHTTP_H
 
+#include "Buffer.h"
+#include "Memory.h"
 #include "URL.h"
 #include "HttpBase.h"
 #include "HttpRequest.h"
 #include "HttpResponse.h"
 #include "TLSContext.h"
+#include "HttpMetrics.h"
+#include "PreparedRequest.h"
 #include "HttpClient.h"
+#include "Download.h"
+#include "Multipart.h"
+#include "EventSource.h"
+#include "WebSocket.h"
+#include "Coroutine.h"
 
 #endif //LWHTTP_H
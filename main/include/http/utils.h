@@ -1,12 +1,38 @@
 #ifndef LWHTTP_UTILS_H
 #define LWHTTP_UTILS_H
 
+#include <cstdint>
 #include <string>
 
+/* Substring search kernels, AVX2 and SSE2 are only available on x86 and picked at runtime by CPU support */
+enum class SearchKernel
+{
+	SCALAR,
+	SSE2,
+	AVX2
+};
+
+bool isSearchKernelSupported(SearchKernel kernel);
+
+/* The fastest supported kernel, resolved once */
+SearchKernel getSearchKernel();
+
+std::pair<bool, size_t> findFirstOf(SearchKernel kernel, const char *target, size_t targetLen, const char *data,
+                                    size_t dataLen);
+
+std::pair<bool, size_t> findLastOf(SearchKernel kernel, const char *target, size_t targetLen, const char *data,
+                                   size_t dataLen);
+
 std::pair<bool, size_t> findFirstOf(const char *target, size_t targetLen, const char *data, size_t dataLen);
 
 std::pair<bool, size_t> findLastOf(const char *target, size_t targetLen, const char *data, size_t dataLen);
 
+/* XORs len bytes of data with the WebSocket masking key, starting at byte offset of the key. The kernels are picked
+ * like the search kernels. */
+void applyMask(SearchKernel kernel, char *data, size_t len, const uint8_t key[4], size_t offset = 0);
+
+void applyMask(char *data, size_t len, const uint8_t key[4], size_t offset = 0);
+
 void ltrim(std::string &s);
 
 void ltrim(std::string &s, char ch);
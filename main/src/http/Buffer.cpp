@@ -0,0 +1,50 @@
+#include "../../include/http/Buffer.h"
+
+/************************** Buffer ***************************/
+Buffer::Buffer(size_t capacity)
+{
+	reserve(capacity);
+}
+
+void Buffer::appendDecimal(uint64_t value)
+{
+	char digits[20];
+	size_t pos = sizeof(digits);
+	do
+	{
+		digits[--pos] = static_cast<char>('0' + value % 10);
+		value /= 10;
+	}
+	while (value != 0);
+	append(digits + pos, sizeof(digits) - pos);
+}
+
+void Buffer::reserve(size_t len)
+{
+	if (len > capability)
+	{
+		std::unique_ptr<char[]> expanded(new char[len]);
+		if (length > 0)
+		{
+			memcpy(expanded.get(), storage.get(), length);
+		}
+		storage = std::move(expanded);
+		capability = len;
+	}
+}
+
+void Buffer::shrink(size_t limit)
+{
+	if ((capability > limit) && (length == 0))
+	{
+		storage.reset();
+		capability = 0;
+	}
+}
+
+void Buffer::grow(size_t len)
+{
+	size_t required = length + len;
+	size_t expanded = capability < 256 ? 256 : capability * 2;
+	reserve(expanded < required ? required : expanded);
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <functional>
+
+#include "ConcurrencyLimiter.h"
+
+/********************* ConcurrencyLimiter ********************/
+ConcurrencyLimiter::ConcurrencyLimiter(const ConcurrencyLimitConfig &limitConfig)
+		: config(limitConfig), shards(std::make_unique<Shard[]>(SHARDS))
+{
+	config.minLimit = std::max(config.minLimit, 1U);
+	config.maxLimit = std::max(config.maxLimit, config.minLimit);
+	config.initialLimit = std::clamp(config.initialLimit, config.minLimit, config.maxLimit);
+}
+
+ConcurrencyLimiter::Shard &ConcurrencyLimiter::shardOf(const std::string &origin)
+{
+	return shards[std::hash<std::string>{}(origin) % SHARDS];
+}
+
+bool ConcurrencyLimiter::acquire(const std::string &origin, Clock::duration wait)
+{
+	Shard &shard = shardOf(origin);
+	std::unique_lock<std::mutex> lock(shard.shardMutex);
+	auto &slot = shard.originMap[origin];
+	if (slot == nullptr)
+	{
+		/* Origins live as long as the client, like the idle connection lists */
+		slot = std::make_unique<OriginState>(config.initialLimit);
+	}
+	OriginState &state = *slot;
+	auto underLimit = [&state]()
+	{
+		return state.inFlight < static_cast<size_t>(state.limit);
+	};
+	if (!underLimit())
+	{
+		if ((state.queued >= config.maxQueue) || (wait <= Clock::duration::zero()))
+		{
+			return false;
+		}
+		++state.queued;
+		bool granted = state.slotFreed.wait_for(lock, wait, underLimit);
+		--state.queued;
+		if (!granted)
+		{
+			return false;
+		}
+	}
+	++state.inFlight;
+	return true;
+}
+
+void ConcurrencyLimiter::decrease(OriginState &state, Clock::time_point now, double latency) const
+{
+	/* One cut per round trip, the calls of one slow window must not compound */
+	if (now - state.lastDecrease < std::chrono::microseconds(static_cast<int64_t>(latency)))
+	{
+		return;
+	}
+	state.lastDecrease = now;
+	state.limit = std::max(static_cast<double>(config.minLimit), state.limit * config.backoff);
+}
+
+void ConcurrencyLimiter::release(const std::string &origin, Clock::duration latency, bool dropped)
+{
+	Clock::time_point now = Clock::now();
+	auto micros = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+	micros = std::max(micros, 1.0);
+	Shard &shard = shardOf(origin);
+	std::lock_guard<std::mutex> lock(shard.shardMutex);
+	auto iter = shard.originMap.find(origin);
+	if (iter == shard.originMap.end())
+	{
+		return;
+	}
+	OriginState &state = *iter->second;
+	bool saturated = (2 * state.inFlight >= static_cast<size_t>(state.limit));
+	--state.inFlight;
+	if (dropped)
+	{
+		decrease(state, now, micros);
+	}
+	else
+	{
+		if ((state.minLatency == 0) || (micros < state.minLatency))
+		{
+			state.minLatency = micros;
+		}
+		else
+		{
+			/* Drift up slowly so that a lasting change of the path is eventually accepted as the new minimum */
+			state.minLatency += (micros - state.minLatency) / 1024;
+		}
+		if (micros > state.minLatency * config.tolerance)
+		{
+			decrease(state, now, micros);
+		}
+		else if (saturated)
+		{
+			state.limit = std::min(static_cast<double>(config.maxLimit), state.limit + 1 / state.limit);
+		}
+	}
+	if ((state.queued > 0) && (state.inFlight < static_cast<size_t>(state.limit)))
+	{
+		state.slotFreed.notify_one();
+	}
+}
+
+void ConcurrencyLimiter::collect(std::vector<OriginLimit> &limits) const
+{
+	for (size_t s = 0; s < SHARDS; ++s)
+	{
+		const Shard &shard = shards[s];
+		std::lock_guard<std::mutex> lock(shard.shardMutex);
+		for (const auto &item: shard.originMap)
+		{
+			const OriginState &state = *item.second;
+			limits.push_back(OriginLimit{item.first, static_cast<size_t>(state.limit), state.inFlight, state.queued});
+		}
+	}
+}
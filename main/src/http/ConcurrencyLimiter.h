@@ -0,0 +1,68 @@
+#ifndef LWHTTP_CONCURRENCYLIMITER_H
+#define LWHTTP_CONCURRENCYLIMITER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../../include/http/HttpClient.h"
+#include "../../include/http/HttpMetrics.h"
+
+/********************* ConcurrencyLimiter ********************/
+/* Per-origin AIMD limit on calls in flight. A call that comes back within tolerance times the origin's minimum
+ * latency while the limit is in use raises the limit by one per limit's worth of calls. A slower call, a failure,
+ * 429 or 503 cuts it by the backoff factor, at most once per round trip. Origins are spread over shards by hash. */
+class ConcurrencyLimiter
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	explicit ConcurrencyLimiter(const ConcurrencyLimitConfig &limitConfig);
+
+	/* Takes a slot of origin. Over the limit the call waits until wait passed if fewer than maxQueue calls are
+	 * already waiting, otherwise it is refused at once. */
+	bool acquire(const std::string &origin, Clock::duration wait);
+
+	/* Gives the slot back with the latency of the call, dropped is set for a failed or overloaded call */
+	void release(const std::string &origin, Clock::duration latency, bool dropped);
+
+	void collect(std::vector<OriginLimit> &limits) const;
+
+	static constexpr size_t SHARDS = 16;
+
+private:
+	struct OriginState
+	{
+		explicit OriginState(double initialLimit) : limit(initialLimit)
+		{
+		}
+
+		double limit;
+		size_t inFlight = 0;
+		size_t queued = 0;
+		/* Microseconds, 0 until the first sample */
+		double minLatency = 0;
+		Clock::time_point lastDecrease{};
+		std::condition_variable slotFreed;
+	};
+
+	struct alignas(64) Shard
+	{
+		mutable std::mutex shardMutex;
+		std::unordered_map<std::string, std::unique_ptr<OriginState>> originMap;
+	};
+
+	Shard &shardOf(const std::string &origin);
+
+	void decrease(OriginState &state, Clock::time_point now, double latency) const;
+
+private:
+	ConcurrencyLimitConfig config;
+	std::unique_ptr<Shard[]> shards;
+};
+
+#endif //LWHTTP_CONCURRENCYLIMITER_H
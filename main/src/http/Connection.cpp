@@ -0,0 +1,2159 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <memory>
+
+#include <openssl/ssl.h>
+
+#include "../../include/http/HttpRequest.h"
+#include "../../include/http/HttpResponse.h"
+#include "../../include/http/utils.h"
+#include "Connection.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <io.h>
+
+#endif
+
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <csignal>
+#include <pthread.h>
+
+#endif
+
+/************************ CancelToken ************************/
+bool CancelToken::attach(SocketHandle socketHandle)
+{
+	std::lock_guard<std::mutex> lock(tokenMutex);
+	handle = socketHandle;
+	return !isCancelled;
+}
+
+void CancelToken::detach()
+{
+	std::lock_guard<std::mutex> lock(tokenMutex);
+	handle = INVALID_FD;
+}
+
+void CancelToken::cancel()
+{
+	std::lock_guard<std::mutex> lock(tokenMutex);
+	isCancelled = true;
+	if (handle != INVALID_FD)
+	{
+#ifdef _WIN32
+		shutdown(handle, SD_BOTH);
+#else
+		shutdown(handle, SHUT_RDWR);
+#endif
+	}
+}
+
+bool CancelToken::cancelled() const
+{
+	std::lock_guard<std::mutex> lock(tokenMutex);
+	return isCancelled;
+}
+
+/************************ RequestTrace ***********************/
+void RequestTrace::finish(const HttpResponse &response, size_t len)
+{
+	if (len == 0)
+	{
+		/* An attempt aborted because another one answered first is no failure of the call */
+		if ((cancel == nullptr) || !cancel->cancelled())
+		{
+			count(MetricCounter::FAILURES);
+		}
+		notify(HttpEvent::CALL_FAILED);
+	}
+	else if (metrics != nullptr)
+	{
+		int statusClass = static_cast<int>(response.getStatusCode()) / 100;
+		if ((statusClass >= 1) && (statusClass <= 5))
+		{
+			count(static_cast<MetricCounter>(static_cast<int>(MetricCounter::STATUS_1XX) + statusClass - 1));
+		}
+		count(MetricCounter::BYTES_RECEIVED, len);
+		record(MetricHistogram::LATENCY, timing.start, timing.lastByte);
+		record(MetricHistogram::TIME_TO_FIRST_BYTE, timing.start, timing.firstByte);
+		if (!timing.connectionReused)
+		{
+			record(MetricHistogram::CONNECT_TIME, timing.connectStart, timing.connectEnd);
+			if (timing.tlsEnd != RequestTiming::Clock::time_point{})
+			{
+				record(MetricHistogram::TLS_HANDSHAKE_TIME, timing.tlsStart, timing.tlsEnd);
+			}
+		}
+	}
+}
+
+bool RequestTrace::mayResend() const
+{
+	bool written = timing.requestWritten != RequestTiming::Clock::time_point{};
+	return !bodyStarted && !timedOut && (timing.firstByte == RequestTiming::Clock::time_point{}) &&
+	       (!written || (request.method != HttpMethod::POST)) && ((cancel == nullptr) || !cancel->cancelled());
+}
+
+/************************** Common ***************************/
+/* Response read buffer, from the thread's memory resource so a per-request arena also covers it */
+struct VariableArray
+{
+	VariableArray() : resource(getMemoryResource())
+	{
+		capability = BUFFER_SIZE;
+		buffer = static_cast<char *>(resource->allocate(capability, 1));
+	}
+
+	~VariableArray()
+	{
+		resource->deallocate(buffer, capability, 1);
+	}
+
+	void expand()
+	{
+		size_t newCap = capability << 2;
+		auto newBuff = static_cast<char *>(resource->allocate(newCap, 1));
+		memcpy(newBuff, buffer, capability);
+		resource->deallocate(buffer, capability, 1);
+		buffer = newBuff;
+		capability = newCap;
+	}
+
+	static constexpr long BUFFER_SIZE = 64L * 1024L;
+	std::pmr::memory_resource *resource;
+	size_t capability;
+	char *buffer;
+};
+
+#if defined(_WIN32) || defined(_WIN64)
+
+void closeSocket(SocketHandle handle)
+{
+	shutdown(handle, SD_BOTH);
+	closesocket(handle);
+}
+
+#elif defined(__linux__)
+
+void closeSocket(SocketHandle handle)
+{
+	shutdown(handle, SHUT_RDWR);
+	close(handle);
+}
+
+#else
+#error Unsupported OS
+#endif
+
+struct GenericAddr
+{
+	int family;
+	union UniAddr
+	{
+		in_addr addr4;
+		in6_addr addr6;
+	} addr;
+};
+
+std::vector<GenericAddr> getAddrByDomain(const std::string &hostName)
+{
+	std::vector<GenericAddr> addrVec;
+	addrinfo hints{};
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = 0;
+	hints.ai_family = AF_UNSPEC; // Allow IPv4 and IPv6
+	hints.ai_socktype = SOCK_STREAM; // Stream socket
+	hints.ai_protocol = 0;
+	hints.ai_canonname = nullptr;
+	hints.ai_addr = nullptr;
+	hints.ai_next = nullptr;
+	addrinfo *result = nullptr;
+	if (0 == getaddrinfo(hostName.c_str(), nullptr, &hints, &result))
+	{
+		for (addrinfo *rp = result; rp != nullptr; rp = rp->ai_next)
+		{
+			auto addr = rp->ai_addr;
+			if (addr->sa_family == AF_INET)
+			{
+				sockaddr_in *addr4 = reinterpret_cast<sockaddr_in *>(rp->ai_addr);
+				GenericAddr genericAddr{};
+				genericAddr.family = AF_INET;
+				genericAddr.addr.addr4 = addr4->sin_addr;
+				addrVec.push_back(genericAddr);
+			}
+			else if (addr->sa_family == AF_INET6)
+			{
+				sockaddr_in6 *addr6 = reinterpret_cast<sockaddr_in6 *>(rp->ai_addr);
+				GenericAddr genericAddr{};
+				genericAddr.family = AF_INET6;
+				genericAddr.addr.addr6 = addr6->sin6_addr;
+				addrVec.push_back(genericAddr);
+			}
+		}
+		if (result != nullptr)
+		{
+			freeaddrinfo(result);
+		}
+	}
+	return addrVec;
+}
+
+void setSocketNonBlock(SocketHandle socketHandle)
+{
+#ifdef _WIN32
+	unsigned long non_block = 1;
+	if (NO_ERROR != ioctlsocket(socketHandle, FIONBIO, &non_block))
+	{
+		int dwErrNo = WSAGetLastError();
+		printf("%s,L%d,set socket flags to non-blocking failed! error:%d\n", __func__, __LINE__, dwErrNo);
+	}
+#elif __linux__
+	int flags = fcntl(socketHandle, F_GETFL, 0);
+	if (-1 != flags)
+	{
+		if (-1 == fcntl(socketHandle, F_SETFL, flags | O_NONBLOCK))
+		{
+#ifdef _DEBUG
+			printf("%s,L%d,set socket flags to non-blocking failed: %s(%d)\n", __func__, __LINE__, strerror(errno),
+				   errno);
+#endif
+		}
+	}
+	else
+	{
+#ifdef _DEBUG
+		printf("%s,L%d, set socket flags failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+	}
+#endif
+}
+
+/* Requests are written whole, Nagle would only hold back the tail of a message that spans several writes */
+static void setSocketNoDelay(SocketHandle handle)
+{
+	int on = 1;
+#ifdef _WIN32
+	int ret = setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&on), sizeof(on));
+#else
+	int ret = setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#endif
+	if (ret != 0)
+	{
+#ifdef _DEBUG
+		printf("%s:%d set TCP_NODELAY failed\n", __func__, __LINE__);
+#endif
+	}
+}
+
+/* The last socket call failed because SO_RCVTIMEO or SO_SNDTIMEO ran out */
+static bool socketTimedOut()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAETIMEDOUT;
+#else
+	return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+#endif
+}
+
+static bool connectPending()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS;
+#endif
+}
+
+SocketHandle createIPv4Socket(const in_addr &addr, unsigned short port, bool async)
+{
+	SocketHandle handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (handle == INVALID_FD)
+	{
+#ifdef _DEBUG
+#ifdef _WIN32
+		printf("%s, L%d, socket create error: %d\n", __func__, __LINE__, WSAGetLastError());
+#elif __linux__
+		printf("%s, L%d, socket create error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+#endif
+		return INVALID_FD;
+	}
+
+	setSocketNoDelay(handle);
+
+	sockaddr_in remote_addr{};
+	memset(&remote_addr, 0, sizeof(remote_addr));
+	remote_addr.sin_family = AF_INET;
+	memcpy(&remote_addr.sin_addr, &addr, sizeof(remote_addr.sin_addr));
+	remote_addr.sin_port = htons(port);
+	socklen_t socklen = sizeof(remote_addr);
+
+	/* An asynchronous socket returns with the connect in progress, it is writable once connected */
+	if (async)
+	{
+		setSocketNonBlock(handle);
+	}
+	if ((-1 == connect(handle, reinterpret_cast<sockaddr *>(&remote_addr), socklen)) && !(async && connectPending()))
+	{
+#ifdef _DEBUG
+#ifdef _WIN32
+		printf("%s, L%d, server error: %d\n", __func__, __LINE__, WSAGetLastError());
+#elif __linux__
+		printf("%s, L%d, connect to server error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+#endif
+		closeSocket(handle);
+		handle = INVALID_FD;
+	}
+	return handle;
+}
+
+SocketHandle createIPv6Socket(const in6_addr &addr, unsigned short port, bool async)
+{
+	SocketHandle handle = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if (handle == INVALID_FD)
+	{
+#ifdef _DEBUG
+#ifdef _WIN32
+		printf("%s, L%d, socket create error: %d\n", __func__, __LINE__, WSAGetLastError());
+#elif __linux__
+		printf("%s, L%d, socket create error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+#endif
+		return INVALID_FD;
+	}
+
+	setSocketNoDelay(handle);
+
+	sockaddr_in6 remote_addr{};
+	memset(&remote_addr, 0, sizeof(remote_addr));
+	remote_addr.sin6_family = AF_INET6;
+	memcpy(&remote_addr.sin6_addr, &addr, sizeof(remote_addr.sin6_addr));
+	remote_addr.sin6_port = htons(port);
+	socklen_t socklen = sizeof(remote_addr);
+
+	/* An asynchronous socket returns with the connect in progress, it is writable once connected */
+	if (async)
+	{
+		setSocketNonBlock(handle);
+	}
+	if ((-1 == connect(handle, reinterpret_cast<sockaddr *>(&remote_addr), socklen)) && !(async && connectPending()))
+	{
+#ifdef _DEBUG
+#ifdef _WIN32
+		printf("%s, L%d, server error: %d\n", __func__, __LINE__, WSAGetLastError());
+#elif __linux__
+		printf("%s, L%d, connect to server error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+#endif
+		closeSocket(handle);
+		handle = INVALID_FD;
+	}
+	return handle;
+}
+
+/************************** DnsCache *************************/
+/* getaddrinfo does not report record TTLs, so answers are kept for a fixed time */
+class DnsCache
+{
+public:
+	[[nodiscard]] bool contains(const std::string &host)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto iter = entryMap.find(host);
+		return (iter != entryMap.end()) && (iter->second.expiry >= std::chrono::steady_clock::now());
+	}
+
+	bool lookup(const std::string &host, std::vector<GenericAddr> &addrVec)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto iter = entryMap.find(host);
+		if ((iter == entryMap.end()) || (iter->second.expiry < std::chrono::steady_clock::now()))
+		{
+			return false;
+		}
+		addrVec = iter->second.addrVec;
+		return true;
+	}
+
+	void store(const std::string &host, const std::vector<GenericAddr> &addrVec)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto now = std::chrono::steady_clock::now();
+		if (entryMap.size() >= CAPACITY)
+		{
+			for (auto iter = entryMap.begin(); iter != entryMap.end();)
+			{
+				iter = (iter->second.expiry < now) ? entryMap.erase(iter) : std::next(iter);
+			}
+			if (entryMap.size() >= CAPACITY)
+			{
+				entryMap.clear();
+			}
+		}
+		entryMap.insert_or_assign(host, Entry{addrVec, now + TTL});
+	}
+
+	void evict(const std::string &host)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		entryMap.erase(host);
+	}
+
+	static constexpr std::chrono::seconds TTL{60};
+	static constexpr size_t CAPACITY = 1024;
+
+private:
+	struct Entry
+	{
+		std::vector<GenericAddr> addrVec;
+		std::chrono::steady_clock::time_point expiry;
+	};
+
+	std::mutex cacheMutex;
+	std::unordered_map<std::string, Entry> entryMap;
+};
+
+static DnsCache dnsCache;
+
+SocketHandle createSocket(const std::string &host, unsigned short port, bool async, RequestTrace *trace)
+{
+	SocketHandle socketHandle = INVALID_FD;
+
+	in_addr addr4{};
+	in6_addr addr6{};
+
+	if (1 == inet_pton(AF_INET, host.c_str(), &addr4))
+	{
+		if (trace != nullptr)
+		{
+			trace->mark(HttpEvent::CONNECT_START, trace->timing.connectStart);
+		}
+		socketHandle = createIPv4Socket(addr4, port, async);
+	}
+	else if (1 == inet_pton(AF_INET6, host.c_str(), &addr6))
+	{
+		if (trace != nullptr)
+		{
+			trace->mark(HttpEvent::CONNECT_START, trace->timing.connectStart);
+		}
+		socketHandle = createIPv6Socket(addr6, port, async);
+	}
+	else
+	{
+		if (trace != nullptr)
+		{
+			trace->mark(HttpEvent::DNS_START, trace->timing.dnsStart);
+		}
+		std::vector<GenericAddr> serverAddrVec;
+		bool cached = dnsCache.lookup(host, serverAddrVec);
+		if (!cached)
+		{
+			serverAddrVec = getAddrByDomain(host);
+			if (!serverAddrVec.empty())
+			{
+				dnsCache.store(host, serverAddrVec);
+			}
+		}
+		if (trace != nullptr)
+		{
+			trace->count(cached ? MetricCounter::DNS_CACHE_HITS : MetricCounter::DNS_CACHE_MISSES);
+			trace->mark(HttpEvent::DNS_END, trace->timing.dnsEnd);
+			trace->mark(HttpEvent::CONNECT_START, trace->timing.connectStart);
+		}
+		for (const auto &tmp: serverAddrVec)
+		{
+			SocketHandle handle = INVALID_FD;
+			if (tmp.family == AF_INET)
+			{
+				handle = createIPv4Socket(tmp.addr.addr4, port, async);
+			}
+			else
+			{
+				handle = createIPv6Socket(tmp.addr.addr6, port, async);
+			}
+			if (handle != INVALID_FD)
+			{
+				socketHandle = handle;
+				break;
+			}
+		}
+		if (cached && (socketHandle == INVALID_FD))
+		{
+			dnsCache.evict(host);
+		}
+	}
+
+	if ((trace != nullptr) && (socketHandle != INVALID_FD) && !async)
+	{
+		trace->mark(HttpEvent::CONNECT_END, trace->timing.connectEnd);
+	}
+	return socketHandle;
+}
+
+bool needsLookup(const URL &uri, const std::string &unixSocket)
+{
+	if (!uri.getSocketPath().empty() || !unixSocket.empty())
+	{
+		return false;
+	}
+	std::string host(uri.getHost());
+	in_addr addr4{};
+	in6_addr addr6{};
+	return (1 != inet_pton(AF_INET, host.c_str(), &addr4)) && (1 != inet_pton(AF_INET6, host.c_str(), &addr6)) &&
+	       !dnsCache.contains(host);
+}
+
+bool lookupHost(const std::string &host)
+{
+	std::vector<GenericAddr> serverAddrVec = getAddrByDomain(host);
+	if (serverAddrVec.empty())
+	{
+		return false;
+	}
+	dnsCache.store(host, serverAddrVec);
+	return true;
+}
+
+#ifndef _WIN32
+
+/* A local connect either completes or fails at once, an async socket only becomes non-blocking */
+static SocketHandle createUnixSocket(std::string_view path, bool async)
+{
+	sockaddr_un remoteAddr{};
+	if (path.length() >= sizeof(remoteAddr.sun_path))
+	{
+		return INVALID_FD;
+	}
+	SocketHandle handle = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (handle == INVALID_FD)
+	{
+#ifdef _DEBUG
+		printf("%s, L%d, socket create error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+		return INVALID_FD;
+	}
+	remoteAddr.sun_family = AF_UNIX;
+	memcpy(remoteAddr.sun_path, path.data(), path.length());
+	if (-1 == connect(handle, reinterpret_cast<sockaddr *>(&remoteAddr), sizeof(remoteAddr)))
+	{
+#ifdef _DEBUG
+		printf("%s, L%d, connect to %.*s error: %s(%d)\n", __func__, __LINE__, static_cast<int>(path.length()),
+		       path.data(), strerror(errno), errno);
+#endif
+		closeSocket(handle);
+		return INVALID_FD;
+	}
+	if (async)
+	{
+		setSocketNonBlock(handle);
+	}
+	return handle;
+}
+
+#endif
+
+SocketHandle createSocket(const URL &uri, const std::string &unixSocket, bool async, RequestTrace *trace)
+{
+	std::string_view path = uri.getSocketPath().empty() ? std::string_view(unixSocket) : uri.getSocketPath();
+	if (path.empty())
+	{
+		return createSocket(std::string(uri.getHost()), uri.getPort(), async, trace);
+	}
+	if (trace != nullptr)
+	{
+		trace->mark(HttpEvent::CONNECT_START, trace->timing.connectStart);
+	}
+#ifdef _WIN32
+	SocketHandle socketHandle = INVALID_FD;
+#else
+	SocketHandle socketHandle = createUnixSocket(path, async);
+#endif
+	if ((trace != nullptr) && (socketHandle != INVALID_FD) && !async)
+	{
+		trace->mark(HttpEvent::CONNECT_END, trace->timing.connectEnd);
+	}
+	return socketHandle;
+}
+
+void traceHandshake(SSL *ssl, RequestTrace &trace)
+{
+	trace.timing.sessionResumed = (1 == SSL_session_reused(ssl));
+	trace.timing.earlyData = (SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED);
+	trace.count(MetricCounter::TLS_HANDSHAKES);
+	if (trace.timing.sessionResumed)
+	{
+		trace.count(MetricCounter::TLS_RESUMED);
+	}
+	if (trace.timing.earlyData)
+	{
+		trace.count(MetricCounter::TLS_EARLY_DATA);
+	}
+	trace.mark(HttpEvent::TLS_END, trace.timing.tlsEnd);
+}
+
+#ifdef __linux__
+/* The socket BIO writes with write(2), which raises SIGPIPE on a connection the peer reset */
+static int noSignalWrite(BIO *bio, const char *data, int len)
+{
+	int fd = -1;
+	BIO_get_fd(bio, &fd);
+	errno = 0;
+	auto sendLen = static_cast<int>(::send(fd, data, len, MSG_NOSIGNAL));
+	BIO_clear_retry_flags(bio);
+	if ((sendLen <= 0) && BIO_sock_should_retry(sendLen))
+	{
+		BIO_set_retry_write(bio);
+	}
+	return sendLen;
+}
+
+static BIO_METHOD *newNoSignalMethod()
+{
+	const BIO_METHOD *socketMethod = BIO_s_socket();
+	BIO_METHOD *method = BIO_meth_new(BIO_TYPE_SOCKET, "socket without SIGPIPE");
+	if (method != nullptr)
+	{
+		BIO_meth_set_write(method, noSignalWrite);
+		BIO_meth_set_read(method, BIO_meth_get_read(socketMethod));
+		BIO_meth_set_ctrl(method, BIO_meth_get_ctrl(socketMethod));
+		BIO_meth_set_create(method, BIO_meth_get_create(socketMethod));
+		BIO_meth_set_destroy(method, BIO_meth_get_destroy(socketMethod));
+	}
+	return method;
+}
+#endif
+
+bool setSocketBio(SSL *ssl, SocketHandle handle)
+{
+#ifdef __linux__
+	static BIO_METHOD *noSignalMethod = newNoSignalMethod();
+	BIO *bio = (noSignalMethod != nullptr) ? BIO_new(noSignalMethod) : nullptr;
+	if (bio == nullptr)
+	{
+		return false;
+	}
+	BIO_set_fd(bio, handle, BIO_NOCLOSE);
+	SSL_set_bio(ssl, bio, bio);
+	return true;
+#else
+	return 1 == SSL_set_fd(ssl, static_cast<int>(handle));
+#endif
+}
+
+void setSocketTimeout(SocketHandle handle, unsigned int seconds)
+{
+#ifdef _WIN32
+	DWORD value = seconds * 1000;
+	setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&value), sizeof(value));
+	setsockopt(handle, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char *>(&value), sizeof(value));
+#elif __linux__
+	timeval value{};
+	value.tv_sec = seconds;
+	value.tv_usec = 0;
+	setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &value, sizeof(value));
+	setsockopt(handle, SOL_SOCKET, SO_SNDTIMEO, &value, sizeof(value));
+#endif
+}
+
+/************************* Connection ************************/
+/* One TLS record carries at most 16 KiB, larger slices gain nothing from being copied together */
+static constexpr size_t COALESCE_LIMIT = 16 * 1024;
+
+Connection::Connection(SocketHandle socketHandle) : handle(socketHandle)
+{
+}
+
+Connection::~Connection()
+{
+	if (handle != INVALID_FD)
+	{
+		closeSocket(handle);
+	}
+}
+
+bool Connection::writeAll(const char *data, size_t len)
+{
+	size_t written = 0;
+	while (written < len)
+	{
+		long sendLen = write(data + written, len - written);
+		if (sendLen <= 0)
+		{
+			return false;
+		}
+		written += sendLen;
+	}
+	return true;
+}
+
+bool Connection::writeAll(const IoSlice *slices, size_t count)
+{
+	static thread_local Buffer gathered;
+	gathered.clear();
+	size_t index = 0;
+	size_t offset = 0;
+	while (index < count)
+	{
+		const char *data = slices[index].data + offset;
+		size_t remain = slices[index].len - offset;
+		if (gathered.empty() && (remain >= COALESCE_LIMIT))
+		{
+			if (!writeAll(data, remain))
+			{
+				return false;
+			}
+			++index;
+			offset = 0;
+			continue;
+		}
+		size_t take = std::min(remain, COALESCE_LIMIT - gathered.size());
+		gathered.append(data, take);
+		offset += take;
+		if (offset == slices[index].len)
+		{
+			++index;
+			offset = 0;
+		}
+		if (gathered.size() == COALESCE_LIMIT)
+		{
+			if (!writeAll(gathered.data(), gathered.size()))
+			{
+				return false;
+			}
+			gathered.clear();
+		}
+	}
+	return gathered.empty() || writeAll(gathered.data(), gathered.size());
+}
+
+bool Connection::sendFile(int fd, size_t offset, size_t len)
+{
+	char buffer[COALESCE_LIMIT];
+	while (len > 0)
+	{
+		size_t want = std::min(len, sizeof(buffer));
+#ifdef _WIN32
+		long readLen = (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0) ? -1 :
+		               _read(fd, buffer, static_cast<unsigned int>(want));
+#else
+		long readLen = ::pread(fd, buffer, want, static_cast<off_t>(offset));
+		if ((readLen < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+#endif
+		if (readLen <= 0)
+		{
+#ifdef _DEBUG
+			printf("%s:%d read file failed at %zu\n", __func__, __LINE__, offset);
+#endif
+			return false;
+		}
+		if (!writeAll(buffer, readLen))
+		{
+			return false;
+		}
+		offset += readLen;
+		len -= readLen;
+	}
+	return true;
+}
+
+bool Connection::isAlive() const
+{
+#ifdef __linux__
+	char ch;
+	long peekLen = ::recv(handle, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+	return (peekLen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+#else
+	return true;
+#endif
+}
+
+bool Connection::waitReadable(unsigned int millis) const
+{
+#if defined(_WIN32) || defined(_WIN64)
+	WSAPOLLFD pollFd{handle, POLLRDNORM, 0};
+	return WSAPoll(&pollFd, 1, static_cast<INT>(millis)) > 0;
+#else
+	pollfd pollFd{handle, POLLIN, 0};
+	int ready;
+	do
+	{
+		ready = poll(&pollFd, 1, static_cast<int>(millis));
+	} while ((ready < 0) && (errno == EINTR));
+	return ready > 0;
+#endif
+}
+
+/********************** PlainConnection **********************/
+#ifdef __linux__
+static constexpr size_t IOV_MAX_SLICES = 64;
+#endif
+
+PlainConnection::PlainConnection(SocketHandle socketHandle) : Connection(socketHandle)
+{
+}
+
+long PlainConnection::write(const char *data, size_t len)
+{
+#ifdef _WIN32
+	long sendLen = ::send(handle, data, static_cast<int>(len), 0);
+#else
+	long sendLen = ::send(handle, data, len, MSG_NOSIGNAL);
+#endif
+	if (sendLen < 0)
+	{
+#ifdef _DEBUG
+#ifdef _WIN32
+		printf("%s:%d send failed: %d\n", __func__, __LINE__, WSAGetLastError());
+#elif __linux__
+		printf("%s:%d send failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+#endif
+	}
+	return sendLen;
+}
+
+#ifdef __linux__
+bool PlainConnection::writeAll(const IoSlice *slices, size_t count)
+{
+	iovec vectors[IOV_MAX_SLICES];
+	size_t index = 0;
+	size_t offset = 0;
+	while (index < count)
+	{
+		size_t vectorCount = 0;
+		for (size_t i = index; (i < count) && (vectorCount < IOV_MAX_SLICES); ++i)
+		{
+			size_t skip = (i == index) ? offset : 0;
+			vectors[vectorCount].iov_base = const_cast<char *>(slices[i].data + skip);
+			vectors[vectorCount].iov_len = slices[i].len - skip;
+			++vectorCount;
+		}
+		msghdr message{};
+		message.msg_iov = vectors;
+		message.msg_iovlen = vectorCount;
+		long sendLen = ::sendmsg(handle, &message, MSG_NOSIGNAL);
+		if (sendLen < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+#ifdef _DEBUG
+			printf("%s:%d sendmsg failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+			return false;
+		}
+		auto remain = static_cast<size_t>(sendLen);
+		while ((index < count) && (remain >= slices[index].len - offset))
+		{
+			remain -= slices[index].len - offset;
+			offset = 0;
+			++index;
+		}
+		offset += remain;
+	}
+	return true;
+}
+
+/* sendfile(2) takes no MSG_NOSIGNAL: SIGPIPE is blocked on the thread meanwhile, and one the call raised is taken
+ * before the mask is restored */
+class SigpipeBlock
+{
+public:
+	SigpipeBlock()
+	{
+		sigemptyset(&pipeSet);
+		sigaddset(&pipeSet, SIGPIPE);
+		sigset_t pending;
+		sigpending(&pending);
+		wasPending = (1 == sigismember(&pending, SIGPIPE));
+		pthread_sigmask(SIG_BLOCK, &pipeSet, &previous);
+	}
+
+	SigpipeBlock(const SigpipeBlock &other) = delete;
+
+	SigpipeBlock &operator=(const SigpipeBlock &other) = delete;
+
+	~SigpipeBlock()
+	{
+		int savedErrno = errno;
+		if (raised && !wasPending)
+		{
+			timespec zero{};
+			while ((sigtimedwait(&pipeSet, nullptr, &zero) < 0) && (errno == EINTR))
+			{
+			}
+		}
+		pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+		errno = savedErrno;
+	}
+
+	/* The peer is gone, a SIGPIPE is pending */
+	bool raised = false;
+
+private:
+	sigset_t pipeSet{};
+	sigset_t previous{};
+	bool wasPending = false;
+};
+
+bool PlainConnection::sendFile(int fd, size_t offset, size_t len)
+{
+	auto position = static_cast<off_t>(offset);
+	size_t sent = 0;
+	SigpipeBlock sigpipeBlock;
+	while (sent < len)
+	{
+		ssize_t sendLen = ::sendfile(handle, fd, &position, len - sent);
+		if (sendLen < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			sigpipeBlock.raised = (errno == EPIPE);
+			if ((sent == 0) && ((errno == EINVAL) || (errno == ENOSYS)))
+			{
+				return Connection::sendFile(fd, offset, len);
+			}
+#ifdef _DEBUG
+			printf("%s:%d sendfile failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+			return false;
+		}
+		if (sendLen == 0)
+		{
+			/* The file is shorter than announced */
+			return false;
+		}
+		sent += sendLen;
+	}
+	return true;
+}
+#endif
+
+long PlainConnection::read(char *buffer, size_t len)
+{
+	while (true)
+	{
+#ifdef _WIN32
+		long readLen = ::recv(handle, buffer, static_cast<int>(len), 0);
+		if ((readLen < 0) && (WSAGetLastError() == WSAEINTR))
+		{
+			continue;
+		}
+#else
+		long readLen = ::recv(handle, buffer, len, 0);
+		if ((readLen < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+#endif
+#ifdef _DEBUG
+		if (readLen < 0)
+		{
+#ifdef _WIN32
+			printf("%s:%d, socket recv error: %d\n", __func__, __LINE__, WSAGetLastError());
+#elif __linux__
+			printf("%s:%d, socket recv error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+		}
+#endif
+		return readLen;
+	}
+}
+
+/*********************** TlsConnection ***********************/
+TlsConnection::TlsConnection(SocketHandle socketHandle, SSL *sslHandle) : Connection(socketHandle), ssl(sslHandle)
+{
+}
+
+TlsConnection::TlsConnection(SocketHandle socketHandle, SSL *sslHandle, size_t earlyLimit, RequestTrace &trace)
+		: Connection(socketHandle), ssl(sslHandle), earlyDataLimit(earlyLimit), handshakeTrace(&trace)
+{
+}
+
+TlsConnection::~TlsConnection()
+{
+	if (ssl != nullptr)
+	{
+		/* No close_notify into a connection that already failed, the peer is gone */
+		if (!broken)
+		{
+			SSL_shutdown(ssl);
+		}
+		SSL_free(ssl);
+	}
+}
+
+long TlsConnection::write(const char *data, size_t len)
+{
+	if (handshakeTrace != nullptr)
+	{
+		return writeEarly(data, len);
+	}
+	size_t written = 0;
+	int var = SSL_write_ex(ssl, data, len, &written);
+	if (0 == var)
+	{
+#ifdef _DEBUG
+		int ssl_errno = SSL_get_error(ssl, var);
+		printf("%s:%d tls write failed: %d\n", __func__, __LINE__, ssl_errno);
+#endif
+		broken = true;
+		return -1;
+	}
+	return static_cast<long>(written);
+}
+
+long TlsConnection::writeEarly(const char *data, size_t len)
+{
+	RequestTrace &trace = *handshakeTrace;
+	handshakeTrace = nullptr;
+	size_t written = 0;
+	if (1 != SSL_write_early_data(ssl, data, std::min(len, earlyDataLimit), &written))
+	{
+#ifdef _DEBUG
+		printf("%s:%d tls early data write failed\n", __func__, __LINE__);
+#endif
+		broken = true;
+		return -1;
+	}
+	int var = SSL_connect(ssl);
+	if (var != 1)
+	{
+#ifdef _DEBUG
+		int ssl_errno = SSL_get_error(ssl, var);
+		printf("%s:%d tls connect to server failed: %d\n", __func__, __LINE__, ssl_errno);
+#endif
+		broken = true;
+		return -1;
+	}
+	traceHandshake(ssl, trace);
+	/* The server dropped the early data, the request goes out again as application data */
+	return trace.timing.earlyData ? static_cast<long>(written) : write(data, len);
+}
+
+long TlsConnection::read(char *buffer, size_t len)
+{
+	size_t readBytes = 0;
+	int var = SSL_read_ex(ssl, buffer, len, &readBytes);
+	if (0 == var)
+	{
+		broken = true;
+		int ssl_errno = SSL_get_error(ssl, var);
+		if (ssl_errno == SSL_ERROR_ZERO_RETURN)
+		{
+			return 0;
+		}
+#ifdef _DEBUG
+		printf("%s:%d tls read failed: %d\n", __func__, __LINE__, ssl_errno);
+#endif
+		return -1;
+	}
+	return static_cast<long>(readBytes);
+}
+
+bool TlsConnection::isAlive() const
+{
+	return (SSL_pending(ssl) == 0) && Connection::isAlive();
+}
+
+bool TlsConnection::waitReadable(unsigned int millis) const
+{
+	return (SSL_pending(ssl) > 0) || Connection::waitReadable(millis);
+}
+
+#ifdef __linux__
+
+/********************* AsyncTlsConnection ********************/
+AsyncTlsConnection::AsyncTlsConnection(SocketHandle socketHandle, SSL *sslHandle, unsigned int timeout)
+		: Connection(socketHandle), ssl(sslHandle), timeoutMillis(static_cast<int>(timeout * 1000))
+{
+	BIO *internal = nullptr;
+	if (1 == BIO_new_bio_pair(&internal, BIO_BUFFER_SIZE, &network, BIO_BUFFER_SIZE))
+	{
+		SSL_set_bio(ssl, internal, internal);
+	}
+	SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_set_connect_state(ssl);
+}
+
+AsyncTlsConnection::~AsyncTlsConnection()
+{
+	if (SSL_is_init_finished(ssl))
+	{
+		/* Best effort, close_notify goes out only if the socket takes it at once */
+		SSL_shutdown(ssl);
+		flush();
+	}
+	SSL_free(ssl);
+	if (network != nullptr)
+	{
+		BIO_free(network);
+	}
+}
+
+AsyncTlsConnection::IoStatus AsyncTlsConnection::flush()
+{
+	if (network == nullptr)
+	{
+		return IoStatus::FAILED;
+	}
+	char *data;
+	int pending;
+	while ((pending = BIO_nread0(network, &data)) > 0)
+	{
+		long sendLen = ::send(handle, data, pending, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sendLen < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return IoStatus::WANT_WRITE;
+			}
+#ifdef _DEBUG
+			printf("%s:%d send failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+			return IoStatus::FAILED;
+		}
+		BIO_nread(network, &data, static_cast<int>(sendLen));
+	}
+	return IoStatus::DONE;
+}
+
+AsyncTlsConnection::IoStatus AsyncTlsConnection::fill()
+{
+	char *space;
+	int room = BIO_nwrite0(network, &space);
+	if (room <= 0)
+	{
+		return IoStatus::DONE;
+	}
+	while (true)
+	{
+		long readLen = ::recv(handle, space, room, MSG_DONTWAIT);
+		if (readLen > 0)
+		{
+			BIO_nwrite(network, &space, static_cast<int>(readLen));
+			return IoStatus::DONE;
+		}
+		if (readLen == 0)
+		{
+			return IoStatus::CLOSED;
+		}
+		if (errno == EINTR)
+		{
+			continue;
+		}
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			return IoStatus::WANT_READ;
+		}
+#ifdef _DEBUG
+		printf("%s:%d recv failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+		return IoStatus::FAILED;
+	}
+}
+
+AsyncTlsConnection::IoStatus AsyncTlsConnection::handshake()
+{
+	while (true)
+	{
+		int var = SSL_do_handshake(ssl);
+		int sslError = SSL_get_error(ssl, var);
+		IoStatus sent = flush();
+		if (sent == IoStatus::FAILED)
+		{
+			return sent;
+		}
+		if (var == 1)
+		{
+			/* What is left of the last flight goes out with the first write */
+			return IoStatus::DONE;
+		}
+		if (sent == IoStatus::WANT_WRITE)
+		{
+			return sent;
+		}
+		if (sslError == SSL_ERROR_WANT_READ)
+		{
+			IoStatus received = fill();
+			if (received != IoStatus::DONE)
+			{
+				return (received == IoStatus::CLOSED) ? IoStatus::FAILED : received;
+			}
+		}
+		else if (sslError != SSL_ERROR_WANT_WRITE)
+		{
+#ifdef _DEBUG
+			printf("%s:%d tls handshake failed: %d\n", __func__, __LINE__, sslError);
+#endif
+			return IoStatus::FAILED;
+		}
+	}
+}
+
+AsyncTlsConnection::IoStatus AsyncTlsConnection::writeSome(const char *data, size_t len, size_t &written)
+{
+	written = 0;
+	IoStatus sent = flush();
+	while (sent == IoStatus::DONE)
+	{
+		if (written == len)
+		{
+			return IoStatus::DONE;
+		}
+		size_t taken = 0;
+		int var = SSL_write_ex(ssl, data + written, len - written, &taken);
+		if (var == 1)
+		{
+			written += taken;
+		}
+		else if (SSL_get_error(ssl, var) != SSL_ERROR_WANT_WRITE)
+		{
+#ifdef _DEBUG
+			printf("%s:%d tls write failed: %d\n", __func__, __LINE__, SSL_get_error(ssl, var));
+#endif
+			return IoStatus::FAILED;
+		}
+		sent = flush();
+	}
+	return sent;
+}
+
+AsyncTlsConnection::IoStatus AsyncTlsConnection::readSome(char *buffer, size_t len, size_t &readLen)
+{
+	while (true)
+	{
+		readLen = 0;
+		int var = SSL_read_ex(ssl, buffer, len, &readLen);
+		if (var == 1)
+		{
+			return IoStatus::DONE;
+		}
+		int sslError = SSL_get_error(ssl, var);
+		/* E.g. a key update to answer */
+		IoStatus sent = flush();
+		if (sent == IoStatus::FAILED)
+		{
+			return sent;
+		}
+		if (sslError == SSL_ERROR_ZERO_RETURN)
+		{
+			return IoStatus::CLOSED;
+		}
+		if (sslError == SSL_ERROR_WANT_READ)
+		{
+			IoStatus received = fill();
+			if ((received == IoStatus::WANT_READ) && (sent == IoStatus::WANT_WRITE))
+			{
+				return sent;
+			}
+			if (received != IoStatus::DONE)
+			{
+				return received;
+			}
+		}
+		else if (sslError == SSL_ERROR_WANT_WRITE)
+		{
+			if (sent != IoStatus::DONE)
+			{
+				return sent;
+			}
+		}
+		else
+		{
+#ifdef _DEBUG
+			printf("%s:%d tls read failed: %d\n", __func__, __LINE__, sslError);
+#endif
+			return IoStatus::FAILED;
+		}
+	}
+}
+
+bool AsyncTlsConnection::await(IoStatus status) const
+{
+	pollfd pollFd{handle, static_cast<short>((status == IoStatus::WANT_READ) ? POLLIN : POLLOUT), 0};
+	int ready;
+	do
+	{
+		ready = poll(&pollFd, 1, timeoutMillis);
+	} while ((ready < 0) && (errno == EINTR));
+	return ready > 0;
+}
+
+long AsyncTlsConnection::write(const char *data, size_t len)
+{
+	if (!SSL_is_init_finished(ssl))
+	{
+		IoStatus status;
+		while ((status = handshake()) != IoStatus::DONE)
+		{
+			if (((status != IoStatus::WANT_READ) && (status != IoStatus::WANT_WRITE)) || !await(status))
+			{
+				return -1;
+			}
+		}
+	}
+	size_t total = 0;
+	while (true)
+	{
+		size_t written = 0;
+		IoStatus status = writeSome(data + total, len - total, written);
+		total += written;
+		if (status == IoStatus::DONE)
+		{
+			return static_cast<long>(total);
+		}
+		if (((status != IoStatus::WANT_READ) && (status != IoStatus::WANT_WRITE)) || !await(status))
+		{
+			return -1;
+		}
+	}
+}
+
+long AsyncTlsConnection::read(char *buffer, size_t len)
+{
+	while (true)
+	{
+		size_t readLen = 0;
+		IoStatus status = readSome(buffer, len, readLen);
+		if (status == IoStatus::DONE)
+		{
+			return static_cast<long>(readLen);
+		}
+		if (status == IoStatus::CLOSED)
+		{
+			return 0;
+		}
+		if (((status != IoStatus::WANT_READ) && (status != IoStatus::WANT_WRITE)) || !await(status))
+		{
+			return -1;
+		}
+	}
+}
+
+bool AsyncTlsConnection::isAlive() const
+{
+	/* Neither plain text nor ciphertext may be left over from the last response */
+	return (SSL_pending(ssl) == 0) && (BIO_ctrl_pending(SSL_get_rbio(ssl)) == 0) && Connection::isAlive();
+}
+
+bool AsyncTlsConnection::waitReadable(unsigned int millis) const
+{
+	return (SSL_pending(ssl) > 0) || (BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0) || Connection::waitReadable(millis);
+}
+
+#endif
+
+/*********************** ConnectionPool **********************/
+ConnectionPool::ConnectionPool() : shards(std::make_unique<Shard[]>(SHARDS))
+{
+}
+
+size_t ConnectionPool::localIndex()
+{
+	static std::atomic<size_t> nextShard{0};
+	static thread_local size_t shardIndex = nextShard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+	return shardIndex;
+}
+
+std::unique_ptr<Connection> ConnectionPool::takeIdle(Shard &shard, const std::string &origin)
+{
+	auto iter = shard.originMap.find(origin);
+	if ((iter == shard.originMap.end()) || iter->second.idle.empty())
+	{
+		return nullptr;
+	}
+	std::unique_ptr<Connection> connection = std::move(iter->second.idle.back());
+	iter->second.idle.pop_back();
+	return connection;
+}
+
+std::unique_ptr<Connection> ConnectionPool::acquire(const std::string &origin)
+{
+	size_t local = localIndex();
+	for (size_t i = 0; i < SHARDS; ++i)
+	{
+		Shard &shard = shards[(local + i) % SHARDS];
+		std::unique_lock<std::mutex> lock(shard.poolMutex, std::defer_lock);
+		if (i == 0)
+		{
+			lock.lock();
+		}
+		else if (!lock.try_lock())
+		{
+			continue;
+		}
+		std::unique_ptr<Connection> connection;
+		while ((connection = takeIdle(shard, origin)) != nullptr)
+		{
+			/* The liveness check is a system call, do not hold the shard meanwhile */
+			lock.unlock();
+			if (connection->isAlive())
+			{
+				opened(origin);
+				return connection;
+			}
+			connection.reset();
+			lock.lock();
+		}
+	}
+	return nullptr;
+}
+
+void ConnectionPool::opened(const std::string &origin)
+{
+	Shard &shard = shards[localIndex()];
+	std::lock_guard<std::mutex> lock(shard.poolMutex);
+	++shard.originMap[origin].active;
+}
+
+void ConnectionPool::release(const std::string &origin, std::unique_ptr<Connection> connection)
+{
+	Shard &shard = shards[localIndex()];
+	std::lock_guard<std::mutex> lock(shard.poolMutex);
+	auto &state = shard.originMap[origin];
+	if (state.active > 0)
+	{
+		--state.active;
+	}
+	if (state.idle.size() < MAX_IDLE_PER_ORIGIN)
+	{
+		state.idle.push_back(std::move(connection));
+	}
+}
+
+void ConnectionPool::discard(const std::string &origin)
+{
+	Shard &shard = shards[localIndex()];
+	std::lock_guard<std::mutex> lock(shard.poolMutex);
+	auto &state = shard.originMap[origin];
+	if (state.active > 0)
+	{
+		--state.active;
+	}
+}
+
+void ConnectionPool::collect(std::vector<OriginConnections> &connections)
+{
+	size_t first = connections.size();
+	for (size_t s = 0; s < SHARDS; ++s)
+	{
+		std::lock_guard<std::mutex> lock(shards[s].poolMutex);
+		for (const auto &item: shards[s].originMap)
+		{
+			auto iter = std::find_if(connections.begin() + static_cast<long>(first), connections.end(),
+			                         [&item](const OriginConnections &origin)
+			                         { return origin.origin == item.first; });
+			if (iter == connections.end())
+			{
+				connections.push_back(OriginConnections{item.first, 0, 0});
+				iter = connections.end() - 1;
+			}
+			iter->active += item.second.active;
+			iter->idle += item.second.idle.size();
+		}
+	}
+}
+
+/*********************** HTTP exchange ***********************/
+/* A thread's output buffer is released when one message grew it beyond this */
+static constexpr size_t OUTPUT_BUFFER_LIMIT = 256 * 1024;
+/* A produced body goes out in pieces of one TLS record */
+static constexpr size_t PRODUCED_CHUNK_SIZE = 16 * 1024;
+
+static bool hasNoBody(HttpStatus status)
+{
+	auto code = static_cast<int>(status);
+	return ((code >= 100) && (code < 200)) || (status == HttpStatus::NO_CONTENT) ||
+	       (status == HttpStatus::NOT_MODIFIED);
+}
+
+static bool isPersistent(const HttpResponse &response)
+{
+	std::string connection(response.getHeader().getField("Connection"));
+	toLowCase(connection);
+	if (response.getVersion() == HttpVersion::HTTP_1_0)
+	{
+		return std::string::npos != connection.find("keep-alive");
+	}
+	return std::string::npos == connection.find("close");
+}
+
+/* A Content-Length of digits only, "12abc" or "5, 5" is none */
+static bool parseContentLength(std::string_view length, size_t &value)
+{
+	size_t parsed = 0;
+	auto result = std::from_chars(length.data(), length.data() + length.length(), parsed);
+	if (length.empty() || (result.ec != std::errc()) || (result.ptr != length.data() + length.length()))
+	{
+		return false;
+	}
+	value = parsed;
+	return true;
+}
+
+/************************ ChunkDecoder ***********************/
+/* Keeps a chunk size from overflowing */
+static constexpr size_t MAX_CHUNK_SIZE = static_cast<size_t>(1) << 48;
+
+static int hexValue(char c)
+{
+	if ((c >= '0') && (c <= '9'))
+	{
+		return c - '0';
+	}
+	if ((c >= 'a') && (c <= 'f'))
+	{
+		return c - 'a' + 10;
+	}
+	if ((c >= 'A') && (c <= 'F'))
+	{
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+size_t ChunkDecoder::decode(char *data, size_t len)
+{
+	size_t out = 0;
+	size_t pos = 0;
+	while ((pos < len) && (state != State::DONE))
+	{
+		char c = data[pos];
+		switch (state)
+		{
+			case State::SIZE:
+			{
+				int digit = hexValue(c);
+				if (digit >= 0)
+				{
+					remaining = (remaining << 4) | static_cast<size_t>(digit);
+					if (remaining > MAX_CHUNK_SIZE)
+					{
+						throw std::invalid_argument("Chunk size too large");
+					}
+					hasDigit = true;
+				}
+				else if (!hasDigit)
+				{
+					throw std::invalid_argument("Invalid chunk size");
+				}
+				else if (c == '\r')
+				{
+					state = State::SIZE_LF;
+				}
+				else if (c == '\n')
+				{
+					state = (remaining == 0) ? State::TRAILER_START : State::DATA;
+				}
+				else if ((c == ';') || (c == ' ') || (c == '\t'))
+				{
+					state = State::EXTENSION;
+				}
+				else
+				{
+					throw std::invalid_argument("Invalid chunk size");
+				}
+				++pos;
+				break;
+			}
+			case State::EXTENSION:
+			{
+				auto lineEnd = static_cast<const char *>(memchr(data + pos, '\n', len - pos));
+				if (lineEnd == nullptr)
+				{
+					pos = len;
+					break;
+				}
+				pos = lineEnd - data + 1;
+				state = (remaining == 0) ? State::TRAILER_START : State::DATA;
+				break;
+			}
+			case State::SIZE_LF:
+				if (c != '\n')
+				{
+					throw std::invalid_argument("Invalid chunk size line");
+				}
+				++pos;
+				state = (remaining == 0) ? State::TRAILER_START : State::DATA;
+				break;
+			case State::DATA:
+			{
+				size_t take = std::min(remaining, len - pos);
+				memmove(data + out, data + pos, take);
+				out += take;
+				pos += take;
+				remaining -= take;
+				if (remaining == 0)
+				{
+					state = State::DATA_CR;
+				}
+				break;
+			}
+			case State::DATA_CR:
+				/* A bare LF is tolerated */
+				if ((c != '\r') && (c != '\n'))
+				{
+					throw std::invalid_argument("Missing CRLF after chunk data");
+				}
+				state = (c == '\r') ? State::DATA_LF : State::SIZE;
+				hasDigit = false;
+				++pos;
+				break;
+			case State::DATA_LF:
+				if (c != '\n')
+				{
+					throw std::invalid_argument("Missing CRLF after chunk data");
+				}
+				state = State::SIZE;
+				++pos;
+				break;
+			case State::TRAILER_START:
+				state = (c == '\r') ? State::TRAILER_LF : ((c == '\n') ? State::DONE : State::TRAILER);
+				++pos;
+				break;
+			case State::TRAILER:
+			{
+				auto lineEnd = static_cast<const char *>(memchr(data + pos, '\n', len - pos));
+				if (lineEnd == nullptr)
+				{
+					pos = len;
+					break;
+				}
+				pos = lineEnd - data + 1;
+				state = State::TRAILER_START;
+				break;
+			}
+			case State::TRAILER_LF:
+				if (c != '\n')
+				{
+					throw std::invalid_argument("Invalid trailer section");
+				}
+				state = State::DONE;
+				++pos;
+				break;
+			case State::DONE:
+				break;
+		}
+	}
+	return out;
+}
+
+/************************ ResponseReader *********************/
+ResponseReader::ResponseReader(RequestTrace &requestTrace, HttpResponse &httpResponse)
+		: trace(requestTrace), response(httpResponse), array(std::make_unique<VariableArray>())
+{
+}
+
+ResponseReader::~ResponseReader() = default;
+
+char *ResponseReader::space()
+{
+	if (dataLen >= array->capability)
+	{
+		array->expand();
+	}
+	return array->buffer + dataLen;
+}
+
+size_t ResponseReader::spaceLen() const
+{
+	return array->capability - dataLen;
+}
+
+/* 101 ends the exchange, other 1xx responses come before the final one */
+static bool isInterim(HttpStatus status)
+{
+	auto code = static_cast<int>(status);
+	return (code >= 100) && (code < 200) && (status != HttpStatus::SWITCHING_PROTOCOLS);
+}
+
+bool ResponseReader::consume(size_t readLen)
+{
+	if (empty())
+	{
+		trace.mark(HttpEvent::RESPONSE_FIRST_BYTE, trace.timing.firstByte);
+	}
+	dataLen += readLen;
+	while (headLen == 0)
+	{
+		headLen = response.buildHeader(array->buffer, dataLen);
+		if (headLen == 0)
+		{
+			return false;
+		}
+		dataLen = dataLen - headLen;
+		memmove(array->buffer, array->buffer + headLen, dataLen);
+		if (isInterim(response.getStatusCode()))
+		{
+			interimLen += headLen;
+			headLen = 0;
+			if (pauseInterim)
+			{
+				pauseInterim = false;
+				isPaused = true;
+				return true;
+			}
+			response.clearHead();
+			continue;
+		}
+		noBody = hasNoBody(response.getStatusCode());
+		streaming = !noBody && response.getBodySink() && (static_cast<int>(response.getStatusCode()) / 100 == 2);
+		const HttpHeader &header = response.getHeader();
+		std::string_view length = header.getField("Content-Length");
+		std::string_view transEnc = header.getField("Transfer-Encoding");
+		if (std::string_view::npos != transEnc.find("chunked"))
+		{
+			/* Transfer-Encoding overrides Content-Length, and a response with both may have been framed
+			 * differently by a proxy on the way: the connection is not used again (RFC 7230 section 3.3.3) */
+			isChunked = true;
+			lengthConflict = !length.empty();
+		}
+		else if (!length.empty())
+		{
+			hasContentLen = true;
+			if (!parseContentLength(length, contentLen))
+			{
+				throw std::invalid_argument("Invalid Content-Length: " + std::string(length));
+			}
+		}
+	}
+	if (noBody)
+	{
+		if (response.getStatusCode() == HttpStatus::SWITCHING_PROTOCOLS)
+		{
+			upgradedLen = dataLen;
+		}
+		dataLen = 0;
+		complete = true;
+	}
+	else if (hasContentLen)
+	{
+		if (drainedLen + dataLen >= contentLen)
+		{
+			dataLen = contentLen - drainedLen;
+			complete = true;
+		}
+	}
+	else if (isChunked)
+	{
+		size_t pending = dataLen - decodedLen;
+		size_t decoded = chunks.decode(array->buffer + decodedLen, pending);
+		drainedLen += pending - decoded;
+		decodedLen += decoded;
+		dataLen = decodedLen;
+		complete = chunks.done();
+	}
+	if (streaming)
+	{
+		stream();
+	}
+	return complete;
+}
+
+bool ResponseReader::resume()
+{
+	pauseInterim = false;
+	if (!isPaused)
+	{
+		return false;
+	}
+	isPaused = false;
+	response.clearHead();
+	return (dataLen > 0) && consume(0);
+}
+
+bool ResponseReader::closed()
+{
+	/* Without Content-Length or chunked encoding, the body is delimited by the connection close */
+	complete = complete || ((headLen > 0) && !hasContentLen && !isChunked);
+	return complete;
+}
+
+std::string_view ResponseReader::upgraded() const
+{
+	return {array->buffer, upgradedLen};
+}
+
+size_t ResponseReader::finish(bool &keepAlive)
+{
+	keepAlive = false;
+	if (headLen == 0)
+	{
+		return 0;
+	}
+	trace.mark(HttpEvent::RESPONSE_END, trace.timing.lastByte);
+	keepAlive = complete && !lengthConflict && (noBody || hasContentLen || isChunked) && isPersistent(response);
+	if ((dataLen > 0) && !streaming)
+	{
+		response.build(array->buffer, dataLen);
+	}
+	return interimLen + headLen + drainedLen + dataLen;
+}
+
+void ResponseReader::stream()
+{
+	if (dataLen == 0)
+	{
+		return;
+	}
+	if (!response.getBodySink()(array->buffer, dataLen))
+	{
+		throw std::runtime_error("Response body refused by its sink");
+	}
+	drainedLen += dataLen;
+	dataLen = 0;
+	decodedLen = 0;
+}
+
+/* Reads until the response is complete or reader paused at an interim response */
+static void readInto(Connection &connection, ResponseReader &reader, RequestTrace &trace)
+{
+	while (true)
+	{
+		char *space = reader.space();
+		long readLen = connection.read(space, reader.spaceLen());
+		if (readLen <= 0)
+		{
+			if (readLen == 0)
+			{
+				reader.closed();
+			}
+			else
+			{
+				trace.timedOut = socketTimedOut();
+			}
+			return;
+		}
+		if (reader.consume(static_cast<size_t>(readLen)))
+		{
+			return;
+		}
+	}
+}
+
+static size_t readResponse(Connection &connection, RequestTrace &trace, HttpResponse &response, bool &keepAlive)
+{
+	ResponseReader reader(trace, response);
+	readInto(connection, reader, trace);
+	return reader.finish(keepAlive);
+}
+
+/* Frames a streamed body: chunked unless the request has a Content-Length, which the body must then match */
+class StreamedBodyWriter : public BodyWriter
+{
+public:
+	StreamedBodyWriter(Connection &bodyConnection, RequestTrace &requestTrace)
+			: connection(bodyConnection), trace(requestTrace)
+	{
+		std::string_view length = trace.request.header.getField("Content-Length");
+		chunked = length.empty();
+		if (!chunked && !parseContentLength(length, expected))
+		{
+			valid = false;
+		}
+	}
+
+	bool write(const IoSlice *slices, size_t count) override
+	{
+		/* Framing around at most MAX_SLICES at a time, each batch becomes one chunk */
+		constexpr size_t MAX_SLICES = 14;
+		while (count > 0)
+		{
+			size_t batch = std::min(count, MAX_SLICES);
+			IoSlice framed[MAX_SLICES + 2];
+			size_t len = 0;
+			for (size_t i = 0; i < batch; ++i)
+			{
+				framed[i + 1] = slices[i];
+				len += slices[i].len;
+			}
+			char line[SIZE_LINE];
+			size_t first = 1;
+			size_t last = batch + 1;
+			if (chunked && (len > 0))
+			{
+				framed[0] = sizeLine(line, len);
+				framed[last++] = IoSlice{"\r\n", 2};
+				first = 0;
+			}
+			if (!account(len) || !send(framed + first, last - first))
+			{
+				return false;
+			}
+			slices += batch;
+			count -= batch;
+		}
+		return true;
+	}
+
+	bool writeFile(int fd, size_t offset, size_t len) override
+	{
+		if ((len == 0) || !account(len))
+		{
+			return len == 0;
+		}
+		char line[SIZE_LINE];
+		IoSlice framing = sizeLine(line, len);
+		if (chunked && !send(&framing, 1))
+		{
+			return false;
+		}
+		trace.count(MetricCounter::BYTES_SENT, len);
+		if (!connection.sendFile(fd, offset, len))
+		{
+			return false;
+		}
+		framing = IoSlice{"\r\n", 2};
+		return !chunked || send(&framing, 1);
+	}
+
+	/* Ends the body, false if it did not match its Content-Length */
+	bool finish()
+	{
+		if (!chunked)
+		{
+			return valid && (total == expected);
+		}
+		IoSlice last{"0\r\n\r\n", 5};
+		return valid && send(&last, 1);
+	}
+
+private:
+	static constexpr size_t SIZE_LINE = 18;
+
+	static IoSlice sizeLine(char *line, size_t len)
+	{
+		int lineLen = snprintf(line, SIZE_LINE, "%zx\r\n", len);
+		return IoSlice{line, static_cast<size_t>(lineLen)};
+	}
+
+	bool account(size_t len)
+	{
+		total += len;
+		valid = valid && (chunked || (total <= expected));
+		return valid;
+	}
+
+	bool send(const IoSlice *slices, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			trace.count(MetricCounter::BYTES_SENT, slices[i].len);
+		}
+		return connection.writeAll(slices, count);
+	}
+
+	Connection &connection;
+	RequestTrace &trace;
+	bool chunked;
+	bool valid = true;
+	size_t expected = 0;
+	size_t total = 0;
+};
+
+/* Writes the request's producer or source body */
+static bool writeStreamed(Connection &connection, RequestTrace &trace)
+{
+	const HttpRequest &request = trace.request;
+	StreamedBodyWriter writer(connection, trace);
+	if (request.source != nullptr)
+	{
+		trace.bodyStarted = !request.source->isRepeatable();
+		return request.source->writeTo(writer) && writer.finish();
+	}
+	trace.bodyStarted = true;
+	char buffer[PRODUCED_CHUNK_SIZE];
+	while (true)
+	{
+		long produced = request.producer(buffer, sizeof(buffer));
+		if (produced <= 0)
+		{
+			return (produced == 0) && writer.finish();
+		}
+		IoSlice piece{buffer, std::min(static_cast<size_t>(produced), sizeof(buffer))};
+		if (!writer.write(&piece, 1))
+		{
+			return false;
+		}
+	}
+}
+
+/* Writes the head, then the body with writeBody, and reads the response. With expectContinue the head carries
+ * "Expect: 100-continue" and the body only goes out once the server agreed or did not answer in time. A final
+ * status before that skips the body, the connection is then closed since the server may still wait for it. */
+template<typename WriteBody>
+static size_t exchangeStreaming(Connection &connection, const IoSlice &head, WriteBody writeBody, bool expectContinue,
+                                unsigned int timeoutMillis, RequestTrace &trace, HttpResponse &response,
+                                bool &keepAlive)
+{
+	trace.count(MetricCounter::BYTES_SENT, head.len);
+	if (!connection.writeAll(&head, 1))
+	{
+		trace.timedOut = socketTimedOut();
+#ifdef _DEBUG
+		printf("%s:%d send request head failed\n", __func__, __LINE__);
+#endif
+		return 0;
+	}
+	try
+	{
+		ResponseReader reader(trace, response);
+		if (expectContinue)
+		{
+			reader.pauseAtInterim();
+			if (connection.waitReadable(timeoutMillis))
+			{
+				readInto(connection, reader, trace);
+				if (!reader.paused())
+				{
+					size_t len = reader.finish(keepAlive);
+					keepAlive = false;
+					return len;
+				}
+			}
+		}
+		if (!writeBody())
+		{
+			trace.timedOut = socketTimedOut();
+#ifdef _DEBUG
+			printf("%s:%d send request body failed\n", __func__, __LINE__);
+#endif
+			return 0;
+		}
+		trace.mark(HttpEvent::REQUEST_WRITTEN, trace.timing.requestWritten);
+		if (!reader.resume())
+		{
+			readInto(connection, reader, trace);
+		}
+		return reader.finish(keepAlive);
+	}
+	catch (std::exception &e)
+	{
+#ifdef _DEBUG
+		printf("%s:%d bad response: %s\n", __func__, __LINE__, e.what());
+#endif
+		keepAlive = false;
+		return 0;
+	}
+}
+
+size_t exchange(Connection &connection, const HttpClientConfig &config, RequestTrace &trace, HttpResponse &response,
+                bool &keepAlive)
+{
+	const HttpRequest &request = trace.request;
+	keepAlive = false;
+	/* One head buffer per thread, head and body then go out in one vectored write */
+	static thread_local Buffer output;
+	output.clear();
+	size_t bodyLen = (request.body != nullptr) ? request.body->getBodyLength() : 0;
+	bool streamed = request.producer || (request.source != nullptr);
+	if (streamed)
+	{
+		std::string_view length = request.header.getField("Content-Length");
+		bodyLen = UNKNOWN_BODY_LENGTH;
+		parseContentLength(length, bodyLen);
+	}
+	bool expectContinue = (bodyLen > 0) && (bodyLen >= config.expectContinueThreshold) &&
+	                      (config.expectContinueThreshold != SIZE_MAX) && request.header.getField("Expect").empty();
+	request.appendRequestLineTo(output);
+	if (expectContinue)
+	{
+		request.header.appendTo(output, {{"expect", "100-continue"}, {"user-agent", config.userAgent}});
+	}
+	else
+	{
+		request.header.appendTo(output, "user-agent", config.userAgent);
+	}
+	IoSlice slices[2] = {{output.data(), output.size()}, {nullptr, 0}};
+	size_t count = 1;
+	size_t len;
+	if (streamed)
+	{
+		len = exchangeStreaming(connection, slices[0], [&connection, &trace]()
+		{
+			return writeStreamed(connection, trace);
+		}, expectContinue, config.expectContinueTimeout, trace, response, keepAlive);
+	}
+	else if (expectContinue)
+	{
+		IoSlice body{request.body->getContent(), bodyLen};
+		len = exchangeStreaming(connection, slices[0], [&connection, &trace, &body]()
+		{
+			trace.count(MetricCounter::BYTES_SENT, body.len);
+			return connection.writeAll(&body, 1);
+		}, true, config.expectContinueTimeout, trace, response, keepAlive);
+	}
+	else
+	{
+		if (bodyLen > 0)
+		{
+			slices[count++] = IoSlice{request.body->getContent(), bodyLen};
+		}
+		len = exchange(connection, slices, count, trace, response, keepAlive);
+	}
+	output.clear();
+	output.shrink(OUTPUT_BUFFER_LIMIT);
+	return len;
+}
+
+size_t exchange(Connection &connection, const IoSlice *slices, size_t count, RequestTrace &trace,
+                HttpResponse &response, bool &keepAlive)
+{
+	keepAlive = false;
+	size_t total = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		total += slices[i].len;
+	}
+	trace.count(MetricCounter::BYTES_SENT, total);
+	if (!connection.writeAll(slices, count))
+	{
+		trace.timedOut = socketTimedOut();
+#ifdef _DEBUG
+		printf("%s:%d send request failed\n", __func__, __LINE__);
+#endif
+		return 0;
+	}
+	trace.mark(HttpEvent::REQUEST_WRITTEN, trace.timing.requestWritten);
+
+	try
+	{
+		return readResponse(connection, trace, response, keepAlive);
+	}
+	catch (std::exception &e)
+	{
+#ifdef _DEBUG
+		printf("%s:%d bad response: %s\n", __func__, __LINE__, e.what());
+#endif
+		keepAlive = false;
+		return 0;
+	}
+}
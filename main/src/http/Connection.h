@@ -0,0 +1,464 @@
+#ifndef LWHTTP_CONNECTION_H
+#define LWHTTP_CONNECTION_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../../include/http/HttpClient.h"
+#include "../../include/http/HttpMetrics.h"
+#include "../../include/http/HttpResponse.h"
+
+class HttpRequest;
+
+typedef struct bio_st BIO;
+
+/************************ CancelToken ************************/
+/* Lets another thread abort an exchange by shutting its socket down, which fails a blocked read or write. The
+ * socket is only known between attach() and detach(), so a connection back in the pool is never hit. */
+class CancelToken
+{
+public:
+	/* Returns false if the exchange was cancelled already and must not start */
+	bool attach(SocketHandle socketHandle);
+
+	void detach();
+
+	void cancel();
+
+	[[nodiscard]] bool cancelled() const;
+
+private:
+	mutable std::mutex tokenMutex;
+	SocketHandle handle = INVALID_FD;
+	bool isCancelled = false;
+};
+
+/************************ RequestTrace ***********************/
+/* Records phase timestamps of one exchange, events and metrics are only dispatched when installed */
+struct RequestTrace
+{
+	const HttpRequest &request;
+	RequestTiming &timing;
+	EventListener *listener;
+	HttpMetrics *metrics;
+	/* Null unless the exchange may be cancelled from another thread */
+	CancelToken *cancel = nullptr;
+	/* A body that cannot be produced again was pulled from, the request cannot be sent again */
+	bool bodyStarted = false;
+	/* A read or write of the exchange ran into the socket timeout */
+	bool timedOut = false;
+
+	void mark(HttpEvent event, RequestTiming::Clock::time_point &point)
+	{
+		point = RequestTiming::Clock::now();
+		if (listener != nullptr)
+		{
+			listener->onEvent(event, request, timing);
+		}
+	}
+
+	void notify(HttpEvent event)
+	{
+		if (listener != nullptr)
+		{
+			listener->onEvent(event, request, timing);
+		}
+	}
+
+	void count(MetricCounter counter, uint64_t value = 1)
+	{
+		if (metrics != nullptr)
+		{
+			metrics->add(counter, value);
+		}
+	}
+
+	void record(MetricHistogram histogram, RequestTiming::Clock::time_point from, RequestTiming::Clock::time_point to)
+	{
+		if (metrics != nullptr)
+		{
+			auto micros = std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+			metrics->record(histogram, micros > 0 ? static_cast<uint64_t>(micros) : 0);
+		}
+	}
+
+	/* Counts the outcome of a finished call and records its phase durations, len is 0 for a failure */
+	void finish(const HttpResponse &response, size_t len);
+
+	/* A failed exchange on a reused connection may go out again on a new one: nothing of the response came, the
+	 * wait did not time out and a POST did not get written */
+	[[nodiscard]] bool mayResend() const;
+};
+
+/************************** Common ***************************/
+void closeSocket(SocketHandle handle);
+
+/* With async the socket is non-blocking and may still be connecting, it turns writable once connected. Its
+ * CONNECT_END is then left to the caller. */
+SocketHandle createSocket(const std::string &host, unsigned short port, bool async, RequestTrace *trace = nullptr);
+
+/* To the socket path of an http+unix URL, else to unixSocket unless it is empty, else to the host and port of uri */
+SocketHandle createSocket(const URL &uri, const std::string &unixSocket, bool async, RequestTrace *trace = nullptr);
+
+/* Whether createSocket() would block on the resolver for uri: its host is a name with no cached addresses */
+bool needsLookup(const URL &uri, const std::string &unixSocket);
+
+/* Resolves host into the cache createSocket() looks in, blocks. False if it has no address. */
+bool lookupHost(const std::string &host);
+
+void setSocketTimeout(SocketHandle handle, unsigned int seconds);
+
+/* Like SSL_set_fd(), but the records are sent with MSG_NOSIGNAL: a peer that reset the connection fails the write
+ * instead of raising SIGPIPE. False if the BIO could not be created. */
+bool setSocketBio(SSL *ssl, SocketHandle handle);
+
+/* Records the end of the TLS handshake of ssl with its resumption and early data */
+void traceHandshake(SSL *ssl, RequestTrace &trace);
+
+/************************* Connection ************************/
+class Connection
+{
+public:
+	explicit Connection(SocketHandle socketHandle);
+
+	Connection(const Connection &other) = delete;
+
+	Connection &operator=(const Connection &other) = delete;
+
+	virtual ~Connection();
+
+	/* Returns the number of bytes written, or a negative value on error */
+	virtual long write(const char *data, size_t len) = 0;
+
+	/* Returns the number of bytes read, 0 on EOF, or a negative value on error */
+	virtual long read(char *buffer, size_t len) = 0;
+
+	bool writeAll(const char *data, size_t len);
+
+	/* Writes all slices in order, coalesced into writes of up to one TLS record, large tails are not copied */
+	virtual bool writeAll(const IoSlice *slices, size_t count);
+
+	/* Writes len bytes of the file at offset, read through a buffer */
+	virtual bool sendFile(int fd, size_t offset, size_t len);
+
+	/* An idle connection is alive if the peer neither closed it nor sent anything unsolicited */
+	[[nodiscard]] virtual bool isAlive() const;
+
+	/* Waits up to millis for something to read, or for the peer to close */
+	[[nodiscard]] virtual bool waitReadable(unsigned int millis) const;
+
+	[[nodiscard]] SocketHandle getHandle() const
+	{
+		return handle;
+	}
+
+protected:
+	SocketHandle handle;
+};
+
+/********************** PlainConnection **********************/
+class PlainConnection : public Connection
+{
+public:
+	explicit PlainConnection(SocketHandle socketHandle);
+
+	long write(const char *data, size_t len) override;
+
+	long read(char *buffer, size_t len) override;
+
+	using Connection::writeAll;
+
+#ifdef __linux__
+	/* One sendmsg per round, resumed after partial writes */
+	bool writeAll(const IoSlice *slices, size_t count) override;
+
+	/* sendfile(2), falls back to the buffered copy for files it cannot send */
+	bool sendFile(int fd, size_t offset, size_t len) override;
+#endif
+};
+
+/*********************** TlsConnection ***********************/
+class TlsConnection : public Connection
+{
+public:
+	TlsConnection(SocketHandle socketHandle, SSL *sslHandle);
+
+	/* Leaves the handshake to the first write, which sends up to earlyLimit bytes as early data with the
+	 * ClientHello and reports the handshake to trace. Rejected early data is written again once it completed. */
+	TlsConnection(SocketHandle socketHandle, SSL *sslHandle, size_t earlyLimit, RequestTrace &trace);
+
+	~TlsConnection() override;
+
+	long write(const char *data, size_t len) override;
+
+	long read(char *buffer, size_t len) override;
+
+	[[nodiscard]] bool isAlive() const override;
+
+	[[nodiscard]] bool waitReadable(unsigned int millis) const override;
+
+private:
+	long writeEarly(const char *data, size_t len);
+
+	SSL *ssl;
+	size_t earlyDataLimit = 0;
+	/* Until the handshake completed in writeEarly() */
+	RequestTrace *handshakeTrace = nullptr;
+	/* A read or write failed or met the end of the stream */
+	bool broken = false;
+};
+
+#ifdef __linux__
+
+/********************* AsyncTlsConnection ********************/
+/* TLS on a non-blocking socket for the event loops. The SSL reads and writes a memory BIO pair, the calls below
+ * move the ciphertext between the pair and the socket and never block: one that cannot go on returns the
+ * readiness of the socket it waits for, and is simply called again once the socket has it. */
+class AsyncTlsConnection : public Connection
+{
+public:
+	enum class IoStatus
+	{
+		DONE,
+		WANT_READ,
+		WANT_WRITE,
+		/* The peer closed the connection */
+		CLOSED,
+		FAILED
+	};
+
+	/* Takes over ssl, which must not have a BIO yet. The blocking calls wait up to timeout seconds for the socket */
+	AsyncTlsConnection(SocketHandle socketHandle, SSL *sslHandle, unsigned int timeout);
+
+	~AsyncTlsConnection() override;
+
+	IoStatus handshake();
+
+	/* Encrypts data and sends it, written tells how much of it was taken, also when the call has to wait. All of
+	 * data can be taken with its last records still pending, call again (len 0 will do) until DONE. */
+	IoStatus writeSome(const char *data, size_t len, size_t &written);
+
+	/* DONE with readLen > 0 bytes of plain text. WANT_WRITE while ciphertext is still pending, the peer may wait for
+	 * it before it answers. */
+	IoStatus readSome(char *buffer, size_t len, size_t &readLen);
+
+	/* The Connection calls wait for the socket with poll */
+	long write(const char *data, size_t len) override;
+
+	long read(char *buffer, size_t len) override;
+
+	[[nodiscard]] bool isAlive() const override;
+
+	[[nodiscard]] bool waitReadable(unsigned int millis) const override;
+
+	[[nodiscard]] SSL *getSSL() const
+	{
+		return ssl;
+	}
+
+	/* Of each half of the BIO pair */
+	static constexpr size_t BIO_BUFFER_SIZE = 64 * 1024;
+
+private:
+	/* Sends the pending ciphertext, DONE once all of it is out */
+	IoStatus flush();
+
+	/* Receives ciphertext into the pair, DONE if some arrived or there is no room */
+	IoStatus fill();
+
+	/* Waits for the readiness status asks for, false unless it came in time */
+	bool await(IoStatus status) const;
+
+	SSL *ssl;
+	/* The socket side of the pair, the SSL owns its own side */
+	BIO *network = nullptr;
+	int timeoutMillis;
+};
+
+#endif
+
+/*********************** ConnectionPool **********************/
+/* Idle connections per origin, also counts the connections in use so that gauges come for free with the lock.
+ * The pool is split into shards by thread like HttpMetrics: a thread releases into its own shard and takes from
+ * it first, so threads that each keep a connection busy do not meet on one lock. Only when its shard has no idle
+ * connection does a thread try the other shards, skipping the ones that are locked. */
+class ConnectionPool
+{
+public:
+	ConnectionPool();
+
+	/* Returns an idle connection to origin and marks it active, or nullptr if there is none */
+	std::unique_ptr<Connection> acquire(const std::string &origin);
+
+	/* A new connection to origin was opened and is active */
+	void opened(const std::string &origin);
+
+	/* An active connection goes back to the idle list */
+	void release(const std::string &origin, std::unique_ptr<Connection> connection);
+
+	/* An active connection was closed */
+	void discard(const std::string &origin);
+
+	void collect(std::vector<OriginConnections> &connections);
+
+	static constexpr size_t SHARDS = 16;
+	/* Per shard, so up to SHARDS times as many per origin in total */
+	static constexpr size_t MAX_IDLE_PER_ORIGIN = 8;
+
+private:
+	struct OriginState
+	{
+		std::vector<std::unique_ptr<Connection>> idle;
+		size_t active = 0;
+	};
+
+	struct alignas(64) Shard
+	{
+		std::mutex poolMutex;
+		std::unordered_map<std::string, OriginState> originMap;
+	};
+
+	static size_t localIndex();
+
+	/* Pops an idle connection without checking it, lock is held by the caller */
+	static std::unique_ptr<Connection> takeIdle(Shard &shard, const std::string &origin);
+
+private:
+	std::unique_ptr<Shard[]> shards;
+};
+
+/************************ ChunkDecoder ***********************/
+/* Incremental decoder of a chunked body. Input may be split anywhere, chunk extensions and trailers are skipped. */
+class ChunkDecoder
+{
+public:
+	/* Decodes data[0, len) in place, the chunk data ends up at the front. Returns its length, throws
+	 * std::invalid_argument on a malformed chunk. Input after the last chunk is ignored. */
+	size_t decode(char *data, size_t len);
+
+	/* The last chunk and the trailer section ended */
+	[[nodiscard]] bool done() const
+	{
+		return state == State::DONE;
+	}
+
+private:
+	enum class State
+	{
+		SIZE,
+		EXTENSION,
+		SIZE_LF,
+		DATA,
+		DATA_CR,
+		DATA_LF,
+		TRAILER_START,
+		TRAILER,
+		TRAILER_LF,
+		DONE
+	};
+
+	State state = State::SIZE;
+	size_t remaining = 0;
+	bool hasDigit = false;
+};
+
+/*********************** ResponseReader **********************/
+struct VariableArray;
+
+/* Incremental reader of one response, fed with whatever a blocking or non-blocking read returned */
+class ResponseReader
+{
+public:
+	ResponseReader(RequestTrace &requestTrace, HttpResponse &httpResponse);
+
+	ResponseReader(const ResponseReader &other) = delete;
+
+	ResponseReader &operator=(const ResponseReader &other) = delete;
+
+	~ResponseReader();
+
+	/* Where the next read goes, spaceLen() bytes are free there after this call */
+	char *space();
+
+	[[nodiscard]] size_t spaceLen() const;
+
+	/* Accounts readLen bytes read into space(). Returns true once the response is complete, or paused at an
+	 * interim response, throws on a bad head. Interim responses (1xx but 101) are skipped otherwise. */
+	bool consume(size_t readLen);
+
+	/* Makes consume() stop at the next interim response */
+	void pauseAtInterim()
+	{
+		pauseInterim = true;
+	}
+
+	/* The last consume() stopped at an interim response, which is gone from the response again */
+	[[nodiscard]] bool paused() const
+	{
+		return isPaused;
+	}
+
+	/* Skips interim responses again and goes on after a pause, returns true if the data already read completes
+	 * the response */
+	bool resume();
+
+	/* The peer closed the connection, returns true if that completes the response */
+	bool closed();
+
+	/* Builds the body. Returns the number of bytes received (head and body), 0 if no head was read. A streamed
+	 * body counts with the bytes its sink took. */
+	size_t finish(bool &keepAlive);
+
+	/* What came after a "101 Switching Protocols" head, it belongs to the new protocol */
+	[[nodiscard]] std::string_view upgraded() const;
+
+	/* Nothing of the response has arrived yet */
+	[[nodiscard]] bool empty() const
+	{
+		return (headLen == 0) && (interimLen == 0) && (dataLen == 0);
+	}
+
+private:
+	/* Hands the body bytes buffered so far to the sink */
+	void stream();
+
+	RequestTrace &trace;
+	HttpResponse &response;
+	std::unique_ptr<VariableArray> array;
+	size_t headLen = 0;
+	/* Heads of the interim responses before the final one */
+	size_t interimLen = 0;
+	size_t dataLen = 0;
+	size_t upgradedLen = 0;
+	size_t contentLen = 0;
+	/* Raw body bytes taken out of the buffer, by de-chunking or by the sink */
+	size_t drainedLen = 0;
+	/* Decoded body at the front of the buffer, the undecoded rest follows */
+	size_t decodedLen = 0;
+	ChunkDecoder chunks;
+	bool streaming = false;
+	bool pauseInterim = false;
+	bool isPaused = false;
+	bool noBody = false;
+	bool hasContentLen = false;
+	bool isChunked = false;
+	/* Both Content-Length and chunked encoding */
+	bool lengthConflict = false;
+	bool complete = false;
+};
+
+/*********************** HTTP exchange ***********************/
+/* Writes the request and reads one complete response. Returns the number of bytes received (head and body),
+ * or 0 on failure. keepAlive tells whether the connection may carry another request afterwards. The config gives
+ * the User-Agent and when a large body waits for "100 Continue". */
+size_t exchange(Connection &connection, const HttpClientConfig &config, RequestTrace &trace, HttpResponse &response,
+                bool &keepAlive);
+
+/* Same as above for a request already laid out in slices */
+size_t exchange(Connection &connection, const IoSlice *slices, size_t count, RequestTrace &trace,
+                HttpResponse &response, bool &keepAlive);
+
+#endif //LWHTTP_CONNECTION_H
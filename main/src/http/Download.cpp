@@ -0,0 +1,544 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+
+#include <io.h>
+#include <sys/stat.h>
+
+#else
+
+#include <unistd.h>
+
+#endif
+
+#include "../../include/http/Download.h"
+#include "../../include/http/HttpResponse.h"
+#include "WorkStealingPool.h"
+
+/*********************** DownloadTarget **********************/
+bool BufferTarget::allocate(size_t size)
+{
+	data.resize(size);
+	return true;
+}
+
+bool BufferTarget::write(size_t offset, const char *content, size_t len)
+{
+	if ((offset > data.size()) || (len > data.size() - offset))
+	{
+		return false;
+	}
+	memcpy(data.data() + offset, content, len);
+	return true;
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+FileTarget::FileTarget(const std::string &path)
+{
+	fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Cannot open " + path);
+	}
+}
+
+FileTarget::~FileTarget()
+{
+	_close(fd);
+}
+
+bool FileTarget::allocate(size_t size)
+{
+	return 0 == _chsize_s(fd, static_cast<__int64>(size));
+}
+
+bool FileTarget::write(size_t offset, const char *data, size_t len)
+{
+	std::lock_guard<std::mutex> lock(fileMutex);
+	if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0)
+	{
+		return false;
+	}
+	while (len > 0)
+	{
+		int written = _write(fd, data, static_cast<unsigned int>(std::min<size_t>(len, 1U << 30)));
+		if (written <= 0)
+		{
+			return false;
+		}
+		data += written;
+		len -= written;
+	}
+	return true;
+}
+
+#else
+
+FileTarget::FileTarget(const std::string &path)
+{
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Cannot open " + path);
+	}
+}
+
+FileTarget::~FileTarget()
+{
+	close(fd);
+}
+
+bool FileTarget::allocate(size_t size)
+{
+	return 0 == ftruncate(fd, static_cast<off_t>(size));
+}
+
+bool FileTarget::write(size_t offset, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t written = pwrite(fd, data, len, static_cast<off_t>(offset));
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		offset += written;
+		len -= written;
+	}
+	return true;
+}
+
+#endif
+
+/*********************** DownloadJournal *********************/
+/* A line naming the object, then the index of every finished segment */
+class DownloadJournal
+{
+public:
+	DownloadJournal(std::string journalPath, std::string journalKey)
+			: path(std::move(journalPath)), key(std::move(journalKey))
+	{
+	}
+
+	DownloadJournal(const DownloadJournal &other) = delete;
+
+	DownloadJournal &operator=(const DownloadJournal &other) = delete;
+
+	~DownloadJournal()
+	{
+		if (file != nullptr)
+		{
+			fclose(file);
+		}
+	}
+
+	/* Marks the segments an earlier download of the same object finished, then records further ones */
+	void resume(std::vector<bool> &done)
+	{
+		std::ifstream in(path);
+		std::string line;
+		bool same = std::getline(in, line) && (line == key);
+		if (same)
+		{
+			size_t segment;
+			while (in >> segment)
+			{
+				if (segment < done.size())
+				{
+					done[segment] = true;
+				}
+			}
+		}
+		in.close();
+		file = fopen(path.c_str(), same ? "a" : "w");
+		if ((file != nullptr) && !same)
+		{
+			fprintf(file, "%s\n", key.c_str());
+			fflush(file);
+		}
+	}
+
+	void finished(size_t segment)
+	{
+		std::lock_guard<std::mutex> lock(journalMutex);
+		if (file != nullptr)
+		{
+			fprintf(file, "%zu\n", segment);
+			fflush(file);
+		}
+	}
+
+	void remove()
+	{
+		if (file != nullptr)
+		{
+			fclose(file);
+			file = nullptr;
+		}
+		std::remove(path.c_str());
+	}
+
+private:
+	std::string path;
+	std::string key;
+	std::mutex journalMutex;
+	FILE *file = nullptr;
+};
+
+/********************* SegmentedDownload *********************/
+/* "bytes first-last/total", total may not be "*". The header parser drops the blank after the unit. */
+static bool parseContentRange(std::string_view range, size_t &first, size_t &total)
+{
+	constexpr std::string_view unit = "bytes";
+	if (range.substr(0, unit.length()) != unit)
+	{
+		return false;
+	}
+	range.remove_prefix(unit.length());
+	while (!range.empty() && (range.front() == ' '))
+	{
+		range.remove_prefix(1);
+	}
+	size_t dash = range.find('-');
+	size_t slash = range.find('/');
+	if ((dash == std::string_view::npos) || (slash == std::string_view::npos) || (slash < dash))
+	{
+		return false;
+	}
+	auto firstResult = std::from_chars(range.data(), range.data() + dash, first);
+	auto totalResult = std::from_chars(range.data() + slash + 1, range.data() + range.length(), total);
+	return (firstResult.ec == std::errc()) && (firstResult.ptr == range.data() + dash) &&
+	       (totalResult.ec == std::errc()) && (totalResult.ptr == range.data() + range.length());
+}
+
+/* What If-Range needs to detect a changed object. Only a strong ETag qualifies: the header parser drops the blanks
+ * of a Last-Modified date, so it would never match. */
+static std::string validatorOf(const HttpResponse &response)
+{
+	std::string_view etag = response.getHeader().getField("ETag");
+	if (!etag.empty() && (etag.substr(0, 2) != "W/"))
+	{
+		return std::string(etag);
+	}
+	return {};
+}
+
+static std::string byteRange(size_t first, size_t last)
+{
+	return "bytes=" + std::to_string(first) + "-" + std::to_string(last);
+}
+
+/* One attempt at the rest of a segment, received counts what earlier attempts wrote. Throws if the object
+ * changed, further attempts would not help then. */
+static bool fetchRange(HttpClient &client, const HttpRequest &request, const std::string &validator, size_t offset,
+                       size_t len, DownloadTarget &target, size_t &received)
+{
+	HttpRequest part(request);
+	part.header.setField("Range", byteRange(offset + received, offset + len - 1));
+	if (!validator.empty())
+	{
+		part.header.setField("If-Range", validator);
+	}
+	HttpResponse response{};
+	bool checked = false;
+	response.setBodySink([&](const char *data, size_t dataLen)
+	                     {
+		                     if (!checked)
+		                     {
+			                     /* Nothing may land at the wrong offset */
+			                     size_t first = 0;
+			                     size_t total = 0;
+			                     if ((response.getStatusCode() != HttpStatus::PARTIAL_CONTENT) ||
+			                         !parseContentRange(response.getHeader().getField("Content-Range"), first,
+			                                            total) || (first != offset + received))
+			                     {
+				                     return false;
+			                     }
+			                     checked = true;
+		                     }
+		                     if ((dataLen > len - received) || !target.write(offset + received, data, dataLen))
+		                     {
+			                     return false;
+		                     }
+		                     received += dataLen;
+		                     return true;
+	                     });
+	size_t responseLen = client.send(part, response);
+	if (response.getStatusCode() == HttpStatus::OK)
+	{
+		throw std::runtime_error("Object changed during download: " + request.uri.serialize());
+	}
+	return (responseLen > 0) && (received == len);
+}
+
+/* What the first range request found out, kept across its attempts */
+struct FirstSegment
+{
+	/* The server answered 206, further attempts resume the range. Otherwise it sends the whole object. */
+	bool ranged = false;
+	/* False for a whole object without Content-Length until it is complete */
+	bool sized = false;
+	size_t total = 0;
+	size_t received = 0;
+	std::string validator;
+};
+
+/* Takes the size of the object from the head of the first response, false if the head does not fit the request */
+static bool startFirst(const HttpResponse &response, FirstSegment &first)
+{
+	if (response.getStatusCode() == HttpStatus::PARTIAL_CONTENT)
+	{
+		size_t start = 0;
+		if (!parseContentRange(response.getHeader().getField("Content-Range"), start, first.total) || (start != 0))
+		{
+			return false;
+		}
+		first.ranged = true;
+		first.sized = true;
+		first.validator = validatorOf(response);
+		return true;
+	}
+	if (response.getStatusCode() == HttpStatus::REQUESTED_RANGE_NOT_SATISFIABLE)
+	{
+		/* Not even the first byte exists, an empty object is complete as it is */
+		std::string_view range = response.getHeader().getField("Content-Range");
+		constexpr std::string_view unit = "bytes";
+		range.remove_prefix(range.substr(0, unit.length()) == unit ? unit.length() : 0);
+		while (!range.empty() && (range.front() == ' '))
+		{
+			range.remove_prefix(1);
+		}
+		first.sized = (range == "*/0");
+		return first.sized;
+	}
+	if (response.getStatusCode() != HttpStatus::OK)
+	{
+		return false;
+	}
+	/* No range support, the whole object comes with the probe */
+	std::string_view length = response.getHeader().getField("Content-Length");
+	auto result = std::from_chars(length.data(), length.data() + length.length(), first.total);
+	first.sized = !length.empty() && (result.ec == std::errc()) && (result.ptr == length.data() + length.length());
+	first.total = first.sized ? first.total : 0;
+	return true;
+}
+
+/* One attempt at the first segment, its body goes straight to the target. The attempt that gets a response head
+ * learns the size of the object from it, later ones resume a range where the last one stopped and start a whole
+ * object over. Throws if the response cannot be used, further attempts would not help then. */
+static bool fetchFirst(HttpClient &client, const HttpRequest &request, size_t segmentSize, DownloadTarget &target,
+                       FirstSegment &first)
+{
+	if (first.ranged)
+	{
+		return fetchRange(client, request, first.validator, 0, std::min(segmentSize, first.total), target,
+		                  first.received);
+	}
+	first = FirstSegment{};
+	HttpRequest probe(request);
+	probe.header.setField("Range", byteRange(0, segmentSize - 1));
+	HttpResponse response{};
+	bool started = false;
+	bool unusable = false;
+	bool unwritable = false;
+	auto start = [&]()
+	{
+		started = true;
+		unusable = !startFirst(response, first);
+		unwritable = !unusable && first.sized && !target.allocate(first.total);
+		return !unusable && !unwritable;
+	};
+	response.setBodySink([&](const char *data, size_t dataLen)
+	                     {
+		                     if (!started && !start())
+		                     {
+			                     return false;
+		                     }
+		                     size_t limit = first.ranged ? std::min(segmentSize, first.total) : first.total;
+		                     if (first.sized ? (dataLen > limit - first.received) :
+		                         !target.allocate(first.received + dataLen))
+		                     {
+			                     return false;
+		                     }
+		                     if (!target.write(first.received, data, dataLen))
+		                     {
+			                     unwritable = true;
+			                     return false;
+		                     }
+		                     first.received += dataLen;
+		                     return true;
+	                     });
+	size_t responseLen = client.send(probe, response);
+	HttpStatus status = response.getStatusCode();
+	if ((responseLen > 0) && !started)
+	{
+		/* The sink takes no empty body, nor one of any other status */
+		start();
+	}
+	std::string url = request.uri.serialize();
+	if (unusable)
+	{
+		throw std::runtime_error("Download failed with status " + std::to_string(static_cast<int>(status)) +
+		                         ": " + url);
+	}
+	if (unwritable)
+	{
+		throw std::runtime_error("Cannot write download of " + url);
+	}
+	if (responseLen == 0)
+	{
+		return false;
+	}
+	if (!first.sized)
+	{
+		first.sized = true;
+		first.total = first.received;
+		if (!target.allocate(first.total))
+		{
+			throw std::runtime_error("Cannot write download of " + url);
+		}
+	}
+	return first.received == (first.ranged ? std::min(segmentSize, first.total) : first.total);
+}
+
+SegmentedDownload::SegmentedDownload(std::shared_ptr<HttpClient> httpClient, DownloadOptions downloadOptions)
+		: client(std::move(httpClient)), options(std::move(downloadOptions))
+{
+	options.segmentSize = std::max<size_t>(options.segmentSize, 1);
+	options.connections = std::max(options.connections, 1U);
+	if (options.connections > 1)
+	{
+		/* Each download() queues at most one task per worker */
+		pool = std::make_unique<WorkStealingPool>(options.connections - 1, options.connections - 1);
+	}
+}
+
+SegmentedDownload::~SegmentedDownload() = default;
+
+size_t SegmentedDownload::download(const HttpRequest &request, DownloadTarget &target)
+{
+	std::string url = request.uri.serialize();
+	FirstSegment first;
+	bool probed = false;
+	for (unsigned int attempt = 0; !probed && (attempt <= options.retries); ++attempt)
+	{
+		probed = fetchFirst(*client, request, options.segmentSize, target, first);
+	}
+	if (!probed)
+	{
+		throw std::runtime_error("Download failed: " + url);
+	}
+	size_t total = first.total;
+	if (!first.ranged)
+	{
+		return total;
+	}
+
+	size_t segments = (total + options.segmentSize - 1) / options.segmentSize;
+	std::vector<bool> done(segments, false);
+	std::string validator = std::move(first.validator);
+	std::unique_ptr<DownloadJournal> journal;
+	/* Without a validator a changed object could not be told apart, so there is nothing to resume. A target that
+	 * starts empty would leave the skipped segments zero. */
+	if (!options.journal.empty() && !validator.empty() && target.isPersistent())
+	{
+		journal = std::make_unique<DownloadJournal>(
+				options.journal, "lwhttp-download " + url + " " + std::to_string(total) + " " +
+				                 std::to_string(options.segmentSize) + " " + validator);
+		journal->resume(done);
+		journal->finished(0);
+	}
+
+	std::atomic<size_t> nextSegment{1};
+	std::atomic<bool> failed{false};
+	std::mutex errorMutex;
+	std::string error;
+	auto worker = [&]()
+	{
+		size_t segment;
+		while (!failed.load(std::memory_order_relaxed) && ((segment = nextSegment++) < segments))
+		{
+			if (done[segment])
+			{
+				continue;
+			}
+			size_t offset = segment * options.segmentSize;
+			size_t len = std::min(options.segmentSize, total - offset);
+			size_t received = 0;
+			bool fetched = false;
+			try
+			{
+				for (unsigned int attempt = 0; !fetched && (attempt <= options.retries); ++attempt)
+				{
+					fetched = fetchRange(*client, request, validator, offset, len, target, received);
+				}
+				if (!fetched)
+				{
+					throw std::runtime_error("Segment at " + std::to_string(offset) + " failed: " + url);
+				}
+			}
+			catch (std::exception &e)
+			{
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!failed.exchange(true))
+				{
+					error = e.what();
+				}
+				return;
+			}
+			if (journal != nullptr)
+			{
+				journal->finished(segment);
+			}
+		}
+	};
+	/* The caller takes a share of the segments itself */
+	size_t helpers = (pool == nullptr) ? 0 : std::min<size_t>(pool->size(), std::max<size_t>(segments, 2) - 2);
+	std::mutex helperMutex;
+	std::condition_variable helperDone;
+	size_t running = 0;
+	for (size_t i = 0; i < helpers; ++i)
+	{
+		std::lock_guard<std::mutex> lock(helperMutex);
+		running += pool->submit([&]()
+		                        {
+			                        worker();
+			                        std::lock_guard<std::mutex> doneLock(helperMutex);
+			                        --running;
+			                        helperDone.notify_all();
+		                        }) ? 1 : 0;
+	}
+	worker();
+	{
+		std::unique_lock<std::mutex> lock(helperMutex);
+		helperDone.wait(lock, [&running]()
+		{
+			return running == 0;
+		});
+	}
+	if (failed)
+	{
+		throw std::runtime_error(error);
+	}
+	if (journal != nullptr)
+	{
+		journal->remove();
+	}
+	return total;
+}
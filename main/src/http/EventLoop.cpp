@@ -0,0 +1,1003 @@
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+
+#include "../../include/http/HttpRequest.h"
+#include "../../include/http/HttpResponse.h"
+#include "EventLoop.h"
+
+/************************** EventLoop ************************/
+static constexpr int MAX_EVENTS = 64;
+/* The loop the calling thread runs, if it is a loop thread */
+static thread_local EventLoop *threadLoop = nullptr;
+
+EventLoop::EventLoop(unsigned int loopIndex, int cpuIndex, EventLoopGroup *owner)
+		: index(loopIndex), cpu(cpuIndex), group(owner)
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if ((epollFd < 0) || (wakeFd < 0) || (0 != epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event)))
+	{
+		std::string error = strerror(errno);
+		if (wakeFd >= 0)
+		{
+			close(wakeFd);
+		}
+		if (epollFd >= 0)
+		{
+			close(epollFd);
+		}
+		throw std::runtime_error("Event loop creation failed: " + error);
+	}
+	thread = std::thread(&EventLoop::run, this);
+}
+
+EventLoop::~EventLoop()
+{
+	execute([this]()
+	        { running.store(false, std::memory_order_relaxed); });
+	thread.join();
+	close(wakeFd);
+	close(epollFd);
+}
+
+void EventLoop::execute(Task task)
+{
+	tasks.push(std::move(task));
+	if (inLoopThread())
+	{
+		localPending = true;
+		return;
+	}
+	/* Sequentially consistent with the push and with run() clearing the flag before it drains the queue, so
+	 * either this producer writes the eventfd or the drain sees its task */
+	if (!wakeupPending.exchange(true))
+	{
+		uint64_t one = 1;
+		while ((write(wakeFd, &one, sizeof(one)) < 0) && (errno == EINTR))
+		{
+		}
+	}
+}
+
+bool EventLoop::watch(int fd, uint32_t events, IoHandler *handler)
+{
+	epoll_event event{};
+	event.events = events;
+	event.data.ptr = handler;
+	return 0 == epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+bool EventLoop::modify(int fd, uint32_t events, IoHandler *handler)
+{
+	epoll_event event{};
+	event.events = events;
+	event.data.ptr = handler;
+	return 0 == epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void EventLoop::unwatch(int fd)
+{
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+EventLoop::Deadline EventLoop::schedule(Clock::time_point deadline, IoHandler *handler)
+{
+	return deadlines.emplace(deadline, handler);
+}
+
+void EventLoop::cancel(Deadline deadline)
+{
+	deadlines.erase(deadline);
+}
+
+void EventLoop::retire(IoHandler *handler)
+{
+	retired.push_back(handler);
+}
+
+bool EventLoop::resolve(Task lookup, Task done)
+{
+	if ((group == nullptr) || stopping)
+	{
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(lookupMutex);
+		++lookups;
+	}
+	bool queued = group->submitLookup([this, lookup = std::move(lookup), done = std::move(done)]() mutable
+	                                  {
+		                                  lookup();
+		                                  execute(std::move(done));
+		                                  std::lock_guard<std::mutex> lock(lookupMutex);
+		                                  if (--lookups == 0)
+		                                  {
+			                                  lookupDone.notify_all();
+		                                  }
+	                                  });
+	if (!queued)
+	{
+		std::lock_guard<std::mutex> lock(lookupMutex);
+		--lookups;
+	}
+	return queued;
+}
+
+void EventLoop::awaitLookups()
+{
+	std::unique_lock<std::mutex> lock(lookupMutex);
+	lookupDone.wait(lock, [this]()
+	{ return lookups == 0; });
+}
+
+std::unique_ptr<Connection> EventLoop::acquire(const std::string &origin)
+{
+	auto iter = idleMap.find(origin);
+	if (iter == idleMap.end())
+	{
+		return nullptr;
+	}
+	auto &idle = iter->second;
+	std::unique_ptr<Connection> connection;
+	while (!idle.empty() && (connection == nullptr))
+	{
+		connection = std::move(idle.back());
+		idle.pop_back();
+		if (!connection->isAlive())
+		{
+			connection.reset();
+		}
+	}
+	std::lock_guard<std::mutex> lock(countMutex);
+	auto count = countMap.try_emplace(origin).first;
+	count->second.idle = idle.size();
+	count->second.active += (connection != nullptr) ? 1 : 0;
+	if ((count->second.active == 0) && (count->second.idle == 0))
+	{
+		countMap.erase(count);
+	}
+	return connection;
+}
+
+void EventLoop::release(const std::string &origin, std::unique_ptr<Connection> connection)
+{
+	auto &idle = idleMap[origin];
+	if (idle.size() < MAX_IDLE_PER_ORIGIN)
+	{
+		idle.push_back(std::move(connection));
+	}
+	std::lock_guard<std::mutex> lock(countMutex);
+	OriginConnections &count = countMap[origin];
+	count.idle = idle.size();
+	--count.active;
+}
+
+void EventLoop::opened(const std::string &origin)
+{
+	std::lock_guard<std::mutex> lock(countMutex);
+	++countMap[origin].active;
+}
+
+void EventLoop::closed(const std::string &origin)
+{
+	std::lock_guard<std::mutex> lock(countMutex);
+	auto iter = countMap.find(origin);
+	if ((--iter->second.active == 0) && (iter->second.idle == 0))
+	{
+		countMap.erase(iter);
+	}
+}
+
+void EventLoop::collect(std::vector<OriginConnections> &connections, size_t first) const
+{
+	std::lock_guard<std::mutex> lock(countMutex);
+	for (const auto &item: countMap)
+	{
+		auto iter = std::find_if(connections.begin() + static_cast<long>(first), connections.end(),
+		                         [&item](const OriginConnections &origin)
+		                         { return origin.origin == item.first; });
+		if (iter == connections.end())
+		{
+			connections.push_back(OriginConnections{item.first, 0, 0});
+			iter = connections.end() - 1;
+		}
+		iter->active += item.second.active;
+		iter->idle += item.second.idle;
+	}
+}
+
+void EventLoop::runTasks()
+{
+	Task task;
+	while (tasks.pop(task))
+	{
+		task();
+	}
+}
+
+void EventLoop::expireDeadlines()
+{
+	Clock::time_point now = Clock::now();
+	while (!deadlines.empty() && (deadlines.begin()->first <= now))
+	{
+		IoHandler *handler = deadlines.begin()->second;
+		deadlines.erase(deadlines.begin());
+		handler->onTimeout();
+	}
+}
+
+void EventLoop::reap()
+{
+	for (IoHandler *handler: retired)
+	{
+		delete handler;
+	}
+	retired.clear();
+}
+
+void EventLoop::run()
+{
+	if (cpu >= 0)
+	{
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(cpu, &cpuSet);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+	}
+	/* Everything the loop allocates from here on is first touched on its own CPU, and so its own NUMA node */
+	threadId.store(std::this_thread::get_id(), std::memory_order_release);
+	threadLoop = this;
+
+	epoll_event events[MAX_EVENTS];
+	while (running.load(std::memory_order_relaxed))
+	{
+		int timeout = -1;
+		if (localPending)
+		{
+			timeout = 0;
+		}
+		else if (!deadlines.empty())
+		{
+			auto wait = std::chrono::ceil<std::chrono::milliseconds>(deadlines.begin()->first - Clock::now());
+			timeout = static_cast<int>(std::max<std::chrono::milliseconds::rep>(wait.count(), 0));
+		}
+		int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+		if ((count < 0) && (errno != EINTR))
+		{
+#ifdef _DEBUG
+			printf("%s:%d epoll_wait failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+			break;
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			auto *handler = static_cast<IoHandler *>(events[i].data.ptr);
+			if (handler == nullptr)
+			{
+				uint64_t value;
+				while ((read(wakeFd, &value, sizeof(value)) < 0) && (errno == EINTR))
+				{
+				}
+				wakeupPending.store(false);
+				runTasks();
+			}
+			else if (retired.empty() || (std::find(retired.begin(), retired.end(), handler) == retired.end()))
+			{
+				handler->onEvents(events[i].events);
+			}
+		}
+		if (localPending)
+		{
+			localPending = false;
+			runTasks();
+		}
+		expireDeadlines();
+		reap();
+	}
+
+	/* Whatever is still in flight fails on the loop thread, its handler may not touch the loop any more. A call
+	 * waiting for its host lookup gets the answer first. */
+	stopping = true;
+	awaitLookups();
+	runTasks();
+	while (!deadlines.empty())
+	{
+		IoHandler *handler = deadlines.begin()->second;
+		deadlines.erase(deadlines.begin());
+		handler->onTimeout();
+	}
+	reap();
+	idleMap.clear();
+	std::lock_guard<std::mutex> lock(countMutex);
+	countMap.clear();
+}
+
+/*********************** EventLoopGroup **********************/
+/* NUMA node of cpu from sysfs, -1 if the kernel does not tell */
+static int nodeOfCpu(int cpu)
+{
+	std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+	DIR *dir = opendir(path.c_str());
+	if (dir == nullptr)
+	{
+		return -1;
+	}
+	int node = -1;
+	while (dirent *entry = readdir(dir))
+	{
+		if ((0 == strncmp(entry->d_name, "node", 4)) && isdigit(static_cast<unsigned char>(entry->d_name[4])))
+		{
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+EventLoopGroup::EventLoopGroup(unsigned int threads, bool pin)
+{
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	std::vector<std::vector<int>> nodeCpus;
+	if (0 == sched_getaffinity(0, sizeof(cpuSet), &cpuSet))
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &cpuSet))
+			{
+				auto node = static_cast<size_t>(std::max(nodeOfCpu(cpu), 0));
+				if (static_cast<size_t>(cpu) >= cpuNodes.size())
+				{
+					cpuNodes.resize(cpu + 1, -1);
+				}
+				cpuNodes[cpu] = static_cast<int>(node);
+				if (node >= nodeCpus.size())
+				{
+					nodeCpus.resize(node + 1);
+				}
+				nodeCpus[node].push_back(cpu);
+			}
+		}
+	}
+	/* Round robin over the nodes, so a group smaller than the machine still spreads over all of them */
+	std::vector<std::pair<int, int>> order;
+	for (size_t round = 0; order.size() < static_cast<size_t>(CPU_COUNT(&cpuSet)); ++round)
+	{
+		for (size_t node = 0; node < nodeCpus.size(); ++node)
+		{
+			if (round < nodeCpus[node].size())
+			{
+				order.emplace_back(nodeCpus[node][round], static_cast<int>(node));
+			}
+		}
+	}
+	if (threads == 0)
+	{
+		threads = std::max<unsigned int>(static_cast<unsigned int>(order.size()), 1);
+	}
+	for (unsigned int i = 0; i < threads; ++i)
+	{
+		bool pinned = pin && !order.empty();
+		int cpu = pinned ? order[i % order.size()].first : -1;
+		loops.push_back(std::make_unique<EventLoop>(i, cpu, this));
+		loopNodes.push_back(pinned ? order[i % order.size()].second : -1);
+	}
+}
+
+EventLoop &EventLoopGroup::next()
+{
+	if (threadLoop != nullptr)
+	{
+		for (auto &loop: loops)
+		{
+			if (loop.get() == threadLoop)
+			{
+				return *loop;
+			}
+		}
+	}
+	/* Round robin, the first loop from there on that runs on the caller's node if there is one */
+	size_t start = nextLoop.fetch_add(1, std::memory_order_relaxed);
+	int cpu = sched_getcpu();
+	int node = ((cpu >= 0) && (static_cast<size_t>(cpu) < cpuNodes.size())) ? cpuNodes[cpu] : -1;
+	for (size_t i = 0; i < loops.size(); ++i)
+	{
+		size_t candidate = (start + i) % loops.size();
+		if (loopNodes[candidate] == node)
+		{
+			return *loops[candidate];
+		}
+	}
+	return *loops[start % loops.size()];
+}
+
+void EventLoopGroup::collect(std::vector<OriginConnections> &connections, size_t first) const
+{
+	for (const auto &loop: loops)
+	{
+		loop->collect(connections, first);
+	}
+}
+
+bool EventLoopGroup::submitLookup(EventLoop::Task lookup)
+{
+	std::call_once(resolverOnce, [this]()
+	{
+		resolver = std::make_unique<WorkStealingPool>(RESOLVER_THREADS, RESOLVER_QUEUE_LIMIT);
+	});
+	return resolver->submit(std::move(lookup));
+}
+
+/********************* Asynchronous exchange *****************/
+/* One request on a loop: connect (and shake hands) or take an idle connection, write, read, then hand the
+ * response over */
+class AsyncExchange : public IoHandler
+{
+public:
+	AsyncExchange(EventLoop &eventLoop, HttpRequest httpRequest, std::shared_ptr<const HttpClientConfig> clientConfig,
+	              const TLSContext *context, std::shared_ptr<HttpMetrics> httpMetrics,
+	              HttpClient::ResponseHandler responseHandler)
+			: loop(eventLoop), request(std::move(httpRequest)), config(std::move(clientConfig)), tlsContext(context),
+			  metrics(std::move(httpMetrics)), handler(std::move(responseHandler)),
+			  trace{request, response.getTiming(), config->listener.get(), metrics.get()}
+	{
+	}
+
+	void setBodySink(HttpResponse::BodySink sink)
+	{
+		response.setBodySink(std::move(sink));
+	}
+
+	void start();
+
+	void onEvents(uint32_t events) override;
+
+	void onTimeout() override;
+
+private:
+	enum class State
+	{
+		RESOLVING,
+		CONNECTING,
+		HANDSHAKING,
+		WRITING,
+		READING
+	};
+
+	/* Connects, after a lookup on the resolvers of the loop if the host is not cached */
+	void open();
+
+	/* The lookup of open() is done */
+	void resolved();
+
+	void connectWith(SocketHandle socketHandle);
+
+	void interest(uint32_t events);
+
+	void handshake();
+
+	void beginWrite();
+
+	void writeSome();
+
+	void writeTls();
+
+	void readSome();
+
+	/* Like recv(2), -1 with errno EAGAIN once it has to wait */
+	long receive(char *buffer, size_t len);
+
+	/* A reused connection that fails before any response byte is retried once on a new one, see
+	 * RequestTrace::mayResend() */
+	void fail();
+
+	void complete(size_t len, bool keepAlive);
+
+private:
+	EventLoop &loop;
+	HttpRequest request;
+	std::shared_ptr<const HttpClientConfig> config;
+	/* Null for plain HTTP */
+	const TLSContext *tlsContext;
+	std::shared_ptr<HttpMetrics> metrics;
+	HttpClient::ResponseHandler handler;
+	HttpResponse response;
+	RequestTrace trace;
+	std::string origin;
+	std::unique_ptr<Connection> connection;
+	/* connection when it is a TLS one */
+	AsyncTlsConnection *tlsConnection = nullptr;
+	std::unique_ptr<ResponseReader> reader;
+	Buffer output;
+	IoSlice slices[2]{};
+	size_t sliceCount = 0;
+	size_t sliceIndex = 0;
+	size_t sliceOffset = 0;
+	State state = State::CONNECTING;
+	uint32_t watchedEvents = 0;
+	/* A read had to send first (e.g. a TLS key update) and waits for the socket to become writable */
+	bool readWaitsWrite = false;
+	bool watched = false;
+	bool reused = false;
+	/* Written by the lookup, read on the loop once its done task runs */
+	bool hostFound = false;
+	/* Failed while its lookup ran, resolved() retires it */
+	bool abandoned = false;
+	EventLoop::Deadline deadline;
+	bool scheduled = false;
+};
+
+void AsyncExchange::start()
+{
+	trace.timing = RequestTiming{};
+	trace.mark(HttpEvent::CALL_START, trace.timing.start);
+	deadline = loop.schedule(EventLoop::Clock::now() + std::chrono::seconds(config->timeout), this);
+	scheduled = true;
+
+	request.appendRequestLineTo(output);
+	request.header.appendTo(output, "user-agent", config->userAgent);
+	slices[sliceCount++] = IoSlice{output.data(), output.size()};
+	if ((request.body != nullptr) && (request.body->getBodyLength() > 0))
+	{
+		slices[sliceCount++] = IoSlice{request.body->getContent(), request.body->getBodyLength()};
+	}
+
+	origin = request.uri.getOrigin();
+	connection = loop.acquire(origin);
+	reused = (connection != nullptr);
+	if (reused)
+	{
+		tlsConnection = (tlsContext != nullptr) ? static_cast<AsyncTlsConnection *>(connection.get()) : nullptr;
+		trace.timing.connectionReused = true;
+		trace.count(MetricCounter::POOL_HITS);
+		trace.notify(HttpEvent::CONNECTION_ACQUIRED);
+		beginWrite();
+	}
+	else
+	{
+		trace.count(MetricCounter::POOL_MISSES);
+		open();
+	}
+}
+
+void AsyncExchange::open()
+{
+	if (!needsLookup(request.uri, config->unixSocket))
+	{
+		connectWith(createSocket(request.uri, config->unixSocket, true, &trace));
+		return;
+	}
+	/* getaddrinfo would block every connection of the loop, so a lookup that cannot be queued fails the call */
+	std::string host(request.uri.getHost());
+	if (!loop.resolve([this, host]()
+	                  { hostFound = lookupHost(host); }, [this]()
+	                  { resolved(); }))
+	{
+		complete(0, false);
+		return;
+	}
+	trace.mark(HttpEvent::DNS_START, trace.timing.dnsStart);
+	trace.count(MetricCounter::DNS_CACHE_MISSES);
+	state = State::RESOLVING;
+}
+
+void AsyncExchange::resolved()
+{
+	if (abandoned)
+	{
+		loop.retire(this);
+		return;
+	}
+	trace.mark(HttpEvent::DNS_END, trace.timing.dnsEnd);
+	if (!hostFound)
+	{
+		complete(0, false);
+		return;
+	}
+	state = State::CONNECTING;
+	trace.mark(HttpEvent::CONNECT_START, trace.timing.connectStart);
+	connectWith(createSocket(request.uri, config->unixSocket, true, nullptr));
+}
+
+void AsyncExchange::connectWith(SocketHandle socketHandle)
+{
+	if (socketHandle == INVALID_FD)
+	{
+		complete(0, false);
+		return;
+	}
+#ifdef SO_INCOMING_CPU
+	/* Steer the connection's receive processing to the CPU of its loop */
+	int cpu = loop.getCpu();
+	if (cpu >= 0)
+	{
+		setsockopt(socketHandle, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+	}
+#endif
+	if (tlsContext != nullptr)
+	{
+		SSL *ssl = tlsContext->newSSL(origin);
+		if (ssl == nullptr)
+		{
+			closeSocket(socketHandle);
+			complete(0, false);
+			return;
+		}
+		std::string host(request.uri.getHost());
+		SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, const_cast<char *>(host.c_str()));
+		auto tls = std::make_unique<AsyncTlsConnection>(socketHandle, ssl, config->timeout);
+		tlsConnection = tls.get();
+		connection = std::move(tls);
+	}
+	else
+	{
+		connection = std::make_unique<PlainConnection>(socketHandle);
+	}
+	loop.opened(origin);
+	state = State::CONNECTING;
+	interest(EPOLLOUT);
+}
+
+void AsyncExchange::interest(uint32_t events)
+{
+	if (watched)
+	{
+		if (events != watchedEvents)
+		{
+			loop.modify(connection->getHandle(), events, this);
+		}
+	}
+	else
+	{
+		watched = loop.watch(connection->getHandle(), events, this);
+	}
+	watchedEvents = events;
+}
+
+void AsyncExchange::handshake()
+{
+	switch (tlsConnection->handshake())
+	{
+		case AsyncTlsConnection::IoStatus::DONE:
+			traceHandshake(tlsConnection->getSSL(), trace);
+			beginWrite();
+			break;
+		case AsyncTlsConnection::IoStatus::WANT_READ:
+			interest(EPOLLIN);
+			break;
+		case AsyncTlsConnection::IoStatus::WANT_WRITE:
+			interest(EPOLLOUT);
+			break;
+		default:
+			complete(0, false);
+			break;
+	}
+}
+
+void AsyncExchange::beginWrite()
+{
+	size_t total = 0;
+	for (size_t i = 0; i < sliceCount; ++i)
+	{
+		total += slices[i].len;
+	}
+	trace.count(MetricCounter::BYTES_SENT, total);
+	sliceIndex = 0;
+	sliceOffset = 0;
+	state = State::WRITING;
+	writeSome();
+}
+
+void AsyncExchange::writeSome()
+{
+	if (tlsConnection != nullptr)
+	{
+		writeTls();
+		return;
+	}
+	while (sliceIndex < sliceCount)
+	{
+		iovec vectors[2];
+		size_t vectorCount = 0;
+		for (size_t i = sliceIndex; i < sliceCount; ++i)
+		{
+			size_t skip = (i == sliceIndex) ? sliceOffset : 0;
+			vectors[vectorCount].iov_base = const_cast<char *>(slices[i].data + skip);
+			vectors[vectorCount].iov_len = slices[i].len - skip;
+			++vectorCount;
+		}
+		msghdr message{};
+		message.msg_iov = vectors;
+		message.msg_iovlen = vectorCount;
+		long sendLen = ::sendmsg(connection->getHandle(), &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sendLen < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				interest(EPOLLOUT);
+				return;
+			}
+#ifdef _DEBUG
+			printf("%s:%d sendmsg failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+			fail();
+			return;
+		}
+		auto remain = static_cast<size_t>(sendLen);
+		while ((sliceIndex < sliceCount) && (remain >= slices[sliceIndex].len - sliceOffset))
+		{
+			remain -= slices[sliceIndex].len - sliceOffset;
+			sliceOffset = 0;
+			++sliceIndex;
+		}
+		sliceOffset += remain;
+	}
+	trace.mark(HttpEvent::REQUEST_WRITTEN, trace.timing.requestWritten);
+	reader = std::make_unique<ResponseReader>(trace, response);
+	state = State::READING;
+	interest(EPOLLIN | EPOLLRDHUP);
+}
+
+void AsyncExchange::writeTls()
+{
+	while (true)
+	{
+		/* Past the last slice only what is left in the BIO pair goes out */
+		bool flushing = sliceIndex == sliceCount;
+		size_t written = 0;
+		AsyncTlsConnection::IoStatus status = flushing ? tlsConnection->writeSome(nullptr, 0, written) :
+		                                      tlsConnection->writeSome(slices[sliceIndex].data + sliceOffset,
+		                                                               slices[sliceIndex].len - sliceOffset, written);
+		sliceOffset += written;
+		if (!flushing && (sliceOffset == slices[sliceIndex].len))
+		{
+			sliceOffset = 0;
+			++sliceIndex;
+		}
+		if ((status == AsyncTlsConnection::IoStatus::WANT_READ) || (status == AsyncTlsConnection::IoStatus::WANT_WRITE))
+		{
+			interest((status == AsyncTlsConnection::IoStatus::WANT_READ) ? EPOLLIN : EPOLLOUT);
+			return;
+		}
+		if (status != AsyncTlsConnection::IoStatus::DONE)
+		{
+			fail();
+			return;
+		}
+		if (flushing)
+		{
+			break;
+		}
+	}
+	trace.mark(HttpEvent::REQUEST_WRITTEN, trace.timing.requestWritten);
+	reader = std::make_unique<ResponseReader>(trace, response);
+	state = State::READING;
+	interest(EPOLLIN | EPOLLRDHUP);
+}
+
+long AsyncExchange::receive(char *buffer, size_t len)
+{
+	if (tlsConnection == nullptr)
+	{
+		return ::recv(connection->getHandle(), buffer, len, MSG_DONTWAIT);
+	}
+	size_t readLen = 0;
+	readWaitsWrite = false;
+	switch (tlsConnection->readSome(buffer, len, readLen))
+	{
+		case AsyncTlsConnection::IoStatus::DONE:
+			return static_cast<long>(readLen);
+		case AsyncTlsConnection::IoStatus::CLOSED:
+			return 0;
+		case AsyncTlsConnection::IoStatus::WANT_WRITE:
+			readWaitsWrite = true;
+			errno = EAGAIN;
+			return -1;
+		case AsyncTlsConnection::IoStatus::WANT_READ:
+			errno = EAGAIN;
+			return -1;
+		default:
+			errno = EIO;
+			return -1;
+	}
+}
+
+void AsyncExchange::readSome()
+{
+	try
+	{
+		while (true)
+		{
+			char *space = reader->space();
+			long readLen = receive(space, reader->spaceLen());
+			if (readLen < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				{
+					interest(readWaitsWrite ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP) : (EPOLLIN | EPOLLRDHUP));
+					return;
+				}
+#ifdef _DEBUG
+				printf("%s:%d recv failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+#endif
+				fail();
+				return;
+			}
+			if (readLen == 0)
+			{
+				if (reader->empty())
+				{
+					fail();
+					return;
+				}
+				reader->closed();
+				break;
+			}
+			if (reader->consume(static_cast<size_t>(readLen)))
+			{
+				break;
+			}
+		}
+	}
+	catch (std::exception &e)
+	{
+#ifdef _DEBUG
+		printf("%s:%d bad response: %s\n", __func__, __LINE__, e.what());
+#endif
+		complete(0, false);
+		return;
+	}
+	bool keepAlive = false;
+	size_t len = reader->finish(keepAlive);
+	complete(len, keepAlive);
+}
+
+void AsyncExchange::onEvents(uint32_t events)
+{
+	switch (state)
+	{
+		case State::RESOLVING:
+			break;
+		case State::CONNECTING:
+		{
+			int error = 0;
+			socklen_t len = sizeof(error);
+			if ((0 != getsockopt(connection->getHandle(), SOL_SOCKET, SO_ERROR, &error, &len)) || (error != 0))
+			{
+#ifdef _DEBUG
+				printf("%s:%d connect failed: %s(%d)\n", __func__, __LINE__, strerror(error), error);
+#endif
+				complete(0, false);
+				return;
+			}
+			trace.mark(HttpEvent::CONNECT_END, trace.timing.connectEnd);
+			if (tlsConnection != nullptr)
+			{
+				trace.mark(HttpEvent::TLS_START, trace.timing.tlsStart);
+				state = State::HANDSHAKING;
+				handshake();
+				break;
+			}
+			beginWrite();
+			break;
+		}
+		case State::HANDSHAKING:
+			handshake();
+			break;
+		case State::WRITING:
+			writeSome();
+			break;
+		case State::READING:
+			readSome();
+			break;
+	}
+}
+
+void AsyncExchange::onTimeout()
+{
+	scheduled = false;
+	complete(0, false);
+}
+
+void AsyncExchange::fail()
+{
+	if (!reused || !trace.mayResend())
+	{
+		complete(0, false);
+		return;
+	}
+	/* The server may close an idle connection at any time */
+	reused = false;
+	trace.timing.connectionReused = false;
+	trace.timing.requestWritten = RequestTiming::Clock::time_point{};
+	if (watched)
+	{
+		loop.unwatch(connection->getHandle());
+		watched = false;
+	}
+	connection.reset();
+	loop.closed(origin);
+	tlsConnection = nullptr;
+	reader.reset();
+	open();
+}
+
+void AsyncExchange::complete(size_t len, bool keepAlive)
+{
+	if (watched)
+	{
+		loop.unwatch(connection->getHandle());
+		watched = false;
+	}
+	if (scheduled)
+	{
+		loop.cancel(deadline);
+		scheduled = false;
+	}
+	if ((len > 0) && keepAlive)
+	{
+		loop.release(origin, std::move(connection));
+	}
+	else if (connection != nullptr)
+	{
+		connection.reset();
+		loop.closed(origin);
+	}
+	tlsConnection = nullptr;
+	trace.finish(response, len);
+	try
+	{
+		handler(len, response);
+	}
+	catch (std::exception &e)
+	{
+#ifdef _DEBUG
+		printf("%s:%d response handler threw: %s\n", __func__, __LINE__, e.what());
+#endif
+	}
+	/* The lookup still refers to it */
+	if (state == State::RESOLVING)
+	{
+		abandoned = true;
+		return;
+	}
+	loop.retire(this);
+}
+
+void exchangeAsync(EventLoop &loop, HttpRequest request, std::shared_ptr<const HttpClientConfig> config,
+                   const TLSContext *tlsContext, std::shared_ptr<HttpMetrics> metrics, HttpResponse::BodySink sink,
+                   HttpClient::ResponseHandler handler)
+{
+	auto *call = new AsyncExchange(loop, std::move(request), std::move(config), tlsContext, std::move(metrics),
+	                               std::move(handler));
+	call->setBodySink(std::move(sink));
+	call->start();
+}
+
+#endif
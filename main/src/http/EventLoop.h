@@ -0,0 +1,293 @@
+#ifndef LWHTTP_EVENTLOOP_H
+#define LWHTTP_EVENTLOOP_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Connection.h"
+#include "WorkStealingPool.h"
+
+class EventLoopGroup;
+
+/************************* MpscQueue *************************/
+/* Vyukov's intrusive multi-producer single-consumer queue. A push is one atomic exchange, producers and the
+ * consumer work on different cache lines. */
+template<typename T>
+class MpscQueue
+{
+public:
+	MpscQueue() : head(&stub), tail(&stub)
+	{
+	}
+
+	MpscQueue(const MpscQueue &other) = delete;
+
+	MpscQueue &operator=(const MpscQueue &other) = delete;
+
+	~MpscQueue()
+	{
+		T value;
+		while (pop(value))
+		{
+		}
+	}
+
+	/* From any thread */
+	void push(T value)
+	{
+		auto *node = new Node{{nullptr}, std::move(value)};
+		/* Sequentially consistent with the wakeup flag, see EventLoop::execute */
+		Node *prev = head.exchange(node);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	/* From the consumer thread only. A push that already swung the head is waited for, so nothing pushed
+	 * before the call is missed. */
+	bool pop(T &value)
+	{
+		Node *first = tail;
+		Node *next = first->next.load(std::memory_order_acquire);
+		if (first == &stub)
+		{
+			if (next == nullptr)
+			{
+				if (head.load() == &stub)
+				{
+					return false;
+				}
+				next = waitNext(first);
+			}
+			tail = next;
+			first = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next == nullptr)
+		{
+			if (head.load() != first)
+			{
+				next = waitNext(first);
+			}
+			else
+			{
+				/* first is the last node, put the stub behind it so that it can be taken */
+				stub.next.store(nullptr, std::memory_order_relaxed);
+				Node *prev = head.exchange(&stub);
+				prev->next.store(&stub, std::memory_order_release);
+				next = waitNext(first);
+			}
+		}
+		tail = next;
+		value = std::move(first->value);
+		delete first;
+		return true;
+	}
+
+private:
+	struct Node
+	{
+		std::atomic<Node *> next;
+		T value;
+	};
+
+	static Node *waitNext(Node *node)
+	{
+		Node *next;
+		while ((next = node->next.load(std::memory_order_acquire)) == nullptr)
+		{
+			std::this_thread::yield();
+		}
+		return next;
+	}
+
+private:
+	alignas(64) std::atomic<Node *> head;
+	alignas(64) Node *tail;
+	Node stub{{nullptr}, T{}};
+};
+
+/************************** IoHandler ************************/
+/* Owner of a descriptor watched by an event loop, called on the loop thread */
+class IoHandler
+{
+public:
+	virtual ~IoHandler() = default;
+
+	/* events is the EPOLL* mask that became ready */
+	virtual void onEvents(uint32_t events) = 0;
+
+	/* The deadline set with EventLoop::schedule passed, it is no longer scheduled */
+	virtual void onTimeout() = 0;
+};
+
+/************************** EventLoop ************************/
+/* One epoll reactor on its own thread. Other threads only hand it tasks through a lock-free queue and wake it
+ * with an eventfd, everything else (descriptors, timers, idle connections) belongs to the loop thread. */
+class EventLoop
+{
+public:
+	using Clock = std::chrono::steady_clock;
+	using Task = std::function<void()>;
+	using Deadline = std::multimap<Clock::time_point, IoHandler *>::iterator;
+
+	/* cpu is the CPU the thread is pinned to, or -1. Host lookups run on the resolvers of owner, a loop without
+	 * one has none. */
+	EventLoop(unsigned int loopIndex, int cpu, EventLoopGroup *owner = nullptr);
+
+	EventLoop(const EventLoop &other) = delete;
+
+	EventLoop &operator=(const EventLoop &other) = delete;
+
+	/* Stops the thread, handlers still registered get their onTimeout() on the loop thread first */
+	~EventLoop();
+
+	/* Runs task on the loop thread, from any thread. On the loop thread it runs after the current events, never
+	 * inline. Tasks still queued when the loop stops run before the handlers in flight fail. */
+	void execute(Task task);
+
+	[[nodiscard]] bool inLoopThread() const
+	{
+		return std::this_thread::get_id() == threadId.load(std::memory_order_acquire);
+	}
+
+	[[nodiscard]] unsigned int getIndex() const
+	{
+		return index;
+	}
+
+	[[nodiscard]] int getCpu() const
+	{
+		return cpu;
+	}
+
+	/* The calls below are for the loop thread only */
+	bool watch(int fd, uint32_t events, IoHandler *handler);
+
+	bool modify(int fd, uint32_t events, IoHandler *handler);
+
+	void unwatch(int fd);
+
+	Deadline schedule(Clock::time_point deadline, IoHandler *handler);
+
+	void cancel(Deadline deadline);
+
+	/* Deletes handler once the events at hand are dispatched, it gets no further calls */
+	void retire(IoHandler *handler);
+
+	/* Runs lookup on a resolver thread and then done on this loop, which does not stop in between. Returns false,
+	 * running neither, if there are no resolvers, they are busy or the loop is stopping. */
+	bool resolve(Task lookup, Task done);
+
+	/* Idle keep-alive connections of this loop, never shared with another thread. An acquired connection counts as
+	 * in use until it is released or closed(). */
+	std::unique_ptr<Connection> acquire(const std::string &origin);
+
+	void release(const std::string &origin, std::unique_ptr<Connection> connection);
+
+	/* A new connection to origin is in use */
+	void opened(const std::string &origin);
+
+	/* A connection in use was closed instead of released */
+	void closed(const std::string &origin);
+
+	/* Adds the connections in use and idle per origin to those of connections from index first on. From any
+	 * thread. */
+	void collect(std::vector<OriginConnections> &connections, size_t first) const;
+
+	static constexpr size_t MAX_IDLE_PER_ORIGIN = 64;
+
+private:
+	void run();
+
+	void runTasks();
+
+	void expireDeadlines();
+
+	void reap();
+
+	/* Lets the lookups still running post their done task */
+	void awaitLookups();
+
+private:
+	unsigned int index;
+	int cpu;
+	EventLoopGroup *group;
+	int epollFd = -1;
+	int wakeFd = -1;
+	std::atomic<bool> running{true};
+	/* Set by the producer that writes the eventfd, so a burst of submissions costs one write */
+	alignas(64) std::atomic<bool> wakeupPending{false};
+	MpscQueue<Task> tasks;
+	/* Tasks queued by the loop thread itself, they need no wakeup */
+	bool localPending = false;
+	std::multimap<Clock::time_point, IoHandler *> deadlines;
+	std::vector<IoHandler *> retired;
+	/* Set on the loop thread once it stopped, resolve() refuses from then on */
+	bool stopping = false;
+	std::mutex lookupMutex;
+	std::condition_variable lookupDone;
+	size_t lookups = 0;
+	std::unordered_map<std::string, std::vector<std::unique_ptr<Connection>>> idleMap;
+	/* What collect() reports, idleMap is for the loop thread only */
+	mutable std::mutex countMutex;
+	std::unordered_map<std::string, OriginConnections> countMap;
+	std::atomic<std::thread::id> threadId{};
+	std::thread thread;
+};
+
+/*********************** EventLoopGroup **********************/
+/* N loops, by default one per CPU the process may run on. Pinned loops take the CPUs in an order that
+ * alternates between NUMA nodes, and the exchanges of a submitting thread spread over the loops of its own node. */
+class EventLoopGroup
+{
+public:
+	/* threads == 0 starts one loop per usable CPU */
+	EventLoopGroup(unsigned int threads, bool pin);
+
+	/* The loop a new exchange of the calling thread goes to: its own loop on a loop thread, otherwise the loops
+	 * take turns, those on the caller's NUMA node first */
+	EventLoop &next();
+
+	[[nodiscard]] size_t size() const
+	{
+		return loops.size();
+	}
+
+	/* Queues a blocking host lookup, false if RESOLVER_QUEUE_LIMIT lookups are already waiting */
+	bool submitLookup(EventLoop::Task lookup);
+
+	/* EventLoop::collect() of every loop */
+	void collect(std::vector<OriginConnections> &connections, size_t first) const;
+
+	static constexpr unsigned int RESOLVER_THREADS = 2;
+	static constexpr size_t RESOLVER_QUEUE_LIMIT = 1024;
+
+private:
+	/* Started by the first lookup, before the loops so that it outlives them: a loop waits for its lookups */
+	std::once_flag resolverOnce;
+	std::unique_ptr<WorkStealingPool> resolver;
+	std::vector<std::unique_ptr<EventLoop>> loops;
+	/* NUMA node of each loop, -1 when not pinned or unknown */
+	std::vector<int> loopNodes;
+	/* NUMA node of each CPU the process may run on, -1 for the others */
+	std::vector<int> cpuNodes;
+	std::atomic<size_t> nextLoop{0};
+};
+
+/********************* Asynchronous exchange *****************/
+/* Sends request over a connection of loop, a TLS one with tlsContext (which must outlive the loop) and a plain
+ * one without. sink, unless empty, and handler run on the loop thread. The config gives the User-Agent, the
+ * timeout of the whole call and the listener. Must be called on the loop thread. */
+void exchangeAsync(EventLoop &loop, HttpRequest request, std::shared_ptr<const HttpClientConfig> config,
+                   const TLSContext *tlsContext, std::shared_ptr<HttpMetrics> metrics, HttpResponse::BodySink sink,
+                   HttpClient::ResponseHandler handler);
+
+#endif //LWHTTP_EVENTLOOP_H
@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+#include "../../include/http/EventSource.h"
+#include "Connection.h"
+
+/********************* EventStreamParser *********************/
+EventStreamParser::EventStreamParser(size_t maxEventSize) : maxEvent(maxEventSize)
+{
+}
+
+void EventStreamParser::reset()
+{
+	pending.clear();
+	event.type.clear();
+	event.data.clear();
+	hasData = false;
+	idBuffer = lastEventId;
+	oversized = false;
+	longLine = false;
+	skipLf = false;
+	streamStart = true;
+}
+
+/* The next '\r' or '\n' at or after cursor, found again only once cursor passed the last one found */
+static const char *nextBreak(const char *&found, char ch, const char *cursor, const char *end)
+{
+	if ((found == nullptr) || ((found != end) && (found < cursor)))
+	{
+		found = static_cast<const char *>(memchr(cursor, ch, end - cursor));
+		found = (found == nullptr) ? end : found;
+	}
+	return found;
+}
+
+bool EventStreamParser::feed(const char *data, size_t len, const EventHandler &handler)
+{
+	const char *cursor = data;
+	const char *end = data + len;
+	if (streamStart && (len > 0))
+	{
+		streamStart = false;
+		/* A BOM split between two feeds is not recognized */
+		if ((len >= 3) && (0 == memcmp(data, "\xEF\xBB\xBF", 3)))
+		{
+			cursor += 3;
+		}
+	}
+	if (skipLf && (cursor < end))
+	{
+		skipLf = false;
+		cursor += (*cursor == '\n') ? 1 : 0;
+	}
+	const char *lf = nullptr;
+	const char *cr = nullptr;
+	while (cursor < end)
+	{
+		const char *eol = std::min(nextBreak(lf, '\n', cursor, end), nextBreak(cr, '\r', cursor, end));
+		if (eol == end)
+		{
+			if (longLine || (pending.length() + (end - cursor) > maxEvent))
+			{
+				longLine = true;
+				oversized = true;
+				pending.clear();
+			}
+			else
+			{
+				pending.append(cursor, end - cursor);
+			}
+			break;
+		}
+		bool go = true;
+		if (longLine)
+		{
+			longLine = false;
+		}
+		else if (pending.empty())
+		{
+			go = processLine(cursor, eol - cursor, handler);
+		}
+		else
+		{
+			pending.append(cursor, eol - cursor);
+			go = processLine(pending.data(), pending.length(), handler);
+			pending.clear();
+		}
+		cursor = eol + 1;
+		if (*eol == '\r')
+		{
+			if (cursor == end)
+			{
+				skipLf = true;
+			}
+			else if (*cursor == '\n')
+			{
+				++cursor;
+			}
+		}
+		if (!go)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool EventStreamParser::processLine(const char *line, size_t len, const EventHandler &handler)
+{
+	if (len == 0)
+	{
+		lastEventId = idBuffer;
+		bool dispatch = hasData && !oversized;
+		droppedEvents += oversized ? 1 : 0;
+		oversized = false;
+		hasData = false;
+		if (!dispatch)
+		{
+			event.type.clear();
+			event.data.clear();
+			return true;
+		}
+		/* The LF behind the last data line */
+		event.data.pop_back();
+		if (event.type.empty())
+		{
+			event.type = "message";
+		}
+		event.id = lastEventId;
+		bool go = handler(event);
+		event.type.clear();
+		event.data.clear();
+		return go;
+	}
+	if (line[0] == ':')
+	{
+		return true;
+	}
+	const auto *colon = static_cast<const char *>(memchr(line, ':', len));
+	std::string_view field(line, (colon == nullptr) ? len : colon - line);
+	std::string_view value;
+	if (colon != nullptr)
+	{
+		value = std::string_view(colon + 1, len - field.length() - 1);
+		if (!value.empty() && (value.front() == ' '))
+		{
+			value.remove_prefix(1);
+		}
+	}
+	if (field == "data")
+	{
+		if (oversized)
+		{
+			return true;
+		}
+		if (event.data.length() + value.length() + 1 > maxEvent)
+		{
+			oversized = true;
+			event.data.clear();
+			return true;
+		}
+		event.data.append(value).push_back('\n');
+		hasData = true;
+	}
+	else if (field == "event")
+	{
+		event.type.assign(value);
+	}
+	else if (field == "id")
+	{
+		if (value.find('\0') == std::string_view::npos)
+		{
+			idBuffer.assign(value);
+		}
+	}
+	else if (field == "retry")
+	{
+		long millis;
+		auto result = std::from_chars(value.data(), value.data() + value.length(), millis);
+		if (!value.empty() && (result.ec == std::errc()) && (result.ptr == value.data() + value.length()) &&
+		    (value.front() != '-'))
+		{
+			retry = millis;
+		}
+	}
+	return true;
+}
+
+/************************ EventSource ************************/
+EventSource::EventSource(std::shared_ptr<HttpClient> httpClient, HttpRequest eventRequest,
+                         EventSourceConfig sourceConfig)
+		: client(std::move(httpClient)), request(std::move(eventRequest)), config(std::move(sourceConfig)),
+		  parser(config.maxEventSize), cancelToken(std::make_unique<CancelToken>())
+{
+	parser.setLastEventId(config.lastEventId);
+}
+
+EventSource::~EventSource() = default;
+
+static bool isEventStream(const HttpResponse &response)
+{
+	constexpr std::string_view type = "text/event-stream";
+	std::string_view contentType = response.getHeader().getField("Content-Type");
+	return (response.getStatusCode() == HttpStatus::OK) && (contentType.length() >= type.length()) &&
+	       std::equal(type.begin(), type.end(), contentType.begin(), [](char a, char b)
+	       {
+		       return a == tolower(static_cast<unsigned char>(b));
+	       });
+}
+
+/* Worth another attempt rather than a refused stream */
+static bool isTransient(HttpStatus status)
+{
+	auto code = static_cast<int>(status);
+	return (code == 429) || (code >= 500);
+}
+
+bool EventSource::run(const EventStreamParser::EventHandler &handler)
+{
+	unsigned int failures = 0;
+	while (!stopped.load(std::memory_order_acquire))
+	{
+		HttpRequest call(request);
+		call.header.setField("Accept", "text/event-stream");
+		call.header.setField("Cache-Control", "no-cache");
+		if (parser.getLastEventId().empty())
+		{
+			call.header.removeField("Last-Event-ID");
+		}
+		else
+		{
+			call.header.setField("Last-Event-ID", parser.getLastEventId());
+		}
+		parser.reset();
+		HttpResponse response{};
+		bool established = false;
+		bool handlerStopped = false;
+		response.setBodySink([this, &response, &established, &handlerStopped, &handler](const char *data, size_t len)
+		                     {
+			                     if (!established)
+			                     {
+				                     if (!isEventStream(response))
+				                     {
+					                     return false;
+				                     }
+				                     established = true;
+			                     }
+			                     handlerStopped = !parser.feed(data, len, handler);
+			                     return !handlerStopped && !stopped.load(std::memory_order_acquire);
+		                     });
+		size_t len = client->dispatch(call, response, nullptr, nullptr, cancelToken.get());
+		status = response.getStatusCode();
+		if (handlerStopped || stopped.load(std::memory_order_acquire))
+		{
+			return true;
+		}
+		if (len > 0)
+		{
+			if (status == HttpStatus::NO_CONTENT)
+			{
+				return true;
+			}
+			established = established || isEventStream(response);
+			if (!established && !isTransient(status))
+			{
+				return false;
+			}
+		}
+		std::chrono::milliseconds delay = (parser.getRetry() >= 0) ? std::chrono::milliseconds(parser.getRetry())
+		                                                          : config.retry;
+		if (established)
+		{
+			failures = 0;
+		}
+		else
+		{
+			++failures;
+			if ((config.maxAttempts > 0) && (failures >= config.maxAttempts))
+			{
+				return false;
+			}
+			/* Doubled for each failure in a row */
+			for (unsigned int i = 1; (i < failures) && (delay < config.maxRetry); ++i)
+			{
+				delay *= 2;
+			}
+			delay = std::min(delay, config.maxRetry);
+		}
+		if (!waitFor(delay))
+		{
+			return true;
+		}
+	}
+	return true;
+}
+
+void EventSource::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(stopMutex);
+		stopped.store(true, std::memory_order_release);
+	}
+	stopSignal.notify_all();
+	cancelToken->cancel();
+}
+
+bool EventSource::waitFor(std::chrono::milliseconds delay)
+{
+	std::unique_lock<std::mutex> lock(stopMutex);
+	return !stopSignal.wait_for(lock, delay, [this]()
+	{
+		return stopped.load(std::memory_order_acquire);
+	});
+}
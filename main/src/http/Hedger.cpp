@@ -0,0 +1,129 @@
+#include <algorithm>
+
+#include "Hedger.h"
+
+/*************************** Hedger **************************/
+Hedger::Hedger(const HedgeConfig &hedgeConfig) : config(hedgeConfig), shards(std::make_unique<Shard[]>(SHARDS))
+{
+	config.percentile = std::clamp(config.percentile, 0.5, 1.0);
+	timerThread = std::thread(&Hedger::run, this);
+}
+
+Hedger::~Hedger()
+{
+	{
+		std::lock_guard<std::mutex> lock(timerMutex);
+		stopping = true;
+	}
+	timerChanged.notify_all();
+	timerThread.join();
+}
+
+Hedger::Shard &Hedger::shardOf(const std::string &origin)
+{
+	return shards[std::hash<std::string>{}(origin) % SHARDS];
+}
+
+bool Hedger::hedgeDelay(const std::string &origin, Clock::duration &delay)
+{
+	Shard &shard = shardOf(origin);
+	std::lock_guard<std::mutex> lock(shard.shardMutex);
+	OriginState &state = shard.originMap[origin];
+	state.budget = std::min(MAX_BUDGET, state.budget + config.budget);
+	uint64_t millis = config.delayMillis;
+	if (millis == 0)
+	{
+		if (state.count < MIN_SAMPLES)
+		{
+			return false;
+		}
+		delay = std::chrono::microseconds(std::max<uint64_t>(state.percentile, config.minDelayMillis * 1000ULL));
+		return true;
+	}
+	delay = std::chrono::milliseconds(std::max<uint64_t>(millis, config.minDelayMillis));
+	return true;
+}
+
+bool Hedger::takeBudget(const std::string &origin)
+{
+	Shard &shard = shardOf(origin);
+	std::lock_guard<std::mutex> lock(shard.shardMutex);
+	OriginState &state = shard.originMap[origin];
+	if (state.budget < 1)
+	{
+		return false;
+	}
+	state.budget -= 1;
+	return true;
+}
+
+void Hedger::record(const std::string &origin, Clock::duration latency)
+{
+	auto micros = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+	Shard &shard = shardOf(origin);
+	std::lock_guard<std::mutex> lock(shard.shardMutex);
+	OriginState &state = shard.originMap[origin];
+	state.samples[state.next] = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+	state.next = (state.next + 1) % SAMPLES;
+	state.count = std::min(state.count + 1, SAMPLES);
+	if ((++state.sinceRefresh >= REFRESH_INTERVAL) && (state.count >= MIN_SAMPLES))
+	{
+		state.sinceRefresh = 0;
+		std::vector<uint64_t> window(state.samples.begin(), state.samples.begin() + static_cast<long>(state.count));
+		auto rank = static_cast<size_t>(config.percentile * static_cast<double>(window.size() - 1));
+		std::nth_element(window.begin(), window.begin() + static_cast<long>(rank), window.end());
+		state.percentile = window[rank];
+	}
+}
+
+uint64_t Hedger::schedule(Clock::time_point when, Action action)
+{
+	std::lock_guard<std::mutex> lock(timerMutex);
+	uint64_t timer = nextTimer++;
+	bool earliest = timers.empty() || (when < timers.begin()->first.first);
+	timers.emplace(std::make_pair(when, timer), std::move(action));
+	timerDeadlines.emplace(timer, when);
+	if (earliest)
+	{
+		timerChanged.notify_one();
+	}
+	return timer;
+}
+
+void Hedger::cancel(uint64_t timer)
+{
+	std::lock_guard<std::mutex> lock(timerMutex);
+	auto iter = timerDeadlines.find(timer);
+	if (iter != timerDeadlines.end())
+	{
+		timers.erase(std::make_pair(iter->second, timer));
+		timerDeadlines.erase(iter);
+	}
+}
+
+void Hedger::run()
+{
+	std::unique_lock<std::mutex> lock(timerMutex);
+	while (!stopping)
+	{
+		if (timers.empty())
+		{
+			timerChanged.wait(lock);
+			continue;
+		}
+		auto first = timers.begin();
+		/* A copy, cancel() may erase the timer while this waits */
+		Clock::time_point deadline = first->first.first;
+		if (deadline > Clock::now())
+		{
+			timerChanged.wait_until(lock, deadline);
+			continue;
+		}
+		Action action = std::move(first->second);
+		timerDeadlines.erase(first->first.second);
+		timers.erase(first);
+		lock.unlock();
+		action();
+		lock.lock();
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef LWHTTP_HEDGER_H
+#define LWHTTP_HEDGER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../../include/http/HttpClient.h"
+
+/*************************** Hedger **************************/
+/* Decides when a GET gets a second attempt and runs the timers that start them. The delay is fixed or the
+ * rolling percentile of the origin's recent latencies. Every hedgeable call earns budget of a hedge, each hedge
+ * spends a whole one, so hedges stay below budget times the calls. */
+class Hedger
+{
+public:
+	using Clock = std::chrono::steady_clock;
+	using Action = std::function<void()>;
+
+	explicit Hedger(const HedgeConfig &hedgeConfig);
+
+	Hedger(const Hedger &other) = delete;
+
+	Hedger &operator=(const Hedger &other) = delete;
+
+	/* Timers not fired yet are dropped */
+	~Hedger();
+
+	/* For a hedgeable call to origin: false while the origin has too few samples for a percentile */
+	bool hedgeDelay(const std::string &origin, Clock::duration &delay);
+
+	/* Spends a hedge of origin's budget, false if there is none left */
+	bool takeBudget(const std::string &origin);
+
+	void record(const std::string &origin, Clock::duration latency);
+
+	/* Runs action on the timer thread at when, unless cancelled before */
+	uint64_t schedule(Clock::time_point when, Action action);
+
+	void cancel(uint64_t timer);
+
+	static constexpr size_t SAMPLES = 256;
+	static constexpr size_t MIN_SAMPLES = 32;
+	/* The percentile is recomputed every this many samples */
+	static constexpr size_t REFRESH_INTERVAL = 16;
+	static constexpr double MAX_BUDGET = 10;
+	static constexpr size_t SHARDS = 16;
+
+private:
+	struct OriginState
+	{
+		std::vector<uint64_t> samples = std::vector<uint64_t>(SAMPLES);
+		size_t next = 0;
+		size_t count = 0;
+		size_t sinceRefresh = 0;
+		uint64_t percentile = 0;
+		double budget = 0;
+	};
+
+	struct alignas(64) Shard
+	{
+		std::mutex shardMutex;
+		std::unordered_map<std::string, OriginState> originMap;
+	};
+
+	Shard &shardOf(const std::string &origin);
+
+	void run();
+
+private:
+	HedgeConfig config;
+	std::unique_ptr<Shard[]> shards;
+	std::mutex timerMutex;
+	std::condition_variable timerChanged;
+	std::map<std::pair<Clock::time_point, uint64_t>, Action> timers;
+	std::unordered_map<uint64_t, Clock::time_point> timerDeadlines;
+	uint64_t nextTimer = 1;
+	bool stopping = false;
+	std::thread timerThread;
+};
+
+#endif //LWHTTP_HEDGER_H
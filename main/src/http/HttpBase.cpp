@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <iterator>
 #include <sstream>
+#include <string_view>
 #include <vector>
 
 #include "../../include/http/HttpBase.h"
@@ -43,6 +44,30 @@ void toLowCase(std::string &str)
 	}
 }
 
+void toLowCase(std::pmr::string &str)
+{
+	for (auto &ch: str)
+	{
+		ch = static_cast<char>(std::tolower(ch));
+	}
+}
+
+void HttpVersionAppendTo(HttpVersion version, Buffer &buffer)
+{
+	switch (version)
+	{
+		case HttpVersion::HTTP_1_0:
+			buffer.append("HTTP/1.0", 8);
+			break;
+		case HttpVersion::HTTP_1_1:
+			buffer.append("HTTP/1.1", 8);
+			break;
+		case HttpVersion::HTTP2:
+			buffer.append("HTTP/2", 6);
+			break;
+	}
+}
+
 std::string HttpVersionSerialize(HttpVersion version)
 {
 	std::string s;
@@ -84,57 +109,237 @@ HttpVersion HttpVersionDeserialize(const std::string &str)
 }
 
 /************************* HttpHeader ************************/
+/* Canonical spelling of common field names, sorted by the lower case name the header map stores */
+static constexpr std::pair<std::string_view, std::string_view> canonicalNames[] = {
+		{"accept",                      "Accept"},
+		{"accept-charset",              "Accept-Charset"},
+		{"accept-encoding",             "Accept-Encoding"},
+		{"accept-language",             "Accept-Language"},
+		{"accept-ranges",               "Accept-Ranges"},
+		{"access-control-allow-origin", "Access-Control-Allow-Origin"},
+		{"age",                         "Age"},
+		{"allow",                       "Allow"},
+		{"authorization",               "Authorization"},
+		{"cache-control",               "Cache-Control"},
+		{"connection",                  "Connection"},
+		{"content-disposition",         "Content-Disposition"},
+		{"content-encoding",            "Content-Encoding"},
+		{"content-language",            "Content-Language"},
+		{"content-length",              "Content-Length"},
+		{"content-location",            "Content-Location"},
+		{"content-md5",                 "Content-MD5"},
+		{"content-range",               "Content-Range"},
+		{"content-security-policy",     "Content-Security-Policy"},
+		{"content-type",                "Content-Type"},
+		{"cookie",                      "Cookie"},
+		{"date",                        "Date"},
+		{"dnt",                         "DNT"},
+		{"etag",                        "ETag"},
+		{"expect",                      "Expect"},
+		{"expires",                     "Expires"},
+		{"forwarded",                   "Forwarded"},
+		{"from",                        "From"},
+		{"host",                        "Host"},
+		{"if-match",                    "If-Match"},
+		{"if-modified-since",           "If-Modified-Since"},
+		{"if-none-match",               "If-None-Match"},
+		{"if-range",                    "If-Range"},
+		{"if-unmodified-since",         "If-Unmodified-Since"},
+		{"keep-alive",                  "Keep-Alive"},
+		{"last-modified",               "Last-Modified"},
+		{"link",                        "Link"},
+		{"location",                    "Location"},
+		{"max-forwards",                "Max-Forwards"},
+		{"origin",                      "Origin"},
+		{"pragma",                      "Pragma"},
+		{"proxy-authenticate",          "Proxy-Authenticate"},
+		{"proxy-authorization",         "Proxy-Authorization"},
+		{"range",                       "Range"},
+		{"referer",                     "Referer"},
+		{"retry-after",                 "Retry-After"},
+		{"sec-websocket-accept",        "Sec-WebSocket-Accept"},
+		{"sec-websocket-extensions",    "Sec-WebSocket-Extensions"},
+		{"sec-websocket-key",           "Sec-WebSocket-Key"},
+		{"sec-websocket-protocol",      "Sec-WebSocket-Protocol"},
+		{"sec-websocket-version",       "Sec-WebSocket-Version"},
+		{"server",                      "Server"},
+		{"set-cookie",                  "Set-Cookie"},
+		{"strict-transport-security",   "Strict-Transport-Security"},
+		{"te",                          "TE"},
+		{"trailer",                     "Trailer"},
+		{"transfer-encoding",           "Transfer-Encoding"},
+		{"upgrade",                     "Upgrade"},
+		{"user-agent",                  "User-Agent"},
+		{"vary",                        "Vary"},
+		{"via",                         "Via"},
+		{"warning",                     "Warning"},
+		{"www-authenticate",            "WWW-Authenticate"},
+		{"x-forwarded-for",             "X-Forwarded-For"},
+		{"x-forwarded-host",            "X-Forwarded-Host"},
+		{"x-forwarded-proto",           "X-Forwarded-Proto"},
+		{"x-request-id",                "X-Request-ID"}
+};
+
+static constexpr bool isCanonicalNamesSorted()
+{
+	for (size_t i = 1; i < std::size(canonicalNames); ++i)
+	{
+		if (!(canonicalNames[i - 1].first < canonicalNames[i].first))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static_assert(isCanonicalNamesSorted(), "canonicalNames must be sorted for the binary search");
+
+static void appendFieldName(Buffer &buffer, std::string_view name)
+{
+	auto found = std::lower_bound(std::begin(canonicalNames), std::end(canonicalNames), name,
+	                              [](const std::pair<std::string_view, std::string_view> &item, std::string_view key)
+	                              { return item.first < key; });
+	if ((found != std::end(canonicalNames)) && (found->first == name))
+	{
+		buffer.append(found->second.data(), found->second.length());
+		return;
+	}
+	/* Same casing as toUpCamelCase, applied to the bytes just written */
+	size_t offset = buffer.size();
+	buffer.append(name);
+	bool isFirstLetter = true;
+	for (char *ch = buffer.data() + offset; ch < buffer.data() + buffer.size(); ++ch)
+	{
+		if (isFirstLetter)
+		{
+			*ch = static_cast<char>(std::toupper(static_cast<unsigned char>(*ch)));
+		}
+		isFirstLetter = (*ch == ' ') || (*ch == '-');
+	}
+}
+
+static void appendField(Buffer &buffer, std::string_view name, std::string_view value)
+{
+	appendFieldName(buffer, name);
+	buffer.append(": ", 2);
+	buffer.append(value);
+	buffer.append("\r\n", 2);
+}
+
 std::string HttpHeader::serialize() const
 {
-	std::string str;
+	Buffer buffer;
+	appendTo(buffer);
+	return buffer.toString();
+}
+
+void HttpHeader::appendTo(Buffer &buffer) const
+{
+	for (const auto &field: fieldsMap)
+	{
+		appendField(buffer, field.first, field.second);
+	}
+	buffer.append("\r\n", 2);
+}
+
+void HttpHeader::appendTo(Buffer &buffer, std::string_view name, std::string_view value) const
+{
+	appendTo(buffer, {{name, value}});
+}
+
+void HttpHeader::appendTo(Buffer &buffer,
+                          std::initializer_list<std::pair<std::string_view, std::string_view>> fields) const
+{
+	auto next = fields.begin();
 	for (const auto &field: fieldsMap)
 	{
-		std::string name = field.first;
-		toUpCamelCase(name);
-		str += name + ": " + field.second + "\r\n";
+		bool replaced = false;
+		while ((next != fields.end()) && (next->first <= field.first))
+		{
+			appendField(buffer, next->first, next->second);
+			replaced = replaced || (next->first == field.first);
+			++next;
+		}
+		if (!replaced)
+		{
+			appendField(buffer, field.first, field.second);
+		}
+	}
+	for (; next != fields.end(); ++next)
+	{
+		appendField(buffer, next->first, next->second);
 	}
-	return str + "\r\n";
+	buffer.append("\r\n", 2);
 }
 
 void HttpHeader::deserialize(const std::string &str)
 {
-	std::string _str = str;
-	_str.erase(std::remove(_str.begin(), _str.end(), '\r'), _str.end());
-	size_t begin = 0;
-	size_t end;
-	do
+	deserialize(str.data(), str.length());
+}
+
+void HttpHeader::deserialize(const char *data, size_t len)
+{
+	std::string_view rest(data, len);
+	while (!rest.empty())
 	{
-		end = _str.find_first_of('\n', begin);
-		if (begin >= end)
+		size_t end = rest.find('\n');
+		std::string_view line = rest.substr(0, end);
+		rest = (end == std::string_view::npos) ? std::string_view{} : rest.substr(end + 1);
+		if ((!line.empty()) && (line.back() == '\r'))
+		{
+			line.remove_suffix(1);
+		}
+		if (line.empty())
 		{
 			break;
 		}
-		std::string field = _str.substr(begin, end - begin);
-		begin = end + 1;
-		std::string name, value;
-		auto delimiter = field.find_first_of(':');
-		if (delimiter == std::string::npos)
+		auto delimiter = line.find(':');
+		if (delimiter == std::string_view::npos)
 		{
 			throw std::invalid_argument(R"(The format of the field should be "name: value\r\n")");
 		}
-		name = field.substr(0, delimiter);
-		std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c)
-		{ return std::tolower(c); });
-		value = field.substr(delimiter + 1);
-		value.erase(std::remove_if(value.begin(), value.end(), isspace), value.end());
-		fieldsMap.insert({name, value});
+		std::pmr::string name(line.substr(0, delimiter), fieldsMap.get_allocator());
+		toLowCase(name);
+		std::pmr::string value(fieldsMap.get_allocator());
+		for (char ch: line.substr(delimiter + 1))
+		{
+			if (!std::isspace(static_cast<unsigned char>(ch)))
+			{
+				value.push_back(ch);
+			}
+		}
+		fieldsMap.emplace(std::move(name), std::move(value));
+	}
+}
+
+HttpHeader::HttpHeader(const HttpHeader &other) : Serializable(other),
+                                                  fieldsMap(other.fieldsMap, getMemoryResource())
+{
+}
+
+/* Names up to the size of a stack buffer are lowered there, so a lookup does not allocate */
+HttpHeader::FieldsMap::const_iterator HttpHeader::find(std::string_view name) const
+{
+	char lower[64];
+	if (name.length() <= sizeof(lower))
+	{
+		for (size_t i = 0; i < name.length(); ++i)
+		{
+			lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(name[i])));
+		}
+		return fieldsMap.find(std::string_view(lower, name.length()));
 	}
-	while (std::string::npos != end);
+	std::pmr::string key(name, getMemoryResource());
+	toLowCase(key);
+	return fieldsMap.find(key);
 }
 
-std::string HttpHeader::getField(const std::string &name) const
+std::string_view HttpHeader::getField(std::string_view name) const
 {
-	std::string _name = name;
-	std::transform(_name.begin(), _name.end(), _name.begin(), [](unsigned char c)
-	{ return std::tolower(c); });
-	if (fieldsMap.cend() != fieldsMap.find(_name))
+	auto iter = find(name);
+	if (iter != fieldsMap.cend())
 	{
-		return fieldsMap.at(_name);
+		return iter->second;
 	}
 	else
 	{
@@ -142,10 +347,18 @@ std::string HttpHeader::getField(const std::string &name) const
 	}
 }
 
-void HttpHeader::setField(const std::string &name, const std::string &value)
+void HttpHeader::setField(std::string_view name, std::string_view value)
 {
-	std::string _name = name;
-	std::transform(_name.begin(), _name.end(), _name.begin(), [](unsigned char c)
-	{ return std::tolower(c); });
-	fieldsMap.insert_or_assign(_name, value);
+	std::pmr::string lower(name, fieldsMap.get_allocator());
+	toLowCase(lower);
+	fieldsMap.insert_or_assign(std::move(lower), std::pmr::string(value, fieldsMap.get_allocator()));
+}
+
+void HttpHeader::removeField(std::string_view name)
+{
+	auto iter = find(name);
+	if (iter != fieldsMap.end())
+	{
+		fieldsMap.erase(iter);
+	}
 }
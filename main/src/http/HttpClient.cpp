@@ -1,493 +1,797 @@
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <list>
 #include <memory>
-#include <sstream>
+#include <mutex>
+#include <unordered_map>
 
 #include <openssl/ssl.h>
 
 #include "../../include/http/HttpRequest.h"
 #include "../../include/http/HttpResponse.h"
 #include "../../include/http/HttpClient.h"
-#include "../../include/http/utils.h"
+#include "ConcurrencyLimiter.h"
+#include "Connection.h"
+#include "EventLoop.h"
+#include "Hedger.h"
+#include "WorkStealingPool.h"
 
 #if defined(_WIN32) || defined(_WIN64)
 
 #include <WinSock2.h>
-#include <WS2tcpip.h>
 
 #endif
 
-#if defined(__linux__)
-
-#include <unistd.h>
-#include <fcntl.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netdb.h>
-
-#endif
-
-/************************** Common ***************************/
-struct VariableArray
+/************************ HttpClient *************************/
+HttpClient::HttpClient(std::shared_ptr<const HttpClientConfig> clientConfig) : config(std::move(clientConfig))
 {
-	VariableArray()
-	{
-		capability = BUFFER_SIZE;
-		buffer = new char[capability];
-		memset(buffer, 0, capability);
-	}
+}
 
-	~VariableArray()
-	{
-		delete[] buffer;
-	}
+size_t HttpClient::dispatch(const HttpRequest &request, HttpResponse &response, EventListener *eventListener,
+                            HttpMetrics *httpMetrics, CancelToken *cancelToken)
+{
+	return send(request, response);
+}
 
-	void expand()
-	{
-		size_t newCap = capability << 2;
-		char *newBuff = new char[newCap];
-		char *oldBuff = buffer;
-		memset(newBuff, 0, newCap);
-		memcpy(newBuff, buffer, capability);
-		buffer = newBuff;
-		capability = newCap;
-		delete[] oldBuff;
-	}
+size_t HttpClient::send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                        HttpResponse &response)
+{
+	return send(prepared.toRequest(values), response);
+}
 
-	static constexpr long BUFFER_SIZE = 64L * 1024L;
-	size_t capability;
-	char *buffer;
-};
+size_t HttpClient::dispatch(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                            HttpResponse &response, EventListener *eventListener, HttpMetrics *httpMetrics)
+{
+	return send(prepared, values, response);
+}
 
-#if defined(_WIN32) || defined(_WIN64)
+bool HttpClient::sendAsync(const HttpRequest &request, ResponseHandler handler)
+{
+	return streamAsync(request, nullptr, std::move(handler));
+}
 
-void closeSocket(SocketHandle handle)
+bool HttpClient::streamAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler)
 {
-	shutdown(handle, SD_BOTH);
-	closesocket(handle);
+	return dispatchAsync(request, std::move(sink), std::move(handler), metrics);
 }
 
-#elif defined(__linux__)
+/* Without event loops the call completes before it returns */
+bool HttpClient::dispatchAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler,
+                               const std::shared_ptr<HttpMetrics> &httpMetrics)
+{
+	HttpResponse response{};
+	response.setBodySink(std::move(sink));
+	size_t len = dispatch(request, response, config->listener.get(), httpMetrics.get());
+	handler(len, response);
+	return true;
+}
 
-void closeSocket(SocketHandle handle)
+void HttpClient::executeAsync(std::function<void()> task)
 {
-	shutdown(handle, SHUT_RDWR);
-	close(handle);
+	task();
 }
 
-#else
-#error Unsupported OS
-#endif
+bool HttpClient::submit(const HttpRequest &request, ResponseHandler handler)
+{
+	HttpResponse response{};
+	size_t len = send(request, response);
+	handler(len, response);
+	return true;
+}
 
-struct GenericAddr
+std::future<HttpResponse> HttpClient::sendFuture(const HttpRequest &request)
 {
-	int family;
-	union UniAddr
+	auto promise = std::make_shared<std::promise<HttpResponse>>();
+	std::future<HttpResponse> future = promise->get_future();
+	bool accepted = submit(request, [promise](size_t len, HttpResponse &response)
 	{
-		in_addr addr4;
-		in6_addr addr6;
-	} addr;
-};
-
-std::vector<GenericAddr> getAddrByDomain(const std::string &hostName)
-{
-	std::vector<GenericAddr> addrVec;
-	addrinfo hints{};
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags = 0;
-	hints.ai_family = AF_UNSPEC; // Allow IPv4 and IPv6
-	hints.ai_socktype = SOCK_STREAM; // Stream socket
-	hints.ai_protocol = 0;
-	hints.ai_canonname = nullptr;
-	hints.ai_addr = nullptr;
-	hints.ai_next = nullptr;
-	addrinfo *result = nullptr;
-	if (0 == getaddrinfo(hostName.c_str(), nullptr, &hints, &result))
-	{
-		for (addrinfo *rp = result; rp != nullptr; rp = rp->ai_next)
+		if (len == 0)
 		{
-			auto addr = rp->ai_addr;
-			if (addr->sa_family == AF_INET)
-			{
-				sockaddr_in *addr4 = reinterpret_cast<sockaddr_in *>(rp->ai_addr);
-				GenericAddr genericAddr{};
-				genericAddr.family = AF_INET;
-				genericAddr.addr.addr4 = addr4->sin_addr;
-				addrVec.push_back(genericAddr);
-			}
-			else if (addr->sa_family == AF_INET6)
-			{
-				sockaddr_in6 *addr6 = reinterpret_cast<sockaddr_in6 *>(rp->ai_addr);
-				GenericAddr genericAddr{};
-				genericAddr.family = AF_INET6;
-				genericAddr.addr.addr6 = addr6->sin6_addr;
-				addrVec.push_back(genericAddr);
-			}
+			promise->set_exception(std::make_exception_ptr(std::runtime_error("HTTP request failed")));
 		}
-		if (result != nullptr)
+		else
 		{
-			freeaddrinfo(result);
+			promise->set_value(std::move(response));
 		}
+	});
+	if (!accepted)
+	{
+		promise->set_exception(std::make_exception_ptr(std::runtime_error("HTTP client executor queue is full")));
 	}
-	return addrVec;
+	return future;
 }
 
-void setSocketNonBlock(SocketHandle socketHandle)
+void HttpClient::collectConnections(std::vector<OriginConnections> &connections) const
 {
-#ifdef _WIN32
-	unsigned long non_block = 1;
-	if (NO_ERROR != ioctlsocket(socketHandle, FIONBIO, &non_block))
+}
+
+MetricsSnapshot HttpClient::getMetrics() const
+{
+	MetricsSnapshot snapshot = (metrics != nullptr) ? metrics->snapshot() : MetricsSnapshot{};
+	collectConnections(snapshot.connections);
+	return snapshot;
+}
+
+using ExchangeFunction = std::function<size_t(Connection &, bool &)>;
+
+/* Sends over an idle pooled connection to the request's origin when there is one, otherwise over a new one */
+static size_t sendPooled(ConnectionPool &pool, RequestTrace &trace, HttpResponse &response,
+                         const std::function<std::unique_ptr<Connection>()> &connect,
+                         const ExchangeFunction &exchangeOn)
+{
+	trace.timing = RequestTiming{};
+	trace.timedOut = false;
+	trace.mark(HttpEvent::CALL_START, trace.timing.start);
+	std::string origin = trace.request.uri.getOrigin();
+	std::unique_ptr<Connection> connection = pool.acquire(origin);
+	bool reused = (connection != nullptr);
+	if (reused)
 	{
-		int dwErrNo = WSAGetLastError();
-		printf("%s,L%d,set socket flags to non-blocking failed! error:%d\n", __func__, __LINE__, dwErrNo);
+		trace.timing.connectionReused = true;
+		trace.count(MetricCounter::POOL_HITS);
+		trace.notify(HttpEvent::CONNECTION_ACQUIRED);
 	}
-#elif __linux__
-	int flags = fcntl(socketHandle, F_GETFL, 0);
-	if (-1 != flags)
+	else
 	{
-		if (-1 == fcntl(socketHandle, F_SETFL, flags | O_NONBLOCK))
+		trace.count(MetricCounter::POOL_MISSES);
+		connection = connect();
+		if (connection == nullptr)
 		{
-#ifdef _DEBUG
-			printf("%s,L%d,set socket flags to non-blocking failed: %s(%d)\n", __func__, __LINE__, strerror(errno),
-				   errno);
-#endif
+			trace.count(MetricCounter::FAILURES);
+			trace.notify(HttpEvent::CALL_FAILED);
+			return 0;
 		}
+		pool.opened(origin);
+	}
+
+	CancelToken *cancel = trace.cancel;
+	auto exchangeCancellable = [cancel, &exchangeOn](Connection &target, bool &keepAlive) -> size_t
+	{
+		if ((cancel != nullptr) && !cancel->attach(target.getHandle()))
+		{
+			keepAlive = false;
+			return 0;
+		}
+		size_t received = exchangeOn(target, keepAlive);
+		if (cancel != nullptr)
+		{
+			cancel->detach();
+		}
+		return received;
+	};
+
+	bool keepAlive = false;
+	size_t len = exchangeCancellable(*connection, keepAlive);
+	if ((len == 0) && reused && trace.mayResend())
+	{
+		/* The server may close an idle connection at any time, retry once on a fresh one */
+		trace.timing.connectionReused = false;
+		trace.timing.requestWritten = RequestTiming::Clock::time_point{};
+		connection = connect();
+		if (connection == nullptr)
+		{
+			pool.discard(origin);
+			trace.count(MetricCounter::FAILURES);
+			trace.notify(HttpEvent::CALL_FAILED);
+			return 0;
+		}
+		len = exchangeCancellable(*connection, keepAlive);
+	}
+
+	trace.finish(response, len);
+	if (keepAlive)
+	{
+		pool.release(origin, std::move(connection));
 	}
 	else
 	{
-#ifdef _DEBUG
-		printf("%s,L%d, set socket flags failed: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
+		pool.discard(origin);
 	}
-#endif
+	return len;
+}
+
+/* A replay of the request must do no harm: a GET without a body */
+static bool isEarlyDataSafe(const HttpRequest &request)
+{
+	return (request.method == HttpMethod::GET) && (request.body == nullptr) && !request.producer &&
+	       (request.source == nullptr);
 }
 
-SocketHandle createIPv4Socket(const in_addr &addr, unsigned short port, bool async)
+/* sendPooled() once more without early data if the server answered "425 Too Early" to it (RFC 8470) */
+static size_t sendPooledEarly(ConnectionPool &pool, RequestTrace &trace, HttpResponse &response, bool &earlyData,
+                              const std::function<std::unique_ptr<Connection>()> &connect,
+                              const ExchangeFunction &exchangeOn)
 {
-	SocketHandle handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (handle == INVALID_FD)
+	size_t len = sendPooled(pool, trace, response, connect, exchangeOn);
+	if ((len == 0) || !response.getTiming().earlyData || (response.getStatusCode() != HttpStatus::TOO_EARLY))
 	{
-#ifdef _DEBUG
-#ifdef _WIN32
-		printf("%s, L%d, socket create error: %d\n", __func__, __LINE__, WSAGetLastError());
-#elif __linux__
-		printf("%s, L%d, socket create error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
-#endif
-		return INVALID_FD;
+		return len;
 	}
+	earlyData = false;
+	HttpResponse::BodySink sink = response.getBodySink();
+	response = HttpResponse{};
+	response.setBodySink(std::move(sink));
+	return sendPooled(pool, trace, response, connect, exchangeOn);
+}
 
-	sockaddr_in remote_addr{};
-	memset(&remote_addr, 0, sizeof(remote_addr));
-	remote_addr.sin_family = AF_INET;
-	memcpy(&remote_addr.sin_addr, &addr, sizeof(remote_addr.sin_addr));
-	remote_addr.sin_port = htons(port);
-	socklen_t socklen = sizeof(remote_addr);
+/*********************** RedirectCache ***********************/
+/* Bounded LRU table of permanent redirects (301/308), keyed by the serialized source URL */
+class RedirectCache
+{
+public:
+	struct Entry
+	{
+		URL target;
+		HttpStatus status;
+	};
 
-	if (-1 == connect(handle, reinterpret_cast<sockaddr *>(&remote_addr), socklen))
+	/* Most clients never see a permanent redirect, their sends skip the lock and the key */
+	[[nodiscard]] bool empty() const
 	{
-#ifdef _DEBUG
-#ifdef _WIN32
-		printf("%s, L%d, server error: %d\n", __func__, __LINE__, WSAGetLastError());
-#elif __linux__
-		printf("%s, L%d, connect to server error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
-#endif
-		closeSocket(handle);
-		handle = INVALID_FD;
+		return 0 == entryCount.load(std::memory_order_acquire);
 	}
 
-	if (async)
+	bool get(const std::string &source, Entry &entry)
 	{
-		setSocketNonBlock(handle);
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto iter = entryMap.find(source);
+		if (iter == entryMap.end())
+		{
+			return false;
+		}
+		lruList.splice(lruList.begin(), lruList, iter->second);
+		entry = iter->second->second;
+		return true;
 	}
 
-	return handle;
-}
+	void put(const std::string &source, const URL &target, HttpStatus status)
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto iter = entryMap.find(source);
+		if (iter != entryMap.end())
+		{
+			iter->second->second = Entry{detachedCopy(target), status};
+			lruList.splice(lruList.begin(), lruList, iter->second);
+			return;
+		}
+		lruList.emplace_front(source, Entry{detachedCopy(target), status});
+		entryMap.insert({source, lruList.begin()});
+		if (lruList.size() > CAPACITY)
+		{
+			entryMap.erase(lruList.back().first);
+			lruList.pop_back();
+		}
+		entryCount.store(lruList.size(), std::memory_order_release);
+	}
+
+	static constexpr size_t CAPACITY = 256;
+
+private:
+	std::mutex cacheMutex;
+	std::atomic<size_t> entryCount{0};
+	std::list<std::pair<std::string, Entry>> lruList;
+	std::unordered_map<std::string, std::list<std::pair<std::string, Entry>>::iterator> entryMap;
+};
 
-SocketHandle createIPv6Socket(const in6_addr &addr, unsigned short port, bool async)
+static bool isRedirect(HttpStatus status)
 {
-	SocketHandle handle = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-	if (handle == INVALID_FD)
+	switch (status)
 	{
-#ifdef _DEBUG
-#ifdef _WIN32
-		printf("%s, L%d, socket create error: %d\n", __func__, __LINE__, WSAGetLastError());
-#elif __linux__
-		printf("%s, L%d, socket create error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
-#endif
-		return INVALID_FD;
+		case HttpStatus::MOVED_PERMANENTLY:
+		case HttpStatus::FOUND:
+		case HttpStatus::SEE_OTHER:
+		case HttpStatus::TEMPORARY_REDIRECT:
+		case HttpStatus::PERMANENT_REDIRECT:
+			return true;
+		default:
+			return false;
 	}
+}
 
-	sockaddr_in6 remote_addr{};
-	memset(&remote_addr, 0, sizeof(remote_addr));
-	remote_addr.sin6_family = AF_INET6;
-	memcpy(&remote_addr.sin6_addr, &addr, sizeof(remote_addr.sin6_addr));
-	remote_addr.sin6_port = htons(port);
-	socklen_t socklen = sizeof(remote_addr);
+static bool isPermanentRedirect(HttpStatus status)
+{
+	return (status == HttpStatus::MOVED_PERMANENTLY) || (status == HttpStatus::PERMANENT_REDIRECT);
+}
 
-	if (-1 == connect(handle, reinterpret_cast<sockaddr *>(&remote_addr), socklen))
+/* Builds the request for the next hop: 303 turns any method into a GET, 301/302 only a POST, 307/308 keep it */
+static void redirectRequest(HttpRequest &request, const URL &target, HttpStatus status)
+{
+	bool toGet = (status == HttpStatus::SEE_OTHER) ||
+	             (((status == HttpStatus::MOVED_PERMANENTLY) || (status == HttpStatus::FOUND)) &&
+	              (request.method == HttpMethod::POST));
+	if (toGet && (request.method != HttpMethod::GET))
 	{
-#ifdef _DEBUG
-#ifdef _WIN32
-		printf("%s, L%d, server error: %d\n", __func__, __LINE__, WSAGetLastError());
-#elif __linux__
-		printf("%s, L%d, connect to server error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
-#endif
-		closeSocket(handle);
-		handle = INVALID_FD;
+		request.method = HttpMethod::GET;
+		request.body = nullptr;
+		request.producer = nullptr;
+		request.source = nullptr;
+		request.header.removeField("Content-Length");
+		request.header.removeField("Transfer-Encoding");
+		request.header.removeField("Content-Type");
 	}
-
-	if (async)
+	if (target.getOrigin() != request.uri.getOrigin())
 	{
-		setSocketNonBlock(handle);
+		request.header.removeField("Authorization");
+		request.header.removeField("Cookie");
 	}
-	return handle;
+	request.header.setField("Host", target.getAuthority());
+	request.uri = target;
 }
 
-SocketHandle createSocket(const std::string &host, unsigned short port, bool async)
+/*********************** HttpClientProxy *********************/
+HttpClientProxy::HttpClientProxy(const std::shared_ptr<const HttpClientConfig> &clientConfig)
+		: HttpClient(clientConfig), redirectCache(std::make_shared<RedirectCache>()),
+		  httpClient(std::make_shared<HttpClientNonTlsImpl>(clientConfig)),
+		  httpsClient(std::make_shared<HttpClientTlsImpl>(clientConfig))
 {
-	SocketHandle socketHandle = INVALID_FD;
-
-	in_addr addr4{};
-	in6_addr addr6{};
-
-	if (1 == inet_pton(AF_INET, host.c_str(), &addr4))
+	metrics = std::make_shared<HttpMetrics>();
+	if (clientConfig->limitConcurrency)
 	{
-		socketHandle = createIPv4Socket(addr4, port, async);
+		limiter = std::make_unique<ConcurrencyLimiter>(clientConfig->concurrencyLimit);
 	}
-	else if (1 == inet_pton(AF_INET6, host.c_str(), &addr6))
+	if (clientConfig->hedgeRequests)
 	{
-		socketHandle = createIPv6Socket(addr6, port, async);
+		hedger = std::make_unique<Hedger>(clientConfig->hedge);
 	}
-	else
+}
+
+HttpClientProxy::~HttpClientProxy()
+{
+	hedger.reset();
+	executor.reset();
+}
+
+MetricsSnapshot HttpClientProxy::getMetrics() const
+{
+	MetricsSnapshot snapshot = metrics->snapshot();
+	httpClient->collectConnections(snapshot.connections);
+	httpsClient->collectConnections(snapshot.connections);
+	if (limiter != nullptr)
 	{
-		std::vector<GenericAddr> serverAddrVec = getAddrByDomain(host);
-		for (const auto &tmp: serverAddrVec)
-		{
-			SocketHandle handle = INVALID_FD;
-			if (tmp.family == AF_INET)
-			{
-				handle = createIPv4Socket(tmp.addr.addr4, port, async);
-			}
-			else
-			{
-				handle = createIPv6Socket(tmp.addr.addr6, port, async);
-			}
-			if (handle != INVALID_FD)
-			{
-				socketHandle = handle;
-				break;
-			}
-		}
+		limiter->collect(snapshot.limits);
 	}
+	return snapshot;
+}
 
-	return socketHandle;
+HttpClient *HttpClientProxy::getClient(Scheme scheme) const
+{
+	return (scheme == Scheme::Https) ? httpsClient.get() : httpClient.get();
 }
 
-/************************ HttpClient *************************/
-HttpClient::HttpClient()
+/* The backend asked for less load, or did not answer at all */
+static bool isOverloaded(size_t len, const HttpResponse &response)
 {
-	redirect = Redirect::NORMAL;
-	userAgent = "lwhttp/0.0.1";
-	timeout = DEFAULT_TIMEOUT;
+	HttpStatus status = response.getStatusCode();
+	return (len == 0) || (status == HttpStatus::TOO_MANY_REQUESTS) || (status == HttpStatus::SERVICE_UNAVAILABLE);
 }
 
-/*********************** HttpClientProxy *********************/
-std::mutex HttpClientProxy::clientMutex;
-std::shared_ptr<HttpClient> HttpClientProxy::httpClient = nullptr;
-std::shared_ptr<HttpClient> HttpClientProxy::httpsClient = nullptr;
+template<typename Dispatch>
+size_t HttpClientProxy::dispatchLimited(const URL &uri, HttpResponse &response, Dispatch dispatchHop)
+{
+	if (limiter == nullptr)
+	{
+		return dispatchHop();
+	}
+	std::string origin = uri.getOrigin();
+	if (!limiter->acquire(origin, std::chrono::seconds(config->timeout)))
+	{
+		metrics->add(MetricCounter::LIMITER_REJECTED);
+		metrics->add(MetricCounter::FAILURES);
+		return 0;
+	}
+	ConcurrencyLimiter::Clock::time_point start = ConcurrencyLimiter::Clock::now();
+	size_t len = dispatchHop();
+	limiter->release(origin, ConcurrencyLimiter::Clock::now() - start, isOverloaded(len, response));
+	return len;
+}
 
 size_t HttpClientProxy::send(const HttpRequest &request, HttpResponse &response)
 {
-	HttpClient *client;
-	if (request.uri.getScheme() == Scheme::Https)
+	return dispatch(request, response, config->listener.get(), metrics.get());
+}
+
+size_t HttpClientProxy::dispatch(const HttpRequest &request, HttpResponse &response, EventListener *eventListener,
+                                 HttpMetrics *httpMetrics, CancelToken *cancelToken)
+{
+	const HttpRequest *current = &request;
+	HttpRequest redirected;
+	RedirectCache::Entry entry{};
+	Redirect redirect = config->redirect;
+	if ((redirect != Redirect::NEVER) && !redirectCache->empty() && redirectCache->get(request.uri.serialize(), entry))
 	{
-		if (HttpClientProxy::httpsClient == nullptr)
+		bool secure = !((redirect == Redirect::NORMAL) && (request.uri.getScheme() == Scheme::Https) &&
+		                (entry.target.getScheme() != Scheme::Https));
+		if (secure && ((entry.status == HttpStatus::PERMANENT_REDIRECT) || (request.method == HttpMethod::GET)))
 		{
-			clientMutex.lock();
-			if (HttpClientProxy::httpsClient == nullptr)
-			{
-				HttpClientProxy::httpsClient = std::make_shared<HttpClientTlsImpl>();
-			}
-			clientMutex.unlock();
+			redirected = request;
+			redirectRequest(redirected, entry.target, entry.status);
+			current = &redirected;
 		}
-		client = HttpClientProxy::httpsClient.get();
 	}
-	else
+
+	for (unsigned int hop = 0;; ++hop)
 	{
-		if (HttpClientProxy::httpClient == nullptr)
+		HttpClient *client = getClient(current->uri.getScheme());
+		size_t len = dispatchLimited(current->uri, response, [client, current, &response, cancelToken, this]()
 		{
-			clientMutex.lock();
-			if (HttpClientProxy::httpClient == nullptr)
-			{
-				HttpClientProxy::httpClient = std::make_shared<HttpClientNonTlsImpl>();
-			}
-			clientMutex.unlock();
+			return dispatchHedged(client, *current, response, cancelToken);
+		});
+		HttpStatus status = response.getStatusCode();
+		if ((len == 0) || (redirect == Redirect::NEVER) || !isRedirect(status) || (hop >= config->maxRedirects))
+		{
+			return len;
+		}
+		/* A produced body was used up by the first hop, a redirect keeping the method cannot send it again */
+		if (!current->hasRepeatableBody() &&
+		    ((status == HttpStatus::TEMPORARY_REDIRECT) || (status == HttpStatus::PERMANENT_REDIRECT)))
+		{
+			return len;
+		}
+		std::string location(response.getHeader().getField("Location"));
+		if (location.empty())
+		{
+			return len;
+		}
+		URL target;
+		try
+		{
+			target = current->uri.resolve(location);
 		}
-		client = HttpClientProxy::httpClient.get();
+		catch (std::exception &e)
+		{
+#ifdef _DEBUG
+			printf("%s:%d unsupported redirect location %s: %s\n", __func__, __LINE__, location.c_str(), e.what());
+#endif
+			return len;
+		}
+		if ((redirect == Redirect::NORMAL) && (current->uri.getScheme() == Scheme::Https) &&
+		    (target.getScheme() != Scheme::Https))
+		{
+			return len;
+		}
+		/* An origin cannot send the request into a local socket, nor one on a socket out of it */
+		if (target.getSocketPath() != current->uri.getSocketPath())
+		{
+			return len;
+		}
+		if (isPermanentRedirect(status))
+		{
+			redirectCache->put(current->uri.serialize(), target, status);
+		}
+		if (current != &redirected)
+		{
+			redirected = *current;
+		}
+		redirectRequest(redirected, target, status);
+		current = &redirected;
+		HttpResponse::BodySink sink = response.getBodySink();
+		response = HttpResponse{};
+		response.setBodySink(std::move(sink));
 	}
-
-	return client->send(request, response);
 }
 
-size_t HttpClientProxy::sendAsync(HttpRequest &httpRequest, std::function<HttpResponse> &responseBodyHandler)
+size_t HttpClientProxy::send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                             HttpResponse &response)
 {
-	return 0;
+	/* Before a limiter slot is taken */
+	prepared.check(values);
+	const URL &uri = prepared.getRequest().uri;
+	HttpClient *client = getClient(uri.getScheme());
+	return dispatchLimited(uri, response, [client, &prepared, &values, &response, this]()
+	{
+		return client->dispatch(prepared, values, response, config->listener.get(), metrics.get());
+	});
 }
 
-/******************* HttpClientNonTlsImpl ********************/
-size_t HttpClientNonTlsImpl::send(const HttpRequest &httpRequest, HttpResponse &response)
+bool HttpClientProxy::streamAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler)
 {
-	SocketHandle socketHandle = createSocket(httpRequest.uri.getHost(), httpRequest.uri.getPort(), false);
-	if (socketHandle == INVALID_FD)
+	HttpClient *client = getClient(request.uri.getScheme());
+	if (limiter == nullptr)
 	{
-		return 0;
+		return client->dispatchAsync(request, std::move(sink), std::move(handler), metrics);
 	}
-
-	std::string requestLine = httpRequest.getRequestLine();
-	HttpHeader header = httpRequest.getHeader();
-	header.setField("user-agent", this->userAgent);
-	std::string requestStr = requestLine + header.serialize();
-#ifdef _WIN32
-	int len = static_cast<int>(requestStr.length());
-#else
-	size_t len =requestStr.length();
-#endif
-	long sendLen = ::send(socketHandle, requestStr.c_str(), len, 0);
-	if (sendLen < 0)
+	/* A loop must not block, so a call over the limit is never queued here */
+	std::string origin = request.uri.getOrigin();
+	if (!limiter->acquire(origin, ConcurrencyLimiter::Clock::duration::zero()))
 	{
+		metrics->add(MetricCounter::LIMITER_REJECTED);
+		metrics->add(MetricCounter::FAILURES);
+		/* Like any other result, not on the caller's thread, which may hold locks the handler takes */
+		client->executeAsync([responseHandler = std::move(handler)]()
+		                     {
+			                     HttpResponse response{};
+			                     try
+			                     {
+				                     responseHandler(0, response);
+			                     }
+			                     catch (std::exception &e)
+			                     {
 #ifdef _DEBUG
-#ifdef _WIN32
-		printf("%s:%d send request header failed:: %d\n", __func__, __LINE__, WSAGetLastError());
-#elif __linux__
-		printf("%s:%d send request header failed:: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
+				                     printf("%s:%d response handler threw: %s\n", __func__, __LINE__, e.what());
 #endif
-#endif
-		return 0;
+			                     }
+		                     });
+		return true;
 	}
-	if ((httpRequest.body != nullptr) && (httpRequest.body->getBodyLength() > 0))
+	ConcurrencyLimiter::Clock::time_point start = ConcurrencyLimiter::Clock::now();
+	return client->dispatchAsync(request, std::move(sink), [this, origin, start, responseHandler = std::move(handler)](
+			size_t len, HttpResponse &response)
 	{
-#ifdef _WIN32
-		len = static_cast<int>(httpRequest.body->getBodyLength());
-#else
-		len = httpRequest.body->getBodyLength();
-#endif
-		sendLen = ::send(socketHandle, httpRequest.body->getContent(), len, 0);
-		if (sendLen < 0)
+		limiter->release(origin, ConcurrencyLimiter::Clock::now() - start, isOverloaded(len, response));
+		responseHandler(len, response);
+	}, metrics);
+}
+
+/* The two attempts of a hedged call, shared with the timer and the worker of the second one */
+struct HedgedCall
+{
+	std::mutex callMutex;
+	std::condition_variable hedgeDone;
+	/* Valid until finished is set */
+	const HttpRequest *request = nullptr;
+	CancelToken primaryToken;
+	CancelToken hedgeToken;
+	/* Set once the call has its result, a hedge that has not started by then never starts */
+	bool finished = false;
+	/* Budget taken but not started by the executor yet, the caller runs it if the first attempt fails first */
+	bool hedgePending = false;
+	bool hedgeRunning = false;
+	bool hedgeWon = false;
+	size_t hedgeLen = 0;
+	HttpResponse hedgeResponse{};
+};
+
+size_t HttpClientProxy::dispatchHedged(HttpClient *client, const HttpRequest &request, HttpResponse &response,
+                                       CancelToken *cancelToken)
+{
+	EventListener *listener = config->listener.get();
+	/* A streamed body cannot come from two attempts, nor can a call cancelled from outside be split */
+	if ((hedger == nullptr) || (request.method != HttpMethod::GET) || response.getBodySink() ||
+	    (cancelToken != nullptr))
+	{
+		return client->dispatch(request, response, listener, metrics.get(), cancelToken);
+	}
+	std::string origin = request.uri.getOrigin();
+	Hedger::Clock::duration delay{};
+	Hedger::Clock::time_point start = Hedger::Clock::now();
+	if (!hedger->hedgeDelay(origin, delay))
+	{
+		size_t len = client->dispatch(request, response, listener, metrics.get());
+		if (len > 0)
 		{
-#ifdef _DEBUG
-#ifdef _WIN32
-			printf("%s:%d send request body failed:: %d\n", __func__, __LINE__, WSAGetLastError());
-#elif __linux__
-			printf("%s:%d send request body failed:: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
-#endif
+			hedger->record(origin, Hedger::Clock::now() - start);
 		}
+		return len;
 	}
 
-	size_t headLen = 0;
-	size_t dataLen = 0;
-	bool isChunked = false;
-	size_t contentLen = 0;
-	VariableArray array;
-	while (true)
+	auto call = std::make_shared<HedgedCall>();
+	call->request = &request;
+	WorkStealingPool &pool = getExecutor();
+	uint64_t timer = hedger->schedule(start + delay, [this, call, client, origin, listener, &pool]()
 	{
-#ifdef _WIN32
-		len = static_cast<int>(array.capability - dataLen);
-#else
-		len = array.capability - dataLen;
-#endif
-		long readLen = ::recv(socketHandle, array.buffer + dataLen, len, 0);
-		if (readLen <= 0)
+		std::shared_ptr<HttpRequest> copy;
 		{
-#ifdef _WIN32
-			auto errorCode = WSAGetLastError();
-			if (errorCode != WSAEINTR)
+			std::lock_guard<std::mutex> lock(call->callMutex);
+			if (call->finished || !hedger->takeBudget(origin))
 			{
-#ifdef _DEBUG
-				printf("%s:%d, socket send error: %d\n", __func__, __LINE__, errorCode);
-#endif
-				break;
+				return;
 			}
-#elif __linux__
-			if (errno != EINTR)
-			{
-#ifdef _DEBUG
-				printf("%s:%d, socket send error: %s(%d)\n", __func__, __LINE__, strerror(errno), errno);
-#endif
-				break;
-			}
-#endif
+			copy = std::make_shared<HttpRequest>(detachedCopy(*call->request));
+			call->hedgePending = true;
 		}
-		else
+		pool.submit([this, call, client, origin, listener, copy]()
+		            {
+			            {
+				            std::lock_guard<std::mutex> lock(call->callMutex);
+				            if (call->finished || !call->hedgePending)
+				            {
+					            return;
+				            }
+				            call->hedgePending = false;
+				            call->hedgeRunning = true;
+			            }
+			            metrics->add(MetricCounter::HEDGES_SENT);
+			            HttpResponse hedgeResponse{};
+			            size_t len = client->dispatch(*copy, hedgeResponse, listener, metrics.get(), &call->hedgeToken);
+			            std::lock_guard<std::mutex> lock(call->callMutex);
+			            if ((len > 0) && !call->finished)
+			            {
+				            call->finished = true;
+				            call->hedgeWon = true;
+				            call->hedgeLen = len;
+				            call->hedgeResponse = std::move(hedgeResponse);
+				            call->primaryToken.cancel();
+				            metrics->add(MetricCounter::HEDGES_WON);
+			            }
+			            call->hedgeRunning = false;
+			            call->hedgeDone.notify_all();
+		            });
+	});
+
+	size_t len = client->dispatch(request, response, listener, metrics.get(), &call->primaryToken);
+	hedger->cancel(timer);
+	std::unique_lock<std::mutex> lock(call->callMutex);
+	if ((len > 0) && !call->finished)
+	{
+		call->finished = true;
+		call->hedgeToken.cancel();
+		hedger->record(origin, Hedger::Clock::now() - start);
+		return len;
+	}
+	if (call->hedgePending)
+	{
+		/* The executor has not got to the second attempt, waiting for it would only add its backlog */
+		call->hedgePending = false;
+		call->finished = true;
+		lock.unlock();
+		metrics->add(MetricCounter::HEDGES_SENT);
+		response = HttpResponse{};
+		len = client->dispatch(request, response, listener, metrics.get());
+		if (len > 0)
 		{
-			dataLen += readLen;
-			if (dataLen >= array.capability)
-			{
-				array.expand();
-			}
-			if (headLen == 0)
-			{
-				headLen = response.buildHeader(array.buffer, dataLen);
-				char tmpBuff[VariableArray::BUFFER_SIZE];
-				memcpy(tmpBuff, array.buffer + headLen, dataLen - headLen);
-				dataLen = dataLen - headLen;
-				memset(array.buffer, 0, array.capability);
-				memcpy(array.buffer, tmpBuff, dataLen);
-				auto tmp = response.getHeader().getField("Content-Length");
-				if (!tmp.empty())
-				{
-					contentLen = std::stoul(tmp);
-				}
-				if (contentLen == 0)
-				{
-					std::string transEnc = response.getHeader().getField("Transfer-Encoding");
-					if (std::string::npos != transEnc.find("chunked"))
-					{
-						isChunked = true;
-					}
-				}
-			}
-			if (contentLen != 0)
-			{
-				if (dataLen >= contentLen)
-				{
-					break;
-				}
-			}
-			else if (isChunked)
-			{
-				char contentEnd[] = "0\r\n\r\n";
-				auto resultPair = findFirstOf(contentEnd, strlen(contentEnd), array.buffer, dataLen);
-				if (resultPair.first)
-				{
-					dataLen = resultPair.second;
-					break;
-				}
-			}
+			metrics->add(MetricCounter::HEDGES_WON);
 		}
+		return len;
+	}
+	/* The first attempt failed or was aborted, the second one may still answer */
+	call->hedgeDone.wait(lock, [&call]()
+	{ return !call->hedgeRunning; });
+	call->finished = true;
+	if (call->hedgeWon)
+	{
+		response = std::move(call->hedgeResponse);
+		return call->hedgeLen;
+	}
+	return len;
+}
+
+WorkStealingPool &HttpClientProxy::getExecutor()
+{
+	std::call_once(executorOnce, [this]()
+	{
+		executor = std::make_unique<WorkStealingPool>(config->executorThreads, config->executorQueueLimit);
+	});
+	return *executor;
+}
+
+bool HttpClientProxy::submit(const HttpRequest &request, ResponseHandler handler)
+{
+	WorkStealingPool &pool = getExecutor();
+	return pool.submit([this, call = detachedCopy(request), responseHandler = std::move(handler)]()
+	                   {
+		                   HttpResponse response{};
+		                   size_t len = send(call, response);
+		                   try
+		                   {
+			                   responseHandler(len, response);
+		                   }
+		                   catch (std::exception &e)
+		                   {
+#ifdef _DEBUG
+			                   printf("%s:%d response handler threw: %s\n", __func__, __LINE__, e.what());
+#endif
+		                   }
+	                   });
+}
+
+#ifdef __linux__
+/* Hands a copy of request to loop */
+static void executeOnLoop(EventLoop &loop, const HttpRequest &request, std::shared_ptr<const HttpClientConfig> config,
+                          const TLSContext *tlsContext, std::shared_ptr<HttpMetrics> httpMetrics,
+                          HttpClient::BodySink sink, HttpClient::ResponseHandler handler)
+{
+	loop.execute([&loop, call = detachedCopy(request), clientConfig = std::move(config), tlsContext,
+		             metrics = std::move(httpMetrics), bodySink = std::move(sink),
+		             responseHandler = std::move(handler)]() mutable
+	             {
+		             exchangeAsync(loop, std::move(call), std::move(clientConfig), tlsContext, std::move(metrics),
+		                           std::move(bodySink), std::move(responseHandler));
+	             });
+}
+#endif
+
+/******************* HttpClientNonTlsImpl ********************/
+size_t HttpClientNonTlsImpl::send(const HttpRequest &httpRequest, HttpResponse &response)
+{
+	return dispatch(httpRequest, response, config->listener.get(), metrics.get());
+}
+
+size_t HttpClientNonTlsImpl::send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                                  HttpResponse &response)
+{
+	return dispatch(prepared, values, response, config->listener.get(), metrics.get());
+}
+
+std::unique_ptr<Connection> HttpClientNonTlsImpl::connect(const URL &uri, RequestTrace &trace)
+{
+	SocketHandle socketHandle = createSocket(uri, config->unixSocket, false, &trace);
+	if (socketHandle == INVALID_FD)
+	{
+		return nullptr;
 	}
+	setSocketTimeout(socketHandle, config->timeout);
+	return std::make_unique<PlainConnection>(socketHandle);
+}
+
+size_t HttpClientNonTlsImpl::dispatch(const HttpRequest &httpRequest, HttpResponse &response,
+                                      EventListener *eventListener, HttpMetrics *httpMetrics, CancelToken *cancelToken)
+{
+	RequestTrace trace{httpRequest, response.getTiming(), eventListener, httpMetrics, cancelToken};
+	auto connectTo = [this, &httpRequest, &trace]()
+	{
+		return connect(httpRequest.uri, trace);
+	};
+	auto exchangeOn = [this, &trace, &response](Connection &connection, bool &keepAlive)
+	{
+		return exchange(connection, *config, trace, response, keepAlive);
+	};
+	return sendPooled(*pool, trace, response, connectTo, exchangeOn);
+}
+
+size_t HttpClientNonTlsImpl::dispatch(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                                      HttpResponse &response, EventListener *eventListener, HttpMetrics *httpMetrics)
+{
+	const HttpRequest &httpRequest = prepared.getRequest();
+	RequestTrace trace{httpRequest, response.getTiming(), eventListener, httpMetrics};
+	IoSlice slices[PreparedRequest::MAX_SLICES];
+	char digits[20];
+	size_t count = prepared.gather(values, slices, digits);
+	auto connectTo = [this, &httpRequest, &trace]()
+	{
+		return connect(httpRequest.uri, trace);
+	};
+	auto exchangeOn = [&slices, count, &trace, &response](Connection &connection, bool &keepAlive)
+	{
+		return exchange(connection, slices, count, trace, response, keepAlive);
+	};
+	return sendPooled(*pool, trace, response, connectTo, exchangeOn);
+}
 
-	closeSocket(socketHandle);
-	if (dataLen > 0)
+void HttpClientNonTlsImpl::collectConnections(std::vector<OriginConnections> &connections) const
+{
+	size_t first = connections.size();
+	pool->collect(connections);
+#ifdef __linux__
+	/* sendAsync() keeps its connections on the loops */
+	if (loopsStarted.load(std::memory_order_acquire))
 	{
-		response.build(array.buffer, dataLen);
-		return dataLen;
+		loops->collect(connections, first);
 	}
-	else
+#endif
+}
+
+#ifdef __linux__
+bool HttpClientNonTlsImpl::dispatchAsync(const HttpRequest &request, BodySink sink,
+                                         ResponseHandler handler, const std::shared_ptr<HttpMetrics> &httpMetrics)
+{
+	if (request.producer || (request.source != nullptr))
 	{
-		return 0;
+		/* The loop writes the request in one go, a streamed body is sent on the calling thread */
+		return HttpClient::dispatchAsync(request, std::move(sink), std::move(handler), httpMetrics);
 	}
+	executeOnLoop(getLoops().next(), request, config, nullptr, httpMetrics, std::move(sink), std::move(handler));
+	return true;
+}
+
+void HttpClientNonTlsImpl::executeAsync(std::function<void()> task)
+{
+	getLoops().next().execute(std::move(task));
 }
 
-size_t HttpClientNonTlsImpl::sendAsync(HttpRequest &request, std::function<HttpResponse> &responseBodyHandler)
+EventLoopGroup &HttpClientNonTlsImpl::getLoops()
 {
-	return 0;
+	std::call_once(loopsOnce, [this]()
+	{
+		loops = std::make_unique<EventLoopGroup>(config->eventLoops, config->pinEventLoops);
+		loopsStarted.store(true, std::memory_order_release);
+	});
+	return *loops;
 }
+#endif
 
-HttpClientNonTlsImpl::HttpClientNonTlsImpl()
+HttpClientNonTlsImpl::HttpClientNonTlsImpl(std::shared_ptr<const HttpClientConfig> clientConfig)
+		: HttpClient(std::move(clientConfig)), pool(std::make_shared<ConnectionPool>())
 {
 #ifdef _WIN32
 	WSAData stWSAData{};
@@ -510,148 +814,142 @@ HttpClientNonTlsImpl::~HttpClientNonTlsImpl()
 /********************* HttpClientTlsImpl *********************/
 size_t HttpClientTlsImpl::send(const HttpRequest &httpRequest, HttpResponse &response)
 {
-	assert(this->tlsContext.ssl != nullptr);
-	SSL *dupSSL = SSL_dup(this->tlsContext.ssl);
-	std::string host = httpRequest.uri.getHost();
+	return dispatch(httpRequest, response, config->listener.get(), metrics.get());
+}
+
+size_t HttpClientTlsImpl::send(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                               HttpResponse &response)
+{
+	return dispatch(prepared, values, response, config->listener.get(), metrics.get());
+}
 
-	SocketHandle socketHandle = createSocket(httpRequest.uri.getHost(), httpRequest.uri.getPort(), false);
+std::unique_ptr<Connection> HttpClientTlsImpl::connect(const URL &uri, RequestTrace &trace, bool earlyData)
+{
+	SocketHandle socketHandle = createSocket(uri, config->unixSocket, false, &trace);
 	if (socketHandle == INVALID_FD)
 	{
-		return 0;
+		return nullptr;
 	}
+	setSocketTimeout(socketHandle, config->timeout);
 
-	SSL_set_fd(dupSSL, static_cast<int>(socketHandle));
-	int var = SSL_connect(dupSSL);
-	if (var != 1)
+	std::string origin = uri.getOrigin();
+	SSL *ssl = this->tlsContext.newSSL(origin);
+	if (ssl == nullptr)
 	{
-#ifdef _DEBUG
-		int ssl_errno = SSL_get_error(dupSSL, var);
-		printf("%s:%d tls connect to server failed: %d\n", __func__, __LINE__, ssl_errno);
-#endif
-		SSL_free(dupSSL);
 		closeSocket(socketHandle);
-		return 0;
+		return nullptr;
 	}
-	std::string requestLine = httpRequest.getRequestLine();
-	HttpHeader header = httpRequest.getHeader();
-	header.setField("user-agent", this->userAgent);
-	std::string requestStr = requestLine + header.serialize();
-	size_t sendLen = 0;
-	var = SSL_write_ex(dupSSL, requestStr.c_str(), requestStr.length(), &sendLen);
-	if (0 == var)
+	if (!setSocketBio(ssl, socketHandle))
 	{
-#ifdef _DEBUG
-		int ssl_errno = SSL_get_error(dupSSL, var);
-		printf("%s:%d send request header failed: %d\n", __func__, __LINE__, ssl_errno);
-#endif
-		SSL_shutdown(dupSSL);
-		SSL_free(dupSSL);
+		SSL_free(ssl);
 		closeSocket(socketHandle);
-		return 0;
+		return nullptr;
 	}
-	if ((httpRequest.body != nullptr) && (httpRequest.body->getBodyLength() > 0))
+	std::string host(uri.getHost());
+	SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, const_cast<char *>(host.c_str()));
+	trace.mark(HttpEvent::TLS_START, trace.timing.tlsStart);
+	size_t earlyLimit = (earlyData && isEarlyDataSafe(trace.request)) ? this->tlsContext.takeEarlyData(ssl) : 0;
+	if (earlyLimit > 0)
 	{
-		size_t written = 0;
-		var = SSL_write_ex(dupSSL, httpRequest.body->getContent(), httpRequest.body->getBodyLength(), &written);
-		if (0 == var)
-		{
-#ifdef _DEBUG
-			int ssl_errno = SSL_get_error(dupSSL, var);
-			printf("%s:%d send request body failed: %d\n", __func__, __LINE__, ssl_errno);
-#endif
-			SSL_shutdown(dupSSL);
-			SSL_free(dupSSL);
-			closeSocket(socketHandle);
-			return 0;
-		}
-		sendLen += written;
+		return std::make_unique<TlsConnection>(socketHandle, ssl, earlyLimit, trace);
 	}
-
-	size_t headLen = 0;
-	size_t dataLen = 0;
-	bool isChunked = false;
-	size_t contentLen = 0;
-	VariableArray array;
-	while (true)
+	int var = SSL_connect(ssl);
+	if (var != 1)
 	{
-		size_t readBytes = 0;
-		var = SSL_read_ex(dupSSL, array.buffer + dataLen, array.capability - dataLen, &readBytes);
-		if (0 == var)
-		{
 #ifdef _DEBUG
-			int ssl_errno = SSL_get_error(dupSSL, var);
-			printf("%s:%d read response failed: %d\n", __func__, __LINE__, ssl_errno);
+		int ssl_errno = SSL_get_error(ssl, var);
+		printf("%s:%d tls connect to server failed: %d\n", __func__, __LINE__, ssl_errno);
 #endif
-			break;
-		}
-		else
-		{
-			dataLen += readBytes;
-			if (dataLen >= array.capability)
-			{
-				array.expand();
-			}
-			if (headLen == 0)
-			{
-				headLen = response.buildHeader(array.buffer, dataLen);
-				char tmpBuff[VariableArray::BUFFER_SIZE];
-				memcpy(tmpBuff, array.buffer + headLen, dataLen - headLen);
-				dataLen = dataLen - headLen;
-				memset(array.buffer, 0, array.capability);
-				memcpy(array.buffer, tmpBuff, dataLen);
-				auto tmp = response.getHeader().getField("Content-Length");
-				if (!tmp.empty())
-				{
-					contentLen = std::stoul(tmp);
-				}
-				if (contentLen == 0)
-				{
-					std::string transEnc = response.getHeader().getField("Transfer-Encoding");
-					if (std::string::npos != transEnc.find("chunked"))
-					{
-						isChunked = true;
-					}
-				}
-			}
-			if (contentLen != 0)
-			{
-				if (dataLen >= contentLen)
-				{
-					break;
-				}
-			}
-			else if (isChunked)
-			{
-				char contentEnd[] = "0\r\n\r\n";
-				auto resultPair = findFirstOf(contentEnd, strlen(contentEnd), array.buffer, dataLen);
-				if (resultPair.first)
-				{
-					dataLen = resultPair.second;
-					break;
-				}
-			}
-		}
+		SSL_free(ssl);
+		closeSocket(socketHandle);
+		return nullptr;
 	}
-	SSL_shutdown(dupSSL);
-	SSL_free(dupSSL);
-	closeSocket(socketHandle);
-	if (dataLen > 0)
+	traceHandshake(ssl, trace);
+	return std::make_unique<TlsConnection>(socketHandle, ssl);
+}
+
+size_t HttpClientTlsImpl::dispatch(const HttpRequest &httpRequest, HttpResponse &response,
+                                   EventListener *eventListener, HttpMetrics *httpMetrics, CancelToken *cancelToken)
+{
+	assert(this->tlsContext.sslCtx != nullptr);
+	RequestTrace trace{httpRequest, response.getTiming(), eventListener, httpMetrics, cancelToken};
+	bool earlyData = true;
+	auto connectTo = [this, &httpRequest, &trace, &earlyData]()
+	{
+		return connect(httpRequest.uri, trace, earlyData);
+	};
+	auto exchangeOn = [this, &trace, &response](Connection &connection, bool &keepAlive)
 	{
-		response.build(array.buffer, dataLen);
-		return dataLen;
+		return exchange(connection, *config, trace, response, keepAlive);
+	};
+	return sendPooledEarly(*pool, trace, response, earlyData, connectTo, exchangeOn);
+}
+
+size_t HttpClientTlsImpl::dispatch(const PreparedRequest &prepared, const PreparedRequest::Values &values,
+                                   HttpResponse &response, EventListener *eventListener, HttpMetrics *httpMetrics)
+{
+	assert(this->tlsContext.sslCtx != nullptr);
+	const HttpRequest &httpRequest = prepared.getRequest();
+	RequestTrace trace{httpRequest, response.getTiming(), eventListener, httpMetrics};
+	IoSlice slices[PreparedRequest::MAX_SLICES];
+	char digits[20];
+	size_t count = prepared.gather(values, slices, digits);
+	bool earlyData = true;
+	auto connectTo = [this, &httpRequest, &trace, &earlyData]()
+	{
+		return connect(httpRequest.uri, trace, earlyData);
+	};
+	auto exchangeOn = [&slices, count, &trace, &response](Connection &connection, bool &keepAlive)
+	{
+		return exchange(connection, slices, count, trace, response, keepAlive);
+	};
+	return sendPooledEarly(*pool, trace, response, earlyData, connectTo, exchangeOn);
+}
+
+void HttpClientTlsImpl::collectConnections(std::vector<OriginConnections> &connections) const
+{
+	size_t first = connections.size();
+	pool->collect(connections);
+#ifdef __linux__
+	/* sendAsync() keeps its connections on the loops */
+	if (loopsStarted.load(std::memory_order_acquire))
+	{
+		loops->collect(connections, first);
 	}
-	else
+#endif
+}
+
+#ifdef __linux__
+bool HttpClientTlsImpl::dispatchAsync(const HttpRequest &request, BodySink sink,
+                                      ResponseHandler handler, const std::shared_ptr<HttpMetrics> &httpMetrics)
+{
+	if (request.producer || (request.source != nullptr))
 	{
-		return 0;
+		return HttpClient::dispatchAsync(request, std::move(sink), std::move(handler), httpMetrics);
 	}
+	executeOnLoop(getLoops().next(), request, config, &tlsContext, httpMetrics, std::move(sink),
+	              std::move(handler));
+	return true;
 }
 
-size_t HttpClientTlsImpl::sendAsync(HttpRequest &request, std::function<HttpResponse> &responseBodyHandler)
+void HttpClientTlsImpl::executeAsync(std::function<void()> task)
 {
-	return 0;
+	getLoops().next().execute(std::move(task));
 }
 
-HttpClientTlsImpl::HttpClientTlsImpl()
+EventLoopGroup &HttpClientTlsImpl::getLoops()
+{
+	std::call_once(loopsOnce, [this]()
+	{
+		loops = std::make_unique<EventLoopGroup>(config->eventLoops, config->pinEventLoops);
+		loopsStarted.store(true, std::memory_order_release);
+	});
+	return *loops;
+}
+#endif
+
+HttpClientTlsImpl::HttpClientTlsImpl(std::shared_ptr<const HttpClientConfig> clientConfig)
+		: HttpClient(std::move(clientConfig)), pool(std::make_shared<ConnectionPool>())
 {
 #ifdef _WIN32
 	WSAData stWSAData{};
@@ -661,7 +959,8 @@ HttpClientTlsImpl::HttpClientTlsImpl()
 		printf("WSAStartup failed! %d\n", wsaError);
 	}
 #endif
-	this->tlsContext = TLSContextBuilder::newBuilder().newClientBuilder().setMinVersion(TLSProtocol::TLSv1_1).build();
+	this->tlsContext = TLSContextBuilder::newBuilder().newClientBuilder().setMinVersion(TLSProtocol::TLSv1_1)
+			.enableEarlyData(config->earlyData).build();
 }
 
 HttpClientTlsImpl::~HttpClientTlsImpl()
@@ -680,21 +979,19 @@ HttpClientBuilder::Builder HttpClientBuilder::newBuilder()
 
 HttpClientBuilder::Builder &HttpClientBuilder::Builder::redirect(Redirect redirect)
 {
-	if (this->client == nullptr)
-	{
-		this->client = std::make_shared<HttpClientProxy>();
-	}
-	this->client->redirect = redirect;
+	this->config.redirect = redirect;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::maxRedirects(unsigned int hops)
+{
+	this->config.maxRedirects = hops;
 	return *this;
 }
 
 HttpClientBuilder::Builder &HttpClientBuilder::Builder::userAgent(const std::string &agent)
 {
-	if (this->client == nullptr)
-	{
-		this->client = std::make_shared<HttpClientProxy>();
-	}
-	this->client->userAgent = agent;
+	this->config.userAgent = agent;
 	return *this;
 }
 
@@ -702,12 +999,69 @@ HttpClientBuilder::Builder &HttpClientBuilder::Builder::timeout(unsigned int sec
 {
 	if (seconds > 0)
 	{
-		this->client->timeout = seconds;
+		this->config.timeout = seconds;
 	}
 	return *this;
 }
 
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::eventListener(std::shared_ptr<EventListener> eventListener)
+{
+	this->config.listener = std::move(eventListener);
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::expectContinue(size_t threshold, unsigned int timeoutMillis)
+{
+	this->config.expectContinueThreshold = threshold;
+	this->config.expectContinueTimeout = timeoutMillis;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::unixSocket(const std::string &path)
+{
+	if (path.empty() || (path.length() > MAX_SOCKET_PATH))
+	{
+		throw std::invalid_argument("Invalid Unix socket path: " + path);
+	}
+	this->config.unixSocket = path;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::earlyData(bool enable)
+{
+	this->config.earlyData = enable;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::eventLoops(unsigned int threads, bool pin)
+{
+	this->config.eventLoops = threads;
+	this->config.pinEventLoops = pin;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::executor(unsigned int threads, size_t queueLimit)
+{
+	this->config.executorThreads = threads;
+	this->config.executorQueueLimit = queueLimit;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::concurrencyLimit(const ConcurrencyLimitConfig &limit)
+{
+	this->config.limitConcurrency = true;
+	this->config.concurrencyLimit = limit;
+	return *this;
+}
+
+HttpClientBuilder::Builder &HttpClientBuilder::Builder::hedge(const HedgeConfig &hedgeConfig)
+{
+	this->config.hedgeRequests = true;
+	this->config.hedge = hedgeConfig;
+	return *this;
+}
+
 std::shared_ptr<HttpClient> HttpClientBuilder::Builder::build()
 {
-	return this->client;
+	return std::make_shared<HttpClientProxy>(std::make_shared<const HttpClientConfig>(this->config));
 }
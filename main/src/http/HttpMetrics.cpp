@@ -0,0 +1,266 @@
+#include <sstream>
+
+#include "../../include/http/HttpMetrics.h"
+
+/********************* HistogramSnapshot *********************/
+static unsigned int highestBit(uint64_t value)
+{
+	unsigned int msb = 0;
+	while (value >>= 1)
+	{
+		++msb;
+	}
+	return msb;
+}
+
+unsigned int HistogramSnapshot::bucketIndex(uint64_t value)
+{
+	if (value < SUB_BUCKETS)
+	{
+		return static_cast<unsigned int>(value);
+	}
+	unsigned int shift = highestBit(value) - SUB_BUCKET_BITS;
+	unsigned int index = (shift + 1) * SUB_BUCKETS + static_cast<unsigned int>((value >> shift) - SUB_BUCKETS);
+	return index < BUCKETS ? index : BUCKETS - 1;
+}
+
+uint64_t HistogramSnapshot::bucketLowerBound(unsigned int index)
+{
+	if (index < SUB_BUCKETS)
+	{
+		return index;
+	}
+	unsigned int shift = index / SUB_BUCKETS - 1;
+	return static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+uint64_t HistogramSnapshot::bucketUpperBound(unsigned int index)
+{
+	if (index < SUB_BUCKETS)
+	{
+		return index;
+	}
+	unsigned int shift = index / SUB_BUCKETS - 1;
+	return bucketLowerBound(index) + (static_cast<uint64_t>(1) << shift) - 1;
+}
+
+uint64_t HistogramSnapshot::valueAtQuantile(double q) const
+{
+	if (count == 0)
+	{
+		return 0;
+	}
+	auto rank = static_cast<uint64_t>(q * static_cast<double>(count) + 0.5);
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+		{
+			return bucketUpperBound(i);
+		}
+	}
+	return bucketUpperBound(BUCKETS - 1);
+}
+
+/********************** MetricsSnapshot **********************/
+static void writeCounter(std::ostream &os, const char *name, const char *help, uint64_t value)
+{
+	os << "# HELP " << name << " " << help << "\n";
+	os << "# TYPE " << name << " counter\n";
+	os << name << " " << value << "\n";
+}
+
+/* total - part, but never below 0: the snapshot reads the two counters one after the other, part may already count
+ * an event that total does not yet */
+static uint64_t excess(uint64_t total, uint64_t part)
+{
+	return total > part ? total - part : 0;
+}
+
+/* Label value with backslash, double quote and line feed escaped */
+static std::string labelValue(const std::string &value)
+{
+	std::string escaped;
+	escaped.reserve(value.length());
+	for (char c: value)
+	{
+		if (c == '\\')
+		{
+			escaped += "\\\\";
+		}
+		else if (c == '"')
+		{
+			escaped += "\\\"";
+		}
+		else if (c == '\n')
+		{
+			escaped += "\\n";
+		}
+		else
+		{
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+/* Exported with power-of-two microsecond bounds so the bucket set does not depend on the recorded values */
+static void writeHistogram(std::ostream &os, const char *name, const char *help, const HistogramSnapshot &histogram)
+{
+	os << "# HELP " << name << " " << help << "\n";
+	os << "# TYPE " << name << " histogram\n";
+	uint64_t cumulative = 0;
+	unsigned int index = 0;
+	for (unsigned int exponent = 0; exponent <= 25; ++exponent)
+	{
+		uint64_t bound = static_cast<uint64_t>(1) << exponent;
+		while ((index < HistogramSnapshot::BUCKETS) && (HistogramSnapshot::bucketUpperBound(index) <= bound))
+		{
+			cumulative += histogram.buckets[index++];
+		}
+		os << name << "_bucket{le=\"" << static_cast<double>(bound) / 1e6 << "\"} " << cumulative << "\n";
+	}
+	os << name << "_bucket{le=\"+Inf\"} " << histogram.count << "\n";
+	os << name << "_sum " << static_cast<double>(histogram.sum) / 1e6 << "\n";
+	os << name << "_count " << histogram.count << "\n";
+}
+
+std::string MetricsSnapshot::toPrometheus() const
+{
+	std::stringstream ss;
+	ss << "# HELP lwhttp_responses_total Responses received, by status class.\n";
+	ss << "# TYPE lwhttp_responses_total counter\n";
+	for (int i = 0; i < 5; ++i)
+	{
+		ss << "lwhttp_responses_total{status_class=\"" << i + 1 << "xx\"} " << statusClass[i] << "\n";
+	}
+	writeCounter(ss, "lwhttp_failures_total", "Exchanges that ended without a response.", failures);
+	writeCounter(ss, "lwhttp_sent_bytes_total", "Request bytes written.", bytesSent);
+	writeCounter(ss, "lwhttp_received_bytes_total", "Response bytes read.", bytesReceived);
+	writeCounter(ss, "lwhttp_pool_hits_total", "Requests sent on an idle pooled connection.", poolHits);
+	writeCounter(ss, "lwhttp_pool_misses_total", "Requests that had to open a connection.", poolMisses);
+	writeCounter(ss, "lwhttp_dns_cache_hits_total", "Host lookups answered from the DNS cache.", dnsCacheHits);
+	writeCounter(ss, "lwhttp_dns_cache_misses_total", "Host lookups sent to the resolver.", dnsCacheMisses);
+	ss << "# HELP lwhttp_tls_handshakes_total TLS handshakes, by session resumption.\n";
+	ss << "# TYPE lwhttp_tls_handshakes_total counter\n";
+	ss << "lwhttp_tls_handshakes_total{resumed=\"false\"} " << excess(tlsHandshakes, tlsResumed) << "\n";
+	ss << "lwhttp_tls_handshakes_total{resumed=\"true\"} " << tlsResumed << "\n";
+	writeCounter(ss, "lwhttp_tls_early_data_total", "Requests the server accepted as TLS 1.3 early data.", tlsEarlyData);
+	ss << "# HELP lwhttp_connections Open connections, by origin and state.\n";
+	ss << "# TYPE lwhttp_connections gauge\n";
+	for (const auto &item: connections)
+	{
+		std::string origin = labelValue(item.origin);
+		ss << "lwhttp_connections{origin=\"" << origin << "\",state=\"active\"} " << item.active << "\n";
+		ss << "lwhttp_connections{origin=\"" << origin << "\",state=\"idle\"} " << item.idle << "\n";
+	}
+	writeCounter(ss, "lwhttp_limiter_rejected_total", "Calls refused by the concurrency limiter.", limiterRejected);
+	ss << "# HELP lwhttp_hedges_total Second attempts of hedged GETs, by whether they answered first.\n";
+	ss << "# TYPE lwhttp_hedges_total counter\n";
+	ss << "lwhttp_hedges_total{won=\"false\"} " << excess(hedgesSent, hedgesWon) << "\n";
+	ss << "lwhttp_hedges_total{won=\"true\"} " << hedgesWon << "\n";
+	if (!limits.empty())
+	{
+		ss << "# HELP lwhttp_concurrency_limit Adaptive concurrency limit, by origin.\n";
+		ss << "# TYPE lwhttp_concurrency_limit gauge\n";
+		for (const auto &item: limits)
+		{
+			std::string origin = labelValue(item.origin);
+			ss << "lwhttp_concurrency_limit{origin=\"" << origin << "\"} " << item.limit << "\n";
+		}
+		ss << "# HELP lwhttp_concurrency_in_flight Calls holding a slot of the concurrency limit, by origin.\n";
+		ss << "# TYPE lwhttp_concurrency_in_flight gauge\n";
+		for (const auto &item: limits)
+		{
+			std::string origin = labelValue(item.origin);
+			ss << "lwhttp_concurrency_in_flight{origin=\"" << origin << "\"} " << item.inFlight << "\n";
+		}
+		ss << "# HELP lwhttp_concurrency_queued Calls waiting for a slot of the concurrency limit, by origin.\n";
+		ss << "# TYPE lwhttp_concurrency_queued gauge\n";
+		for (const auto &item: limits)
+		{
+			std::string origin = labelValue(item.origin);
+			ss << "lwhttp_concurrency_queued{origin=\"" << origin << "\"} " << item.queued << "\n";
+		}
+	}
+	writeHistogram(ss, "lwhttp_request_duration_seconds", "Time from call start to the last response byte.", latency);
+	writeHistogram(ss, "lwhttp_time_to_first_byte_seconds", "Time from call start to the first response byte.",
+	               timeToFirstByte);
+	writeHistogram(ss, "lwhttp_connect_duration_seconds", "TCP connect time of new connections.", connectTime);
+	writeHistogram(ss, "lwhttp_tls_handshake_duration_seconds", "TLS handshake time of new connections.",
+	               tlsHandshakeTime);
+	return ss.str();
+}
+
+/************************ HttpMetrics ************************/
+HttpMetrics::HttpMetrics() : shards(std::make_unique<Shard[]>(SHARDS))
+{
+}
+
+HttpMetrics::Shard &HttpMetrics::localShard()
+{
+	static std::atomic<size_t> nextShard{0};
+	static thread_local size_t shardIndex = nextShard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+	return shards[shardIndex];
+}
+
+void HttpMetrics::record(MetricHistogram histogram, uint64_t micros)
+{
+	Shard &shard = localShard();
+	auto index = static_cast<size_t>(histogram);
+	shard.buckets[index][HistogramSnapshot::bucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+	shard.sums[index].fetch_add(micros, std::memory_order_relaxed);
+}
+
+MetricsSnapshot HttpMetrics::snapshot() const
+{
+	uint64_t counters[static_cast<size_t>(MetricCounter::COUNT)]{};
+	HistogramSnapshot histograms[static_cast<size_t>(MetricHistogram::COUNT)];
+	for (size_t s = 0; s < SHARDS; ++s)
+	{
+		const Shard &shard = shards[s];
+		for (size_t c = 0; c < static_cast<size_t>(MetricCounter::COUNT); ++c)
+		{
+			counters[c] += shard.counters[c].load(std::memory_order_relaxed);
+		}
+		for (size_t h = 0; h < static_cast<size_t>(MetricHistogram::COUNT); ++h)
+		{
+			histograms[h].sum += shard.sums[h].load(std::memory_order_relaxed);
+			for (unsigned int b = 0; b < HistogramSnapshot::BUCKETS; ++b)
+			{
+				uint64_t value = shard.buckets[h][b].load(std::memory_order_relaxed);
+				histograms[h].buckets[b] += value;
+				histograms[h].count += value;
+			}
+		}
+	}
+
+	MetricsSnapshot snapshot{};
+	for (int i = 0; i < 5; ++i)
+	{
+		snapshot.statusClass[i] = counters[static_cast<size_t>(MetricCounter::STATUS_1XX) + i];
+	}
+	snapshot.failures = counters[static_cast<size_t>(MetricCounter::FAILURES)];
+	snapshot.bytesSent = counters[static_cast<size_t>(MetricCounter::BYTES_SENT)];
+	snapshot.bytesReceived = counters[static_cast<size_t>(MetricCounter::BYTES_RECEIVED)];
+	snapshot.poolHits = counters[static_cast<size_t>(MetricCounter::POOL_HITS)];
+	snapshot.poolMisses = counters[static_cast<size_t>(MetricCounter::POOL_MISSES)];
+	snapshot.dnsCacheHits = counters[static_cast<size_t>(MetricCounter::DNS_CACHE_HITS)];
+	snapshot.dnsCacheMisses = counters[static_cast<size_t>(MetricCounter::DNS_CACHE_MISSES)];
+	snapshot.tlsHandshakes = counters[static_cast<size_t>(MetricCounter::TLS_HANDSHAKES)];
+	snapshot.tlsResumed = counters[static_cast<size_t>(MetricCounter::TLS_RESUMED)];
+	snapshot.tlsEarlyData = counters[static_cast<size_t>(MetricCounter::TLS_EARLY_DATA)];
+	snapshot.limiterRejected = counters[static_cast<size_t>(MetricCounter::LIMITER_REJECTED)];
+	snapshot.hedgesSent = counters[static_cast<size_t>(MetricCounter::HEDGES_SENT)];
+	snapshot.hedgesWon = counters[static_cast<size_t>(MetricCounter::HEDGES_WON)];
+	snapshot.latency = std::move(histograms[static_cast<size_t>(MetricHistogram::LATENCY)]);
+	snapshot.timeToFirstByte = std::move(histograms[static_cast<size_t>(MetricHistogram::TIME_TO_FIRST_BYTE)]);
+	snapshot.connectTime = std::move(histograms[static_cast<size_t>(MetricHistogram::CONNECT_TIME)]);
+	snapshot.tlsHandshakeTime = std::move(histograms[static_cast<size_t>(MetricHistogram::TLS_HANDSHAKE_TIME)]);
+	return snapshot;
+}
@@ -1,9 +1,17 @@
-#include <sstream>
+#include <stdexcept>
 #include <utility>
 #include "../../include/http/HttpBase.h"
 #include "../../include/http/HttpRequest.h"
 
 /************************ HttpRequest ************************/
+HttpRequest::HttpRequest(const HttpRequest &other) : uri(other.uri), method(other.method), version(other.version),
+                                                     header(other.header),
+                                                     parameterMap(other.parameterMap, getMemoryResource()),
+                                                     body(other.body), producer(other.producer),
+                                                     source(other.source)
+{
+}
+
 HttpRequest::~HttpRequest()
 {
 	parameterMap.clear();
@@ -11,42 +19,46 @@ HttpRequest::~HttpRequest()
 
 std::string HttpRequest::getRequestLine() const
 {
-	std::stringstream ss;
+	Buffer buffer;
+	appendRequestLineTo(buffer);
+	return buffer.toString();
+}
+
+void HttpRequest::appendRequestLineTo(Buffer &buffer) const
+{
 	switch (method)
 	{
 		case HttpMethod::GET:
-			ss << "GET";
+			buffer.append("GET ", 4);
 			break;
 		case HttpMethod::POST:
-			ss << "POST";
+			buffer.append("POST ", 5);
 			break;
 		case HttpMethod::PUT:
-			ss << "PUT";
+			buffer.append("PUT ", 4);
 			break;
 		case HttpMethod::DELETE:
-			ss << "DELETE";
+			buffer.append("DELETE ", 7);
 			break;
 	}
-	ss << " " << uri.getPath();
-	std::string query = uri.getQuery();
-	if (!query.empty())
-	{
-		ss << "?" << query;
-	}
-	ss << " " << HttpVersionSerialize(version) << "\r\n";
-	return ss.str();
+	uri.appendRequestTargetTo(buffer);
+	buffer.append(' ');
+	HttpVersionAppendTo(version, buffer);
+	buffer.append("\r\n", 2);
 }
 
-HttpHeader HttpRequest::getHeader() const
+void HttpRequest::appendTo(Buffer &buffer) const
 {
-	return header;
+	appendRequestLineTo(buffer);
+	header.appendTo(buffer);
 }
 
-std::string HttpRequest::getParameter(const std::string &name) const
+std::string_view HttpRequest::getParameter(std::string_view name) const
 {
-	if (parameterMap.cend() != parameterMap.find(name))
+	auto iter = parameterMap.find(std::pmr::string(name, getMemoryResource()));
+	if (iter != parameterMap.cend())
 	{
-		return parameterMap.at(name);
+		return iter->second;
 	}
 	else
 	{
@@ -54,43 +66,32 @@ std::string HttpRequest::getParameter(const std::string &name) const
 	}
 }
 
-std::unordered_map<std::string, std::string> HttpRequest::getParameterMap() const
-{
-	return parameterMap;
-}
-
 /********************* HttpRequestBuilder *********************/
 HttpRequestBuilder::Builder HttpRequestBuilder::newBuilder()
 {
 	return HttpRequestBuilder::Builder{};
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::url(URL &url)
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::url(URL url) &
 {
-	std::string host = url.getHost();
-	if (url.getPort() != 0)
-	{
-		host.append(":");
-		host.append(std::to_string(url.getPort()));
-	}
-	this->httpRequest.header.setField("Host", host);
-	this->httpRequest.uri = url;
+	this->httpRequest.header.setField("Host", url.getAuthority());
+	this->httpRequest.uri = std::move(url);
 	return *this;
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::header(HttpHeader &header)
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::header(HttpHeader header) &
 {
-	this->httpRequest.header = header;
+	this->httpRequest.header = std::move(header);
 	return *this;
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::GET()
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::GET() &
 {
 	this->httpRequest.method = HttpMethod::GET;
 	return *this;
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::POST(std::shared_ptr<HttpBody> body)
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::POST(std::shared_ptr<HttpBody> body) &
 {
 	this->httpRequest.method = HttpMethod::POST;
 	this->httpRequest.header.setField("Content-Length", std::to_string(body->getBodyLength()));
@@ -98,7 +99,7 @@ HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::POST(std::shared_ptr<H
 	return *this;
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::PUT(std::shared_ptr<HttpBody> body)
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::PUT(std::shared_ptr<HttpBody> body) &
 {
 	this->httpRequest.method = HttpMethod::PUT;
 	this->httpRequest.header.setField("Content-Length", std::to_string(body->getBodyLength()));
@@ -106,21 +107,97 @@ HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::PUT(std::shared_ptr<Ht
 	return *this;
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::DELETE()
+/* Content-Length when the length is known, chunked otherwise */
+static void setStreamedLength(HttpRequest &request, size_t length)
+{
+	if (length == UNKNOWN_BODY_LENGTH)
+	{
+		request.header.removeField("Content-Length");
+		request.header.setField("Transfer-Encoding", "chunked");
+	}
+	else
+	{
+		request.header.removeField("Transfer-Encoding");
+		request.header.setField("Content-Length", std::to_string(length));
+	}
+}
+
+static void setProducer(HttpRequest &request, BodyProducer producer, size_t length)
+{
+	request.body = nullptr;
+	request.source = nullptr;
+	request.producer = std::move(producer);
+	setStreamedLength(request, length);
+}
+
+static void setSource(HttpRequest &request, std::shared_ptr<const BodySource> source)
+{
+	if (source == nullptr)
+	{
+		throw std::invalid_argument("Body source must not be null");
+	}
+	request.body = nullptr;
+	request.producer = nullptr;
+	setStreamedLength(request, source->getLength());
+	std::string contentType = source->getContentType();
+	if (!contentType.empty())
+	{
+		request.header.setField("Content-Type", contentType);
+	}
+	request.source = std::move(source);
+}
+
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::POST(BodyProducer producer, size_t length) &
+{
+	this->httpRequest.method = HttpMethod::POST;
+	setProducer(this->httpRequest, std::move(producer), length);
+	return *this;
+}
+
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::PUT(BodyProducer producer, size_t length) &
+{
+	this->httpRequest.method = HttpMethod::PUT;
+	setProducer(this->httpRequest, std::move(producer), length);
+	return *this;
+}
+
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::POST(std::shared_ptr<const BodySource> source) &
+{
+	this->httpRequest.method = HttpMethod::POST;
+	setSource(this->httpRequest, std::move(source));
+	return *this;
+}
+
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::PUT(std::shared_ptr<const BodySource> source) &
+{
+	this->httpRequest.method = HttpMethod::PUT;
+	setSource(this->httpRequest, std::move(source));
+	return *this;
+}
+
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::DELETE() &
 {
 	this->httpRequest.method = HttpMethod::DELETE;
 	return *this;
 }
 
-HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::version(HttpVersion version)
+HttpRequestBuilder::Builder &HttpRequestBuilder::Builder::version(HttpVersion version) &
 {
 	this->httpRequest.version = version;
 	return *this;
 }
 
-HttpRequest HttpRequestBuilder::Builder::build()
+HttpRequest HttpRequestBuilder::Builder::build() const &
+{
+	HttpRequest request = this->httpRequest;
+	request.header.setField("User-Agent", "lwhttp/0.0.1");
+	request.header.setField("Accept", "*/*");
+	return request;
+}
+
+HttpRequest HttpRequestBuilder::Builder::build() &&
 {
 	this->httpRequest.header.setField("User-Agent", "lwhttp/0.0.1");
 	this->httpRequest.header.setField("Accept", "*/*");
-	return this->httpRequest;
+	return std::move(this->httpRequest);
 }
@@ -1,6 +1,4 @@
 #include <cassert>
-#include <sstream>
-#include <vector>
 #include "../../include/http/HttpResponse.h"
 #include "../../include/http/utils.h"
 
@@ -97,9 +95,17 @@ std::ostream &operator<<(std::ostream &os, const HttpStatus &obj)
 }
 
 /************************* StatusLine ************************/
-std::string StatusLine::getReason() const
+std::string_view StatusLine::getReason() const
 {
-	return statusCodeMap[status];
+	auto iter = statusCodeMap.find(status);
+	if (iter != statusCodeMap.cend())
+	{
+		return iter->second;
+	}
+	else
+	{
+		return {};
+	}
 }
 
 size_t StatusLine::build(const char *buffer, size_t len)
@@ -112,11 +118,7 @@ size_t StatusLine::build(const char *buffer, size_t len)
 	if (resultPair.first)
 	{
 		size_t statusLen = resultPair.second + strlen(statusLinePattern);
-		//char statusLineArray[statusLen + 1];
-		std::vector<char> statusLineVec(statusLen + 1);
-		memcpy(statusLineVec.data(), buffer, statusLineVec.size());
-		statusLineVec[statusLen] = '\0';
-		std::string statusLine(statusLineVec.data());
+		std::string statusLine(buffer, statusLen);
 		try
 		{
 			deserialize(statusLine);
@@ -132,11 +134,23 @@ size_t StatusLine::build(const char *buffer, size_t len)
 
 std::string StatusLine::serialize() const
 {
-	std::stringstream ss;
-	ss << HttpVersionSerialize(this->version) << " " << HttpStatusSerialize(this->status) << " "
-	   << statusCodeMap[this->status]
-	   << "\r\n";
-	return ss.str();
+	Buffer buffer;
+	appendTo(buffer);
+	return buffer.toString();
+}
+
+void StatusLine::appendTo(Buffer &buffer) const
+{
+	HttpVersionAppendTo(version, buffer);
+	buffer.append(' ');
+	buffer.appendDecimal(static_cast<uint64_t>(status));
+	buffer.append(' ');
+	auto reason = statusCodeMap.find(status);
+	if (reason != statusCodeMap.end())
+	{
+		buffer.append(reason->second);
+	}
+	buffer.append("\r\n", 2);
 }
 
 void StatusLine::deserialize(const std::string &str)
@@ -190,19 +204,6 @@ void StatusLine::deserialize(const std::string &str)
 }
 
 /************************ HttpResponse ***********************/
-HttpResponse::~HttpResponse()
-{
-	if (body != nullptr)
-	{
-		delete body;
-	}
-}
-
-HttpHeader HttpResponse::getHeader() const
-{
-	return this->header;
-}
-
 static size_t getHttpHeader(const char *buffer, size_t len)
 {
 	size_t headLen = 0;
@@ -223,8 +224,7 @@ size_t HttpResponse::buildHeader(const char *buffer, size_t len)
 		try
 		{
 			size_t statusLen = this->statusLine.build(buffer, headLen);
-			const std::string headStr(buffer + statusLen);
-			this->header.deserialize(headStr);
+			this->header.deserialize(buffer + statusLen, headLen - statusLen);
 			return headLen;
 		}
 		catch (std::exception &e)
@@ -239,6 +239,6 @@ void HttpResponse::build(const char *buffer, size_t bodyLen)
 {
 	assert(buffer != nullptr);
 	assert(bodyLen > 0);
-	this->body = new HttpBodyImpl(buffer, bodyLen);
+	this->body = std::make_unique<HttpBodyImpl>(buffer, bodyLen);
 	this->body->setBodyLength(bodyLen);
 }
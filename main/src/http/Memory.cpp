@@ -0,0 +1,19 @@
+#include "../../include/http/Memory.h"
+
+/************************** Memory ***************************/
+static thread_local std::pmr::memory_resource *currentResource = nullptr;
+
+std::pmr::memory_resource *getMemoryResource()
+{
+	return (currentResource != nullptr) ? currentResource : std::pmr::get_default_resource();
+}
+
+MemoryScope::MemoryScope(std::pmr::memory_resource *resource) : previous(currentResource)
+{
+	currentResource = resource;
+}
+
+MemoryScope::~MemoryScope()
+{
+	currentResource = previous;
+}
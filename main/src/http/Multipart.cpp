@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+
+#include <io.h>
+
+#else
+
+#include <unistd.h>
+
+#endif
+
+#include "../../include/http/Multipart.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+static int openFile(const std::string &path)
+{
+	return _open(path.c_str(), _O_RDONLY | _O_BINARY);
+}
+
+static void closeFile(int fd)
+{
+	_close(fd);
+}
+
+static bool fileSize(int fd, size_t &size)
+{
+	struct _stat64 status{};
+	if (_fstat64(fd, &status) != 0)
+	{
+		return false;
+	}
+	size = static_cast<size_t>(status.st_size);
+	return true;
+}
+
+#else
+
+static int openFile(const std::string &path)
+{
+	return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+static void closeFile(int fd)
+{
+	close(fd);
+}
+
+static bool fileSize(int fd, size_t &size)
+{
+	struct stat status{};
+	if (fstat(fd, &status) != 0)
+	{
+		return false;
+	}
+	size = static_cast<size_t>(status.st_size);
+	return true;
+}
+
+#endif
+
+/*********************** MultipartBody ***********************/
+static constexpr std::string_view CRLF = "\r\n";
+
+static bool isBoundary(const std::string &boundary)
+{
+	constexpr std::string_view allowed = "'()+_,-./:=?";
+	return !boundary.empty() && (boundary.length() <= 70) &&
+	       std::all_of(boundary.begin(), boundary.end(), [&allowed](char ch)
+	       {
+		       return isalnum(static_cast<unsigned char>(ch)) || (allowed.find(ch) != std::string_view::npos);
+	       });
+}
+
+static std::string randomBoundary()
+{
+	static thread_local std::mt19937_64 generator{std::random_device{}()};
+	static constexpr char hex[] = "0123456789abcdef";
+	std::string boundary = "lwhttp-";
+	for (int i = 0; i < 2; ++i)
+	{
+		uint64_t bits = generator();
+		for (int j = 0; j < 16; ++j, bits >>= 4)
+		{
+			boundary.push_back(hex[bits & 0xF]);
+		}
+	}
+	return boundary;
+}
+
+/* A quoted parameter as browsers send it: quote and line breaks percent encoded */
+static void appendQuoted(std::string &head, std::string_view value)
+{
+	head.push_back('"');
+	for (char ch: value)
+	{
+		switch (ch)
+		{
+			case '"':
+				head.append("%22");
+				break;
+			case '\r':
+				head.append("%0D");
+				break;
+			case '\n':
+				head.append("%0A");
+				break;
+			default:
+				head.push_back(ch);
+		}
+	}
+	head.push_back('"');
+}
+
+MultipartBody::MultipartBody() : boundary(randomBoundary())
+{
+}
+
+MultipartBody::MultipartBody(std::string partBoundary) : boundary(std::move(partBoundary))
+{
+	if (!isBoundary(boundary))
+	{
+		throw std::invalid_argument("Invalid multipart boundary: " + boundary);
+	}
+}
+
+MultipartBody::~MultipartBody()
+{
+	for (Part &part: parts)
+	{
+		if (part.ownsFd)
+		{
+			closeFile(part.fd);
+		}
+	}
+}
+
+MultipartBody::Part &MultipartBody::addPart(PartKind kind, std::string_view name, std::string_view filename,
+                                            std::string_view contentType)
+{
+	if (contentType.find_first_of("\r\n") != std::string_view::npos)
+	{
+		throw std::invalid_argument("Invalid part content type: " + std::string(contentType));
+	}
+	Part &part = parts.emplace_back();
+	part.kind = kind;
+	part.head.append("--").append(boundary).append(CRLF);
+	part.head.append("Content-Disposition: form-data; name=");
+	appendQuoted(part.head, name);
+	if (!filename.empty())
+	{
+		part.head.append("; filename=");
+		appendQuoted(part.head, filename);
+	}
+	part.head.append(CRLF);
+	if (!contentType.empty())
+	{
+		part.head.append("Content-Type: ").append(contentType).append(CRLF);
+	}
+	part.head.append(CRLF);
+	return part;
+}
+
+MultipartBody &MultipartBody::addField(std::string_view name, std::string_view value)
+{
+	Part &part = addPart(PartKind::MEMORY, name, {}, {});
+	part.value = value;
+	part.length = part.value.length();
+	return *this;
+}
+
+MultipartBody &MultipartBody::addData(std::string_view name, const char *data, size_t len, std::string_view filename,
+                                      std::string_view contentType)
+{
+	Part &part = addPart(PartKind::MEMORY, name, filename, contentType);
+	part.data = data;
+	part.length = len;
+	return *this;
+}
+
+MultipartBody &MultipartBody::addFile(std::string_view name, int fd, std::string_view filename,
+                                      std::string_view contentType)
+{
+	size_t size = 0;
+	if (!fileSize(fd, size))
+	{
+		throw std::runtime_error("Cannot get the size of file " + std::string(filename));
+	}
+	Part &part = addPart(PartKind::DESCRIPTOR, name, filename, contentType);
+	part.fd = fd;
+	part.length = size;
+	return *this;
+}
+
+MultipartBody &MultipartBody::addFile(std::string_view name, const std::string &path, std::string_view contentType)
+{
+	int fd = openFile(path);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Cannot open " + path);
+	}
+	size_t slash = path.find_last_of("/\\");
+	std::string_view filename(path);
+	filename.remove_prefix((slash == std::string::npos) ? 0 : slash + 1);
+	try
+	{
+		addFile(name, fd, filename, contentType);
+	}
+	catch (...)
+	{
+		closeFile(fd);
+		throw;
+	}
+	parts.back().ownsFd = true;
+	return *this;
+}
+
+MultipartBody &MultipartBody::addProducer(std::string_view name, BodyProducer producer, size_t length,
+                                          std::string_view filename, std::string_view contentType)
+{
+	Part &part = addPart(PartKind::PRODUCER, name, filename, contentType);
+	part.producer = std::move(producer);
+	part.length = length;
+	return *this;
+}
+
+size_t MultipartBody::getLength() const
+{
+	/* "--boundary--\r\n" */
+	size_t length = boundary.length() + 6;
+	for (const Part &part: parts)
+	{
+		if (part.length == UNKNOWN_BODY_LENGTH)
+		{
+			return UNKNOWN_BODY_LENGTH;
+		}
+		length += part.head.length() + part.length + CRLF.length();
+	}
+	return length;
+}
+
+std::string MultipartBody::getContentType() const
+{
+	return "multipart/form-data; boundary=" + boundary;
+}
+
+bool MultipartBody::isRepeatable() const
+{
+	return std::none_of(parts.begin(), parts.end(), [](const Part &part)
+	{
+		return part.kind == PartKind::PRODUCER;
+	});
+}
+
+bool MultipartBody::writeTo(BodyWriter &writer) const
+{
+	/* Memory parts and the delimiters between them are gathered into one write */
+	constexpr size_t MAX_PENDING = 48;
+	IoSlice pending[MAX_PENDING];
+	size_t count = 0;
+	auto flush = [&writer, &pending, &count]()
+	{
+		bool written = (count == 0) || writer.write(pending, count);
+		count = 0;
+		return written;
+	};
+	auto add = [&flush, &pending, &count](const char *data, size_t len)
+	{
+		if ((count == MAX_PENDING) && !flush())
+		{
+			return false;
+		}
+		pending[count++] = IoSlice{data, len};
+		return true;
+	};
+	std::string closing = "--" + boundary + "--\r\n";
+	for (const Part &part: parts)
+	{
+		if (!add(part.head.data(), part.head.length()))
+		{
+			return false;
+		}
+		if (part.kind == PartKind::MEMORY)
+		{
+			/* A field's data is its value, which moves with the vector */
+			const char *data = (part.data != nullptr) ? part.data : part.value.data();
+			if ((part.length > 0) && !add(data, part.length))
+			{
+				return false;
+			}
+		}
+		else if (part.kind == PartKind::DESCRIPTOR)
+		{
+			if (!flush() || !writer.writeFile(part.fd, 0, part.length))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			if (!flush())
+			{
+				return false;
+			}
+			char buffer[16 * 1024];
+			size_t total = 0;
+			while (true)
+			{
+				long produced = part.producer(buffer, sizeof(buffer));
+				if (produced < 0)
+				{
+					return false;
+				}
+				if (produced == 0)
+				{
+					break;
+				}
+				IoSlice piece{buffer, std::min(static_cast<size_t>(produced), sizeof(buffer))};
+				total += piece.len;
+				if (((part.length != UNKNOWN_BODY_LENGTH) && (total > part.length)) || !writer.write(&piece, 1))
+				{
+					return false;
+				}
+			}
+			if ((part.length != UNKNOWN_BODY_LENGTH) && (total != part.length))
+			{
+				return false;
+			}
+		}
+		if (!add(CRLF.data(), CRLF.length()))
+		{
+			return false;
+		}
+	}
+	return add(closing.data(), closing.length()) && flush();
+}
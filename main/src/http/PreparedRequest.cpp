@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "../../include/http/HttpBase.h"
+#include "../../include/http/PreparedRequest.h"
+
+/********************** PreparedRequest **********************/
+/* A CR or LF in a slot value would end the line early and let the rest pass for more header fields */
+static void checkLine(std::string_view value, const char *slot)
+{
+	if (value.find_first_of("\r\n") != std::string_view::npos)
+	{
+		throw std::invalid_argument(std::string("Line break in the ") + slot + " slot");
+	}
+}
+
+/* gather() sends the value as it is, toRequest() resolves it against the URL. They only agree on an origin-form
+ * target: an absolute path without dot segments, a query may follow. */
+static void checkPath(std::string_view value)
+{
+	checkLine(value, "path");
+	if (value.empty())
+	{
+		return;
+	}
+	if ((value[0] != '/') || (0 == value.compare(0, 2, "//")) ||
+	    (value.find_first_of(" \t#") != std::string_view::npos))
+	{
+		throw std::invalid_argument("Path slot value is not an origin-form target");
+	}
+	std::string_view path = value.substr(0, value.find('?'));
+	size_t segmentStart = 1;
+	while (segmentStart <= path.length())
+	{
+		size_t segmentEnd = std::min(path.find('/', segmentStart), path.length());
+		std::string_view segment = path.substr(segmentStart, segmentEnd - segmentStart);
+		if ((segment == ".") || (segment == ".."))
+		{
+			throw std::invalid_argument("Dot segment in the path slot");
+		}
+		segmentStart = segmentEnd + 1;
+	}
+}
+
+void PreparedRequest::check(const Values &values) const
+{
+	if (hasPathSlot)
+	{
+		checkPath(values.path);
+	}
+	for (size_t i = 0; i < headerSlots.size(); ++i)
+	{
+		checkLine(values.headers[i], "header");
+	}
+}
+
+size_t PreparedRequest::gather(const Values &values, IoSlice *slices, char (&digits)[20]) const
+{
+	check(values);
+	size_t count = 0;
+	for (const auto &part: parts)
+	{
+		if (part.len > 0)
+		{
+			slices[count++] = IoSlice{head.data() + part.offset, part.len};
+		}
+		std::string_view value;
+		switch (part.slot)
+		{
+			case Slot::PATH:
+				value = values.path.empty() ? std::string_view("/") : values.path;
+				break;
+			case Slot::HEADER:
+				value = values.headers[part.index];
+				break;
+			case Slot::CONTENT_LENGTH:
+			{
+				size_t len = values.body.length();
+				size_t pos = sizeof(digits);
+				do
+				{
+					digits[--pos] = static_cast<char>('0' + len % 10);
+					len /= 10;
+				}
+				while (len != 0);
+				value = std::string_view(digits + pos, sizeof(digits) - pos);
+				break;
+			}
+			case Slot::BODY:
+				value = hasBodySlot ? values.body :
+				        std::string_view(request.body->getContent(), request.body->getBodyLength());
+				break;
+			case Slot::NONE:
+			default:
+				break;
+		}
+		if (!value.empty())
+		{
+			slices[count++] = IoSlice{value.data(), value.length()};
+		}
+	}
+	return count;
+}
+
+HttpRequest PreparedRequest::toRequest(const Values &values) const
+{
+	check(values);
+	HttpRequest result = request;
+	if (hasPathSlot)
+	{
+		result.uri = result.uri.resolve(values.path.empty() ? std::string("/") : std::string(values.path));
+	}
+	for (size_t i = 0; i < headerSlots.size(); ++i)
+	{
+		result.header.setField(headerSlots[i], values.headers[i]);
+	}
+	if (hasBodySlot)
+	{
+		result.body = std::make_shared<HttpBodyImpl>(values.body.data(), values.body.length());
+		result.body->setBodyLength(values.body.length());
+		result.header.setField("Content-Length", std::to_string(values.body.length()));
+	}
+	return result;
+}
+
+PreparedRequest::Builder PreparedRequest::newBuilder()
+{
+	return PreparedRequest::Builder{};
+}
+
+PreparedRequest::Builder &PreparedRequest::Builder::request(HttpRequest request) &
+{
+	this->templateRequest = std::move(request);
+	return *this;
+}
+
+PreparedRequest::Builder &PreparedRequest::Builder::pathSlot() &
+{
+	this->hasPathSlot = true;
+	return *this;
+}
+
+PreparedRequest::Builder &PreparedRequest::Builder::headerSlot(const std::string &name) &
+{
+	if (this->headerSlots.size() >= MAX_HEADER_SLOTS)
+	{
+		throw std::invalid_argument("Too many header slots, at most " + std::to_string(MAX_HEADER_SLOTS));
+	}
+	std::string lowerName = name;
+	toLowCase(lowerName);
+	if ((lowerName == "content-length") || (lowerName == "host"))
+	{
+		throw std::invalid_argument("Header slot not allowed: " + name);
+	}
+	this->headerSlots.push_back(lowerName);
+	return *this;
+}
+
+PreparedRequest::Builder &PreparedRequest::Builder::bodySlot() &
+{
+	this->hasBodySlot = true;
+	return *this;
+}
+
+PreparedRequest PreparedRequest::Builder::build() const &
+{
+	Builder copy = *this;
+	return std::move(copy).build();
+}
+
+PreparedRequest PreparedRequest::Builder::build() &&
+{
+	PreparedRequest prepared;
+	prepared.request = std::move(this->templateRequest);
+	prepared.headerSlots = std::move(this->headerSlots);
+	prepared.hasPathSlot = this->hasPathSlot;
+	prepared.hasBodySlot = this->hasBodySlot;
+	const HttpRequest &request = prepared.request;
+
+	Buffer buffer;
+	size_t partStart = 0;
+	auto endPart = [&buffer, &prepared, &partStart](Slot slot, size_t index)
+	{
+		prepared.parts.push_back(Part{partStart, buffer.size() - partStart, slot, index});
+		partStart = buffer.size();
+	};
+
+	if (this->hasPathSlot)
+	{
+		/* The request line without the target: "METHOD " slot " HTTP/1.1\r\n" */
+		Buffer line;
+		request.appendRequestLineTo(line);
+		std::string lineStr = line.toString();
+		size_t methodEnd = lineStr.find(' ') + 1;
+		buffer.append(lineStr.data(), methodEnd);
+		endPart(Slot::PATH, 0);
+		buffer.append(' ');
+		HttpVersionAppendTo(request.version, buffer);
+		buffer.append("\r\n", 2);
+	}
+	else
+	{
+		request.appendRequestLineTo(buffer);
+	}
+
+	HttpHeader fixed = request.header;
+	for (const auto &name: prepared.headerSlots)
+	{
+		fixed.removeField(name);
+	}
+	if (this->hasBodySlot)
+	{
+		fixed.removeField("content-length");
+	}
+	fixed.appendTo(buffer);
+	/* Reopen the header to add the slot fields before the blank line */
+	Buffer fields;
+	fields.append(buffer.data(), buffer.size() - 2);
+	buffer = std::move(fields);
+	for (size_t i = 0; i < prepared.headerSlots.size(); ++i)
+	{
+		HttpHeader single;
+		single.setField(prepared.headerSlots[i], "");
+		Buffer name;
+		single.appendTo(name);
+		/* "Name: \r\n\r\n" without the trailing "\r\n\r\n" */
+		buffer.append(name.data(), name.size() - 4);
+		endPart(Slot::HEADER, i);
+		buffer.append("\r\n", 2);
+	}
+	if (this->hasBodySlot)
+	{
+		buffer.append("Content-Length: ", 16);
+		endPart(Slot::CONTENT_LENGTH, 0);
+		buffer.append("\r\n", 2);
+	}
+	buffer.append("\r\n", 2);
+	bool hasBody = this->hasBodySlot || ((request.body != nullptr) && (request.body->getBodyLength() > 0));
+	endPart(hasBody ? Slot::BODY : Slot::NONE, 0);
+	prepared.head = buffer.toString();
+	return prepared;
+}
@@ -1,5 +1,8 @@
 #include <cassert>
+#include <functional>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 #include <openssl/ssl.h>
@@ -25,6 +28,135 @@ long tlsProtocolToVersion(TLSProtocol protocol)
 	return version;
 }
 
+/********************** TlsSessionCache **********************/
+/* The last few resumable sessions per origin. Origins are spread over shards so that handshakes to different
+ * servers do not take the same lock, the cache is only touched around handshakes and new session tickets. */
+class TlsSessionCache
+{
+public:
+	TlsSessionCache() = default;
+
+	TlsSessionCache(const TlsSessionCache &other) = delete;
+
+	TlsSessionCache &operator=(const TlsSessionCache &other) = delete;
+
+	~TlsSessionCache()
+	{
+		for (auto &shard: shards)
+		{
+			for (auto &item: shard.sessionMap)
+			{
+				for (SSL_SESSION *session: item.second)
+				{
+					SSL_SESSION_free(session);
+				}
+			}
+		}
+	}
+
+	/* Returns a reference to the newest session or nullptr. A TLS 1.3 session is taken out, a server may refuse
+	 * its ticket the second time (RFC 8446 appendix C.4), so parallel handshakes must not offer the same one. */
+	SSL_SESSION *get(const std::string &origin)
+	{
+		Shard &shard = shardOf(origin);
+		std::lock_guard<std::mutex> lock(shard.cacheMutex);
+		auto iter = shard.sessionMap.find(origin);
+		if ((iter == shard.sessionMap.end()) || iter->second.empty())
+		{
+			return nullptr;
+		}
+		SSL_SESSION *session = iter->second.back();
+		if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION)
+		{
+			iter->second.pop_back();
+		}
+		else
+		{
+			SSL_SESSION_up_ref(session);
+		}
+		return session;
+	}
+
+	/* Takes over the reference of session */
+	void put(const std::string &origin, SSL_SESSION *session)
+	{
+		Shard &shard = shardOf(origin);
+		std::lock_guard<std::mutex> lock(shard.cacheMutex);
+		auto iter = shard.sessionMap.find(origin);
+		if (iter == shard.sessionMap.end())
+		{
+			if (shard.sessionMap.size() >= CAPACITY_PER_SHARD)
+			{
+				for (SSL_SESSION *evicted: shard.sessionMap.begin()->second)
+				{
+					SSL_SESSION_free(evicted);
+				}
+				shard.sessionMap.erase(shard.sessionMap.begin());
+			}
+			iter = shard.sessionMap.emplace(origin, std::vector<SSL_SESSION *>{}).first;
+		}
+		std::vector<SSL_SESSION *> &sessions = iter->second;
+		if (sessions.size() >= SESSIONS_PER_ORIGIN)
+		{
+			SSL_SESSION_free(sessions.front());
+			sessions.erase(sessions.begin());
+		}
+		sessions.push_back(session);
+	}
+
+	static constexpr size_t SHARDS = 16;
+	static constexpr size_t CAPACITY_PER_SHARD = 64;
+	/* TLS 1.3 tickets are used once, enough of them for as many parallel connections to one origin */
+	static constexpr size_t SESSIONS_PER_ORIGIN = 16;
+
+private:
+	struct alignas(64) Shard
+	{
+		std::mutex cacheMutex;
+		std::unordered_map<std::string, std::vector<SSL_SESSION *>> sessionMap;
+	};
+
+	Shard &shardOf(const std::string &origin)
+	{
+		return shards[std::hash<std::string>{}(origin) % SHARDS];
+	}
+
+private:
+	Shard shards[SHARDS];
+};
+
+static void freeOrigin(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	delete static_cast<std::string *>(ptr);
+}
+
+/* Index of the origin an SSL connects to, owned by the SSL */
+static int originIndex()
+{
+	static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, freeOrigin);
+	return index;
+}
+
+/* Index of the TlsSessionCache of an SSL_CTX */
+static int cacheIndex()
+{
+	static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+	return index;
+}
+
+/* Called for every session the server issues (with TLS 1.3 after the handshake, on a later read) */
+static int onNewSession(SSL *ssl, SSL_SESSION *session)
+{
+	auto *cache = static_cast<TlsSessionCache *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), cacheIndex()));
+	auto *origin = static_cast<const std::string *>(SSL_get_ex_data(ssl, originIndex()));
+	if ((cache == nullptr) || (origin == nullptr) || (1 != SSL_SESSION_is_resumable(session)))
+	{
+		return 0;
+	}
+	cache->put(*origin, session);
+	return 1;
+}
+
 /************************ TLSContext *************************/
 TLSContext::Initializer::Initializer()
 {
@@ -42,10 +174,10 @@ TLSContext::TLSContext(TLSContext &&other) noexcept
 	{
 		this->sslCtx = other.sslCtx;
 		other.sslCtx = nullptr;
-		this->ssl = other.ssl;
-		other.ssl = nullptr;
+		this->sessionCache = std::move(other.sessionCache);
 		this->tlsProtocol = other.tlsProtocol;
 		this->ciphers = std::move(other.ciphers);
+		this->earlyData = other.earlyData;
 	}
 }
 
@@ -53,23 +185,22 @@ TLSContext &TLSContext::operator=(TLSContext &&other) noexcept
 {
 	if (this != &other)
 	{
+		if (this->sslCtx != nullptr)
+		{
+			SSL_CTX_free(this->sslCtx);
+		}
 		this->sslCtx = other.sslCtx;
 		other.sslCtx = nullptr;
-		this->ssl = other.ssl;
-		other.ssl = nullptr;
+		this->sessionCache = std::move(other.sessionCache);
 		this->tlsProtocol = other.tlsProtocol;
 		this->ciphers = std::move(other.ciphers);
+		this->earlyData = other.earlyData;
 	}
 	return *this;
 }
 
 TLSContext::~TLSContext()
 {
-	if (ssl != nullptr)
-	{
-		SSL_shutdown(ssl);
-		SSL_free(ssl);
-	}
 	if (sslCtx != nullptr)
 	{
 		SSL_CTX_free(sslCtx);
@@ -86,6 +217,35 @@ std::vector<std::string> TLSContext::getCiphers() const
 	return this->ciphers;
 }
 
+size_t TLSContext::takeEarlyData(SSL *ssl) const
+{
+	SSL_SESSION *session = SSL_get0_session(ssl);
+	if (!this->earlyData || (session == nullptr) || (SSL_SESSION_get_protocol_version(session) != TLS1_3_VERSION))
+	{
+		return 0;
+	}
+	/* The cache gave the session to this connection alone, its early data is not sent twice (RFC 8446 section 8) */
+	return SSL_SESSION_get_max_early_data(session);
+}
+
+SSL *TLSContext::newSSL(const std::string &origin) const
+{
+	assert(this->sslCtx != nullptr);
+	SSL *ssl = SSL_new(this->sslCtx);
+	if ((ssl == nullptr) || (this->sessionCache == nullptr))
+	{
+		return ssl;
+	}
+	SSL_set_ex_data(ssl, originIndex(), new std::string(origin));
+	SSL_SESSION *session = this->sessionCache->get(origin);
+	if (session != nullptr)
+	{
+		SSL_set_session(ssl, session);
+		SSL_SESSION_free(session);
+	}
+	return ssl;
+}
+
 /********************* TLSContextBuilder *********************/
 TLSContextBuilder::Builder &TLSContextBuilder::Builder::newClientBuilder()
 {
@@ -96,25 +256,25 @@ TLSContextBuilder::Builder &TLSContextBuilder::Builder::newClientBuilder()
 		throw std::runtime_error("SSL context create failed!");
 	}
 	this->tlsContext.sslCtx = sslCtx;
-
-	tlsContext.ssl = SSL_new(sslCtx);
-	if (tlsContext.ssl == nullptr)
-	{
-		throw std::runtime_error("SSL create failed!");
-	}
-	if (0 == SSL_set_min_proto_version(this->tlsContext.ssl, tlsProtocolToVersion(this->tlsContext.tlsProtocol)))
+	if (0 == SSL_CTX_set_min_proto_version(sslCtx, tlsProtocolToVersion(this->tlsContext.tlsProtocol)))
 	{
 		std::string exceptWhat("Set TLS version error!");
 		throw std::runtime_error(exceptWhat);
 	}
+
+	/* Sessions are looked up by origin here rather than by OpenSSL's internal (server side) cache */
+	this->tlsContext.sessionCache = std::make_shared<TlsSessionCache>();
+	SSL_CTX_set_ex_data(sslCtx, cacheIndex(), this->tlsContext.sessionCache.get());
+	SSL_CTX_set_session_cache_mode(sslCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(sslCtx, onNewSession);
 	return *this;
 }
 
 TLSContextBuilder::Builder &TLSContextBuilder::Builder::setMinVersion(TLSProtocol protocol)
 {
-	assert(this->tlsContext.ssl != nullptr);
+	assert(this->tlsContext.sslCtx != nullptr);
 
-	if (0 == SSL_set_min_proto_version(this->tlsContext.ssl, tlsProtocolToVersion(protocol)))
+	if (0 == SSL_CTX_set_min_proto_version(this->tlsContext.sslCtx, tlsProtocolToVersion(protocol)))
 	{
 		std::string exceptWhat("Set TLS version error!");
 		throw std::runtime_error(exceptWhat);
@@ -123,9 +283,15 @@ TLSContextBuilder::Builder &TLSContextBuilder::Builder::setMinVersion(TLSProtoco
 	return *this;
 }
 
+TLSContextBuilder::Builder &TLSContextBuilder::Builder::enableEarlyData(bool enable)
+{
+	this->tlsContext.earlyData = enable;
+	return *this;
+}
+
 TLSContext TLSContextBuilder::Builder::build()
 {
-	assert(this->tlsContext.ssl != nullptr);
+	assert(this->tlsContext.sslCtx != nullptr);
 	return std::move(this->tlsContext);
 }
 
@@ -1,18 +1,78 @@
 #include <regex>
 #include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <vector>
 
+#include "../../include/http/HttpBase.h"
 #include "../../include/http/URL.h"
+#include "../../include/http/utils.h"
 
 URL::URL()
 {
 	this->initialize();
 }
 
+static int hexValue(char ch)
+{
+	if ((ch >= '0') && (ch <= '9'))
+	{
+		return ch - '0';
+	}
+	ch = static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+	return ((ch >= 'a') && (ch <= 'f')) ? (ch - 'a' + 10) : -1;
+}
+
+static std::string percentDecode(std::string_view encoded)
+{
+	std::string decoded;
+	for (size_t i = 0; i < encoded.length(); ++i)
+	{
+		if (encoded[i] != '%')
+		{
+			decoded += encoded[i];
+			continue;
+		}
+		int high = (i + 2 < encoded.length()) ? hexValue(encoded[i + 1]) : -1;
+		int low = (high >= 0) ? hexValue(encoded[i + 2]) : -1;
+		if (low < 0)
+		{
+			throw std::invalid_argument("Invalid percent-encoding in URL.");
+		}
+		decoded += static_cast<char>(high * 16 + low);
+		i += 2;
+	}
+	return decoded;
+}
+
+static constexpr std::string_view UNIX_PREFIX = "http+unix://";
+
 URL::URL(const std::string &str)
 {
 	this->initialize();
 
+	std::string lowerPrefix = str.substr(0, UNIX_PREFIX.length());
+	toLowCase(lowerPrefix);
+	if (lowerPrefix == UNIX_PREFIX)
+	{
+		size_t authorityEnd = std::min(str.find_first_of("/?", UNIX_PREFIX.length()), str.length());
+		host = str.substr(UNIX_PREFIX.length(), authorityEnd - UNIX_PREFIX.length());
+		socketPath = percentDecode(host);
+		if (socketPath.empty() || (socketPath.length() > MAX_SOCKET_PATH) ||
+		    (socketPath.find('\0') != std::string::npos))
+		{
+			throw std::invalid_argument("Invalid Unix socket path in URL.");
+		}
+		scheme = Scheme::Http;
+		port = 80;
+		size_t queryStart = std::min(str.find('?', authorityEnd), str.length());
+		path = (queryStart > authorityEnd) ? str.substr(authorityEnd, queryStart - authorityEnd) : "/";
+		if (queryStart + 1 < str.length())
+		{
+			query = str.substr(queryStart + 1);
+		}
+		return;
+	}
+
 	std::regex regexAuth(R"((https?):\/\/([^:\s]+):([^@\s]+)@([^\/:\s]+)(:\d+)?(\/[^?\s]*)?(\?\S+)?)");
 	std::regex regexNoAuth(R"((https?):\/\/([^\/:\s]+)(:\d+)?(\/[^?\s]*)?(\?\S+)?)");
 	std::smatch matchResults;
@@ -92,16 +152,36 @@ URL::URL(const std::string &str)
 	}
 }
 
+URL::URL(const URL &other) : scheme(other.scheme), authInfo(other.authInfo, getMemoryResource()),
+                             host(other.host, getMemoryResource()), port(other.port),
+                             path(other.path, getMemoryResource()), query(other.query, getMemoryResource()),
+                             socketPath(other.socketPath, getMemoryResource())
+{
+}
+
 std::string URL::serialize() const
 {
-	std::stringstream ss;
+	Buffer buffer;
+	appendTo(buffer);
+	return buffer.toString();
+}
+
+void URL::appendTo(Buffer &buffer) const
+{
+	if (!socketPath.empty())
+	{
+		buffer.append(UNIX_PREFIX.data(), UNIX_PREFIX.length());
+		buffer.append(host);
+		appendRequestTargetTo(buffer);
+		return;
+	}
 	switch (scheme)
 	{
 		case Scheme::Http:
-			ss << "http://";
+			buffer.append("http://", 7);
 			break;
 		case Scheme::Https:
-			ss << "https://";
+			buffer.append("https://", 8);
 			break;
 		case Scheme::Null:
 		default:
@@ -110,20 +190,154 @@ std::string URL::serialize() const
 	if (!authInfo.empty())
 	{
 		size_t delimiter = authInfo.find_first_of('@');
-		ss << authInfo.substr(0, delimiter) << ":" << authInfo.substr(delimiter + 1) + "@";
+		buffer.append(authInfo.data(), std::min(delimiter, authInfo.length()));
+		buffer.append(':');
+		if (delimiter != std::string::npos)
+		{
+			buffer.append(authInfo.data() + delimiter + 1, authInfo.length() - delimiter - 1);
+		}
+		buffer.append('@');
 	}
-	ss << host;
+	buffer.append(host);
 	if (((scheme == Scheme::Http) && (port != 80)) ||
 	    ((scheme == Scheme::Https) && (port != 443)))
 	{
-		ss << ":" << port;
+		buffer.append(':');
+		buffer.appendDecimal(port);
 	}
-	ss << path;
+	appendRequestTargetTo(buffer);
+}
+
+void URL::appendRequestTargetTo(Buffer &buffer) const
+{
+	buffer.append(path);
 	if (!query.empty())
 	{
-		ss << "?" << query;
+		buffer.append('?');
+		buffer.append(query);
+	}
+}
+
+/* RFC 3986 5.2.4 */
+static std::string removeDotSegments(const std::string &path)
+{
+	std::vector<std::string> segments;
+	size_t begin = 0;
+	while (begin <= path.length())
+	{
+		size_t end = path.find_first_of('/', begin);
+		if (end == std::string::npos)
+		{
+			end = path.length();
+		}
+		std::string segment = path.substr(begin, end - begin);
+		if (segment == "..")
+		{
+			if (segments.size() > 1)
+			{
+				segments.pop_back();
+			}
+		}
+		else if (segment != ".")
+		{
+			segments.push_back(segment);
+		}
+		begin = end + 1;
+	}
+	std::string last = path.substr(path.find_last_of('/') + 1);
+	std::string result;
+	for (size_t i = 0; i < segments.size(); ++i)
+	{
+		if (i > 0)
+		{
+			result += "/";
+		}
+		result += segments[i];
+	}
+	if (((last == ".") || (last == "..")) && !result.empty())
+	{
+		result += "/";
+	}
+	if (result.empty() || (result[0] != '/'))
+	{
+		result.insert(0, "/");
+	}
+	return result;
+}
+
+URL URL::resolve(const std::string &reference) const
+{
+	std::string ref = reference.substr(0, reference.find_first_of('#'));
+	trim(ref);
+	std::string lowerRef = ref.substr(0, UNIX_PREFIX.length());
+	toLowCase(lowerRef);
+	if ((0 == lowerRef.compare(0, 7, "http://")) || (0 == lowerRef.compare(0, 8, "https://")) ||
+	    (lowerRef == UNIX_PREFIX))
+	{
+		/* Schemes are case-insensitive (RFC 3986 section 3.1), the parser only takes them in lowercase */
+		size_t schemeEnd = ref.find(':');
+		return URL(lowerRef.substr(0, schemeEnd) + ref.substr(schemeEnd));
+	}
+	if (0 == ref.compare(0, 2, "//"))
+	{
+		return URL((scheme == Scheme::Https ? "https:" : "http:") + ref);
+	}
+
+	URL target = *this;
+	std::string refPath = ref;
+	std::string refQuery;
+	bool hasQuery = false;
+	size_t delimiter = ref.find_first_of('?');
+	if (delimiter != std::string::npos)
+	{
+		refPath = ref.substr(0, delimiter);
+		refQuery = ref.substr(delimiter + 1);
+		hasQuery = true;
+	}
+	if (refPath.empty())
+	{
+		if (hasQuery)
+		{
+			target.query = refQuery;
+		}
+		return target;
+	}
+	if (refPath[0] == '/')
+	{
+		target.path = removeDotSegments(refPath);
+	}
+	else
+	{
+		target.path = removeDotSegments(std::string(path, 0, path.find_last_of('/') + 1) + refPath);
+	}
+	target.query = refQuery;
+	return target;
+}
+
+std::string URL::getOrigin() const
+{
+	if (!socketPath.empty())
+	{
+		return std::string(UNIX_PREFIX).append(host);
+	}
+	std::string origin = (scheme == Scheme::Https) ? "https://" : "http://";
+	origin.append(host).append(":").append(std::to_string(port));
+	return origin;
+}
+
+std::string URL::getAuthority() const
+{
+	if (!socketPath.empty())
+	{
+		return "localhost";
+	}
+	if (((scheme == Scheme::Http) && (port == 80)) || ((scheme == Scheme::Https) && (port == 443)) || (port == 0))
+	{
+		return std::string(host);
 	}
-	return ss.str();
+	std::string authority(host);
+	authority.append(":").append(std::to_string(port));
+	return authority;
 }
 
 void URL::initialize()
@@ -134,4 +348,5 @@ void URL::initialize()
 	port = 0;
 	path = {};
 	query = {};
+	socketPath = {};
 }
@@ -0,0 +1,869 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/epoll.h>
+
+#endif
+#ifndef _WIN32
+
+#include <sys/socket.h>
+
+#endif
+
+#include <openssl/ssl.h>
+
+#include "../../include/http/WebSocket.h"
+#include "Connection.h"
+#include "EventLoop.h"
+#include "WebSocketCodec.h"
+
+/************************* WebSocket *************************/
+static const std::shared_ptr<const TLSContext> &defaultTlsContext()
+{
+	static const std::shared_ptr<const TLSContext> context = std::make_shared<const TLSContext>(
+			TLSContextBuilder::newBuilder().newClientBuilder().setMinVersion(TLSProtocol::TLSv1_2).build());
+	return context;
+}
+
+static bool equalsIgnoreCase(std::string_view left, std::string_view right)
+{
+	return (left.length() == right.length()) &&
+	       std::equal(left.begin(), left.end(), right.begin(), [](char a, char b)
+	       {
+		       return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+	       });
+}
+
+/* Whether the comma separated list holds token */
+static bool listContains(std::string_view list, std::string_view token)
+{
+	size_t index = 0;
+	while (index <= list.length())
+	{
+		size_t comma = std::min(list.find(',', index), list.length());
+		std::string_view item = list.substr(index, comma - index);
+		while (!item.empty() && (item.front() == ' '))
+		{
+			item.remove_prefix(1);
+		}
+		while (!item.empty() && (item.back() == ' '))
+		{
+			item.remove_suffix(1);
+		}
+		if (equalsIgnoreCase(item, token))
+		{
+			return true;
+		}
+		index = comma + 1;
+	}
+	return false;
+}
+
+#ifdef __linux__
+/* Waits up to millis for the readiness status asks for, false unless it came */
+static bool awaitSocket(SocketHandle handle, AsyncTlsConnection::IoStatus status, int millis)
+{
+	pollfd pollFd{handle, static_cast<short>((status == AsyncTlsConnection::IoStatus::WANT_READ) ? POLLIN : POLLOUT),
+	              0};
+	int ready;
+	do
+	{
+		ready = poll(&pollFd, 1, millis);
+	} while ((ready < 0) && (errno == EINTR));
+	return ready > 0;
+}
+
+static bool isWaiting(AsyncTlsConnection::IoStatus status)
+{
+	return (status == AsyncTlsConnection::IoStatus::WANT_READ) || (status == AsyncTlsConnection::IoStatus::WANT_WRITE);
+}
+#endif
+
+static std::unique_ptr<Connection> connectTo(const URL &uri, const WebSocketConfig &config, RequestTrace &trace)
+{
+	SocketHandle socketHandle = createSocket(uri, std::string(), false, &trace);
+	if (socketHandle == INVALID_FD)
+	{
+		return nullptr;
+	}
+	setSocketTimeout(socketHandle, config.timeout);
+	if (uri.getScheme() != Scheme::Https)
+	{
+		return std::make_unique<PlainConnection>(socketHandle);
+	}
+	const TLSContext &context = config.tlsContext ? *config.tlsContext : *defaultTlsContext();
+	SSL *ssl = context.newSSL(uri.getOrigin());
+	if (ssl == nullptr)
+	{
+		closeSocket(socketHandle);
+		return nullptr;
+	}
+	std::string host(uri.getHost());
+	SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, const_cast<char *>(host.c_str()));
+#ifdef __linux__
+	/* Memory BIOs, so that an event loop can read the connection once it listens */
+	auto tlsConnection = std::make_unique<AsyncTlsConnection>(socketHandle, ssl, config.timeout);
+	AsyncTlsConnection::IoStatus status;
+	while ((status = tlsConnection->handshake()) != AsyncTlsConnection::IoStatus::DONE)
+	{
+		if (!isWaiting(status) || !awaitSocket(socketHandle, status, static_cast<int>(config.timeout * 1000)))
+		{
+#ifdef _DEBUG
+			printf("%s:%d tls connect to server failed\n", __func__, __LINE__);
+#endif
+			return nullptr;
+		}
+	}
+	return tlsConnection;
+#else
+	if (!setSocketBio(ssl, socketHandle))
+	{
+		SSL_free(ssl);
+		closeSocket(socketHandle);
+		return nullptr;
+	}
+	int var = SSL_connect(ssl);
+	if (var != 1)
+	{
+#ifdef _DEBUG
+		printf("%s:%d tls connect to server failed: %d\n", __func__, __LINE__, SSL_get_error(ssl, var));
+#endif
+		SSL_free(ssl);
+		closeSocket(socketHandle);
+		return nullptr;
+	}
+	return std::make_unique<TlsConnection>(socketHandle, ssl);
+#endif
+}
+
+std::shared_ptr<WebSocket> WebSocket::connect(const std::string &url, const WebSocketConfig &config)
+{
+	std::string httpUrl = url;
+	if ((url.length() >= 5) && equalsIgnoreCase(std::string_view(url).substr(0, 5), "ws://"))
+	{
+		httpUrl = "http://" + url.substr(5);
+	}
+	else if ((url.length() >= 6) && equalsIgnoreCase(std::string_view(url).substr(0, 6), "wss://"))
+	{
+		httpUrl = "https://" + url.substr(6);
+	}
+	return connect(HttpRequestBuilder::newBuilder().url(URL(httpUrl)).GET().build(), config);
+}
+
+std::shared_ptr<WebSocket> WebSocket::connect(const HttpRequest &request, const WebSocketConfig &config)
+{
+	if (request.uri.getScheme() == Scheme::Null)
+	{
+		throw std::runtime_error("WebSocket URL without http or https scheme");
+	}
+	HttpRequest handshake(request);
+	handshake.method = HttpMethod::GET;
+	handshake.body = nullptr;
+	handshake.producer = nullptr;
+	handshake.source = nullptr;
+	std::string key = webSocketKey();
+	handshake.header.setField("Upgrade", "websocket");
+	handshake.header.setField("Connection", "Upgrade");
+	handshake.header.setField("Sec-WebSocket-Key", key);
+	handshake.header.setField("Sec-WebSocket-Version", "13");
+	if (!config.protocols.empty())
+	{
+		std::string protocols;
+		for (const std::string &protocol: config.protocols)
+		{
+			protocols.append(protocols.empty() ? "" : ", ").append(protocol);
+		}
+		handshake.header.setField("Sec-WebSocket-Protocol", protocols);
+	}
+	bool offerDeflate = config.deflate && PerMessageDeflate::isAvailable();
+	if (offerDeflate)
+	{
+		handshake.header.setField("Sec-WebSocket-Extensions", PerMessageDeflate::OFFER);
+	}
+
+	std::string url = handshake.uri.getOrigin();
+	HttpResponse response{};
+	RequestTrace trace{handshake, response.getTiming(), nullptr, nullptr};
+	std::unique_ptr<Connection> connection = connectTo(handshake.uri, config, trace);
+	if (connection == nullptr)
+	{
+		throw std::runtime_error("WebSocket connect failed: " + url);
+	}
+	Buffer output;
+	handshake.appendRequestLineTo(output);
+	handshake.header.appendTo(output, "user-agent", config.userAgent);
+	if (!connection->writeAll(output.data(), output.size()))
+	{
+		throw std::runtime_error("WebSocket handshake not sent: " + url);
+	}
+	std::string upgraded;
+	try
+	{
+		ResponseReader reader(trace, response);
+		while (true)
+		{
+			long readLen = connection->read(reader.space(), reader.spaceLen());
+			if (readLen <= 0)
+			{
+				throw std::runtime_error("Connection closed during the handshake");
+			}
+			if (reader.consume(static_cast<size_t>(readLen)))
+			{
+				break;
+			}
+		}
+		upgraded = reader.upgraded();
+		bool keepAlive;
+		reader.finish(keepAlive);
+	}
+	catch (const std::exception &e)
+	{
+		throw std::runtime_error("WebSocket handshake failed: " + url + ": " + e.what());
+	}
+
+	if (response.getStatusCode() != HttpStatus::SWITCHING_PROTOCOLS)
+	{
+		throw std::runtime_error("WebSocket handshake refused with status " +
+		                         std::to_string(static_cast<int>(response.getStatusCode())) + ": " + url);
+	}
+	const HttpHeader &header = response.getHeader();
+	if (!equalsIgnoreCase(header.getField("Upgrade"), "websocket") ||
+	    !listContains(header.getField("Connection"), "upgrade"))
+	{
+		throw std::runtime_error("Not upgraded to WebSocket: " + url);
+	}
+	if (header.getField("Sec-WebSocket-Accept") != webSocketAccept(key))
+	{
+		throw std::runtime_error("Wrong Sec-WebSocket-Accept: " + url);
+	}
+	std::string_view protocol = header.getField("Sec-WebSocket-Protocol");
+	if (!protocol.empty() && (std::find(config.protocols.begin(), config.protocols.end(), protocol) ==
+	                          config.protocols.end()))
+	{
+		throw std::runtime_error("Subprotocol not offered: " + std::string(protocol));
+	}
+	std::unique_ptr<PerMessageDeflate> messageDeflate;
+	std::string_view extensions = header.getField("Sec-WebSocket-Extensions");
+	if (!extensions.empty())
+	{
+		if (!offerDeflate)
+		{
+			throw std::runtime_error("Extension not offered: " + std::string(extensions));
+		}
+		messageDeflate = std::make_unique<PerMessageDeflate>(PerMessageDeflate::accept(extensions));
+	}
+
+	bool isTls = handshake.uri.getScheme() == Scheme::Https;
+	std::shared_ptr<WebSocket> socket(
+			new WebSocket(std::move(connection), isTls, std::move(response), config, std::move(messageDeflate)));
+	/* Frames the server sent right behind its response */
+	if (!upgraded.empty())
+	{
+		socket->parser->append(upgraded.data(), upgraded.length());
+	}
+	return socket;
+}
+
+WebSocket::WebSocket(std::unique_ptr<Connection> webSocketConnection, bool isTls, HttpResponse response,
+                     const WebSocketConfig &config, std::unique_ptr<PerMessageDeflate> messageDeflate)
+		: connection(std::move(webSocketConnection)), tls(isTls), handshakeResponse(std::move(response)),
+		  parser(std::make_unique<FrameParser>(config.maxMessageSize, messageDeflate != nullptr)),
+		  deflate(std::move(messageDeflate)), deflateThreshold(config.deflateThreshold),
+		  maxMessageSize(config.maxMessageSize), timeout(config.timeout)
+{
+}
+
+WebSocket::~WebSocket() = default;
+
+std::string_view WebSocket::getProtocol() const
+{
+	return handshakeResponse.getHeader().getField("Sec-WebSocket-Protocol");
+}
+
+bool WebSocket::sendText(std::string_view text)
+{
+	return sendFrame(WebSocketOpcode::TEXT, text.data(), text.length());
+}
+
+bool WebSocket::sendBinary(const char *data, size_t len)
+{
+	return sendFrame(WebSocketOpcode::BINARY, data, len);
+}
+
+bool WebSocket::ping(std::string_view payload)
+{
+	return sendFrame(WebSocketOpcode::PING, payload.data(), std::min(payload.length(), static_cast<size_t>(125)));
+}
+
+bool WebSocket::close(uint16_t code, std::string_view reason)
+{
+	char payload[125];
+	payload[0] = static_cast<char>(code >> 8);
+	payload[1] = static_cast<char>(code);
+	size_t reasonLen = std::min(reason.length(), sizeof(payload) - 2);
+	memcpy(payload + 2, reason.data(), reasonLen);
+	return sendFrame(WebSocketOpcode::CLOSE, payload, reasonLen + 2);
+}
+
+bool WebSocket::sendFrame(WebSocketOpcode opcode, const char *data, size_t len)
+{
+	static thread_local Buffer output;
+	static thread_local std::string compressed;
+	std::lock_guard<std::mutex> lock(writeMutex);
+	std::string control;
+	{
+		std::lock_guard<std::mutex> controlLock(controlMutex);
+		if (closed.load(std::memory_order_acquire) || closeSent)
+		{
+			return false;
+		}
+		closeSent = (opcode == WebSocketOpcode::CLOSE);
+		/* Queued control frames go first */
+		control.swap(pendingControl);
+	}
+	bool isData = (opcode == WebSocketOpcode::TEXT) || (opcode == WebSocketOpcode::BINARY);
+	bool isCompressed = false;
+	/* The compression context follows the order of the frames, so it is used under the lock */
+	if (isData && (deflate != nullptr) && deflate->canCompress() && (len >= deflateThreshold) &&
+	    deflate->compress(data, len, compressed))
+	{
+		data = compressed.data();
+		len = compressed.length();
+		isCompressed = true;
+	}
+	uint8_t maskKey[4];
+	randomMaskKey(maskKey);
+	output.clear();
+	encodeFrame(output, opcode, isCompressed, data, len, maskKey);
+	bool written = (control.empty() || writeAll(control.data(), control.length())) &&
+	               writeAll(output.data(), output.size());
+	output.shrink(4 * FrameParser::READ_SIZE);
+	if (compressed.capacity() > 4 * FrameParser::READ_SIZE)
+	{
+		std::string().swap(compressed);
+	}
+	return written;
+}
+
+bool WebSocket::writeAll(const char *data, size_t len)
+{
+#ifdef __linux__
+	if (tls)
+	{
+		/* The SSL is held for each step only, the wait for a slow peer leaves it to the reading side */
+		auto *tlsConnection = static_cast<AsyncTlsConnection *>(connection.get());
+		size_t total = 0;
+		while (true)
+		{
+			size_t written = 0;
+			AsyncTlsConnection::IoStatus status;
+			{
+				std::lock_guard<std::mutex> tlsLock(tlsMutex);
+				status = tlsConnection->writeSome(data + total, len - total, written);
+			}
+			total += written;
+			if (status == AsyncTlsConnection::IoStatus::DONE)
+			{
+				return true;
+			}
+			if (!isWaiting(status) || !awaitSocket(connection->getHandle(), status, static_cast<int>(timeout * 1000)))
+			{
+				return false;
+			}
+		}
+	}
+#endif
+	return connection->writeAll(data, len);
+}
+
+void WebSocket::sendControl(WebSocketOpcode opcode, const char *data, size_t len)
+{
+	if (!queueControl)
+	{
+		sendFrame(opcode, data, len);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> controlLock(controlMutex);
+		/* The peer is not reading, one pong waiting is answer enough (RFC 6455 section 5.5.3) */
+		if (closeSent || ((opcode == WebSocketOpcode::PONG) && !pendingControl.empty()))
+		{
+			return;
+		}
+		Buffer output;
+		uint8_t maskKey[4];
+		randomMaskKey(maskKey);
+		encodeFrame(output, opcode, false, data, len, maskKey);
+		pendingControl.append(output.data(), output.size());
+		closeSent = (opcode == WebSocketOpcode::CLOSE);
+	}
+	flushControl();
+}
+
+bool WebSocket::flushControl()
+{
+	/* A send in progress takes the queued frames along */
+	std::unique_lock<std::mutex> lock(writeMutex, std::try_to_lock);
+	std::lock_guard<std::mutex> controlLock(controlMutex);
+	if (!lock.owns_lock())
+	{
+		return pendingControl.empty();
+	}
+#ifdef __linux__
+	if (tls)
+	{
+		/* Also sends the ciphertext a read left behind, e.g. the answer to a key update */
+		size_t written = 0;
+		AsyncTlsConnection::IoStatus status;
+		{
+			std::lock_guard<std::mutex> tlsLock(tlsMutex);
+			status = static_cast<AsyncTlsConnection *>(connection.get())->writeSome(pendingControl.data(),
+			                                                                       pendingControl.length(), written);
+		}
+		pendingControl.erase(0, written);
+		if (!isWaiting(status))
+		{
+			/* Done, or broken and nothing more goes out */
+			pendingControl.clear();
+			return true;
+		}
+		return false;
+	}
+	while (!pendingControl.empty())
+	{
+		long sendLen = ::send(connection->getHandle(), pendingControl.data(), pendingControl.length(),
+		                      MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sendLen < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return false;
+			}
+			/* Broken, nothing more goes out */
+			pendingControl.clear();
+			break;
+		}
+		pendingControl.erase(0, static_cast<size_t>(sendLen));
+	}
+#endif
+	return pendingControl.empty();
+}
+
+bool WebSocket::receive(WebSocketMessage &message)
+{
+	if (listening)
+	{
+		return false;
+	}
+	while (true)
+	{
+		if (nextMessage(message))
+		{
+			return true;
+		}
+		if (closed.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		bool wouldBlock;
+		if (!readSome(false, wouldBlock))
+		{
+			shutdown();
+			return false;
+		}
+	}
+}
+
+/* 1005, 1006 and 1015 are never sent, the others below 3000 are reserved */
+static bool isValidCloseCode(uint16_t code)
+{
+	return ((code >= 1000) && (code <= 1003)) || ((code >= 1007) && (code <= 1011)) ||
+	       ((code >= 3000) && (code <= 4999));
+}
+
+bool WebSocket::nextMessage(WebSocketMessage &message)
+{
+	try
+	{
+		WebSocketFrame frame{};
+		while (!closed.load(std::memory_order_acquire) && parser->next(frame))
+		{
+			switch (frame.opcode)
+			{
+				case WebSocketOpcode::PING:
+					sendControl(WebSocketOpcode::PONG, frame.payload, frame.len);
+					continue;
+				case WebSocketOpcode::PONG:
+					continue;
+				case WebSocketOpcode::CLOSE:
+				{
+					uint16_t code = WS_CLOSE_NO_STATUS;
+					if (frame.len == 1)
+					{
+						throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Close frame of one byte");
+					}
+					if (frame.len >= 2)
+					{
+						code = static_cast<uint16_t>((static_cast<uint8_t>(frame.payload[0]) << 8) |
+						                             static_cast<uint8_t>(frame.payload[1]));
+						if (!isValidCloseCode(code))
+						{
+							throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Invalid close code");
+						}
+						if (!isValidUtf8(frame.payload + 2, frame.len - 2))
+						{
+							throw WebSocketError(WS_CLOSE_INVALID_DATA, "Close reason is not UTF-8");
+						}
+					}
+					closeCode = code;
+					closeReason.assign(frame.len >= 2 ? frame.payload + 2 : "", frame.len >= 2 ? frame.len - 2 : 0);
+					/* Echo the code, the server then closes the TCP connection */
+					sendControl(WebSocketOpcode::CLOSE, frame.payload, std::min(frame.len, static_cast<size_t>(2)));
+					shutdown();
+					return false;
+				}
+				case WebSocketOpcode::TEXT:
+				case WebSocketOpcode::BINARY:
+					if (inMessage)
+					{
+						throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "New message within a fragmented one");
+					}
+					partial.opcode = frame.opcode;
+					partial.data.assign(frame.payload, frame.len);
+					partialCompressed = frame.compressed;
+					break;
+				default:
+					if (!inMessage || frame.compressed)
+					{
+						throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Unexpected continuation frame");
+					}
+					if (partial.data.length() + frame.len > maxMessageSize)
+					{
+						throw WebSocketError(WS_CLOSE_TOO_BIG, "Message too big");
+					}
+					partial.data.append(frame.payload, frame.len);
+					break;
+			}
+			inMessage = !frame.fin;
+			if (inMessage)
+			{
+				continue;
+			}
+			if (partialCompressed)
+			{
+				std::string inflated;
+				deflate->decompress(partial.data.data(), partial.data.length(), maxMessageSize, inflated);
+				partial.data.swap(inflated);
+			}
+			if (partial.isText() && !isValidUtf8(partial.data.data(), partial.data.length()))
+			{
+				throw WebSocketError(WS_CLOSE_INVALID_DATA, "Text message is not UTF-8");
+			}
+			message.opcode = partial.opcode;
+			message.data.swap(partial.data);
+			partial.data.clear();
+			return true;
+		}
+	}
+	catch (const WebSocketError &e)
+	{
+		fail(e.code, e.what());
+	}
+	return false;
+}
+
+bool WebSocket::readSome(bool nonBlocking, bool &wouldBlock)
+{
+	wouldBlock = false;
+	char *space = parser->space();
+	size_t spaceLen = parser->spaceLen();
+	long readLen;
+#ifdef __linux__
+	if (tls)
+	{
+		auto *tlsConnection = static_cast<AsyncTlsConnection *>(connection.get());
+		while (true)
+		{
+			size_t tlsReadLen = 0;
+			AsyncTlsConnection::IoStatus status;
+			{
+				std::lock_guard<std::mutex> tlsLock(tlsMutex);
+				status = tlsConnection->readSome(space, spaceLen, tlsReadLen);
+			}
+			if (status == AsyncTlsConnection::IoStatus::DONE)
+			{
+				parser->commit(tlsReadLen);
+				return true;
+			}
+			if (!isWaiting(status))
+			{
+				return false;
+			}
+			if (nonBlocking)
+			{
+				wouldBlock = true;
+				return true;
+			}
+			/* Woken every second to notice shutdown() */
+			while (!awaitSocket(connection->getHandle(), status, 1000))
+			{
+				if (closed.load(std::memory_order_acquire))
+				{
+					return false;
+				}
+			}
+		}
+	}
+	if (nonBlocking)
+	{
+		do
+		{
+			readLen = ::recv(connection->getHandle(), space, spaceLen, MSG_DONTWAIT);
+		} while ((readLen < 0) && (errno == EINTR));
+		if ((readLen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			wouldBlock = true;
+			return true;
+		}
+	}
+	else
+#endif
+	{
+		/* Wait outside the lock, a TLS read then holds it only as long as the record takes */
+		while (!connection->waitReadable(1000))
+		{
+			if (closed.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+		}
+		if (tls)
+		{
+			std::lock_guard<std::mutex> lock(writeMutex);
+			readLen = connection->read(space, spaceLen);
+		}
+		else
+		{
+			readLen = connection->read(space, spaceLen);
+		}
+	}
+	if (readLen <= 0)
+	{
+		return false;
+	}
+	parser->commit(static_cast<size_t>(readLen));
+	return true;
+}
+
+void WebSocket::fail(uint16_t code, std::string_view reason)
+{
+#ifdef _DEBUG
+	printf("%s:%d WebSocket failed: %.*s\n", __func__, __LINE__, static_cast<int>(reason.length()), reason.data());
+#endif
+	const char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code)};
+	sendControl(WebSocketOpcode::CLOSE, payload, sizeof(payload));
+	closeCode = code;
+	closeReason = reason;
+	shutdown();
+}
+
+void WebSocket::shutdown()
+{
+	if (closed.exchange(true, std::memory_order_acq_rel))
+	{
+		return;
+	}
+	/* Wakes a reader blocked on the socket. Writing stays open for the TLS close_notify, the descriptor itself is
+	 * closed with the connection. */
+#ifdef _WIN32
+	::shutdown(connection->getHandle(), SD_RECEIVE);
+#else
+	::shutdown(connection->getHandle(), SHUT_RD);
+#endif
+}
+
+/********************* Listening WebSockets ******************/
+#ifdef __linux__
+
+/* Reads a listening ws or wss connection on an event loop thread. The control frames it answers with are queued by the
+ * socket and written as it becomes writable, the loop thread never waits for the peer. */
+class WebSocketReader : public IoHandler
+{
+public:
+	WebSocketReader(EventLoop &eventLoop, std::shared_ptr<WebSocket> webSocket,
+	                std::shared_ptr<WebSocketHandler> messageHandler)
+			: loop(eventLoop), socket(std::move(webSocket)), handler(std::move(messageHandler))
+	{
+	}
+
+	void start()
+	{
+		if (!loop.watch(static_cast<int>(socket->connection->getHandle()), watchedEvents, this))
+		{
+			socket->shutdown();
+			finish();
+			return;
+		}
+		watched = true;
+		/* Frames may already be buffered from the handshake */
+		drain();
+	}
+
+	void onEvents(uint32_t events) override
+	{
+		if (!closing)
+		{
+			drain();
+			return;
+		}
+		if (socket->flushControl() || ((events & (EPOLLERR | EPOLLHUP)) != 0))
+		{
+			finish();
+		}
+	}
+
+	void onTimeout() override
+	{
+		/* The loop stops, or the peer took too long for the close echo */
+		scheduled = false;
+		socket->close(WS_CLOSE_GOING_AWAY);
+		socket->shutdown();
+		finish();
+	}
+
+private:
+	void drain()
+	{
+		WebSocketMessage message;
+		while (true)
+		{
+			while (socket->nextMessage(message))
+			{
+				handler->onMessage(*socket, message);
+			}
+			if (!socket->isOpen())
+			{
+				close();
+				return;
+			}
+			bool wouldBlock;
+			if (!socket->readSome(true, wouldBlock))
+			{
+				socket->shutdown();
+				finish();
+				return;
+			}
+			if (wouldBlock)
+			{
+				interest(socket->flushControl() ? EPOLLIN | EPOLLRDHUP : EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+				return;
+			}
+		}
+	}
+
+	/* The close echo goes out before the socket is let go */
+	void close()
+	{
+		if (socket->flushControl())
+		{
+			finish();
+			return;
+		}
+		closing = true;
+		interest(EPOLLOUT);
+		deadline = loop.schedule(EventLoop::Clock::now() + std::chrono::seconds(socket->timeout), this);
+		scheduled = true;
+	}
+
+	void interest(uint32_t events)
+	{
+		if (events != watchedEvents)
+		{
+			loop.modify(static_cast<int>(socket->connection->getHandle()), events, this);
+			watchedEvents = events;
+		}
+	}
+
+	void finish()
+	{
+		if (scheduled)
+		{
+			loop.cancel(deadline);
+			scheduled = false;
+		}
+		if (watched)
+		{
+			loop.unwatch(static_cast<int>(socket->connection->getHandle()));
+			watched = false;
+		}
+		handler->onClose(*socket, socket->closeCode, socket->closeReason);
+		loop.retire(this);
+	}
+
+	EventLoop &loop;
+	std::shared_ptr<WebSocket> socket;
+	std::shared_ptr<WebSocketHandler> handler;
+	bool watched = false;
+	uint32_t watchedEvents = EPOLLIN | EPOLLRDHUP;
+	/* Closed, waiting to write the close echo */
+	bool closing = false;
+	bool scheduled = false;
+	EventLoop::Deadline deadline{};
+};
+
+/* Shared by the listening ws and wss connections of the process */
+static EventLoopGroup &webSocketLoops()
+{
+	static EventLoopGroup group(0, false);
+	return group;
+}
+
+#endif
+
+void WebSocket::listen(std::shared_ptr<WebSocketHandler> handler)
+{
+	if (listening || (handler == nullptr))
+	{
+		return;
+	}
+	listening = true;
+#ifdef __linux__
+	EventLoop &loop = webSocketLoops().next();
+	queueControl = true;
+	auto *reader = new WebSocketReader(loop, shared_from_this(), std::move(handler));
+	loop.execute([reader]()
+	             {
+		             reader->start();
+	             });
+#else
+	/* No event loop here, the connection is read by a thread of its own */
+	std::thread([self = shared_from_this(), messageHandler = std::move(handler)]()
+	            {
+		            WebSocketMessage message;
+		            while (true)
+		            {
+			            if (!self->nextMessage(message))
+			            {
+				            bool wouldBlock;
+				            if (!self->isOpen() || !self->readSome(false, wouldBlock))
+				            {
+					            break;
+				            }
+				            continue;
+			            }
+			            messageHandler->onMessage(*self, message);
+		            }
+		            self->shutdown();
+		            messageHandler->onClose(*self, self->closeCode, self->closeReason);
+	            }).detach();
+#endif
+}
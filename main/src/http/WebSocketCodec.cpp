@@ -0,0 +1,533 @@
+#include <algorithm>
+#include <cstring>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#ifdef LWHTTP_HAS_ZLIB
+
+#include <zlib.h>
+
+#endif
+
+#include "../../include/http/utils.h"
+#include "WebSocketCodec.h"
+
+/************************** Handshake ************************/
+static std::string base64(const unsigned char *data, size_t len)
+{
+	std::string encoded(4 * ((len + 2) / 3), '\0');
+	int encodedLen = EVP_EncodeBlock(reinterpret_cast<unsigned char *>(encoded.data()), data, static_cast<int>(len));
+	encoded.resize(static_cast<size_t>(encodedLen));
+	return encoded;
+}
+
+std::string webSocketKey()
+{
+	unsigned char nonce[16];
+	if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+	{
+		throw std::runtime_error("No randomness for the WebSocket key");
+	}
+	return base64(nonce, sizeof(nonce));
+}
+
+std::string webSocketAccept(std::string_view key)
+{
+	std::string input(key);
+	input.append("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1(reinterpret_cast<const unsigned char *>(input.data()), input.length(), digest);
+	return base64(digest, sizeof(digest));
+}
+
+void randomMaskKey(uint8_t key[4])
+{
+	static thread_local uint8_t pool[256];
+	static thread_local size_t used = sizeof(pool);
+	if (used == sizeof(pool))
+	{
+		if (RAND_bytes(pool, sizeof(pool)) != 1)
+		{
+			throw std::runtime_error("No randomness for WebSocket masking");
+		}
+		used = 0;
+	}
+	memcpy(key, pool + used, 4);
+	used += 4;
+}
+
+bool isValidUtf8(const char *data, size_t len)
+{
+	const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+	size_t index = 0;
+	while (index < len)
+	{
+		/* ASCII runs eight bytes at a time */
+		if (index + 8 <= len)
+		{
+			uint64_t block;
+			memcpy(&block, bytes + index, 8);
+			if ((block & 0x8080808080808080ULL) == 0)
+			{
+				index += 8;
+				continue;
+			}
+		}
+		unsigned char lead = bytes[index];
+		if (lead < 0x80)
+		{
+			++index;
+			continue;
+		}
+		size_t extra;
+		unsigned char low = 0x80;
+		unsigned char high = 0xBF;
+		if ((lead >= 0xC2) && (lead <= 0xDF))
+		{
+			extra = 1;
+		}
+		else if ((lead >= 0xE0) && (lead <= 0xEF))
+		{
+			extra = 2;
+			/* No overlong forms and no surrogates */
+			low = (lead == 0xE0) ? 0xA0 : 0x80;
+			high = (lead == 0xED) ? 0x9F : 0xBF;
+		}
+		else if ((lead >= 0xF0) && (lead <= 0xF4))
+		{
+			extra = 3;
+			low = (lead == 0xF0) ? 0x90 : 0x80;
+			high = (lead == 0xF4) ? 0x8F : 0xBF;
+		}
+		else
+		{
+			return false;
+		}
+		if (index + extra >= len)
+		{
+			return false;
+		}
+		if ((bytes[index + 1] < low) || (bytes[index + 1] > high))
+		{
+			return false;
+		}
+		for (size_t i = 2; i <= extra; ++i)
+		{
+			if ((bytes[index + i] & 0xC0) != 0x80)
+			{
+				return false;
+			}
+		}
+		index += extra + 1;
+	}
+	return true;
+}
+
+/*************************** Frames **************************/
+void encodeFrame(Buffer &output, WebSocketOpcode opcode, bool compressed, const char *payload, size_t len,
+                 const uint8_t maskKey[4])
+{
+	char header[14];
+	size_t headerLen = 2;
+	header[0] = static_cast<char>(0x80 | (compressed ? 0x40 : 0) | static_cast<uint8_t>(opcode));
+	if (len < 126)
+	{
+		header[1] = static_cast<char>(0x80 | len);
+	}
+	else if (len <= 0xFFFF)
+	{
+		header[1] = static_cast<char>(0x80 | 126);
+		header[2] = static_cast<char>(len >> 8);
+		header[3] = static_cast<char>(len);
+		headerLen = 4;
+	}
+	else
+	{
+		header[1] = static_cast<char>(0x80 | 127);
+		for (int i = 0; i < 8; ++i)
+		{
+			header[2 + i] = static_cast<char>(static_cast<uint64_t>(len) >> (56 - 8 * i));
+		}
+		headerLen = 10;
+	}
+	memcpy(header + headerLen, maskKey, 4);
+	headerLen += 4;
+	output.append(header, headerLen);
+	size_t offset = output.size();
+	if (len > 0)
+	{
+		output.append(payload, len);
+		applyMask(output.data() + offset, len, maskKey);
+	}
+}
+
+FrameParser::FrameParser(size_t maxFrameSize, bool compressed)
+		: buffer(READ_SIZE), maxFrame(maxFrameSize), allowCompressed(compressed)
+{
+}
+
+char *FrameParser::space()
+{
+	if (begin == end)
+	{
+		begin = 0;
+		end = 0;
+	}
+	else if ((begin > 0) && (buffer.size() - end < READ_SIZE))
+	{
+		memmove(buffer.data(), buffer.data() + begin, end - begin);
+		end -= begin;
+		begin = 0;
+	}
+	/* Room for the whole frame at hand, or for one more read */
+	size_t wanted = std::max(needed, end + READ_SIZE);
+	if (buffer.size() < wanted)
+	{
+		buffer.resize(wanted);
+	}
+	else if ((needed == 0) && (end == 0) && (buffer.size() > 4 * READ_SIZE))
+	{
+		/* A large message passed, do not keep its buffer */
+		std::vector<char>(READ_SIZE).swap(buffer);
+	}
+	return buffer.data() + end;
+}
+
+void FrameParser::append(const char *data, size_t len)
+{
+	space();
+	if (spaceLen() < len)
+	{
+		buffer.resize(end + len);
+	}
+	memcpy(buffer.data() + end, data, len);
+	end += len;
+}
+
+bool FrameParser::next(WebSocketFrame &frame)
+{
+	size_t available = end - begin;
+	if (available < 2)
+	{
+		return false;
+	}
+	auto *data = reinterpret_cast<uint8_t *>(buffer.data() + begin);
+	if ((data[0] & 0x30) != 0)
+	{
+		throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Reserved frame bits set");
+	}
+	bool compressed = (data[0] & 0x40) != 0;
+	auto opcode = static_cast<WebSocketOpcode>(data[0] & 0x0F);
+	bool control = (static_cast<uint8_t>(opcode) & 0x08) != 0;
+	switch (opcode)
+	{
+		case WebSocketOpcode::CONTINUATION:
+		case WebSocketOpcode::TEXT:
+		case WebSocketOpcode::BINARY:
+		case WebSocketOpcode::CLOSE:
+		case WebSocketOpcode::PING:
+		case WebSocketOpcode::PONG:
+			break;
+		default:
+			throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Unknown opcode");
+	}
+	if (compressed && (!allowCompressed || control))
+	{
+		throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Unexpected compressed frame");
+	}
+	if ((data[1] & 0x80) != 0)
+	{
+		throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Masked frame from the server");
+	}
+	bool fin = (data[0] & 0x80) != 0;
+	uint64_t len = data[1] & 0x7F;
+	size_t headerLen = 2;
+	if (len == 126)
+	{
+		headerLen = 4;
+	}
+	else if (len == 127)
+	{
+		headerLen = 10;
+	}
+	if (available < headerLen)
+	{
+		return false;
+	}
+	if (len >= 126)
+	{
+		len = 0;
+		for (size_t i = 2; i < headerLen; ++i)
+		{
+			len = (len << 8) | data[i];
+		}
+	}
+	if (control && (!fin || (len > 125)))
+	{
+		throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Fragmented or long control frame");
+	}
+	if (len > maxFrame)
+	{
+		throw WebSocketError(WS_CLOSE_TOO_BIG, "Frame too big");
+	}
+	if (available - headerLen < len)
+	{
+		needed = headerLen + static_cast<size_t>(len);
+		return false;
+	}
+	needed = 0;
+	frame = WebSocketFrame{opcode, fin, compressed, buffer.data() + begin + headerLen, static_cast<size_t>(len)};
+	begin += headerLen + static_cast<size_t>(len);
+	return true;
+}
+
+/********************* permessage-deflate ********************/
+/* "15" or "\"15\"" within 8 to 15 */
+static unsigned int windowBits(std::string_view value)
+{
+	if ((value.length() >= 2) && (value.front() == '"') && (value.back() == '"'))
+	{
+		value = value.substr(1, value.length() - 2);
+	}
+	if ((value.length() == 1) && (value[0] >= '8') && (value[0] <= '9'))
+	{
+		return value[0] - '0';
+	}
+	if ((value.length() == 2) && (value[0] == '1') && (value[1] >= '0') && (value[1] <= '5'))
+	{
+		return 10 + (value[1] - '0');
+	}
+	throw std::runtime_error("Invalid window bits in permessage-deflate: " + std::string(value));
+}
+
+static bool equalsIgnoreCase(std::string_view left, std::string_view right)
+{
+	return (left.length() == right.length()) &&
+	       std::equal(left.begin(), left.end(), right.begin(), [](char a, char b)
+	       {
+		       return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+	       });
+}
+
+PerMessageDeflate::Parameters PerMessageDeflate::accept(std::string_view extensions)
+{
+	if (extensions.find(',') != std::string_view::npos)
+	{
+		throw std::runtime_error("More extensions accepted than offered: " + std::string(extensions));
+	}
+	Parameters parameters;
+	bool seen[4] = {false, false, false, false};
+	size_t index = 0;
+	bool first = true;
+	while (index <= extensions.length())
+	{
+		size_t semicolon = std::min(extensions.find(';', index), extensions.length());
+		std::string_view token = extensions.substr(index, semicolon - index);
+		while (!token.empty() && (token.front() == ' '))
+		{
+			token.remove_prefix(1);
+		}
+		while (!token.empty() && (token.back() == ' '))
+		{
+			token.remove_suffix(1);
+		}
+		index = semicolon + 1;
+		if (first)
+		{
+			if (!equalsIgnoreCase(token, "permessage-deflate"))
+			{
+				throw std::runtime_error("Extension not offered: " + std::string(token));
+			}
+			first = false;
+			continue;
+		}
+		size_t equals = token.find('=');
+		std::string_view name = token.substr(0, equals);
+		std::string_view value = (equals == std::string_view::npos) ? std::string_view() : token.substr(equals + 1);
+		int parameter;
+		if (equalsIgnoreCase(name, "server_no_context_takeover") && value.empty())
+		{
+			parameter = 0;
+			parameters.serverNoContext = true;
+		}
+		else if (equalsIgnoreCase(name, "client_no_context_takeover") && value.empty())
+		{
+			parameter = 1;
+			parameters.clientNoContext = true;
+		}
+		else if (equalsIgnoreCase(name, "server_max_window_bits"))
+		{
+			parameter = 2;
+			parameters.serverBits = windowBits(value);
+		}
+		else if (equalsIgnoreCase(name, "client_max_window_bits"))
+		{
+			parameter = 3;
+			parameters.clientBits = windowBits(value);
+		}
+		else
+		{
+			throw std::runtime_error("Unknown permessage-deflate parameter: " + std::string(token));
+		}
+		if (seen[parameter])
+		{
+			throw std::runtime_error("Repeated permessage-deflate parameter: " + std::string(name));
+		}
+		seen[parameter] = true;
+	}
+	return parameters;
+}
+
+#ifdef LWHTTP_HAS_ZLIB
+
+struct PerMessageDeflate::Streams
+{
+	z_stream deflater{};
+	z_stream inflater{};
+	bool deflaterReady = false;
+	bool inflaterReady = false;
+};
+
+/* Every message ends with an empty stored block, which is left off on the wire */
+static constexpr unsigned char DEFLATE_TAIL[] = {0x00, 0x00, 0xFF, 0xFF};
+
+bool PerMessageDeflate::isAvailable()
+{
+	return true;
+}
+
+PerMessageDeflate::PerMessageDeflate(const Parameters &deflateParameters)
+		: parameters(deflateParameters), streams(std::make_unique<Streams>())
+{
+	if (canCompress())
+	{
+		streams->deflaterReady = (Z_OK == deflateInit2(&streams->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		                                               -static_cast<int>(parameters.clientBits), 8,
+		                                               Z_DEFAULT_STRATEGY));
+	}
+	/* The largest window can read whatever the server uses */
+	streams->inflaterReady = (Z_OK == inflateInit2(&streams->inflater, -15));
+	if (!streams->inflaterReady)
+	{
+		throw std::runtime_error("Cannot set up permessage-deflate");
+	}
+}
+
+PerMessageDeflate::~PerMessageDeflate()
+{
+	if (streams->deflaterReady)
+	{
+		deflateEnd(&streams->deflater);
+	}
+	if (streams->inflaterReady)
+	{
+		inflateEnd(&streams->inflater);
+	}
+}
+
+bool PerMessageDeflate::compress(const char *data, size_t len, std::string &out)
+{
+	if (!streams->deflaterReady)
+	{
+		return false;
+	}
+	z_stream &stream = streams->deflater;
+	out.resize(deflateBound(&stream, static_cast<uLong>(len)) + 16);
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+	stream.avail_in = static_cast<uInt>(len);
+	size_t produced = 0;
+	do
+	{
+		if (produced == out.size())
+		{
+			out.resize(out.size() * 2);
+		}
+		stream.next_out = reinterpret_cast<Bytef *>(out.data() + produced);
+		stream.avail_out = static_cast<uInt>(out.size() - produced);
+		if (deflate(&stream, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+		{
+			return false;
+		}
+		produced = out.size() - stream.avail_out;
+	} while ((stream.avail_out == 0) || (stream.avail_in > 0));
+	if ((produced < sizeof(DEFLATE_TAIL)) ||
+	    (0 != memcmp(out.data() + produced - sizeof(DEFLATE_TAIL), DEFLATE_TAIL, sizeof(DEFLATE_TAIL))))
+	{
+		return false;
+	}
+	out.resize(produced - sizeof(DEFLATE_TAIL));
+	if (parameters.clientNoContext)
+	{
+		deflateReset(&stream);
+	}
+	return true;
+}
+
+void PerMessageDeflate::decompress(const char *data, size_t len, size_t limit, std::string &out)
+{
+	z_stream &stream = streams->inflater;
+	out.clear();
+	char chunk[16 * 1024];
+	for (int part = 0; part < 2; ++part)
+	{
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+		stream.avail_in = static_cast<uInt>(len);
+		if (part == 1)
+		{
+			stream.next_in = const_cast<Bytef *>(DEFLATE_TAIL);
+			stream.avail_in = sizeof(DEFLATE_TAIL);
+		}
+		do
+		{
+			stream.next_out = reinterpret_cast<Bytef *>(chunk);
+			stream.avail_out = sizeof(chunk);
+			int result = inflate(&stream, Z_SYNC_FLUSH);
+			if ((result != Z_OK) && (result != Z_BUF_ERROR) && (result != Z_STREAM_END))
+			{
+				throw WebSocketError(WS_CLOSE_INVALID_DATA, "Corrupt compressed message");
+			}
+			size_t produced = sizeof(chunk) - stream.avail_out;
+			if (out.length() + produced > limit)
+			{
+				throw WebSocketError(WS_CLOSE_TOO_BIG, "Message too big");
+			}
+			out.append(chunk, produced);
+		} while (stream.avail_out == 0);
+	}
+	if (parameters.serverNoContext)
+	{
+		inflateReset(&stream);
+	}
+}
+
+#else
+
+struct PerMessageDeflate::Streams
+{
+};
+
+bool PerMessageDeflate::isAvailable()
+{
+	return false;
+}
+
+PerMessageDeflate::PerMessageDeflate(const Parameters &deflateParameters) : parameters(deflateParameters)
+{
+	throw std::runtime_error("Built without zlib, no permessage-deflate");
+}
+
+PerMessageDeflate::~PerMessageDeflate() = default;
+
+bool PerMessageDeflate::compress(const char *data, size_t len, std::string &out)
+{
+	return false;
+}
+
+void PerMessageDeflate::decompress(const char *data, size_t len, size_t limit, std::string &out)
+{
+	throw WebSocketError(WS_CLOSE_PROTOCOL_ERROR, "Compressed message without permessage-deflate");
+}
+
+#endif
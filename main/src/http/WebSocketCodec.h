@@ -0,0 +1,140 @@
+#ifndef LWHTTP_WEBSOCKETCODEC_H
+#define LWHTTP_WEBSOCKETCODEC_H
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../include/http/Buffer.h"
+#include "../../include/http/WebSocket.h"
+
+/************************** Handshake ************************/
+/* A protocol violation of the server, the connection is closed with code */
+class WebSocketError : public std::runtime_error
+{
+public:
+	WebSocketError(uint16_t closeCode, const std::string &what) : std::runtime_error(what), code(closeCode)
+	{
+	}
+
+	uint16_t code;
+};
+
+/* A fresh Sec-WebSocket-Key: 16 random bytes in base64 */
+std::string webSocketKey();
+
+/* The Sec-WebSocket-Accept the server has to answer key with */
+std::string webSocketAccept(std::string_view key);
+
+/* Four unpredictable bytes per frame, drawn from a per-thread pool */
+void randomMaskKey(uint8_t key[4]);
+
+bool isValidUtf8(const char *data, size_t len);
+
+/*************************** Frames **************************/
+struct WebSocketFrame
+{
+	WebSocketOpcode opcode;
+	bool fin;
+	/* RSV1, the message is compressed */
+	bool compressed;
+	char *payload;
+	size_t len;
+};
+
+/* Appends one final, masked client frame */
+void encodeFrame(Buffer &output, WebSocketOpcode opcode, bool compressed, const char *payload, size_t len,
+                 const uint8_t maskKey[4]);
+
+/* Splits the bytes read from the server into frames */
+class FrameParser
+{
+public:
+	/* A larger frame is refused with WS_CLOSE_TOO_BIG. RSV1 is only accepted with compressed. */
+	FrameParser(size_t maxFrameSize, bool compressed);
+
+	/* Where the next read goes, spaceLen() bytes are free there after this call */
+	char *space();
+
+	[[nodiscard]] size_t spaceLen() const
+	{
+		return buffer.size() - end;
+	}
+
+	/* Accounts len bytes read into space() */
+	void commit(size_t len)
+	{
+		end += len;
+	}
+
+	/* Copies bytes read elsewhere, e.g. behind the handshake response */
+	void append(const char *data, size_t len);
+
+	/* The next complete frame, its payload stays valid until the next call of space(). Throws WebSocketError. */
+	bool next(WebSocketFrame &frame);
+
+	static constexpr size_t READ_SIZE = 16 * 1024;
+
+private:
+	std::vector<char> buffer;
+	size_t begin = 0;
+	size_t end = 0;
+	/* Size of the incomplete frame at begin, once its header is in */
+	size_t needed = 0;
+	size_t maxFrame;
+	bool allowCompressed;
+};
+
+/********************* permessage-deflate ********************/
+/* RFC 7692 with zlib, compressing and decompressing use one context each for the whole connection unless the
+ * server asked for no context takeover */
+class PerMessageDeflate
+{
+public:
+	struct Parameters
+	{
+		unsigned int clientBits = 15;
+		unsigned int serverBits = 15;
+		bool clientNoContext = false;
+		bool serverNoContext = false;
+	};
+
+	/* Whether the library was built with zlib */
+	static bool isAvailable();
+
+	/* The Sec-WebSocket-Extensions offer */
+	static constexpr std::string_view OFFER = "permessage-deflate; client_max_window_bits";
+
+	/* Parses the server's answer to the offer, throws std::runtime_error if it cannot be accepted */
+	static Parameters accept(std::string_view extensions);
+
+	explicit PerMessageDeflate(const Parameters &parameters);
+
+	PerMessageDeflate(const PerMessageDeflate &other) = delete;
+
+	PerMessageDeflate &operator=(const PerMessageDeflate &other) = delete;
+
+	~PerMessageDeflate();
+
+	/* zlib has no 256 byte window, a server asking for one gets uncompressed messages */
+	[[nodiscard]] bool canCompress() const
+	{
+		return parameters.clientBits > 8;
+	}
+
+	/* Replaces out with the compressed message */
+	bool compress(const char *data, size_t len, std::string &out);
+
+	/* Replaces out with the message, throws WebSocketError if it is corrupt or inflates beyond limit */
+	void decompress(const char *data, size_t len, size_t limit, std::string &out);
+
+private:
+	struct Streams;
+
+	Parameters parameters;
+	std::unique_ptr<Streams> streams;
+};
+
+#endif //LWHTTP_WEBSOCKETCODEC_H
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <chrono>
+
+#include "WorkStealingPool.h"
+
+/********************** WorkStealingPool *********************/
+/* Longest a worker sleeps while a task is counted but not found in any queue */
+static constexpr std::chrono::milliseconds PUSH_WAIT{1};
+
+/* The pool and queue index of the worker running on this thread, if any */
+static thread_local const WorkStealingPool *currentPool = nullptr;
+static thread_local size_t currentQueue = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned int threads, size_t queueLimit) : limit(std::max<size_t>(queueLimit, 1))
+{
+	if (threads == 0)
+	{
+		threads = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+	queues = std::make_unique<WorkQueue[]>(threads);
+	for (size_t i = 0; i < threads; ++i)
+	{
+		workers.emplace_back(&WorkStealingPool::run, this, i);
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (auto &worker: workers)
+	{
+		worker.join();
+	}
+}
+
+bool WorkStealingPool::submit(Task task)
+{
+	/* Reserve a slot first, the count is what sleeping workers check before they wait */
+	size_t queued = pending.load(std::memory_order_relaxed);
+	do
+	{
+		if (queued >= limit)
+		{
+			return false;
+		}
+	}
+	while (!pending.compare_exchange_weak(queued, queued + 1));
+
+	size_t index = (currentPool == this) ? currentQueue :
+	               nextQueue.fetch_add(1, std::memory_order_relaxed) % workers.size();
+	{
+		std::lock_guard<std::mutex> lock(queues[index].queueMutex);
+		queues[index].tasks.push_back(std::move(task));
+	}
+	if (sleepers.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		wakeup.notify_one();
+	}
+	return true;
+}
+
+bool WorkStealingPool::take(size_t index, Task &task, bool wait)
+{
+	{
+		WorkQueue &own = queues[index];
+		std::lock_guard<std::mutex> lock(own.queueMutex);
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < workers.size(); ++i)
+	{
+		WorkQueue &victim = queues[(index + i) % workers.size()];
+		std::unique_lock<std::mutex> lock(victim.queueMutex, std::defer_lock);
+		if (wait)
+		{
+			lock.lock();
+		}
+		else
+		{
+			lock.try_lock();
+		}
+		if (lock.owns_lock() && !victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkStealingPool::run(size_t index)
+{
+	currentPool = this;
+	currentQueue = index;
+	Task task;
+	while (true)
+	{
+		/* A steal attempt skips busy queues, before sleeping they are waited for once */
+		if (take(index, task, false) || ((pending.load() > 0) && take(index, task, true)))
+		{
+			pending.fetch_sub(1);
+			task();
+			task = nullptr;
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepers.fetch_add(1);
+		if (pending.load() == 0)
+		{
+			if (stopping)
+			{
+				sleepers.fetch_sub(1);
+				break;
+			}
+			wakeup.wait(lock);
+		}
+		else
+		{
+			/* Counted by a submit() that has not queued it yet, whose wakeup may come before this worker sleeps */
+			wakeup.wait_for(lock, PUSH_WAIT);
+		}
+		sleepers.fetch_sub(1);
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef LWHTTP_WORKSTEALINGPOOL_H
+#define LWHTTP_WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/********************** WorkStealingPool *********************/
+/* Fixed set of workers, each with its own deque. A worker runs its own tasks newest first and steals the oldest
+ * task of another worker when it runs dry, so tasks submitted by a task stay on the worker's warm cache. Tasks
+ * from outside are spread round robin. The number of queued tasks is bounded. */
+class WorkStealingPool
+{
+public:
+	using Task = std::function<void()>;
+
+	/* threads == 0 starts one worker per hardware thread */
+	WorkStealingPool(unsigned int threads, size_t queueLimit);
+
+	WorkStealingPool(const WorkStealingPool &other) = delete;
+
+	WorkStealingPool &operator=(const WorkStealingPool &other) = delete;
+
+	/* Runs the tasks still queued, then joins the workers. Must not run on a worker. */
+	~WorkStealingPool();
+
+	/* Returns false without queueing task if queueLimit tasks are already waiting */
+	bool submit(Task task);
+
+	[[nodiscard]] size_t size() const
+	{
+		return workers.size();
+	}
+
+private:
+	struct alignas(64) WorkQueue
+	{
+		std::mutex queueMutex;
+		std::deque<Task> tasks;
+	};
+
+	void run(size_t index);
+
+	/* Own queue first, then steals from the others. Without wait a queue whose lock is taken is skipped. */
+	bool take(size_t index, Task &task, bool wait);
+
+private:
+	size_t limit;
+	std::unique_ptr<WorkQueue[]> queues;
+	std::vector<std::thread> workers;
+	alignas(64) std::atomic<size_t> pending{0};
+	std::atomic<size_t> nextQueue{0};
+	alignas(64) std::mutex sleepMutex;
+	std::condition_variable wakeup;
+	std::atomic<size_t> sleepers{0};
+	bool stopping = false;
+};
+
+#endif //LWHTTP_WORKSTEALINGPOOL_H
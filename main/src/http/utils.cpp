@@ -1,51 +1,350 @@
 #include <algorithm>
 #include <cstring>
+#include <stdexcept>
 #include <string>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define LWHTTP_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
-std::pair<bool, size_t> findFirstOf(const char *target, size_t targetLen, const char *data, size_t dataLen)
+#include "../../include/http/utils.h"
+
+using SearchFunction = std::pair<bool, size_t> (*)(const char *, size_t, const char *, size_t);
+
+using MaskFunction = void (*)(char *, size_t, uint32_t);
+
+/*
+ * All kernels expect 0 < targetLen <= dataLen. The vector kernels compare a block of candidate positions against
+ * the first and the last byte of the target at once and only call memcmp where both match, which filters out
+ * nearly all false candidates of the CRLF style patterns searched here.
+ */
+static std::pair<bool, size_t> findFirstOfScalar(const char *target, size_t targetLen, const char *data, size_t dataLen)
 {
-	if (targetLen > dataLen)
+	const char *end = data + dataLen - targetLen + 1;
+	const char *pos = data;
+	while (pos < end)
 	{
-		return {false, 0};
+		pos = static_cast<const char *>(memchr(pos, target[0], static_cast<size_t>(end - pos)));
+		if (pos == nullptr)
+		{
+			break;
+		}
+		if (0 == memcmp(target, pos, targetLen))
+		{
+			return {true, static_cast<size_t>(pos - data)};
+		}
+		++pos;
+	}
+	return {false, 0};
+}
+
+static std::pair<bool, size_t> findLastOfScalar(const char *target, size_t targetLen, const char *data, size_t dataLen)
+{
+	for (size_t index = dataLen - targetLen + 1; index > 0; --index)
+	{
+		if ((target[0] == data[index - 1]) && (0 == memcmp(target, data + index - 1, targetLen)))
+		{
+			return {true, index - 1};
+		}
 	}
+	return {false, 0};
+}
 
-	std::pair<bool, size_t> found{false, 0};
-	for (size_t index = 0; index <= dataLen - targetLen; ++index)
+#ifdef LWHTTP_X86_SIMD
+static std::pair<bool, size_t> findFirstOfSse2(const char *target, size_t targetLen, const char *data, size_t dataLen)
+{
+	const __m128i first = _mm_set1_epi8(target[0]);
+	const __m128i last = _mm_set1_epi8(target[targetLen - 1]);
+	const size_t candidates = dataLen - targetLen + 1;
+	size_t index = 0;
+	for (; index + 16 <= candidates; index += 16)
 	{
-		if (target[0] == data[index])
+		__m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + index));
+		__m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + index + targetLen - 1));
+		auto mask = static_cast<unsigned int>(_mm_movemask_epi8(
+				_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last))));
+		while (mask != 0)
 		{
-			if (0 == memcmp(target, data + index, targetLen))
+			auto bit = static_cast<size_t>(__builtin_ctz(mask));
+			if (0 == memcmp(target, data + index + bit, targetLen))
 			{
-				found.first = true;
-				found.second = index;
-				break;
+				return {true, index + bit};
 			}
+			mask &= mask - 1;
 		}
 	}
-	return found;
+	auto found = findFirstOfScalar(target, targetLen, data + index, dataLen - index);
+	return {found.first, found.second + index};
 }
 
-std::pair<bool, size_t> findLastOf(const char *target, size_t targetLen, const char *data, size_t dataLen)
+static std::pair<bool, size_t> findLastOfSse2(const char *target, size_t targetLen, const char *data, size_t dataLen)
 {
-	if (targetLen > dataLen)
+	const __m128i first = _mm_set1_epi8(target[0]);
+	const __m128i last = _mm_set1_epi8(target[targetLen - 1]);
+	size_t index = dataLen - targetLen + 1;
+	while (index >= 16)
 	{
-		return {false, 0};
+		index -= 16;
+		__m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + index));
+		__m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + index + targetLen - 1));
+		auto mask = static_cast<unsigned int>(_mm_movemask_epi8(
+				_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last))));
+		while (mask != 0)
+		{
+			auto bit = static_cast<size_t>(31 - __builtin_clz(mask));
+			if (0 == memcmp(target, data + index + bit, targetLen))
+			{
+				return {true, index + bit};
+			}
+			mask &= ~(1u << bit);
+		}
 	}
+	return findLastOfScalar(target, targetLen, data, index + targetLen - 1);
+}
 
-	std::pair<bool, size_t> found{false, 0};
-	for (size_t index = 0; index <= dataLen - targetLen; ++index)
+__attribute__((target("avx2")))
+static std::pair<bool, size_t> findFirstOfAvx2(const char *target, size_t targetLen, const char *data, size_t dataLen)
+{
+	const __m256i first = _mm256_set1_epi8(target[0]);
+	const __m256i last = _mm256_set1_epi8(target[targetLen - 1]);
+	const size_t candidates = dataLen - targetLen + 1;
+	size_t index = 0;
+	for (; index + 32 <= candidates; index += 32)
 	{
-		if (target[0] == data[index])
+		__m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + index));
+		__m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + index + targetLen - 1));
+		auto mask = static_cast<unsigned int>(_mm256_movemask_epi8(
+				_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last))));
+		while (mask != 0)
 		{
-			if (0 == memcmp(target, data + index, targetLen))
+			auto bit = static_cast<size_t>(__builtin_ctz(mask));
+			if (0 == memcmp(target, data + index + bit, targetLen))
 			{
-				found.first = true;
-				found.second = index;
+				return {true, index + bit};
 			}
+			mask &= mask - 1;
 		}
 	}
-	return found;
+	auto found = findFirstOfSse2(target, targetLen, data + index, dataLen - index);
+	return {found.first, found.second + index};
+}
+
+__attribute__((target("avx2")))
+static std::pair<bool, size_t> findLastOfAvx2(const char *target, size_t targetLen, const char *data, size_t dataLen)
+{
+	const __m256i first = _mm256_set1_epi8(target[0]);
+	const __m256i last = _mm256_set1_epi8(target[targetLen - 1]);
+	size_t index = dataLen - targetLen + 1;
+	while (index >= 32)
+	{
+		index -= 32;
+		__m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + index));
+		__m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + index + targetLen - 1));
+		auto mask = static_cast<unsigned int>(_mm256_movemask_epi8(
+				_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last))));
+		while (mask != 0)
+		{
+			auto bit = static_cast<size_t>(31 - __builtin_clz(mask));
+			if (0 == memcmp(target, data + index + bit, targetLen))
+			{
+				return {true, index + bit};
+			}
+			mask &= ~(1u << bit);
+		}
+	}
+	return findLastOfSse2(target, targetLen, data, index + targetLen - 1);
+}
+#endif
+
+bool isSearchKernelSupported(SearchKernel kernel)
+{
+	switch (kernel)
+	{
+		case SearchKernel::SCALAR:
+			return true;
+#ifdef LWHTTP_X86_SIMD
+		case SearchKernel::SSE2:
+			return true;
+		case SearchKernel::AVX2:
+			return __builtin_cpu_supports("avx2");
+#endif
+		default:
+			return false;
+	}
+}
+
+SearchKernel getSearchKernel()
+{
+	static const SearchKernel kernel = isSearchKernelSupported(SearchKernel::AVX2) ? SearchKernel::AVX2 :
+	                                   isSearchKernelSupported(SearchKernel::SSE2) ? SearchKernel::SSE2 :
+	                                   SearchKernel::SCALAR;
+	return kernel;
+}
+
+static std::pair<SearchFunction, SearchFunction> searchFunctions(SearchKernel kernel)
+{
+	if (!isSearchKernelSupported(kernel))
+	{
+		throw std::invalid_argument("Search kernel not supported on this CPU!");
+	}
+	switch (kernel)
+	{
+#ifdef LWHTTP_X86_SIMD
+		case SearchKernel::AVX2:
+			return {findFirstOfAvx2, findLastOfAvx2};
+		case SearchKernel::SSE2:
+			return {findFirstOfSse2, findLastOfSse2};
+#endif
+		default:
+			return {findFirstOfScalar, findLastOfScalar};
+	}
+}
+
+std::pair<bool, size_t> findFirstOf(SearchKernel kernel, const char *target, size_t targetLen, const char *data,
+                                    size_t dataLen)
+{
+	if (targetLen == 0)
+	{
+		return {true, 0};
+	}
+	if (targetLen > dataLen)
+	{
+		return {false, 0};
+	}
+	return searchFunctions(kernel).first(target, targetLen, data, dataLen);
+}
+
+std::pair<bool, size_t> findLastOf(SearchKernel kernel, const char *target, size_t targetLen, const char *data,
+                                   size_t dataLen)
+{
+	if (targetLen == 0)
+	{
+		return {true, dataLen};
+	}
+	if (targetLen > dataLen)
+	{
+		return {false, 0};
+	}
+	return searchFunctions(kernel).second(target, targetLen, data, dataLen);
+}
+
+std::pair<bool, size_t> findFirstOf(const char *target, size_t targetLen, const char *data, size_t dataLen)
+{
+	static const SearchFunction function = searchFunctions(getSearchKernel()).first;
+	if (targetLen == 0)
+	{
+		return {true, 0};
+	}
+	if (targetLen > dataLen)
+	{
+		return {false, 0};
+	}
+	return function(target, targetLen, data, dataLen);
+}
+
+std::pair<bool, size_t> findLastOf(const char *target, size_t targetLen, const char *data, size_t dataLen)
+{
+	static const SearchFunction function = searchFunctions(getSearchKernel()).second;
+	if (targetLen == 0)
+	{
+		return {true, dataLen};
+	}
+	if (targetLen > dataLen)
+	{
+		return {false, 0};
+	}
+	return function(target, targetLen, data, dataLen);
+}
+
+/*
+ * The mask kernels get the key already rotated to the first byte, as it lies in memory. A block of any multiple of
+ * four bytes then starts at the same key byte again.
+ */
+static void applyMaskScalar(char *data, size_t len, uint32_t key)
+{
+	uint64_t wide = (static_cast<uint64_t>(key) << 32) | key;
+	size_t index = 0;
+	for (; index + 8 <= len; index += 8)
+	{
+		uint64_t block;
+		memcpy(&block, data + index, 8);
+		block ^= wide;
+		memcpy(data + index, &block, 8);
+	}
+	for (; index < len; ++index)
+	{
+		data[index] = static_cast<char>(data[index] ^ reinterpret_cast<const char *>(&key)[index % 4]);
+	}
+}
+
+#ifdef LWHTTP_X86_SIMD
+static void applyMaskSse2(char *data, size_t len, uint32_t key)
+{
+	const __m128i wide = _mm_set1_epi32(static_cast<int>(key));
+	size_t index = 0;
+	for (; index + 16 <= len; index += 16)
+	{
+		auto *block = reinterpret_cast<__m128i *>(data + index);
+		_mm_storeu_si128(block, _mm_xor_si128(_mm_loadu_si128(block), wide));
+	}
+	applyMaskScalar(data + index, len - index, key);
+}
+
+__attribute__((target("avx2")))
+static void applyMaskAvx2(char *data, size_t len, uint32_t key)
+{
+	const __m256i wide = _mm256_set1_epi32(static_cast<int>(key));
+	size_t index = 0;
+	for (; index + 32 <= len; index += 32)
+	{
+		auto *block = reinterpret_cast<__m256i *>(data + index);
+		_mm256_storeu_si256(block, _mm256_xor_si256(_mm256_loadu_si256(block), wide));
+	}
+	applyMaskSse2(data + index, len - index, key);
+}
+#endif
+
+static MaskFunction maskFunction(SearchKernel kernel)
+{
+	if (!isSearchKernelSupported(kernel))
+	{
+		throw std::invalid_argument("Mask kernel not supported on this CPU!");
+	}
+	switch (kernel)
+	{
+#ifdef LWHTTP_X86_SIMD
+		case SearchKernel::AVX2:
+			return applyMaskAvx2;
+		case SearchKernel::SSE2:
+			return applyMaskSse2;
+#endif
+		default:
+			return applyMaskScalar;
+	}
+}
+
+static uint32_t rotatedKey(const uint8_t key[4], size_t offset)
+{
+	uint8_t rotated[4];
+	for (size_t i = 0; i < 4; ++i)
+	{
+		rotated[i] = key[(offset + i) % 4];
+	}
+	uint32_t word;
+	memcpy(&word, rotated, 4);
+	return word;
+}
+
+void applyMask(SearchKernel kernel, char *data, size_t len, const uint8_t key[4], size_t offset)
+{
+	maskFunction(kernel)(data, len, rotatedKey(key, offset));
+}
+
+void applyMask(char *data, size_t len, const uint8_t key[4], size_t offset)
+{
+	static const MaskFunction function = maskFunction(getSearchKernel());
+	function(data, len, rotatedKey(key, offset));
 }
 
 void ltrim(std::string &s)
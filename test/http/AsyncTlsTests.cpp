@@ -0,0 +1,222 @@
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <openssl/ssl.h>
+
+#include <http/lwhttp.h>
+
+#include "src/http/Connection.h"
+#include "TestServer.h"
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Waits for what the connection asked for */
+static bool await(int fd, AsyncTlsConnection::IoStatus status)
+{
+	if ((status != AsyncTlsConnection::IoStatus::WANT_READ) && (status != AsyncTlsConnection::IoStatus::WANT_WRITE))
+	{
+		return false;
+	}
+	pollfd pollFd{fd, static_cast<short>((status == AsyncTlsConnection::IoStatus::WANT_READ) ? POLLIN : POLLOUT), 0};
+	return poll(&pollFd, 1, 5000) == 1;
+}
+
+TEST(AsyncTlsTests, drivesHandshakeAndRecords)
+{
+	int fds[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	/* Small buffers, so that a large record has to wait for the socket */
+	int small = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	SSL_CTX *ctx = newSelfSignedContext();
+	const std::string payload(1024 * 1024, 'p');
+	std::string received;
+	std::thread server([ctx, fd = fds[1], &payload, &received]()
+	                   {
+		                   SSL *ssl = SSL_new(ctx);
+		                   setSocketBio(ssl, fd);
+		                   ASSERT_EQ(1, SSL_accept(ssl));
+		                   char buffer[16384];
+		                   size_t readLen;
+		                   while ((received.length() < payload.length()) &&
+		                          (1 == SSL_read_ex(ssl, buffer, sizeof(buffer), &readLen)))
+		                   {
+			                   received.append(buffer, readLen);
+		                   }
+		                   size_t written;
+		                   SSL_write_ex(ssl, payload.data(), payload.length(), &written);
+		                   SSL_shutdown(ssl);
+		                   SSL_free(ssl);
+	                   });
+
+	TLSContext tlsContext = TLSContextBuilder::newBuilder().newClientBuilder().build();
+	AsyncTlsConnection connection(fds[0], tlsContext.newSSL("https://peer:443"), DEFAULT_TIMEOUT);
+	AsyncTlsConnection::IoStatus status;
+	while ((status = connection.handshake()) != AsyncTlsConnection::IoStatus::DONE)
+	{
+		ASSERT_TRUE(await(fds[0], status));
+	}
+
+	/* The last records may still be pending once all of the payload was taken */
+	size_t offset = 0;
+	bool waitedToWrite = false;
+	while (true)
+	{
+		size_t written = 0;
+		status = connection.writeSome(payload.data() + offset, payload.length() - offset, written);
+		offset += written;
+		if (status == AsyncTlsConnection::IoStatus::DONE)
+		{
+			break;
+		}
+		waitedToWrite = waitedToWrite || (status == AsyncTlsConnection::IoStatus::WANT_WRITE);
+		ASSERT_TRUE(await(fds[0], status));
+	}
+	EXPECT_EQ(payload.length(), offset);
+	EXPECT_TRUE(waitedToWrite);
+
+	std::string echoed;
+	char buffer[8192];
+	while (true)
+	{
+		size_t readLen = 0;
+		status = connection.readSome(buffer, sizeof(buffer), readLen);
+		if (status == AsyncTlsConnection::IoStatus::DONE)
+		{
+			echoed.append(buffer, readLen);
+			continue;
+		}
+		if (status == AsyncTlsConnection::IoStatus::CLOSED)
+		{
+			break;
+		}
+		ASSERT_TRUE(await(fds[0], status));
+	}
+	server.join();
+	EXPECT_EQ(payload.length(), received.length());
+	EXPECT_EQ(payload, echoed);
+	SSL_CTX_free(ctx);
+	close(fds[1]);
+}
+
+TEST(AsyncTlsTests, blockingCallsWaitForTheTimeout)
+{
+	int fds[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	TLSContext tlsContext = TLSContextBuilder::newBuilder().newClientBuilder().build();
+	/* The peer never answers the handshake */
+	AsyncTlsConnection connection(fds[0], tlsContext.newSSL("https://peer:443"), 1);
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_EQ(-1, connection.write("x", 1));
+	auto waited = std::chrono::steady_clock::now() - start;
+	EXPECT_GE(waited, std::chrono::milliseconds(900));
+	EXPECT_LT(waited, std::chrono::seconds(DEFAULT_TIMEOUT));
+	close(fds[1]);
+}
+
+/* The body of a response is its target */
+static std::string targetOf(const std::string &head, const std::string &)
+{
+	size_t targetStart = head.find(' ') + 1;
+	std::string target = head.substr(targetStart, head.find(' ', targetStart) - targetStart);
+	return textResponse("200 OK", target);
+}
+
+TEST(AsyncTlsTests, sendAsyncOverHttps)
+{
+	TestServer origin(keepAliveHandler(targetOf), newSelfSignedContext());
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(2).build();
+	std::mutex doneMutex;
+	std::condition_variable doneSignal;
+	size_t done = 0;
+	size_t matched = 0;
+	const size_t calls = 64;
+	for (size_t i = 0; i < calls; ++i)
+	{
+		std::string target = "/item/" + std::to_string(i);
+		HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url(target))).GET().build();
+		ASSERT_TRUE(client->sendAsync(request, [&, target](size_t len, HttpResponse &response)
+		{
+			bool match = (len != 0) && (target == bodyOf(response));
+			std::lock_guard<std::mutex> lock(doneMutex);
+			matched += match ? 1 : 0;
+			++done;
+			doneSignal.notify_one();
+		}));
+	}
+	std::unique_lock<std::mutex> lock(doneMutex);
+	ASSERT_TRUE(doneSignal.wait_for(lock, std::chrono::seconds(20), [&]()
+	{ return done == calls; }));
+	EXPECT_EQ(calls, matched);
+	lock.unlock();
+
+	/* One after the other, the idle connection of the loop is used again */
+	int opened = origin.accepted;
+	for (int i = 0; i < 4; ++i)
+	{
+		std::promise<size_t> result;
+		HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url("/again"))).GET().build();
+		client->sendAsync(request, [&result](size_t len, HttpResponse &response)
+		{
+			result.set_value(len);
+		});
+		EXPECT_NE(0U, result.get_future().get());
+	}
+	EXPECT_LE(origin.accepted - opened, 2);
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(static_cast<uint64_t>(origin.accepted), metrics.tlsHandshakes);
+}
+
+TEST(AsyncTlsTests, sendAsyncToHostName)
+{
+	TestServer origin(keepAliveHandler(targetOf), newSelfSignedContext());
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).build();
+	std::string url = "https://localhost:" + std::to_string(origin.getPort());
+	for (const std::string target: {"/first", "/second"})
+	{
+		std::promise<std::string> result;
+		HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(url + target)).GET().build();
+		ASSERT_TRUE(client->sendAsync(request, [&result](size_t len, HttpResponse &response)
+		{
+			result.set_value((len != 0) ? bodyOf(response) : "failed");
+		}));
+		EXPECT_EQ(target, result.get_future().get());
+	}
+	/* The name is looked up once, on a resolver thread if it was not cached yet */
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(1U, metrics.dnsCacheHits + metrics.dnsCacheMisses);
+}
+
+TEST(AsyncTlsTests, metricsCountLoopConnections)
+{
+	TestServer origin(keepAliveHandler(targetOf), newSelfSignedContext());
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).build();
+	std::promise<size_t> result;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url("/idle"))).GET().build();
+	ASSERT_TRUE(client->sendAsync(request, [&result](size_t len, HttpResponse &)
+	{
+		result.set_value(len);
+	}));
+	ASSERT_NE(0U, result.get_future().get());
+	/* The loop keeps it idle before the handler runs */
+	std::vector<OriginConnections> connections = client->getMetrics().connections;
+	ASSERT_EQ(1U, connections.size());
+	EXPECT_EQ(URL(origin.url("/")).getOrigin(), connections[0].origin);
+	EXPECT_EQ(0U, connections[0].active);
+	EXPECT_EQ(1U, connections[0].idle);
+}
+
+#endif
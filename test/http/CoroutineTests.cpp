@@ -0,0 +1,249 @@
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+/* Only built with ENABLE_CXX20 */
+#ifdef LWHTTP_HAS_COROUTINES
+
+static Task<int> answer()
+{
+	co_return 42;
+}
+
+static Task<int> twice()
+{
+	int first = co_await answer();
+	int second = co_await answer();
+	co_return first + second;
+}
+
+static Task<void> failing()
+{
+	co_await answer();
+	throw std::invalid_argument("failing");
+}
+
+TEST(CoroutineTests, tasksChain)
+{
+	EXPECT_EQ(syncWait(twice()), 84);
+}
+
+TEST(CoroutineTests, exceptionsReachTheAwaiter)
+{
+	EXPECT_THROW(syncWait(failing()), std::invalid_argument);
+}
+
+TEST(CoroutineTests, framesAreRecycled)
+{
+	void *first = FramePool::allocate(200);
+	FramePool::deallocate(first, 200);
+	void *second = FramePool::allocate(250);
+	EXPECT_EQ(first, second);
+	FramePool::deallocate(second, 250);
+}
+
+static Task<std::thread::id> sendAndReportThread(HttpClient &client, HttpRequest request, bool &failed)
+{
+	try
+	{
+		co_await co_send(client, std::move(request));
+	}
+	catch (std::runtime_error &e)
+	{
+		failed = true;
+	}
+	co_return std::this_thread::get_id();
+}
+
+TEST(CoroutineTests, sendResumesOnEventLoop)
+{
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).build();
+	/* Nothing listens on port 1, the call fails on the loop after the connect */
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://127.0.0.1:1/")).GET().build();
+	bool failed = false;
+	std::thread::id resumedOn = syncWait(sendAndReportThread(*client, request, failed));
+	EXPECT_TRUE(failed);
+	EXPECT_NE(resumedOn, std::this_thread::get_id());
+}
+
+/* Takes no asynchronous call */
+class RefusingClient : public HttpClient
+{
+public:
+	RefusingClient() : HttpClient(std::make_shared<HttpClientConfig>())
+	{
+	}
+
+	using HttpClient::send;
+
+	size_t send(const HttpRequest &request, HttpResponse &response) override
+	{
+		return 0;
+	}
+
+	bool streamAsync(const HttpRequest &request, BodySink sink, ResponseHandler handler) override
+	{
+		return false;
+	}
+};
+
+TEST(CoroutineTests, sendNotTakenFailsAtOnce)
+{
+	RefusingClient client;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://127.0.0.1:1/")).GET().build();
+	bool failed = false;
+	std::thread::id resumedOn = syncWait(sendAndReportThread(client, request, failed));
+	EXPECT_TRUE(failed);
+	EXPECT_EQ(resumedOn, std::this_thread::get_id());
+}
+
+#ifndef _WIN32
+
+/* The body of the response to request read chunk by chunk and then its status code, or only the first stopAfter
+ * chunks */
+static Task<std::vector<std::string>> readChunks(HttpClient &client, HttpRequest request, size_t stopAfter = 0)
+{
+	std::vector<std::string> chunks;
+	ChunkReader reader(client, request);
+	while (std::optional<std::string_view> chunk = co_await reader.next())
+	{
+		chunks.emplace_back(*chunk);
+		if (chunks.size() == stopAfter)
+		{
+			co_return chunks;
+		}
+	}
+	chunks.push_back(std::to_string(static_cast<int>(reader.getResponse().getStatusCode())));
+	co_return chunks;
+}
+
+/* data as one chunk of a chunked body */
+static std::string chunkOf(const std::string &data)
+{
+	char size[16];
+	snprintf(size, sizeof(size), "%zx\r\n", data.length());
+	return size + data + "\r\n";
+}
+
+TEST(CoroutineTests, chunkReaderStreamsBody)
+{
+	const std::vector<std::string> parts = {"first ", "second ", "third"};
+	TestServer origin([&parts](TestConnection &connection)
+	                  {
+		                  std::string head;
+		                  std::string body;
+		                  if (!connection.readRequest(head, body))
+		                  {
+			                  return;
+		                  }
+		                  connection.write("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+		                  for (const std::string &part: parts)
+		                  {
+			                  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			                  connection.write(chunkOf(part));
+		                  }
+		                  connection.write("0\r\n\r\n");
+	                  });
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url("/stream"))).GET().build();
+	std::vector<std::string> chunks = syncWait(readChunks(*client, request));
+	ASSERT_FALSE(chunks.empty());
+	EXPECT_EQ("200", chunks.back());
+	chunks.pop_back();
+	std::string streamed;
+	for (const std::string &chunk: chunks)
+	{
+		streamed += chunk;
+	}
+	EXPECT_EQ("first second third", streamed);
+	/* The parts were written apart, they were not all read at once */
+	EXPECT_GE(chunks.size(), 2U);
+}
+
+/* Each chunk of request is kept across a call of other, during which the loop reads on */
+static Task<std::string> readAcrossCalls(HttpClient &client, HttpRequest request, HttpRequest other)
+{
+	std::string streamed;
+	ChunkReader reader(client, request);
+	while (std::optional<std::string_view> chunk = co_await reader.next())
+	{
+		co_await co_send(client, other);
+		streamed.append(*chunk);
+	}
+	co_return streamed;
+}
+
+TEST(CoroutineTests, chunkOutlivesSuspension)
+{
+	const std::vector<std::string> parts = {std::string(3000, 'a'), std::string(3000, 'b'), std::string(3000, 'c')};
+	TestServer origin([&parts](TestConnection &connection)
+	                  {
+		                  std::string head;
+		                  std::string body;
+		                  if (!connection.readRequest(head, body))
+		                  {
+			                  return;
+		                  }
+		                  connection.write("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+		                  for (const std::string &part: parts)
+		                  {
+			                  connection.write(chunkOf(part));
+			                  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		                  }
+		                  connection.write("0\r\n\r\n");
+	                  });
+	/* Answers after the origin sent its next chunk */
+	TestServer slow(keepAliveHandler([](const std::string &, const std::string &)
+	                                 {
+		                                 std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		                                 return textResponse("200 OK", "ok");
+	                                 }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url("/stream"))).GET().build();
+	HttpRequest other = HttpRequestBuilder::newBuilder().url(URL(slow.url("/slow"))).GET().build();
+	EXPECT_EQ(parts[0] + parts[1] + parts[2], syncWait(readAcrossCalls(*client, request, other)));
+}
+
+TEST(CoroutineTests, chunkReaderStopsEarly)
+{
+	std::atomic<bool> cut{false};
+	TestServer origin([&cut](TestConnection &connection)
+	                  {
+		                  std::string head;
+		                  std::string body;
+		                  if (!connection.readRequest(head, body))
+		                  {
+			                  return;
+		                  }
+		                  connection.write("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+		                  /* Until the client hangs up */
+		                  for (int i = 0; (i < 500) && connection.write(chunkOf("more")); ++i)
+		                  {
+			                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		                  }
+		                  cut = true;
+	                  });
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url("/endless"))).GET().build();
+	std::vector<std::string> chunks = syncWait(readChunks(*client, request, 2));
+	ASSERT_EQ(2U, chunks.size());
+	EXPECT_EQ(0U, chunks[0].find("more"));
+	EXPECT_EQ(0U, chunks[1].find("more"));
+	origin.join();
+	EXPECT_TRUE(cut);
+
+	/* A failed call ends the reading with an exception */
+	HttpRequest refused = HttpRequestBuilder::newBuilder().url(URL("http://127.0.0.1:1/")).GET().build();
+	EXPECT_THROW(syncWait(readChunks(*client, refused)), std::runtime_error);
+}
+
+#endif
+
+#endif
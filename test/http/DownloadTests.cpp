@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "src/http/Connection.h"
+#include "TestServer.h"
+
+/* Feeds data to a decoder in pieces of step bytes, returns the decoded body */
+static std::string decodeInSteps(ChunkDecoder &decoder, const std::string &data, size_t step)
+{
+	std::string body;
+	for (size_t offset = 0; offset < data.length(); offset += step)
+	{
+		std::string piece = data.substr(offset, step);
+		size_t len = decoder.decode(piece.data(), piece.length());
+		body.append(piece.data(), len);
+	}
+	return body;
+}
+
+TEST(DownloadTests, chunkDecoderAnySplit)
+{
+	const std::string data = "5;name=value\r\nhello\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\nX-Trailer: 1\r\n\r\n";
+	for (size_t step = 1; step <= data.length(); ++step)
+	{
+		ChunkDecoder decoder;
+		EXPECT_EQ("helloabcdefghijklmnopqrstuvwxyz", decodeInSteps(decoder, data, step)) << "step " << step;
+		EXPECT_TRUE(decoder.done());
+	}
+}
+
+TEST(DownloadTests, chunkDecoderRejectsGarbage)
+{
+	ChunkDecoder decoder;
+	std::string data = "zz\r\n";
+	EXPECT_THROW(decoder.decode(data.data(), data.length()), std::invalid_argument);
+	ChunkDecoder missingCrlf;
+	data = "3\r\nabcX";
+	EXPECT_THROW(missingCrlf.decode(data.data(), data.length()), std::invalid_argument);
+}
+
+TEST(DownloadTests, sinkTakesDecodedBody)
+{
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/")).GET().build();
+	HttpResponse response{};
+	std::string streamed;
+	response.setBodySink([&streamed](const char *data, size_t len)
+	                     {
+		                     streamed.append(data, len);
+		                     return true;
+	                     });
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	ResponseReader reader(trace, response);
+	const std::string wire = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nwiki\r\n5\r\npedia\r\n0\r\n\r\n";
+	bool complete = false;
+	for (char c: wire)
+	{
+		*reader.space() = c;
+		complete = reader.consume(1);
+	}
+	EXPECT_TRUE(complete);
+	bool keepAlive = false;
+	EXPECT_EQ(wire.length(), reader.finish(keepAlive));
+	EXPECT_TRUE(keepAlive);
+	EXPECT_EQ("wikipedia", streamed);
+	EXPECT_EQ(0U, response.getBodyLength());
+}
+
+TEST(DownloadTests, bufferTargetBounds)
+{
+	BufferTarget target;
+	ASSERT_TRUE(target.allocate(8));
+	EXPECT_TRUE(target.write(4, "efgh", 4));
+	EXPECT_TRUE(target.write(0, "abcd", 4));
+	EXPECT_FALSE(target.write(6, "xyz", 3));
+	EXPECT_EQ("abcdefgh", std::string(target.getData().data(), target.getData().size()));
+}
+
+#ifndef _WIN32
+
+/* Origin of one object that serves byte ranges, with a strong ETag */
+class RangeOrigin
+{
+public:
+	explicit RangeOrigin(size_t size) : server([this](TestConnection &connection)
+	                                           { serve(connection); })
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			object += static_cast<char>('a' + (i * 7 + i / 251) % 26);
+		}
+	}
+
+	/* The "first-last" of each range request, "all" for one without */
+	std::vector<std::string> takeRanges()
+	{
+		std::lock_guard<std::mutex> lock(rangeMutex);
+		std::vector<std::string> taken;
+		taken.swap(ranges);
+		return taken;
+	}
+
+	[[nodiscard]] HttpRequest request() const
+	{
+		return HttpRequestBuilder::newBuilder().url(URL(server.url("/object.bin"))).GET().build();
+	}
+
+	std::string object;
+	/* Answers every request with the whole object */
+	std::atomic<bool> ignoreRange{false};
+	std::atomic<bool> changeAfterProbe{false};
+	/* This many responses starting in the 16 KiB at cutAt break off after 1000 bytes */
+	std::atomic<int> cuts{0};
+	size_t cutAt = 0;
+
+private:
+	void serve(TestConnection &connection)
+	{
+		std::string head;
+		std::string body;
+		while (connection.readRequest(head, body))
+		{
+			std::string lower = head;
+			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			size_t rangeStart = lower.find("\r\nrange: bytes=");
+			std::string etag = "\"v1\"";
+			bool changed;
+			{
+				std::lock_guard<std::mutex> lock(rangeMutex);
+				changed = changeAfterProbe && !ranges.empty();
+				ranges.push_back((rangeStart == std::string::npos) || ignoreRange ? "all" :
+				                 lower.substr(rangeStart + 15, lower.find("\r\n", rangeStart + 15) - rangeStart - 15));
+			}
+			etag = changed ? "\"v2\"" : etag;
+			size_t ifRange = lower.find("\r\nif-range: ");
+			bool stale = (ifRange != std::string::npos) && (head.substr(ifRange + 12, etag.length()) != etag);
+			if ((rangeStart == std::string::npos) || ignoreRange || stale)
+			{
+				connection.write(textResponse("200 OK", object, "ETag: " + etag + "\r\n"));
+				continue;
+			}
+			size_t first = std::stoul(lower.substr(rangeStart + 15));
+			if (first >= object.size())
+			{
+				connection.write(textResponse("416 Range Not Satisfiable", "",
+				                              "Content-Range: bytes */" + std::to_string(object.size()) + "\r\n"));
+				continue;
+			}
+			size_t last = std::min(std::stoul(lower.substr(lower.find('-', rangeStart + 15) + 1)), object.size() - 1);
+			std::string part = object.substr(first, last - first + 1);
+			std::string reply = textResponse("206 Partial Content", part,
+			                                 "ETag: " + etag + "\r\nContent-Range: bytes " + std::to_string(first) +
+			                                 "-" + std::to_string(last) + "/" + std::to_string(object.size()) +
+			                                 "\r\n");
+			if ((first >= cutAt) && (first < cutAt + 16384) && (cuts-- > 0))
+			{
+				connection.write(reply.substr(0, reply.length() - part.length() + 1000));
+				return;
+			}
+			connection.write(reply);
+		}
+	}
+
+	std::mutex rangeMutex;
+	std::vector<std::string> ranges;
+	TestServer server;
+};
+
+static std::string contentOf(const BufferTarget &target)
+{
+	return {target.getData().data(), target.getData().size()};
+}
+
+static std::string fileContent(const std::string &path)
+{
+	std::ifstream in(path, std::ios::binary);
+	return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+static DownloadOptions segmentsOf16k(unsigned int connections)
+{
+	DownloadOptions options;
+	options.segmentSize = 16384;
+	options.connections = connections;
+	return options;
+}
+
+TEST(DownloadTests, segmentsInParallel)
+{
+	RangeOrigin origin(100000);
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	BufferTarget target;
+	EXPECT_EQ(100000U, SegmentedDownload(client, segmentsOf16k(4)).download(origin.request(), target));
+	EXPECT_EQ(origin.object, contentOf(target));
+	std::vector<std::string> ranges = origin.takeRanges();
+	ASSERT_FALSE(ranges.empty());
+	EXPECT_EQ("0-16383", ranges[0]);
+	std::sort(ranges.begin(), ranges.end());
+	EXPECT_EQ((std::vector<std::string>{"0-16383", "16384-32767", "32768-49151", "49152-65535", "65536-81919",
+	                                    "81920-98303", "98304-99999"}), ranges);
+}
+
+TEST(DownloadTests, segmentResumesWhereItBroke)
+{
+	RangeOrigin origin(100000);
+	origin.cutAt = 32768;
+	origin.cuts = 1;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	BufferTarget target;
+	EXPECT_EQ(100000U, SegmentedDownload(client, segmentsOf16k(1)).download(origin.request(), target));
+	EXPECT_EQ(origin.object, contentOf(target));
+	EXPECT_EQ((std::vector<std::string>{"0-16383", "16384-32767", "32768-49151", "33768-49151", "49152-65535",
+	                                    "65536-81919", "81920-98303", "98304-99999"}), origin.takeRanges());
+}
+
+TEST(DownloadTests, firstSegmentResumesWhereItBroke)
+{
+	RangeOrigin origin(100000);
+	origin.cuts = 1;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	BufferTarget target;
+	EXPECT_EQ(100000U, SegmentedDownload(client, segmentsOf16k(1)).download(origin.request(), target));
+	EXPECT_EQ(origin.object, contentOf(target));
+	EXPECT_EQ((std::vector<std::string>{"0-16383", "1000-16383", "16384-32767", "32768-49151", "49152-65535",
+	                                    "65536-81919", "81920-98303", "98304-99999"}), origin.takeRanges());
+}
+
+TEST(DownloadTests, journalSkipsFinishedSegments)
+{
+	RangeOrigin origin(100000);
+	origin.cutAt = 49152;
+	origin.cuts = 100;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	const std::string path = "/tmp/lwhttp-download-" + std::to_string(getpid()) + ".bin";
+	DownloadOptions options = segmentsOf16k(1);
+	options.retries = 1;
+	options.journal = path + ".journal";
+	{
+		FileTarget target(path);
+		EXPECT_THROW(SegmentedDownload(client, options).download(origin.request(), target), std::runtime_error);
+	}
+	EXPECT_EQ((std::vector<std::string>{"0-16383", "16384-32767", "32768-49151", "49152-65535", "50152-65535"}),
+	          origin.takeRanges());
+
+	/* Memory starts out empty, the journal does not apply to it */
+	origin.cuts = 0;
+	BufferTarget buffer;
+	EXPECT_EQ(100000U, SegmentedDownload(client, options).download(origin.request(), buffer));
+	EXPECT_EQ(origin.object, contentOf(buffer));
+	EXPECT_EQ(7U, origin.takeRanges().size());
+
+	{
+		FileTarget target(path);
+		EXPECT_EQ(100000U, SegmentedDownload(client, options).download(origin.request(), target));
+	}
+	/* The probe always comes back with the first segment */
+	EXPECT_EQ((std::vector<std::string>{"0-16383", "49152-65535", "65536-81919", "81920-98303", "98304-99999"}),
+	          origin.takeRanges());
+	EXPECT_EQ(origin.object, fileContent(path));
+	EXPECT_FALSE(std::ifstream(options.journal).good());
+	std::remove(path.c_str());
+}
+
+TEST(DownloadTests, changedObjectFails)
+{
+	RangeOrigin origin(100000);
+	origin.changeAfterProbe = true;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	BufferTarget target;
+	EXPECT_THROW(SegmentedDownload(client, segmentsOf16k(2)).download(origin.request(), target), std::runtime_error);
+}
+
+TEST(DownloadTests, emptyObject)
+{
+	RangeOrigin origin(0);
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	BufferTarget target;
+	EXPECT_EQ(0U, SegmentedDownload(client, segmentsOf16k(4)).download(origin.request(), target));
+	EXPECT_TRUE(target.getData().empty());
+	EXPECT_EQ((std::vector<std::string>{"0-16383"}), origin.takeRanges());
+}
+
+TEST(DownloadTests, serverWithoutRanges)
+{
+	RangeOrigin origin(100000);
+	origin.ignoreRange = true;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	BufferTarget target;
+	EXPECT_EQ(100000U, SegmentedDownload(client, segmentsOf16k(4)).download(origin.request(), target));
+	EXPECT_EQ(origin.object, contentOf(target));
+	EXPECT_EQ((std::vector<std::string>{"all"}), origin.takeRanges());
+}
+
+#endif
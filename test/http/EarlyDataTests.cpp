@@ -0,0 +1,193 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <openssl/ssl.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+#ifndef _WIN32
+
+/* TLS 1.3 origin on a loopback port that accepts early data. Each response closes the connection and tells in its
+ * body whether the request came as early data. */
+class EarlyDataServer
+{
+public:
+	enum class Mode
+	{
+		ACCEPT,
+		/* Early data is refused in the handshake */
+		REJECT,
+		/* Early data is accepted, a request in it gets "425 Too Early" */
+		TOO_EARLY
+	};
+
+	EarlyDataServer() : server([this](TestConnection &connection)
+	                           { serve(connection); }, earlyDataContext(this))
+	{
+	}
+
+	[[nodiscard]] std::string url() const
+	{
+		return server.url("/resource");
+	}
+
+	/* Request lines, prefixed with "early " if they came as early data */
+	std::vector<std::string> getRequests()
+	{
+		server.join();
+		std::lock_guard<std::mutex> lock(requestMutex);
+		return requests;
+	}
+
+	std::atomic<Mode> mode{Mode::ACCEPT};
+	/* A request is only answered once this many came */
+	std::atomic<size_t> answerAfter{0};
+
+private:
+	static SSL_CTX *earlyDataContext(EarlyDataServer *owner)
+	{
+		SSL_CTX *ctx = newSelfSignedContext();
+		SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+		SSL_CTX_set_max_early_data(ctx, 16384);
+		SSL_CTX_set_allow_early_data_cb(ctx, [](SSL *, void *arg)
+		{
+			return static_cast<EarlyDataServer *>(arg)->mode == Mode::REJECT ? 0 : 1;
+		}, owner);
+		return ctx;
+	}
+
+	void serve(TestConnection &connection)
+	{
+		SSL *ssl = connection.getSSL();
+		std::string request;
+		char buffer[4096];
+		size_t readLen = 0;
+		int status;
+		while ((status = SSL_read_early_data(ssl, buffer, sizeof(buffer), &readLen)) == SSL_READ_EARLY_DATA_SUCCESS)
+		{
+			request.append(buffer, readLen);
+		}
+		bool early = !request.empty();
+		if ((status == SSL_READ_EARLY_DATA_ERROR) || (SSL_do_handshake(ssl) != 1))
+		{
+			return;
+		}
+		connection.unread(request);
+		std::string head;
+		std::string body;
+		if (!connection.readRequest(head, body))
+		{
+			return;
+		}
+		{
+			std::unique_lock<std::mutex> lock(requestMutex);
+			requests.push_back((early ? "early " : "") + head.substr(0, head.find("\r\n")));
+			requestArrived.notify_all();
+			requestArrived.wait_for(lock, std::chrono::seconds(5), [this]()
+			{ return requests.size() >= answerAfter; });
+		}
+		const char *reply = (early && (mode == Mode::TOO_EARLY)) ? "425 Too Early" : "200 OK";
+		connection.write(textResponse(reply, early ? "early" : "late", "Connection: close\r\n"));
+	}
+
+	std::mutex requestMutex;
+	std::condition_variable requestArrived;
+	std::vector<std::string> requests;
+	TestServer server;
+};
+
+TEST(EarlyDataTests, sendsGetAsEarlyData)
+{
+	EarlyDataServer server;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().earlyData().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url())).GET().build();
+
+	/* No session yet, the first handshake is a full one */
+	HttpResponse first;
+	ASSERT_NE(0U, client->send(request, first));
+	EXPECT_EQ("late", bodyOf(first));
+	EXPECT_FALSE(first.getTiming().earlyData);
+
+	HttpResponse second;
+	ASSERT_NE(0U, client->send(request, second));
+	EXPECT_EQ(HttpStatus::OK, second.getStatusCode());
+	EXPECT_EQ("early", bodyOf(second));
+	EXPECT_TRUE(second.getTiming().sessionResumed);
+	EXPECT_TRUE(second.getTiming().earlyData);
+
+	/* A body makes the request unsafe to replay */
+	HttpRequest post = HttpRequestBuilder::newBuilder().url(URL(server.url()))
+			.POST(std::make_shared<HttpBodyImpl>("payload", 7)).build();
+	HttpResponse posted;
+	ASSERT_NE(0U, client->send(post, posted));
+	EXPECT_EQ("late", bodyOf(posted));
+	EXPECT_TRUE(posted.getTiming().sessionResumed);
+	EXPECT_FALSE(posted.getTiming().earlyData);
+
+	server.mode = EarlyDataServer::Mode::REJECT;
+	HttpResponse rejected;
+	ASSERT_NE(0U, client->send(request, rejected));
+	EXPECT_EQ(HttpStatus::OK, rejected.getStatusCode());
+	EXPECT_EQ("late", bodyOf(rejected));
+	EXPECT_FALSE(rejected.getTiming().earlyData);
+
+	server.mode = EarlyDataServer::Mode::TOO_EARLY;
+	HttpResponse retried;
+	ASSERT_NE(0U, client->send(request, retried));
+	EXPECT_EQ(HttpStatus::OK, retried.getStatusCode());
+	EXPECT_EQ("late", bodyOf(retried));
+
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(2U, metrics.tlsEarlyData);
+	EXPECT_EQ(6U, metrics.tlsHandshakes);
+	EXPECT_EQ((std::vector<std::string>{"GET /resource HTTP/1.1", "early GET /resource HTTP/1.1",
+	                                    "POST /resource HTTP/1.1", "GET /resource HTTP/1.1",
+	                                    "early GET /resource HTTP/1.1", "GET /resource HTTP/1.1"}), server.getRequests());
+}
+
+TEST(EarlyDataTests, ticketCarriesEarlyDataOnce)
+{
+	EarlyDataServer server;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().earlyData().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url())).GET().build();
+	HttpResponse first;
+	ASSERT_NE(0U, client->send(request, first));
+
+	/* Two connections at once, both before either got new tickets. Each needs a ticket of its own, the server
+	 * refuses early data with one it has seen. */
+	server.answerAfter = 3;
+	HttpResponse parallel;
+	std::thread other([&client, &request, &parallel]()
+	                  { client->send(request, parallel); });
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(request, response));
+	other.join();
+	EXPECT_EQ("early", bodyOf(response));
+	EXPECT_EQ("early", bodyOf(parallel));
+	EXPECT_EQ(2U, client->getMetrics().tlsEarlyData);
+}
+
+TEST(EarlyDataTests, offByDefault)
+{
+	EarlyDataServer server;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url())).GET().build();
+	for (int i = 0; i < 2; ++i)
+	{
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(request, response));
+		EXPECT_EQ("late", bodyOf(response));
+		EXPECT_FALSE(response.getTiming().earlyData);
+	}
+	EXPECT_EQ(0U, client->getMetrics().tlsEarlyData);
+}
+
+#endif
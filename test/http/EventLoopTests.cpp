@@ -0,0 +1,220 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "src/http/EventLoop.h"
+
+TEST(EventLoopTests, mpscQueueKeepsProducerOrder)
+{
+	constexpr int PRODUCERS = 4;
+	constexpr int ITEMS = 20000;
+	MpscQueue<int> queue;
+	std::vector<std::thread> producers;
+	for (int p = 0; p < PRODUCERS; ++p)
+	{
+		producers.emplace_back([&queue, p]()
+		                       {
+			                       for (int i = 0; i < ITEMS; ++i)
+			                       {
+				                       queue.push(p * ITEMS + i);
+			                       }
+		                       });
+	}
+	std::vector<int> next(PRODUCERS, 0);
+	int received = 0;
+	while (received < PRODUCERS * ITEMS)
+	{
+		int value;
+		if (!queue.pop(value))
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		int producer = value / ITEMS;
+		ASSERT_EQ(next[producer], value % ITEMS);
+		++next[producer];
+		++received;
+	}
+	for (auto &producer: producers)
+	{
+		producer.join();
+	}
+	int value;
+	EXPECT_FALSE(queue.pop(value));
+}
+
+TEST(EventLoopTests, executeFromManyThreads)
+{
+	EventLoop loop(0, -1);
+	std::atomic<int> executed{0};
+	std::atomic<bool> onLoop{true};
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([&]()
+		                     {
+			                     for (int i = 0; i < 1000; ++i)
+			                     {
+				                     loop.execute([&]()
+				                                  {
+					                                  onLoop = onLoop && loop.inLoopThread();
+					                                  ++executed;
+				                                  });
+			                     }
+		                     });
+	}
+	for (auto &thread: threads)
+	{
+		thread.join();
+	}
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while ((executed < 8000) && (std::chrono::steady_clock::now() < deadline))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_EQ(executed, 8000);
+	EXPECT_TRUE(onLoop);
+}
+
+class TimeoutHandler : public IoHandler
+{
+public:
+	void onEvents(uint32_t events) override
+	{
+	}
+
+	void onTimeout() override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		fired = true;
+		firedCondition.notify_all();
+	}
+
+	std::mutex mutex;
+	std::condition_variable firedCondition;
+	bool fired = false;
+};
+
+TEST(EventLoopTests, deadlineFires)
+{
+	EventLoop loop(0, -1);
+	TimeoutHandler handler;
+	auto start = std::chrono::steady_clock::now();
+	loop.execute([&]()
+	             { loop.schedule(EventLoop::Clock::now() + std::chrono::milliseconds(20), &handler); });
+	std::unique_lock<std::mutex> lock(handler.mutex);
+	ASSERT_TRUE(handler.firedCondition.wait_for(lock, std::chrono::seconds(5), [&handler]()
+	{ return handler.fired; }));
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+}
+
+TEST(EventLoopTests, lookupRunsOffTheLoop)
+{
+	std::atomic<bool> lookupOnLoop{true};
+	std::atomic<bool> doneOnLoop{false};
+	std::atomic<bool> submitted{false};
+	std::atomic<bool> done{false};
+	{
+		EventLoopGroup group(1, false);
+		EventLoop &loop = group.next();
+		loop.execute([&]()
+		             {
+			             submitted = loop.resolve([&]()
+			                                      {
+				                                      lookupOnLoop = loop.inLoopThread();
+				                                      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			                                      }, [&]()
+			                                      {
+				                                      doneOnLoop = loop.inLoopThread();
+				                                      done = true;
+			                                      });
+		             });
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (!submitted && (std::chrono::steady_clock::now() < deadline))
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		ASSERT_TRUE(submitted);
+	}
+	/* The group went down while the lookup ran, its done task still came */
+	EXPECT_TRUE(done);
+	EXPECT_FALSE(lookupOnLoop);
+	EXPECT_TRUE(doneOnLoop);
+
+	EventLoop alone(0, -1);
+	EXPECT_FALSE(alone.resolve([]()
+	                           {}, []()
+	                           {}));
+}
+
+TEST(EventLoopTests, unqueuedLookupFailsTheCall)
+{
+	/* A loop without resolvers cannot look the name up and must not do it on its own thread */
+	EventLoop loop(0, -1);
+	auto metrics = std::make_shared<HttpMetrics>();
+	std::mutex doneMutex;
+	std::condition_variable doneSignal;
+	bool done = false;
+	size_t received = 1;
+	bool onLoop = false;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://lwhttp-unresolved.invalid/")).GET()
+			.build();
+	loop.execute([&]()
+	             {
+		             exchangeAsync(loop, request, std::make_shared<HttpClientConfig>(), nullptr, metrics, nullptr,
+		                           [&](size_t len, HttpResponse &)
+		                           {
+			                           std::lock_guard<std::mutex> lock(doneMutex);
+			                           received = len;
+			                           onLoop = loop.inLoopThread();
+			                           done = true;
+			                           doneSignal.notify_one();
+		                           });
+	             });
+	std::unique_lock<std::mutex> lock(doneMutex);
+	ASSERT_TRUE(doneSignal.wait_for(lock, std::chrono::seconds(5), [&done]()
+	{ return done; }));
+	EXPECT_EQ(0U, received);
+	EXPECT_TRUE(onLoop);
+	EXPECT_EQ(1U, metrics->snapshot().failures);
+	/* No lookup ran, not even a blocking one on the loop */
+	EXPECT_EQ(0U, metrics->snapshot().dnsCacheMisses);
+}
+
+TEST(EventLoopTests, nextSpreadsOverLoops)
+{
+	EventLoopGroup group(4, false);
+	/* One submitting thread reaches every loop */
+	std::set<EventLoop *> used;
+	for (int i = 0; i < 8; ++i)
+	{
+		used.insert(&group.next());
+	}
+	EXPECT_EQ(4U, used.size());
+
+	/* A loop thread submits to its own loop */
+	EventLoop *loop = &group.next();
+	std::atomic<int> own{0};
+	std::atomic<bool> answered{false};
+	loop->execute([&]()
+	              {
+		              for (int i = 0; i < 8; ++i)
+		              {
+			              own += (&group.next() == loop) ? 1 : 0;
+		              }
+		              answered = true;
+	              });
+	while (!answered)
+	{
+		std::this_thread::yield();
+	}
+	EXPECT_EQ(8, own);
+}
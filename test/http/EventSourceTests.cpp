@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+/* Events of stream as "type|data|id", fed in pieces of step bytes */
+static std::vector<std::string> parse(const std::string &stream, size_t step, EventStreamParser &parser)
+{
+	std::vector<std::string> events;
+	auto handler = [&events](const ServerSentEvent &event)
+	{
+		events.push_back(event.type + "|" + event.data + "|" + event.id);
+		return true;
+	};
+	for (size_t offset = 0; offset < stream.length(); offset += step)
+	{
+		parser.feed(stream.data() + offset, std::min(step, stream.length() - offset), handler);
+	}
+	return events;
+}
+
+TEST(EventSourceTests, parsesAcrossPieces)
+{
+	const std::string stream = "\xEF\xBB\xBF: comment\n"
+	                           "data: first\n\n"
+	                           "event: update\r\ndata:two\r\ndata:  lines\r\nid: 7\r\n\r\n"
+	                           "data\rretry: 1500\r\r"
+	                           "id: 8\n\n"
+	                           "unknown: field\ndata: no id change\n\n"
+	                           "data: unterminated";
+	const std::vector<std::string> expected = {"message|first|", "update|two\n lines|7", "message||7",
+	                                           "message|no id change|8"};
+	for (size_t step = 1; step <= stream.length(); ++step)
+	{
+		EventStreamParser parser;
+		ASSERT_EQ(expected, parse(stream, step, parser)) << "step " << step;
+		EXPECT_EQ("8", parser.getLastEventId());
+		EXPECT_EQ(1500, parser.getRetry());
+	}
+}
+
+TEST(EventSourceTests, dropsLargeEventsAndStops)
+{
+	EventStreamParser parser(16);
+	std::string stream = "data: small\n\ndata: " + std::string(40, 'x') + "\nid: 3\n\ndata: 0123456789\ndata: 0123456789\n\n"
+	                     "data: after\n\n";
+	EXPECT_EQ((std::vector<std::string>{"message|small|", "message|after|3"}), parse(stream, 7, parser));
+	EXPECT_EQ(2U, parser.getDroppedEvents());
+
+	EventStreamParser stopping;
+	size_t calls = 0;
+	std::string twoEvents = "data: a\n\ndata: b\n\n";
+	EXPECT_FALSE(stopping.feed(twoEvents.data(), twoEvents.length(), [&calls](const ServerSentEvent &event)
+	{
+		++calls;
+		return false;
+	}));
+	EXPECT_EQ(1U, calls);
+
+	/* A new connection drops the partial event, not the last ID */
+	EventStreamParser reconnecting;
+	std::string partial = "id: 5\n\ndata: cut";
+	parse(partial, partial.length(), reconnecting);
+	reconnecting.reset();
+	EXPECT_EQ((std::vector<std::string>{"message|whole|5"}), parse("data: whole\n\n", 4, reconnecting));
+}
+
+#ifndef _WIN32
+
+TEST(EventSourceTests, reconnectsWithLastEventId)
+{
+	const std::string replies[] = {
+			"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nConnection: close\r\n\r\n"
+			"retry: 10\ndata: one\nid: 1\n\n",
+			"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+			"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\n"
+			"Connection: close\r\n\r\n6\r\ndata: \r\n9\r\ntwo\nid: 2\r\n2\r\n\n\n\r\n0\r\n\r\n",
+			"HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n"};
+	std::mutex requestMutex;
+	std::vector<std::string> requests;
+	/* One reply per connection, in order */
+	TestServer server([&](TestConnection &connection)
+	                  {
+		                  std::string head;
+		                  std::string body;
+		                  if (!connection.readRequest(head, body))
+		                  {
+			                  return;
+		                  }
+		                  std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+		                  std::lock_guard<std::mutex> lock(requestMutex);
+		                  if (requests.size() < 4)
+		                  {
+			                  connection.write(replies[requests.size()]);
+		                  }
+		                  requests.push_back(head);
+	                  });
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder()
+			.url(URL(server.url("/events"))).GET().build();
+	EventSource source(client, request);
+	std::vector<std::string> events;
+	EXPECT_TRUE(source.run([&events](const ServerSentEvent &event)
+	                       {
+		                       events.push_back(event.data + "|" + event.id);
+		                       return true;
+	                       }));
+	server.join();
+	EXPECT_EQ((std::vector<std::string>{"one|1", "two|2"}), events);
+	EXPECT_EQ(HttpStatus::NO_CONTENT, source.getStatus());
+	EXPECT_EQ("2", source.getLastEventId());
+	ASSERT_EQ(4U, requests.size());
+	EXPECT_NE(std::string::npos, requests[0].find("accept: text/event-stream"));
+	EXPECT_EQ(std::string::npos, requests[0].find("last-event-id"));
+	EXPECT_NE(std::string::npos, requests[1].find("last-event-id: 1\r\n"));
+	EXPECT_NE(std::string::npos, requests[3].find("last-event-id: 2\r\n"));
+}
+
+TEST(EventSourceTests, stopAbortsQuietStream)
+{
+	/* One event, then nothing until the client goes away */
+	TestServer server([](TestConnection &connection)
+	                  {
+		                  std::string head;
+		                  std::string body;
+		                  if (!connection.readRequest(head, body))
+		                  {
+			                  return;
+		                  }
+		                  connection.write("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n\r\ndata: one\n\n");
+		                  char buffer[64];
+		                  while (connection.read(buffer, sizeof(buffer)) > 0)
+		                  {
+		                  }
+	                  });
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().timeout(30).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder()
+			.url(URL(server.url("/events"))).GET().build();
+	EventSource source(client, request);
+	std::promise<void> first;
+	std::future<bool> result = std::async(std::launch::async, [&source, &first]()
+	{
+		return source.run([&first](const ServerSentEvent &event)
+		                  {
+			                  first.set_value();
+			                  return true;
+		                  });
+	});
+	first.get_future().wait();
+	source.stop();
+	ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(5)));
+	EXPECT_TRUE(result.get());
+	server.join();
+}
+
+#endif
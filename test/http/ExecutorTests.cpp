@@ -0,0 +1,64 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "src/http/WorkStealingPool.h"
+
+TEST(ExecutorTests, runsNestedSubmissions)
+{
+	std::atomic<int> executed{0};
+	{
+		WorkStealingPool pool(4, 100000);
+		for (int i = 0; i < 1000; ++i)
+		{
+			ASSERT_TRUE(pool.submit([&pool, &executed]()
+			                        {
+				                        ++executed;
+				                        /* Lands on the worker's own queue, others may steal it */
+				                        pool.submit([&executed]()
+				                                    { ++executed; });
+			                        }));
+		}
+	}
+	EXPECT_EQ(executed, 2000);
+}
+
+TEST(ExecutorTests, rejectsBeyondQueueLimit)
+{
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+	std::atomic<bool> started{false};
+	WorkStealingPool pool(1, 2);
+	ASSERT_TRUE(pool.submit([released, &started]()
+	                        {
+		                        started = true;
+		                        released.wait();
+	                        }));
+	while (!started)
+	{
+		std::this_thread::yield();
+	}
+	EXPECT_TRUE(pool.submit([]()
+	                        {}));
+	EXPECT_TRUE(pool.submit([]()
+	                        {}));
+	EXPECT_FALSE(pool.submit([]()
+	                         {}));
+	release.set_value();
+}
+
+TEST(ExecutorTests, futureHoldsFailure)
+{
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().executor(2, 16).build();
+	/* Nothing listens on port 1 */
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://127.0.0.1:1/")).GET().build();
+	std::future<HttpResponse> future = client->sendFuture(request);
+	ASSERT_EQ(future.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+	EXPECT_THROW(future.get(), std::runtime_error);
+}
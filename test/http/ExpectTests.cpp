@@ -0,0 +1,118 @@
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "src/http/Connection.h"
+
+/* Reads from fd until the data ends with terminator or holds len bytes, returns what was read */
+static std::string readUntil(int fd, const std::string &terminator, size_t len = 0)
+{
+	std::string data;
+	char buffer[4096];
+	while (true)
+	{
+		if ((len > 0) ? (data.length() >= len) :
+		    ((data.length() >= terminator.length()) &&
+		     (data.compare(data.length() - terminator.length(), terminator.length(), terminator) == 0)))
+		{
+			return data;
+		}
+		ssize_t readLen = recv(fd, buffer, sizeof(buffer), 0);
+		if (readLen <= 0)
+		{
+			return data;
+		}
+		data.append(buffer, readLen);
+	}
+}
+
+static size_t put(int fd, const std::string &payload, HttpResponse &response, bool &keepAlive)
+{
+	HttpClientConfig config;
+	config.expectContinueThreshold = 16;
+	auto body = std::make_shared<HttpBodyImpl>(payload.c_str(), payload.length());
+	body->setBodyLength(payload.length());
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload")).PUT(body).build();
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	PlainConnection connection(fd);
+	return exchange(connection, config, trace, response, keepAlive);
+}
+
+TEST(ExpectTests, bodyFollowsContinue)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	const std::string payload(100, 'x');
+	std::string head;
+	std::string received;
+	std::thread server([&]()
+	                   {
+		                   head = readUntil(fds[1], "\r\n\r\n");
+		                   std::string interim = "HTTP/1.1 100 Continue\r\n\r\n";
+		                   send(fds[1], interim.data(), interim.length(), 0);
+		                   received = readUntil(fds[1], "", payload.length());
+		                   std::string reply = "HTTP/1.1 201 Created\r\nContent-Length: 2\r\n\r\nok";
+		                   send(fds[1], reply.data(), reply.length(), 0);
+	                   });
+	HttpResponse response{};
+	bool keepAlive = false;
+	EXPECT_GT(put(fds[0], payload, response, keepAlive), 0U);
+	server.join();
+	EXPECT_NE(std::string::npos, head.find("\r\nExpect: 100-continue\r\n"));
+	EXPECT_EQ(payload, received);
+	EXPECT_EQ(HttpStatus::CREATED, response.getStatusCode());
+	EXPECT_STREQ("ok", response.getResponseBody()->getContent());
+	EXPECT_TRUE(keepAlive);
+	close(fds[1]);
+}
+
+TEST(ExpectTests, rejectionSkipsBody)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	std::string afterHead;
+	std::thread server([&]()
+	                   {
+		                   readUntil(fds[1], "\r\n\r\n");
+		                   std::string reply = "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\n\r\n";
+		                   send(fds[1], reply.data(), reply.length(), 0);
+		                   /* The client closes without sending the body */
+		                   afterHead = readUntil(fds[1], "", 1);
+	                   });
+	HttpResponse response{};
+	bool keepAlive = true;
+	EXPECT_GT(put(fds[0], std::string(100, 'x'), response, keepAlive), 0U);
+	server.join();
+	EXPECT_EQ(HttpStatus::PAYLOAD_TOO_LARGE, response.getStatusCode());
+	EXPECT_FALSE(keepAlive);
+	EXPECT_TRUE(afterHead.empty());
+	close(fds[1]);
+}
+
+TEST(ExpectTests, earlyHintsAreSkipped)
+{
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/")).GET().build();
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	ResponseReader reader(trace, response);
+	const std::string wire = "HTTP/1.1 103 Early Hints\r\nLink: </a.css>\r\n\r\n"
+	                         "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nhi";
+	memcpy(reader.space(), wire.data(), wire.length());
+	EXPECT_TRUE(reader.consume(wire.length()));
+	bool keepAlive = false;
+	EXPECT_EQ(wire.length(), reader.finish(keepAlive));
+	EXPECT_EQ(HttpStatus::OK, response.getStatusCode());
+	EXPECT_TRUE(response.getHeader().getField("Link").empty());
+	EXPECT_STREQ("hi", response.getResponseBody()->getContent());
+}
+
+#endif
@@ -0,0 +1,293 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif
+
+#include "src/http/Connection.h"
+#include "src/http/Hedger.h"
+#include "TestServer.h"
+
+TEST(HedgeTests, delayIsRollingPercentile)
+{
+	HedgeConfig config;
+	config.percentile = 0.9;
+	Hedger hedger(config);
+	Hedger::Clock::duration delay{};
+	EXPECT_FALSE(hedger.hedgeDelay("http://a", delay));
+	for (int i = 1; i <= 100; ++i)
+	{
+		hedger.record("http://a", std::chrono::milliseconds(i));
+	}
+	ASSERT_TRUE(hedger.hedgeDelay("http://a", delay));
+	auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(delay).count();
+	EXPECT_GE(millis, 85);
+	EXPECT_LE(millis, 95);
+	/* Other origins have their own samples */
+	EXPECT_FALSE(hedger.hedgeDelay("http://b", delay));
+}
+
+TEST(HedgeTests, budgetCapsHedges)
+{
+	HedgeConfig config;
+	config.delayMillis = 10;
+	config.budget = 0.1;
+	Hedger hedger(config);
+	Hedger::Clock::duration delay{};
+	int hedges = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		ASSERT_TRUE(hedger.hedgeDelay("http://a", delay));
+		hedges += hedger.takeBudget("http://a") ? 1 : 0;
+	}
+	EXPECT_EQ(std::chrono::duration_cast<std::chrono::milliseconds>(delay).count(), 10);
+	EXPECT_GE(hedges, 9);
+	EXPECT_LE(hedges, 10);
+}
+
+TEST(HedgeTests, cancelledTimerNeverFires)
+{
+	Hedger hedger(HedgeConfig{});
+	std::atomic<int> fired{0};
+	uint64_t late = hedger.schedule(Hedger::Clock::now() + std::chrono::milliseconds(50), [&fired]()
+	{ fired += 10; });
+	hedger.schedule(Hedger::Clock::now() + std::chrono::milliseconds(5), [&fired]()
+	{ fired += 1; });
+	hedger.cancel(late);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	EXPECT_EQ(fired.load(), 1);
+}
+
+#ifndef _WIN32
+
+TEST(HedgeTests, cancelAbortsBlockedRead)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	CancelToken token;
+	ASSERT_TRUE(token.attach(fds[0]));
+	std::thread canceller([&token]()
+	                      {
+		                      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		                      token.cancel();
+	                      });
+	char byte;
+	EXPECT_EQ(recv(fds[0], &byte, 1, 0), 0);
+	canceller.join();
+	token.detach();
+	EXPECT_TRUE(token.cancelled());
+	EXPECT_FALSE(token.attach(fds[0]));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/* Keep-alive origin where behaviour() answers the n-th request over all connections, an empty answer closes the
+ * connection */
+class HedgeOrigin
+{
+public:
+	using Behaviour = std::function<std::string(size_t n, TestConnection &connection)>;
+
+	explicit HedgeOrigin(Behaviour requestBehaviour) : behaviour(std::move(requestBehaviour)),
+	                                                   server([this](TestConnection &connection)
+	                                                          { serve(connection); })
+	{
+	}
+
+	/* Waits until count requests came */
+	bool awaitRequests(size_t count)
+	{
+		std::unique_lock<std::mutex> lock(stateMutex);
+		return requestArrived.wait_for(lock, std::chrono::seconds(5), [this, count]()
+		{ return served.size() >= count; });
+	}
+
+	/* The connection number of each request so far */
+	std::vector<int> getServed()
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		return served;
+	}
+
+	[[nodiscard]] URL url() const
+	{
+		return URL(server.url("/hedged"));
+	}
+
+private:
+	void serve(TestConnection &connection)
+	{
+		int number;
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			number = connections++;
+		}
+		std::string head;
+		std::string body;
+		while (connection.readRequest(head, body))
+		{
+			size_t n;
+			{
+				std::lock_guard<std::mutex> lock(stateMutex);
+				n = served.size();
+				served.push_back(number);
+			}
+			requestArrived.notify_all();
+			std::string reply = behaviour(n, connection);
+			if (reply.empty() || !connection.write(reply))
+			{
+				return;
+			}
+		}
+	}
+
+	std::mutex stateMutex;
+	std::condition_variable requestArrived;
+	std::vector<int> served;
+	int connections = 0;
+	Behaviour behaviour;
+	TestServer server;
+};
+
+static std::string answer(size_t n)
+{
+	return textResponse("200 OK", "answer " + std::to_string(n));
+}
+
+static std::shared_ptr<HttpClient> hedgingClient()
+{
+	HedgeConfig config;
+	config.delayMillis = 50;
+	config.budget = 1.0;
+	return HttpClientBuilder::newBuilder().hedge(config).build();
+}
+
+TEST(HedgeTests, hedgeWinsAndPrimaryIsDropped)
+{
+	/* The first request never gets an answer, the client has to give up on it */
+	HedgeOrigin origin([](size_t n, TestConnection &connection)
+	                   {
+		                   char ch;
+		                   while ((n == 0) && (connection.read(&ch, 1) > 0))
+		                   {
+		                   }
+		                   return (n == 0) ? std::string() : answer(n);
+	                   });
+	std::shared_ptr<HttpClient> client = hedgingClient();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(origin.url()).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(request, response));
+	EXPECT_EQ("answer 1", bodyOf(response));
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(1U, metrics.hedgesSent);
+	EXPECT_EQ(1U, metrics.hedgesWon);
+
+	/* The primary's connection was aborted, only the hedge's one went back to the pool */
+	HttpResponse next;
+	ASSERT_NE(0U, client->send(request, next));
+	EXPECT_EQ("answer 2", bodyOf(next));
+	EXPECT_EQ((std::vector<int>{0, 1, 1}), origin.getServed());
+	EXPECT_EQ(1U, client->getMetrics().hedgesSent);
+}
+
+TEST(HedgeTests, primaryFailsWhileHedgeRuns)
+{
+	HedgeOrigin origin([&origin](size_t n, TestConnection &)
+	                   {
+		                   if (n == 0)
+		                   {
+			                   /* Closed without an answer once the hedge is out */
+			                   origin.awaitRequests(2);
+			                   return std::string();
+		                   }
+		                   std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		                   return answer(n);
+	                   });
+	std::shared_ptr<HttpClient> client = hedgingClient();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(origin.url()).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(request, response));
+	EXPECT_EQ("answer 1", bodyOf(response));
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(1U, metrics.hedgesSent);
+	EXPECT_EQ(1U, metrics.hedgesWon);
+}
+
+TEST(HedgeTests, primaryFailsWhileHedgeIsQueued)
+{
+	HedgeOrigin origin([](size_t n, TestConnection &)
+	                   {
+		                   if (n == 0)
+		                   {
+			                   /* Closed without an answer well after the hedge delay */
+			                   std::this_thread::sleep_for(std::chrono::milliseconds(150));
+			                   return std::string();
+		                   }
+		                   return answer(n);
+	                   });
+	HedgeConfig config;
+	config.delayMillis = 50;
+	config.budget = 1.0;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().hedge(config).executor(1).build();
+
+	/* The only executor thread is busy, so the hedge stays queued behind it */
+	TestServer other(keepAliveHandler([](const std::string &, const std::string &)
+	                                  { return textResponse("200 OK", "other"); }));
+	std::promise<void> busy;
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+	ASSERT_TRUE(client->submit(HttpRequestBuilder::newBuilder().url(URL(other.url("/"))).GET().build(),
+	                           [&busy, released](size_t, HttpResponse &)
+	                           {
+		                           busy.set_value();
+		                           released.wait();
+	                           }));
+	busy.get_future().wait();
+
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(origin.url()).GET().build();
+	HttpResponse response;
+	EXPECT_NE(0U, client->send(request, response));
+	release.set_value();
+	EXPECT_EQ("answer 1", bodyOf(response));
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(1U, metrics.hedgesSent);
+	EXPECT_EQ(1U, metrics.hedgesWon);
+	EXPECT_EQ(2U, origin.getServed().size());
+}
+
+TEST(HedgeTests, noHedgeAfterPrimaryFinished)
+{
+	HedgeOrigin origin([](size_t n, TestConnection &)
+	                   {
+		                   /* The first connection fails at once, the rest answer well before the hedge delay */
+		                   return (n == 0) ? std::string() : answer(n);
+	                   });
+	std::shared_ptr<HttpClient> client = hedgingClient();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(origin.url()).GET().build();
+	HttpResponse response;
+	EXPECT_EQ(0U, client->send(request, response));
+	for (int i = 0; i < 3; ++i)
+	{
+		ASSERT_NE(0U, client->send(request, response));
+	}
+	/* Past the delay of every call, their timers must not have sent anything */
+	std::this_thread::sleep_for(std::chrono::milliseconds(150));
+	EXPECT_EQ((std::vector<int>{0, 1, 1, 1}), origin.getServed());
+	MetricsSnapshot metrics = client->getMetrics();
+	EXPECT_EQ(0U, metrics.hedgesSent);
+	EXPECT_EQ(0U, metrics.hedgesWon);
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "src/http/ConcurrencyLimiter.h"
+#include "TestServer.h"
+
+static OriginLimit limitOf(const ConcurrencyLimiter &limiter)
+{
+	std::vector<OriginLimit> limits;
+	limiter.collect(limits);
+	return limits.empty() ? OriginLimit{} : limits.front();
+}
+
+TEST(LimiterTests, rejectsOverTheLimit)
+{
+	ConcurrencyLimitConfig config;
+	config.initialLimit = 2;
+	ConcurrencyLimiter limiter(config);
+	EXPECT_TRUE(limiter.acquire("http://a", std::chrono::seconds(1)));
+	EXPECT_TRUE(limiter.acquire("http://a", std::chrono::seconds(1)));
+	/* No queue: refused without waiting */
+	EXPECT_FALSE(limiter.acquire("http://a", std::chrono::seconds(1)));
+	EXPECT_TRUE(limiter.acquire("http://b", std::chrono::seconds(1)));
+	limiter.release("http://a", std::chrono::milliseconds(1), false);
+	EXPECT_TRUE(limiter.acquire("http://a", std::chrono::seconds(1)));
+}
+
+TEST(LimiterTests, queuedCallGetsFreedSlot)
+{
+	ConcurrencyLimitConfig config;
+	config.initialLimit = 1;
+	config.maxQueue = 1;
+	ConcurrencyLimiter limiter(config);
+	ASSERT_TRUE(limiter.acquire("http://a", std::chrono::seconds(1)));
+	std::thread releaser([&limiter]()
+	                     {
+		                     std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		                     limiter.release("http://a", std::chrono::milliseconds(1), false);
+	                     });
+	EXPECT_TRUE(limiter.acquire("http://a", std::chrono::seconds(5)));
+	releaser.join();
+	EXPECT_EQ(limitOf(limiter).inFlight, 1U);
+}
+
+TEST(LimiterTests, adaptsToLatency)
+{
+	ConcurrencyLimitConfig config;
+	config.initialLimit = 10;
+	config.maxLimit = 100;
+	ConcurrencyLimiter limiter(config);
+	ASSERT_TRUE(limiter.acquire("http://a", std::chrono::seconds(0)));
+	limiter.release("http://a", std::chrono::milliseconds(1), false);
+	/* Fast calls with the limit in use raise it by about one per limit's worth of calls */
+	for (int round = 0; round < 50; ++round)
+	{
+		size_t limit = limitOf(limiter).limit;
+		for (size_t i = 0; i < limit; ++i)
+		{
+			ASSERT_TRUE(limiter.acquire("http://a", std::chrono::seconds(0)));
+		}
+		for (size_t i = 0; i < limit; ++i)
+		{
+			limiter.release("http://a", std::chrono::milliseconds(1), false);
+		}
+	}
+	size_t raised = limitOf(limiter).limit;
+	EXPECT_GT(raised, 10U);
+	EXPECT_LE(raised, 100U);
+
+	/* A call far slower than the minimum cuts the limit */
+	ASSERT_TRUE(limiter.acquire("http://a", std::chrono::seconds(0)));
+	limiter.release("http://a", std::chrono::milliseconds(50), false);
+	EXPECT_LT(limitOf(limiter).limit, raised);
+}
+
+#ifdef __linux__
+
+TEST(LimiterTests, asyncRejectionComesOnTheLoop)
+{
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+	TestServer origin(keepAliveHandler([released](const std::string &, const std::string &)
+	                                   {
+		                                   released.wait();
+		                                   return textResponse("200 OK", "late");
+	                                   }));
+	ConcurrencyLimitConfig limit;
+	limit.initialLimit = 1;
+	limit.maxLimit = 1;
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventLoops(1).concurrencyLimit(limit).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(origin.url("/slow"))).GET().build();
+	std::promise<size_t> first;
+	ASSERT_TRUE(client->sendAsync(request, [&first](size_t len, HttpResponse &)
+	{
+		first.set_value(len);
+	}));
+	/* The only slot is taken, the second call is refused but not on this thread */
+	std::promise<std::thread::id> rejected;
+	ASSERT_TRUE(client->sendAsync(request, [&rejected](size_t len, HttpResponse &)
+	{
+		EXPECT_EQ(0U, len);
+		rejected.set_value(std::this_thread::get_id());
+	}));
+	EXPECT_NE(std::this_thread::get_id(), rejected.get_future().get());
+	release.set_value();
+	EXPECT_NE(0U, first.get_future().get());
+	EXPECT_EQ(1U, client->getMetrics().limiterRejected);
+}
+
+#endif
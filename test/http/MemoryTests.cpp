@@ -0,0 +1,107 @@
+#include <memory_resource>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+/* Counts what goes through it and forwards to the heap */
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+	size_t allocations = 0;
+	size_t outstanding = 0;
+
+private:
+	void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		++allocations;
+		outstanding += bytes;
+		return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override
+	{
+		outstanding -= bytes;
+		std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+	}
+
+	[[nodiscard]] bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+};
+
+TEST(MemoryTests, scopedResource)
+{
+	CountingResource counting;
+	EXPECT_EQ(std::pmr::get_default_resource(), getMemoryResource());
+	{
+		MemoryScope scope(&counting);
+		EXPECT_EQ(&counting, getMemoryResource());
+		{
+			URL url("http://example.com/a/rather/long/path/that/does/not/fit/inline?query=also-long-enough");
+			HttpRequest request = HttpRequestBuilder::newBuilder().url(url).GET().build();
+			HttpRequest copy = request;
+			EXPECT_EQ(url.serialize(), copy.uri.serialize());
+
+			const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\n"
+			                    "X-A-Rather-Long-Header-Name: value\r\n\r\nhello";
+			HttpResponse response{};
+			size_t headLen = response.buildHeader(head, strlen(head));
+			ASSERT_EQ(strlen(head) - 5, headLen);
+			response.build(head + headLen, 5);
+			EXPECT_EQ("value", response.getHeader().getField("x-a-rather-long-header-name"));
+			EXPECT_STREQ("hello", response.getResponseBody()->getContent());
+			EXPECT_GT(counting.allocations, 0u);
+		}
+		EXPECT_EQ(0u, counting.outstanding);
+	}
+	EXPECT_EQ(std::pmr::get_default_resource(), getMemoryResource());
+}
+
+TEST(MemoryTests, monotonicArena)
+{
+	char storage[16 * 1024];
+	std::pmr::monotonic_buffer_resource arena(storage, sizeof(storage), std::pmr::null_memory_resource());
+	MemoryScope scope(&arena);
+	HttpHeader header;
+	header.deserialize("Content-Type: application/json\r\nCache-Control: no-cache, no-store, must-revalidate\r\n\r\n");
+	HttpHeader copy = header;
+	EXPECT_EQ("no-cache,no-store,must-revalidate", copy.getField("Cache-Control"));
+	HttpBodyImpl body("payload", 7);
+	EXPECT_STREQ("payload", body.getContent());
+}
+
+TEST(MemoryTests, accessorsDoNotCopy)
+{
+	const char head[] = "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n"
+	                    "X-A-Rather-Long-Header-Name: a-value-that-does-not-fit-inline\r\n\r\n";
+	HttpResponse response{};
+	ASSERT_EQ(strlen(head), response.buildHeader(head, strlen(head)));
+	URL url("http://example.com:8080/a/rather/long/path/that/does/not/fit/inline?query=also-long-enough");
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(url).GET().build();
+
+	CountingResource counting;
+	MemoryScope scope(&counting);
+	EXPECT_EQ("a-value-that-does-not-fit-inline", response.getHeader().getField("X-A-RATHER-LONG-HEADER-NAME"));
+	EXPECT_EQ("text/html", response.getContentType());
+	EXPECT_EQ("Not Found", response.getStatusLine().getReason());
+	EXPECT_TRUE(response.getHeader().getField("Location").empty());
+	EXPECT_EQ("example.com", request.uri.getHost());
+	EXPECT_EQ("/a/rather/long/path/that/does/not/fit/inline", request.uri.getPath());
+	EXPECT_EQ("example.com:8080", request.getHeader().getField("Host"));
+	EXPECT_EQ(0u, counting.allocations);
+}
+
+TEST(MemoryTests, detachedCopy)
+{
+	CountingResource counting;
+	MemoryScope scope(&counting);
+	URL url("http://example.com/a/rather/long/path/that/does/not/fit/inline?query=also-long-enough");
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(url).GET().build();
+	size_t allocations = counting.allocations;
+	HttpRequest copy = detachedCopy(request);
+	EXPECT_EQ(url.serialize(), copy.uri.serialize());
+	EXPECT_EQ(allocations, counting.allocations);
+	EXPECT_EQ(&counting, getMemoryResource());
+}
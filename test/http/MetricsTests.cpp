@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+TEST(MetricsTests, histogramBuckets)
+{
+	for (uint64_t value: {0ULL, 1ULL, 15ULL, 16ULL, 17ULL, 100ULL, 1000ULL, 123456ULL, 987654321ULL})
+	{
+		unsigned int index = HistogramSnapshot::bucketIndex(value);
+		EXPECT_LE(HistogramSnapshot::bucketLowerBound(index), value);
+		EXPECT_GE(HistogramSnapshot::bucketUpperBound(index), value);
+		/* Relative error stays within one sub-bucket */
+		EXPECT_LE(HistogramSnapshot::bucketUpperBound(index) - value, value / HistogramSnapshot::SUB_BUCKETS + 1);
+	}
+}
+
+TEST(MetricsTests, concurrentRecording)
+{
+	HttpMetrics metrics;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([&metrics]()
+		                     {
+			                     for (uint64_t i = 1; i <= 1000; ++i)
+			                     {
+				                     metrics.add(MetricCounter::STATUS_2XX);
+				                     metrics.add(MetricCounter::BYTES_RECEIVED, 10);
+				                     metrics.record(MetricHistogram::LATENCY, i);
+			                     }
+		                     });
+	}
+	for (auto &thread: threads)
+	{
+		thread.join();
+	}
+
+	MetricsSnapshot snapshot = metrics.snapshot();
+	EXPECT_EQ(snapshot.statusClass[1], 8000u);
+	EXPECT_EQ(snapshot.bytesReceived, 80000u);
+	EXPECT_EQ(snapshot.latency.count, 8000u);
+	EXPECT_EQ(snapshot.latency.sum, 8u * 500500u);
+	uint64_t p50 = snapshot.latency.valueAtQuantile(0.5);
+	EXPECT_GE(p50, 500u);
+	EXPECT_LE(p50, 532u);
+	EXPECT_NE(std::string::npos, snapshot.toPrometheus().find("lwhttp_responses_total{status_class=\"2xx\"} 8000"));
+}
+
+TEST(MetricsTests, prometheusClampsAndEscapes)
+{
+	MetricsSnapshot snapshot;
+	/* A snapshot taken between the two counters of one handshake or hedge */
+	snapshot.tlsResumed = 1;
+	snapshot.hedgesWon = 1;
+	snapshot.connections.push_back(OriginConnections{"http://a\\b\"c\nd", 1, 2});
+	snapshot.limits.push_back(OriginLimit{"x\"y", 4, 1, 0});
+	std::string text = snapshot.toPrometheus();
+	EXPECT_NE(std::string::npos, text.find("lwhttp_tls_handshakes_total{resumed=\"false\"} 0\n"));
+	EXPECT_NE(std::string::npos, text.find("lwhttp_hedges_total{won=\"false\"} 0\n"));
+	EXPECT_NE(std::string::npos,
+	          text.find("lwhttp_connections{origin=\"http://a\\\\b\\\"c\\nd\",state=\"idle\"} 2\n"));
+	EXPECT_NE(std::string::npos, text.find("lwhttp_concurrency_limit{origin=\"x\\\"y\"} 4\n"));
+}
+
+#ifndef _WIN32
+
+/* Events of each call in order, with the timing as it was at the last of them */
+class RecordingListener : public EventListener
+{
+public:
+	void onEvent(HttpEvent event, const HttpRequest &request, const RequestTiming &timing) override
+	{
+		if (event == HttpEvent::CALL_START)
+		{
+			calls.emplace_back();
+		}
+		calls.back().first.push_back(event);
+		calls.back().second = timing;
+	}
+
+	std::vector<std::pair<std::vector<HttpEvent>, RequestTiming>> calls;
+};
+
+TEST(MetricsTests, listenerSeesPhasesInOrder)
+{
+	TestServer server(keepAliveHandler([](const std::string &head, const std::string &)
+	                                   {
+		                                   bool close = head.find(" /close ") != std::string::npos;
+		                                   return textResponse("200 OK", "phase", close ? "Connection: close\r\n" : "");
+	                                   }), newSelfSignedContext());
+	auto listener = std::make_shared<RecordingListener>();
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().eventListener(listener).build();
+	/* By name, so that the call resolves it */
+	const std::string base = "https://localhost:" + std::to_string(server.getPort());
+	for (const char *path: {"/first", "/close", "/resumed"})
+	{
+		HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(base + path)).GET().build();
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(request, response));
+	}
+	ASSERT_EQ(3U, listener->calls.size());
+
+	const std::vector<HttpEvent> fresh = {
+			HttpEvent::CALL_START, HttpEvent::DNS_START, HttpEvent::DNS_END, HttpEvent::CONNECT_START,
+			HttpEvent::CONNECT_END, HttpEvent::TLS_START, HttpEvent::TLS_END, HttpEvent::REQUEST_WRITTEN,
+			HttpEvent::RESPONSE_FIRST_BYTE, HttpEvent::RESPONSE_END};
+	EXPECT_EQ(fresh, listener->calls[0].first);
+	const RequestTiming &first = listener->calls[0].second;
+	const std::vector<RequestTiming::Clock::time_point> points = {
+			first.start, first.dnsStart, first.dnsEnd, first.connectStart, first.connectEnd, first.tlsStart,
+			first.tlsEnd, first.requestWritten, first.firstByte, first.lastByte};
+	EXPECT_NE(RequestTiming::Clock::time_point{}, first.start);
+	EXPECT_TRUE(std::is_sorted(points.begin(), points.end()));
+	EXPECT_FALSE(first.connectionReused);
+	EXPECT_FALSE(first.sessionResumed);
+
+	/* The idle connection is taken again, no DNS, connect or handshake */
+	EXPECT_EQ((std::vector<HttpEvent>{HttpEvent::CALL_START, HttpEvent::CONNECTION_ACQUIRED,
+	                                  HttpEvent::REQUEST_WRITTEN, HttpEvent::RESPONSE_FIRST_BYTE,
+	                                  HttpEvent::RESPONSE_END}), listener->calls[1].first);
+	const RequestTiming &reused = listener->calls[1].second;
+	EXPECT_TRUE(reused.connectionReused);
+	EXPECT_EQ(RequestTiming::Clock::time_point{}, reused.dnsStart);
+	EXPECT_EQ(RequestTiming::Clock::time_point{}, reused.tlsStart);
+	EXPECT_LE(first.lastByte, reused.start);
+
+	/* The server closed it, a new connection resumes the TLS session */
+	EXPECT_EQ(fresh, listener->calls[2].first);
+	EXPECT_FALSE(listener->calls[2].second.connectionReused);
+	EXPECT_TRUE(listener->calls[2].second.sessionResumed);
+	EXPECT_EQ(2, server.accepted);
+}
+
+#endif
@@ -0,0 +1,229 @@
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "src/http/Connection.h"
+
+/* Collects the body, files are read back */
+class StringWriter : public BodyWriter
+{
+public:
+	bool write(const IoSlice *slices, size_t count) override
+	{
+		++writes;
+		for (size_t i = 0; i < count; ++i)
+		{
+			data.append(slices[i].data, slices[i].len);
+		}
+		return true;
+	}
+
+	bool writeFile(int fd, size_t offset, size_t len) override
+	{
+		std::string content(len, '\0');
+		if (pread(fd, content.data(), len, static_cast<off_t>(offset)) != static_cast<ssize_t>(len))
+		{
+			return false;
+		}
+		data += content;
+		return true;
+	}
+
+	std::string data;
+	size_t writes = 0;
+};
+
+/* A temporary file holding content */
+static std::string writeFile(const std::string &content)
+{
+	char path[] = "/tmp/lwhttp-multipart-XXXXXX";
+	int fd = mkstemp(path);
+	EXPECT_GE(fd, 0);
+	EXPECT_EQ(static_cast<ssize_t>(content.length()), ::write(fd, content.data(), content.length()));
+	close(fd);
+	return path;
+}
+
+TEST(MultipartTests, encodesParts)
+{
+	std::string path = writeFile("file content");
+	const std::string view = "viewed";
+	MultipartBody form("b0undary");
+	form.addField("title", "hello").addData("blob", view.data(), view.length(), "blob.bin")
+			.addFile("upload", path, "text/plain");
+	std::string expected = "--b0undary\r\nContent-Disposition: form-data; name=\"title\"\r\n\r\nhello\r\n"
+	                       "--b0undary\r\nContent-Disposition: form-data; name=\"blob\"; filename=\"blob.bin\"\r\n"
+	                       "Content-Type: application/octet-stream\r\n\r\nviewed\r\n"
+	                       "--b0undary\r\nContent-Disposition: form-data; name=\"upload\"; filename=\"" +
+	                       path.substr(5) + "\"\r\nContent-Type: text/plain\r\n\r\nfile content\r\n--b0undary--\r\n";
+	StringWriter writer;
+	EXPECT_TRUE(form.writeTo(writer));
+	EXPECT_EQ(expected, writer.data);
+	EXPECT_EQ(expected.length(), form.getLength());
+	EXPECT_EQ("multipart/form-data; boundary=b0undary", form.getContentType());
+	EXPECT_TRUE(form.isRepeatable());
+	/* Everything before the file in one write, the rest in another */
+	EXPECT_EQ(2U, writer.writes);
+	std::remove(path.c_str());
+}
+
+TEST(MultipartTests, quotesNamesAndChecksBoundary)
+{
+	MultipartBody form("x");
+	form.addField("a\"b\r\n", "");
+	StringWriter writer;
+	EXPECT_TRUE(form.writeTo(writer));
+	EXPECT_NE(std::string::npos, writer.data.find("name=\"a%22b%0D%0A\"\r\n\r\n\r\n"));
+	EXPECT_THROW(MultipartBody(""), std::invalid_argument);
+	EXPECT_THROW(MultipartBody("with space"), std::invalid_argument);
+	EXPECT_THROW(MultipartBody(std::string(71, 'a')), std::invalid_argument);
+	EXPECT_THROW(form.addData("a", "", 0, "", "text/plain\r\nX: y"), std::invalid_argument);
+	EXPECT_THROW(form.addFile("a", std::string("/nonexistent/file")), std::runtime_error);
+	EXPECT_NE(MultipartBody().getBoundary(), MultipartBody().getBoundary());
+}
+
+TEST(MultipartTests, producerParts)
+{
+	MultipartBody form("b");
+	bool done = false;
+	form.addProducer("stream", [&done](char *buffer, size_t len) -> long
+	{
+		if (done)
+		{
+			return 0;
+		}
+		done = true;
+		memcpy(buffer, "abc", 3);
+		return 3;
+	});
+	EXPECT_EQ(UNKNOWN_BODY_LENGTH, form.getLength());
+	EXPECT_FALSE(form.isRepeatable());
+	StringWriter writer;
+	EXPECT_TRUE(form.writeTo(writer));
+	EXPECT_NE(std::string::npos, writer.data.find("\r\n\r\nabc\r\n--b--\r\n"));
+
+	MultipartBody sized("b");
+	sized.addProducer("stream", [](char *buffer, size_t len) -> long
+	{
+		return 0;
+	}, 3);
+	EXPECT_NE(UNKNOWN_BODY_LENGTH, sized.getLength());
+	/* Shorter than announced */
+	EXPECT_FALSE(sized.writeTo(writer));
+}
+
+TEST(MultipartTests, sendsFileOverConnection)
+{
+	std::string content(300 * 1024, 'f');
+	for (size_t i = 0; i < content.length(); i += 4096)
+	{
+		content[i] = static_cast<char>('a' + (i / 4096) % 26);
+	}
+	std::string path = writeFile(content);
+	auto form = std::make_shared<MultipartBody>("sep");
+	form->addField("name", "value").addFile("file", path);
+	StringWriter expected;
+	ASSERT_TRUE(form->writeTo(expected));
+
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	std::string received;
+	std::thread server([&]()
+	                   {
+		                   char buffer[65536];
+		                   size_t headEnd = std::string::npos;
+		                   while ((headEnd == std::string::npos) ||
+		                          (received.length() < headEnd + 4 + expected.data.length()))
+		                   {
+			                   ssize_t readLen = recv(fds[1], buffer, sizeof(buffer), 0);
+			                   if (readLen <= 0)
+			                   {
+				                   break;
+			                   }
+			                   received.append(buffer, readLen);
+			                   headEnd = received.find("\r\n\r\n");
+		                   }
+		                   std::string reply = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+		                   send(fds[1], reply.data(), reply.length(), 0);
+	                   });
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload")).POST(form).build();
+	HttpClientConfig config;
+	config.expectContinueThreshold = SIZE_MAX;
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	PlainConnection connection(fds[0]);
+	bool keepAlive = false;
+	EXPECT_GT(exchange(connection, config, trace, response, keepAlive), 0U);
+	server.join();
+	size_t headEnd = received.find("\r\n\r\n");
+	ASSERT_NE(std::string::npos, headEnd);
+	std::string head = received.substr(0, headEnd);
+	EXPECT_NE(std::string::npos, head.find("multipart/form-data; boundary=sep"));
+	EXPECT_NE(std::string::npos, head.find(std::to_string(expected.data.length())));
+	EXPECT_TRUE(received.compare(headEnd + 4, std::string::npos, expected.data) == 0);
+	EXPECT_FALSE(trace.bodyStarted);
+	close(fds[1]);
+	std::remove(path.c_str());
+}
+
+static std::atomic<int> sigpipeCount{0};
+
+TEST(MultipartTests, peerClosingMidFileFailsWithoutSigpipe)
+{
+	std::string path = writeFile(std::string(4 * 1024 * 1024, 'f'));
+	auto form = std::make_shared<MultipartBody>("sep");
+	form->addFile("file", path);
+
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	/* Counted instead of killing the test binary */
+	struct sigaction counting{};
+	struct sigaction previous{};
+	counting.sa_handler = [](int)
+	{
+		++sigpipeCount;
+	};
+	sigaction(SIGPIPE, &counting, &previous);
+	std::thread server([&fds]()
+	                   {
+		                   /* Into the file part, then gone */
+		                   char buffer[65536];
+		                   size_t received = 0;
+		                   while (received < 128 * 1024)
+		                   {
+			                   ssize_t readLen = recv(fds[1], buffer, sizeof(buffer), 0);
+			                   if (readLen <= 0)
+			                   {
+				                   break;
+			                   }
+			                   received += readLen;
+		                   }
+		                   close(fds[1]);
+	                   });
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload")).POST(form).build();
+	HttpClientConfig config;
+	config.expectContinueThreshold = SIZE_MAX;
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	PlainConnection connection(fds[0]);
+	bool keepAlive = false;
+	EXPECT_EQ(0U, exchange(connection, config, trace, response, keepAlive));
+	server.join();
+	sigaction(SIGPIPE, &previous, nullptr);
+	EXPECT_EQ(0, sigpipeCount);
+	std::remove(path.c_str());
+}
+
+#endif
@@ -0,0 +1,134 @@
+#include <atomic>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+#ifndef _WIN32
+
+/* Answers the first request of a connection, then takes the next one and closes without a word, or waits until
+ * the server goes down if hold is set */
+static TestServer::Handler answerOnce(std::atomic<int> &received, bool hold = false)
+{
+	return [&received, hold](TestConnection &connection)
+	{
+		std::string head;
+		std::string body;
+		if (!connection.readRequest(head, body))
+		{
+			return;
+		}
+		++received;
+		connection.write(textResponse("200 OK", "first"));
+		if (connection.readRequest(head, body))
+		{
+			++received;
+			char ch;
+			while (hold && (connection.read(&ch, 1) > 0))
+			{
+			}
+		}
+	};
+}
+
+TEST(PoolTests, resendsOnlyWhatIsSafe)
+{
+	std::atomic<int> received{0};
+	TestServer server(answerOnce(received));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest get = HttpRequestBuilder::newBuilder().url(URL(server.url("/item"))).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(get, response));
+
+	/* The pooled connection dies under a GET, it goes out again on a new one */
+	ASSERT_NE(0U, client->send(get, response));
+	EXPECT_EQ("first", bodyOf(response));
+	EXPECT_FALSE(response.getTiming().connectionReused);
+	EXPECT_EQ(2, server.accepted);
+	EXPECT_EQ(3, received);
+
+	/* A written POST may have been processed, it is not sent twice */
+	HttpRequest post = HttpRequestBuilder::newBuilder().url(URL(server.url("/item")))
+			.POST(std::make_shared<HttpBodyImpl>("payload", 7)).build();
+	EXPECT_EQ(0U, client->send(post, response));
+	server.join();
+	EXPECT_EQ(2, server.accepted);
+	EXPECT_EQ(4, received);
+}
+
+TEST(PoolTests, timeoutIsNotResent)
+{
+	std::atomic<int> received{0};
+	TestServer server(answerOnce(received, true));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().timeout(1).build();
+	HttpRequest get = HttpRequestBuilder::newBuilder().url(URL(server.url("/slow"))).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(get, response));
+	EXPECT_EQ(0U, client->send(get, response));
+	EXPECT_EQ(1, server.accepted);
+	EXPECT_EQ(2, received);
+}
+
+TEST(PoolTests, chunkedBodyEndsAtLastChunk)
+{
+	/* The chunk data holds what looks like the last chunk */
+	const std::string data = "x0\r\n\r\ny";
+	TestServer server(keepAliveHandler([&data](const std::string &, const std::string &)
+	                                   {
+		                                   return "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" +
+		                                          std::to_string(data.length()) + "\r\n" + data +
+		                                          "\r\n3\r\nend\r\n0\r\n\r\n";
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url("/chunks"))).GET().build();
+	for (int i = 0; i < 3; ++i)
+	{
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(request, response));
+		EXPECT_EQ(data + "end", bodyOf(response));
+	}
+	/* The connection was left clean at the end of each body */
+	EXPECT_EQ(1, server.accepted);
+}
+
+TEST(PoolTests, chunkedWinsOverContentLength)
+{
+	/* A Content-Length shorter than the chunked body, as a smuggled response would have */
+	TestServer server(keepAliveHandler([](const std::string &, const std::string &)
+	                                   {
+		                                   return std::string("HTTP/1.1 200 OK\r\nContent-Length: 3\r\n"
+		                                                      "Transfer-Encoding: chunked\r\n\r\n"
+		                                                      "5\r\nhello\r\n0\r\n\r\n");
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url("/both"))).GET().build();
+	for (int i = 0; i < 2; ++i)
+	{
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(request, response));
+		EXPECT_EQ("hello", bodyOf(response));
+		EXPECT_FALSE(response.getTiming().connectionReused);
+	}
+	EXPECT_EQ(2, server.accepted);
+}
+
+TEST(PoolTests, malformedContentLengthFails)
+{
+	std::atomic<int> replies{0};
+	TestServer server(keepAliveHandler([&replies](const std::string &, const std::string &)
+	                                   {
+		                                   std::string length = (++replies == 1) ? "5, 5" : "5abc";
+		                                   return "HTTP/1.1 200 OK\r\nContent-Length: " + length + "\r\n\r\nhello";
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url("/length"))).GET().build();
+	HttpResponse response;
+	EXPECT_EQ(0U, client->send(request, response));
+	EXPECT_EQ(0U, client->send(request, response));
+	EXPECT_EQ(2, replies);
+}
+
+#endif
@@ -0,0 +1,202 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "src/http/Connection.h"
+
+/* Reads a request from fd, the body up to terminator or len bytes. Head and body may come in one read. */
+static void readRequest(int fd, std::string &head, std::string &body, const std::string &terminator, size_t len = 0)
+{
+	std::string data;
+	char buffer[4096];
+	size_t headEnd;
+	while (true)
+	{
+		headEnd = data.find("\r\n\r\n");
+		if (headEnd != std::string::npos)
+		{
+			headEnd += 4;
+			size_t bodyLen = data.length() - headEnd;
+			if ((len > 0) ? (bodyLen >= len) :
+			    ((bodyLen >= terminator.length()) &&
+			     (data.compare(data.length() - terminator.length(), terminator.length(), terminator) == 0)))
+			{
+				break;
+			}
+		}
+		ssize_t readLen = recv(fd, buffer, sizeof(buffer), 0);
+		if (readLen <= 0)
+		{
+			break;
+		}
+		data.append(buffer, readLen);
+	}
+	head = data.substr(0, std::min(headEnd, data.length()));
+	body = (headEnd == std::string::npos) ? std::string() : data.substr(headEnd);
+}
+
+/* Hands out pieces in turn, then the end of the body */
+static BodyProducer piecesOf(std::vector<std::string> pieces, size_t &calls)
+{
+	return [pieces = std::move(pieces), next = size_t{0}, &calls](char *buffer, size_t len) mutable -> long
+	{
+		++calls;
+		if (next == pieces.size())
+		{
+			return 0;
+		}
+		const std::string &piece = pieces[next++];
+		size_t pieceLen = std::min(piece.length(), len);
+		memcpy(buffer, piece.data(), pieceLen);
+		return static_cast<long>(pieceLen);
+	};
+}
+
+static size_t post(int fd, const HttpRequest &request, HttpResponse &response, RequestTrace &trace)
+{
+	HttpClientConfig config;
+	/* No 100-continue round trip, ExpectTests cover it */
+	config.expectContinueThreshold = SIZE_MAX;
+	PlainConnection connection(fd);
+	bool keepAlive = false;
+	return exchange(connection, config, trace, response, keepAlive);
+}
+
+static const std::string REPLY = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+TEST(ProducerTests, unknownLengthIsChunked)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	std::string head;
+	std::string body;
+	std::thread server([&]()
+	                   {
+		                   readRequest(fds[1], head, body, "0\r\n\r\n");
+		                   send(fds[1], REPLY.data(), REPLY.length(), 0);
+	                   });
+	size_t calls = 0;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload"))
+			.POST(piecesOf({"hello", " world"}, calls)).build();
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	EXPECT_GT(post(fds[0], request, response, trace), 0U);
+	server.join();
+	EXPECT_NE(std::string::npos, head.find("chunked\r\n"));
+	EXPECT_EQ(std::string::npos, head.find("ength:"));
+	EXPECT_EQ("5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", body);
+	EXPECT_EQ(3U, calls);
+	EXPECT_TRUE(trace.bodyStarted);
+	EXPECT_STREQ("ok", response.getResponseBody()->getContent());
+	close(fds[1]);
+}
+
+TEST(ProducerTests, knownLengthIsSentAsIs)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	std::string head;
+	std::string body;
+	std::thread server([&]()
+	                   {
+		                   readRequest(fds[1], head, body, "", 10);
+		                   send(fds[1], REPLY.data(), REPLY.length(), 0);
+	                   });
+	size_t calls = 0;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload"))
+			.PUT(piecesOf({"0123", "456", "789"}, calls), 10).build();
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	EXPECT_GT(post(fds[0], request, response, trace), 0U);
+	server.join();
+	EXPECT_EQ(std::string::npos, head.find("chunked"));
+	EXPECT_EQ("0123456789", body);
+	EXPECT_EQ(HttpStatus::OK, response.getStatusCode());
+	close(fds[1]);
+}
+
+TEST(ProducerTests, largeBodyIsPulledInPieces)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	constexpr size_t total = 1024 * 1024;
+	size_t received = 0;
+	std::thread server([&]()
+	                   {
+		                   std::string head;
+		                   std::string body;
+		                   readRequest(fds[1], head, body, "", total);
+		                   received = body.length();
+		                   send(fds[1], REPLY.data(), REPLY.length(), 0);
+	                   });
+	size_t produced = 0;
+	size_t calls = 0;
+	size_t largestAsk = 0;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload")).POST(
+			[&](char *buffer, size_t len) -> long
+			{
+				++calls;
+				largestAsk = std::max(largestAsk, len);
+				size_t pieceLen = std::min(len, total - produced);
+				memset(buffer, 'x', pieceLen);
+				produced += pieceLen;
+				return static_cast<long>(pieceLen);
+			}, total).build();
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	EXPECT_GT(post(fds[0], request, response, trace), 0U);
+	server.join();
+	EXPECT_EQ(total, received);
+	EXPECT_LT(largestAsk, total);
+	EXPECT_GT(calls, total / largestAsk);
+	close(fds[1]);
+}
+
+TEST(ProducerTests, failingProducerFailsCall)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload")).POST(
+			[](char *, size_t) -> long
+			{
+				return -1;
+			}).build();
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	EXPECT_EQ(0U, post(fds[0], request, response, trace));
+	EXPECT_TRUE(trace.bodyStarted);
+	close(fds[1]);
+}
+
+TEST(ProducerTests, producerPastLengthFailsCall)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	std::thread server([&]()
+	                   {
+		                   std::string head;
+		                   std::string body;
+		                   readRequest(fds[1], head, body, "", 4);
+	                   });
+	size_t calls = 0;
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://example.com/upload"))
+			.POST(piecesOf({"0123", "4567"}, calls), 4).build();
+	HttpResponse response{};
+	RequestTrace trace{request, response.getTiming(), nullptr, nullptr};
+	EXPECT_EQ(0U, post(fds[0], request, response, trace));
+	server.join();
+	close(fds[1]);
+}
+
+#endif
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+#ifndef _WIN32
+
+#include <unistd.h>
+
+/* Request lines an origin received, each followed by " auth" and " cookie" if it carried those fields */
+class RequestLog
+{
+public:
+	void add(const std::string &head, const std::string &body)
+	{
+		std::string lower = head;
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+		std::string line = head.substr(0, head.find(" HTTP/"));
+		line += (lower.find("\r\nauthorization:") != std::string::npos) ? " auth" : "";
+		line += (lower.find("\r\ncookie:") != std::string::npos) ? " cookie" : "";
+		/* An HttpBodyImpl sends its terminating NUL too */
+		line += body.empty() ? "" : " " + std::string(body.c_str());
+		std::lock_guard<std::mutex> lock(logMutex);
+		lines.push_back(line);
+	}
+
+	std::vector<std::string> take()
+	{
+		std::lock_guard<std::mutex> lock(logMutex);
+		std::vector<std::string> taken;
+		taken.swap(lines);
+		return taken;
+	}
+
+private:
+	std::mutex logMutex;
+	std::vector<std::string> lines;
+};
+
+static std::string targetOf(const std::string &head)
+{
+	size_t targetStart = head.find(' ') + 1;
+	return head.substr(targetStart, head.find(' ', targetStart) - targetStart);
+}
+
+static std::string redirectTo(const std::string &status, const std::string &location)
+{
+	return textResponse(status, "", "Location: " + location + "\r\n");
+}
+
+static HttpRequest postWithCredentials(const std::string &url)
+{
+	HttpHeader header;
+	header.setField("Authorization", "Bearer secret");
+	header.setField("Cookie", "session=1");
+	header.setField("Content-Type", "text/plain");
+	return HttpRequestBuilder::newBuilder().url(URL(url)).header(header)
+			.POST(std::make_shared<HttpBodyImpl>("payload", 7)).build();
+}
+
+TEST(RedirectTests, followsEachStatusAcrossOrigins)
+{
+	RequestLog sourceLog;
+	RequestLog targetLog;
+	TestServer target(keepAliveHandler([&targetLog](const std::string &head, const std::string &body)
+	                                   {
+		                                   targetLog.add(head, body);
+		                                   return textResponse("200 OK", "landed");
+	                                   }));
+	TestServer source(keepAliveHandler([&](const std::string &head, const std::string &body)
+	                                   {
+		                                   sourceLog.add(head, body);
+		                                   std::string path = targetOf(head);
+		                                   return redirectTo(path.substr(1) + " Moved", target.url(path));
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	/* 301/302 turn a POST into a GET, 303 any method, 307/308 keep method and body */
+	const std::vector<std::pair<std::string, std::string>> expected = {
+			{"301", "GET /301"}, {"302", "GET /302"}, {"303", "GET /303"}, {"307", "POST /307 payload"},
+			{"308", "POST /308 payload"}};
+	for (const auto &[status, line]: expected)
+	{
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(postWithCredentials(source.url("/" + status)), response));
+		EXPECT_EQ(HttpStatus::OK, response.getStatusCode());
+		EXPECT_EQ("landed", bodyOf(response));
+		EXPECT_EQ((std::vector<std::string>{"POST /" + status + " auth cookie payload"}), sourceLog.take());
+		/* Credentials of the first origin are not sent to the second */
+		EXPECT_EQ((std::vector<std::string>{line}), targetLog.take());
+	}
+}
+
+TEST(RedirectTests, stopsAtHopLimit)
+{
+	RequestLog log;
+	TestServer server(keepAliveHandler([&log](const std::string &head, const std::string &body)
+	                                   {
+		                                   log.add(head, body);
+		                                   int hop = std::stoi(targetOf(head).substr(1));
+		                                   return redirectTo("302 Found", "/" + std::to_string(hop + 1));
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().maxRedirects(3).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url("/0"))).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(request, response));
+	/* The last redirect is handed to the caller */
+	EXPECT_EQ(HttpStatus::FOUND, response.getStatusCode());
+	EXPECT_EQ("/4", response.getHeader().getField("Location"));
+	EXPECT_EQ((std::vector<std::string>{"GET /0", "GET /1", "GET /2", "GET /3"}), log.take());
+
+	std::shared_ptr<HttpClient> never = HttpClientBuilder::newBuilder().redirect(Redirect::NEVER).build();
+	ASSERT_NE(0U, never->send(request, response));
+	EXPECT_EQ(HttpStatus::FOUND, response.getStatusCode());
+	EXPECT_EQ((std::vector<std::string>{"GET /0"}), log.take());
+}
+
+TEST(RedirectTests, refusesHttpsToHttpUnlessAlways)
+{
+	RequestLog plainLog;
+	TestServer plain(keepAliveHandler([&plainLog](const std::string &head, const std::string &body)
+	                                  {
+		                                  plainLog.add(head, body);
+		                                  return textResponse("200 OK", "plain");
+	                                  }));
+	TestServer secure(keepAliveHandler([&plain](const std::string &head, const std::string &)
+	                                   {
+		                                   return redirectTo("302 Found", plain.url(targetOf(head)));
+	                                   }), newSelfSignedContext());
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(secure.url("/down"))).GET().build();
+
+	std::shared_ptr<HttpClient> normal = HttpClientBuilder::newBuilder().build();
+	HttpResponse refused;
+	ASSERT_NE(0U, normal->send(request, refused));
+	EXPECT_EQ(HttpStatus::FOUND, refused.getStatusCode());
+	EXPECT_TRUE(plainLog.take().empty());
+
+	std::shared_ptr<HttpClient> always = HttpClientBuilder::newBuilder().redirect(Redirect::ALWAYS).build();
+	HttpResponse followed;
+	ASSERT_NE(0U, always->send(request, followed));
+	EXPECT_EQ("plain", bodyOf(followed));
+	EXPECT_EQ((std::vector<std::string>{"GET /down"}), plainLog.take());
+}
+
+TEST(RedirectTests, reusesConnectionOnSameOrigin)
+{
+	TestServer server(keepAliveHandler([](const std::string &head, const std::string &)
+	                                   {
+		                                   if (targetOf(head) == "/from")
+		                                   {
+			                                   return redirectTo("302 Found", "to?relative=1");
+		                                   }
+		                                   return textResponse("200 OK", targetOf(head));
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url("/from"))).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, client->send(request, response));
+	EXPECT_EQ("/to?relative=1", bodyOf(response));
+	EXPECT_TRUE(response.getTiming().connectionReused);
+	EXPECT_EQ(1, server.accepted);
+}
+
+TEST(RedirectTests, memoizesPermanentRedirects)
+{
+	RequestLog log;
+	TestServer server(keepAliveHandler([&log](const std::string &head, const std::string &body)
+	                                   {
+		                                   log.add(head, body);
+		                                   std::string path = targetOf(head);
+		                                   if (path == "/moved")
+		                                   {
+			                                   return redirectTo("301 Moved Permanently", "/new");
+		                                   }
+		                                   if (path == "/kept")
+		                                   {
+			                                   return redirectTo("308 Permanent Redirect", "/new");
+		                                   }
+		                                   if (path == "/found")
+		                                   {
+			                                   return redirectTo("302 Found", "/new");
+		                                   }
+		                                   return textResponse("200 OK", "new");
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	for (const std::string path: {"/moved", "/kept", "/found"})
+	{
+		HttpRequest request = HttpRequestBuilder::newBuilder().url(URL(server.url(path))).GET().build();
+		for (int i = 0; i < 2; ++i)
+		{
+			HttpResponse response;
+			ASSERT_NE(0U, client->send(request, response));
+			EXPECT_EQ("new", bodyOf(response));
+		}
+	}
+	/* Only the temporary redirect is asked again */
+	EXPECT_EQ((std::vector<std::string>{"GET /moved", "GET /new", "GET /new", "GET /kept", "GET /new", "GET /new",
+	                                    "GET /found", "GET /new", "GET /found", "GET /new"}), log.take());
+
+	/* A memoized 301 is not applied to a POST, it could not be turned into a GET without asking */
+	HttpResponse posted;
+	ASSERT_NE(0U, client->send(postWithCredentials(server.url("/moved")), posted));
+	EXPECT_EQ((std::vector<std::string>{"POST /moved auth cookie payload", "GET /new auth cookie"}), log.take());
+}
+
+TEST(RedirectTests, refusesRedirectIntoUnixSocket)
+{
+	RequestLog socketLog;
+	const std::string path = "/tmp/lwhttp-redirect-" + std::to_string(getpid()) + ".sock";
+	TestServer local(path, keepAliveHandler([&socketLog](const std::string &head, const std::string &body)
+	                                        {
+		                                        socketLog.add(head, body);
+		                                        return textResponse("200 OK", "local");
+	                                        }));
+	TestServer remote(keepAliveHandler([](const std::string &head, const std::string &)
+	                                   {
+		                                   return redirectTo(targetOf(head).substr(1) + " Moved",
+		                                                     "http+unix://%2Ftmp%2Flwhttp-redirect-" +
+		                                                     std::to_string(getpid()) + ".sock/containers");
+	                                   }));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().redirect(Redirect::ALWAYS).build();
+	for (const std::string status: {"302", "307", "308"})
+	{
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(postWithCredentials(remote.url("/" + status)), response));
+		/* The redirect is handed to the caller, the socket is never dialed */
+		EXPECT_EQ(status, std::to_string(static_cast<int>(response.getStatusCode())));
+	}
+	EXPECT_TRUE(socketLog.take().empty());
+	EXPECT_EQ(0, local.accepted);
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+TEST(SerializeTests, headerCanonicalNames)
+{
+	HttpHeader header;
+	header.setField("etag", "\"abc\"");
+	header.setField("WWW-AUTHENTICATE", "Basic");
+	header.setField("x-custom-field", "1");
+	header.setField("content-length", "0");
+	EXPECT_EQ("Content-Length: 0\r\nETag: \"abc\"\r\nWWW-Authenticate: Basic\r\nX-Custom-Field: 1\r\n\r\n",
+	          header.serialize());
+
+	Buffer buffer;
+	header.appendTo(buffer, "user-agent", "lwhttp-test");
+	EXPECT_EQ("Content-Length: 0\r\nETag: \"abc\"\r\nUser-Agent: lwhttp-test\r\nWWW-Authenticate: Basic\r\n"
+	          "X-Custom-Field: 1\r\n\r\n", buffer.toString());
+	buffer.clear();
+	header.appendTo(buffer, "etag", "\"def\"");
+	EXPECT_EQ("Content-Length: 0\r\nETag: \"def\"\r\nWWW-Authenticate: Basic\r\nX-Custom-Field: 1\r\n\r\n",
+	          buffer.toString());
+	buffer.clear();
+	header.appendTo(buffer, {{"expect", "100-continue"}, {"user-agent", "lwhttp-test"}, {"x-custom-field", "2"}});
+	EXPECT_EQ("Content-Length: 0\r\nETag: \"abc\"\r\nExpect: 100-continue\r\nUser-Agent: lwhttp-test\r\n"
+	          "WWW-Authenticate: Basic\r\nX-Custom-Field: 2\r\n\r\n", buffer.toString());
+}
+
+TEST(SerializeTests, requestHead)
+{
+	URL url("http://example.com:8080/index.html?a=1&b=2");
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(url).DELETE().build();
+	Buffer buffer(16);
+	request.appendTo(buffer);
+	EXPECT_EQ("DELETE /index.html?a=1&b=2 HTTP/1.1\r\nAccept: */*\r\nHost: example.com:8080\r\n"
+	          "User-Agent: lwhttp/0.0.1\r\n\r\n", buffer.toString());
+	EXPECT_EQ("DELETE /index.html?a=1&b=2 HTTP/1.1\r\n", request.getRequestLine());
+	EXPECT_EQ(url.serialize(), "http://example.com:8080/index.html?a=1&b=2");
+}
+
+TEST(SerializeTests, statusLine)
+{
+	StatusLine statusLine;
+	const char line[] = "HTTP/1.1 404 Not Found\r\n";
+	ASSERT_EQ(strlen(line), statusLine.build(line, strlen(line)));
+	EXPECT_EQ(line, statusLine.serialize());
+}
+
+TEST(SerializeTests, preparedRequest)
+{
+	URL url("http://example.com/items");
+	std::shared_ptr<HttpBody> body = std::make_shared<HttpBodyImpl>("{}", 2);
+	body->setBodyLength(2);
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(url).POST(body).build();
+	PreparedRequest prepared = PreparedRequest::newBuilder().request(request).pathSlot().headerSlot("x-request-id")
+	                                                        .bodySlot().build();
+
+	PreparedRequest::Values values;
+	values.path = "/items/42?full=1";
+	values.headers[0] = "abc";
+	values.body = "{\"id\":42}";
+	IoSlice slices[PreparedRequest::MAX_SLICES];
+	char digits[20];
+	size_t count = prepared.gather(values, slices, digits);
+	std::string wire;
+	for (size_t i = 0; i < count; ++i)
+	{
+		wire.append(slices[i].data, slices[i].len);
+	}
+	EXPECT_EQ("POST /items/42?full=1 HTTP/1.1\r\nAccept: */*\r\nHost: example.com\r\nUser-Agent: lwhttp/0.0.1\r\n"
+	          "X-Request-ID: abc\r\nContent-Length: 9\r\n\r\n{\"id\":42}", wire);
+
+	HttpRequest equivalent = prepared.toRequest(values);
+	EXPECT_EQ("/items/42", equivalent.uri.getPath());
+	EXPECT_EQ("abc", equivalent.header.getField("X-Request-Id"));
+	EXPECT_EQ("9", equivalent.header.getField("Content-Length"));
+
+	EXPECT_THROW(PreparedRequest::newBuilder().headerSlot("Content-Length"), std::invalid_argument);
+
+	/* A line break would inject header fields */
+	values.headers[0] = "abc\r\nX-Injected: 1";
+	EXPECT_THROW(prepared.gather(values, slices, digits), std::invalid_argument);
+	EXPECT_THROW(prepared.toRequest(values), std::invalid_argument);
+	values.headers[0] = "abc";
+	values.path = "/items\nX-Injected: 1";
+	EXPECT_THROW(prepared.gather(values, slices, digits), std::invalid_argument);
+	/* Either would send a different request line than toRequest() resolves to */
+	for (const char *path: {"/items 42", "/items\t42", "items/42", "http://other/x", "//other/x", "/a/../x",
+	                        "/a/./x", "/a/..", "/x#frag"})
+	{
+		values.path = path;
+		EXPECT_THROW(prepared.gather(values, slices, digits), std::invalid_argument) << path;
+		EXPECT_THROW(prepared.toRequest(values), std::invalid_argument) << path;
+	}
+	values.path = "/a/..b/.x?q=/../";
+	EXPECT_EQ("/a/..b/.x", prepared.toRequest(values).uri.getPath());
+
+	values.path = "";
+	count = prepared.gather(values, slices, digits);
+	wire.clear();
+	for (size_t i = 0; i < count; ++i)
+	{
+		wire.append(slices[i].data, slices[i].len);
+	}
+	EXPECT_EQ(0U, wire.find("POST / HTTP/1.1\r\n"));
+	EXPECT_EQ("/", prepared.toRequest(values).uri.getPath());
+}
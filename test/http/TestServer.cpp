@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "src/http/Connection.h"
+#include "TestServer.h"
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#endif
+
+SSL_CTX *newSelfSignedContext()
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	EVP_PKEY_CTX *keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+	EVP_PKEY *key = nullptr;
+	if ((ctx == nullptr) || (keyCtx == nullptr) || (EVP_PKEY_keygen_init(keyCtx) <= 0) ||
+	    (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1) <= 0) ||
+	    (EVP_PKEY_keygen(keyCtx, &key) <= 0))
+	{
+		throw std::runtime_error("Test server key generation failed!");
+	}
+	EVP_PKEY_CTX_free(keyCtx);
+
+	X509 *cert = X509_new();
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 24L * 3600L);
+	X509_set_pubkey(cert, key);
+	X509_NAME *name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("127.0.0.1"), -1,
+	                           -1, 0);
+	X509_set_issuer_name(cert, name);
+	X509_sign(cert, key, EVP_sha256());
+
+	if ((1 != SSL_CTX_use_certificate(ctx, cert)) || (1 != SSL_CTX_use_PrivateKey(ctx, key)))
+	{
+		throw std::runtime_error("Test server certificate setup failed!");
+	}
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ctx;
+}
+
+std::string bodyOf(HttpResponse &response)
+{
+	if (response.getResponseBody() == nullptr)
+	{
+		return {};
+	}
+	return {response.getResponseBody()->getContent(), response.getBodyLength()};
+}
+
+#ifndef _WIN32
+
+/*********************** TestConnection **********************/
+long TestConnection::read(char *buffer, size_t len)
+{
+	if (!pending.empty())
+	{
+		size_t take = std::min(len, pending.length());
+		memcpy(buffer, pending.data(), take);
+		pending.erase(0, take);
+		return static_cast<long>(take);
+	}
+	if (ssl != nullptr)
+	{
+		size_t readLen = 0;
+		return (1 == SSL_read_ex(ssl, buffer, len, &readLen)) ? static_cast<long>(readLen) : 0;
+	}
+	return recv(fd, buffer, len, 0);
+}
+
+bool TestConnection::write(const std::string &data)
+{
+	if (ssl != nullptr)
+	{
+		size_t written = 0;
+		return (1 == SSL_write_ex(ssl, data.data(), data.length(), &written)) && (written == data.length());
+	}
+	return send(fd, data.data(), data.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(data.length());
+}
+
+bool TestConnection::readRequest(std::string &head, std::string &body)
+{
+	std::string data;
+	char buffer[4096];
+	size_t headEnd;
+	while ((headEnd = data.find("\r\n\r\n")) == std::string::npos)
+	{
+		long readLen = read(buffer, sizeof(buffer));
+		if (readLen <= 0)
+		{
+			return false;
+		}
+		data.append(buffer, readLen);
+	}
+	head = data.substr(0, headEnd + 4);
+	body = data.substr(headEnd + 4);
+	std::string lower = head;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	size_t length = 0;
+	size_t field = lower.find("\r\ncontent-length:");
+	if (field != std::string::npos)
+	{
+		size_t start = lower.find_first_not_of(' ', field + 17);
+		std::from_chars(lower.data() + start, lower.data() + lower.length(), length);
+	}
+	while (body.length() < length)
+	{
+		long readLen = read(buffer, sizeof(buffer));
+		if (readLen <= 0)
+		{
+			return false;
+		}
+		body.append(buffer, readLen);
+	}
+	/* The start of a pipelined request */
+	pending = body.substr(length) + pending;
+	body.resize(length);
+	return true;
+}
+
+/************************* TestServer ************************/
+TestServer::TestServer(Handler connectionHandler, SSL_CTX *ctx) : handler(std::move(connectionHandler)), sslCtx(ctx)
+{
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addressLen = sizeof(address);
+	if ((0 != bind(listenFd, reinterpret_cast<sockaddr *>(&address), addressLen)) || (0 != listen(listenFd, 128)) ||
+	    (0 != getsockname(listenFd, reinterpret_cast<sockaddr *>(&address), &addressLen)))
+	{
+		throw std::runtime_error(std::string("Test server listen failed: ") + strerror(errno));
+	}
+	port = ntohs(address.sin_port);
+	acceptThread = std::thread(&TestServer::acceptLoop, this);
+}
+
+TestServer::TestServer(const std::string &path, Handler connectionHandler)
+		: handler(std::move(connectionHandler)), unixPath(path)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.data(), std::min(path.length(), sizeof(address.sun_path) - 1));
+	unlink(path.c_str());
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((0 != bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address))) || (0 != listen(listenFd, 128)))
+	{
+		throw std::runtime_error(std::string("Test server listen failed: ") + strerror(errno));
+	}
+	acceptThread = std::thread(&TestServer::acceptLoop, this);
+}
+
+TestServer::~TestServer()
+{
+	shutdown(listenFd, SHUT_RDWR);
+	close(listenFd);
+	acceptThread.join();
+	for (int fd: clientFds)
+	{
+		shutdown(fd, SHUT_RDWR);
+	}
+	join();
+	for (int fd: clientFds)
+	{
+		close(fd);
+	}
+	if (!unixPath.empty())
+	{
+		unlink(unixPath.c_str());
+	}
+	SSL_CTX_free(sslCtx);
+}
+
+std::string TestServer::url(const std::string &target) const
+{
+	return std::string((sslCtx != nullptr) ? "https" : "http") + "://127.0.0.1:" + std::to_string(port) + target;
+}
+
+void TestServer::join()
+{
+	std::vector<std::thread> running;
+	{
+		std::lock_guard<std::mutex> lock(workerMutex);
+		running.swap(workers);
+	}
+	for (std::thread &worker: running)
+	{
+		worker.join();
+	}
+}
+
+void TestServer::acceptLoop()
+{
+	int fd;
+	while ((fd = accept(listenFd, nullptr, nullptr)) >= 0)
+	{
+		++accepted;
+		std::lock_guard<std::mutex> lock(workerMutex);
+		clientFds.push_back(fd);
+		workers.emplace_back(&TestServer::serve, this, fd);
+	}
+}
+
+void TestServer::serve(int fd)
+{
+	SSL *ssl = nullptr;
+	if (sslCtx != nullptr)
+	{
+		ssl = SSL_new(sslCtx);
+		/* A client that reset the connection must not take the test binary down with SIGPIPE */
+		setSocketBio(ssl, fd);
+		SSL_set_accept_state(ssl);
+	}
+	TestConnection connection(fd, ssl);
+	handler(connection);
+	if (ssl != nullptr)
+	{
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+	/* The descriptor stays open until the destructor, so that no other socket can take its number meanwhile */
+	shutdown(fd, SHUT_RDWR);
+}
+
+std::string textResponse(const std::string &status, const std::string &body, const std::string &extra)
+{
+	return "HTTP/1.1 " + status + "\r\nContent-Length: " + std::to_string(body.length()) + "\r\n" + extra + "\r\n" +
+	       body;
+}
+
+TestServer::Handler keepAliveHandler(Responder respond)
+{
+	return [respond](TestConnection &connection)
+	{
+		std::string head;
+		std::string body;
+		while (connection.readRequest(head, body))
+		{
+			std::string reply = respond(head, body);
+			if (reply.empty() || !connection.write(reply))
+			{
+				return;
+			}
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef LWHTTP_TEST_TESTSERVER_H
+#define LWHTTP_TEST_TESTSERVER_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <http/lwhttp.h>
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+/* Server context with a new self-signed P-256 certificate for 127.0.0.1, clients do not verify peers. Throws
+ * std::runtime_error if the key or the certificate cannot be set up. */
+SSL_CTX *newSelfSignedContext();
+
+/* The body of response, empty without one */
+std::string bodyOf(HttpResponse &response);
+
+#ifndef _WIN32
+
+/* One accepted connection of a TestServer, plain or TLS. A TLS one shakes hands with the first read or write. */
+class TestConnection
+{
+public:
+	TestConnection(int socketFd, SSL *sslHandle) : fd(socketFd), ssl(sslHandle)
+	{
+	}
+
+	[[nodiscard]] int getFd() const
+	{
+		return fd;
+	}
+
+	/* Null for a plain connection */
+	[[nodiscard]] SSL *getSSL() const
+	{
+		return ssl;
+	}
+
+	/* Like recv(2), 0 once the peer closed */
+	long read(char *buffer, size_t len);
+
+	bool write(const std::string &data);
+
+	/* The next request head, up to and with its blank line, and its Content-Length bytes of body. False once the
+	 * peer closed. */
+	bool readRequest(std::string &head, std::string &body);
+
+	/* data is taken as read already, readRequest() starts with it */
+	void unread(const std::string &data)
+	{
+		pending = data + pending;
+	}
+
+private:
+	int fd;
+	SSL *ssl;
+	std::string pending;
+};
+
+/* Origin on a loopback port or a Unix socket, every accepted connection runs handler on a thread of its own. A
+ * connection is shut down once its handler returns, the destructor shuts down those still open and joins. */
+class TestServer
+{
+public:
+	using Handler = std::function<void(TestConnection &connection)>;
+
+	/* On 127.0.0.1, TLS with ctx unless it is null. Takes ctx over. */
+	explicit TestServer(Handler connectionHandler, SSL_CTX *ctx = nullptr);
+
+	/* On the Unix socket at path */
+	TestServer(const std::string &path, Handler connectionHandler);
+
+	TestServer(const TestServer &other) = delete;
+
+	TestServer &operator=(const TestServer &other) = delete;
+
+	~TestServer();
+
+	[[nodiscard]] unsigned short getPort() const
+	{
+		return port;
+	}
+
+	/* scheme://127.0.0.1:port followed by target */
+	[[nodiscard]] std::string url(const std::string &target) const;
+
+	/* Waits for the handlers of the connections accepted so far */
+	void join();
+
+	std::atomic<int> accepted{0};
+
+private:
+	void acceptLoop();
+
+	void serve(int fd);
+
+	Handler handler;
+	SSL_CTX *sslCtx = nullptr;
+	int listenFd = -1;
+	unsigned short port = 0;
+	std::string unixPath;
+	std::thread acceptThread;
+	std::mutex workerMutex;
+	std::vector<int> clientFds;
+	std::vector<std::thread> workers;
+};
+
+/* A response with a Content-Length, extra holds more header lines, each ending with CRLF */
+std::string textResponse(const std::string &status, const std::string &body, const std::string &extra = "");
+
+/* Handler of a keep-alive origin, respond() builds the whole response to each request. An empty one closes the
+ * connection instead. */
+using Responder = std::function<std::string(const std::string &head, const std::string &body)>;
+
+TestServer::Handler keepAliveHandler(Responder respond);
+
+#endif
+
+#endif //LWHTTP_TEST_TESTSERVER_H
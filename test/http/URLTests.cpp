@@ -46,3 +46,48 @@ TEST(URLTests, serialize)
 {
 	urlTests();
 }
+
+TEST(URLTests, resolve)
+{
+	URL base("https://www.github.com:8080/a/b/c?query");
+	std::vector<std::pair<std::string, std::string>> references{
+			{R"(http://www.google.com/)",  R"(http://www.google.com/)"},
+			{R"(HTTP://www.google.com/)",  R"(http://www.google.com/)"},
+			{R"(Https://Example.com/x)",   R"(https://Example.com/x)"},
+			{R"(//www.google.com/x?y)",    R"(https://www.google.com/x?y)"},
+			{R"(/d/e)",                    R"(https://www.github.com:8080/d/e)"},
+			{R"(d)",                       R"(https://www.github.com:8080/a/b/d)"},
+			{R"(./d/)",                    R"(https://www.github.com:8080/a/b/d/)"},
+			{R"(../d?x=1)",                R"(https://www.github.com:8080/a/d?x=1)"},
+			{R"(../../../d)",              R"(https://www.github.com:8080/d)"},
+			{R"(?x=1)",                    R"(https://www.github.com:8080/a/b/c?x=1)"},
+			{R"(d#ref)",                   R"(https://www.github.com:8080/a/b/d)"},
+	};
+
+	for (auto &item: references)
+	{
+		EXPECT_EQ(item.second, base.resolve(item.first).serialize());
+	}
+	EXPECT_EQ("www.github.com:8080", base.getAuthority());
+	EXPECT_EQ("https://www.github.com:8080", base.getOrigin());
+}
+
+TEST(URLTests, unixSocket)
+{
+	URL url("http+unix://%2Fvar%2Frun%2Fsidecar.sock/v1/items?limit=10");
+	EXPECT_EQ("/var/run/sidecar.sock", url.getSocketPath());
+	EXPECT_EQ(Scheme::Http, url.getScheme());
+	EXPECT_EQ("/v1/items", url.getPath());
+	EXPECT_EQ("limit=10", url.getQuery());
+	EXPECT_EQ("localhost", url.getAuthority());
+	EXPECT_EQ("http+unix://%2Fvar%2Frun%2Fsidecar.sock", url.getOrigin());
+	EXPECT_EQ("http+unix://%2Fvar%2Frun%2Fsidecar.sock/v1/items?limit=10", url.serialize());
+	EXPECT_EQ("http+unix://%2Fvar%2Frun%2Fsidecar.sock/v1/other", url.resolve("other").serialize());
+	EXPECT_EQ("/", URL("HTTP+UNIX://%2Ftmp%2Fa.sock").getPath());
+	EXPECT_TRUE(URL("http://localhost/").getSocketPath().empty());
+
+	EXPECT_THROW(URL("http+unix:///path"), std::invalid_argument);
+	EXPECT_THROW(URL("http+unix://%2Ftmp%2G/"), std::invalid_argument);
+	EXPECT_THROW(URL("http+unix://%2Ftmp%00x/"), std::invalid_argument);
+	EXPECT_THROW(URL("http+unix://%2F" + std::string(200, 's') + "/"), std::invalid_argument);
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "TestServer.h"
+
+#ifndef _WIN32
+
+#include <unistd.h>
+
+/* Each response body is the request line it answers and its host */
+static std::string requestLineOf(const std::string &head, const std::string &)
+{
+	std::string body = head.substr(0, head.find("\r\n"));
+	std::string lower = head;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	size_t hostStart = lower.find("\r\nhost: ");
+	if (hostStart != std::string::npos)
+	{
+		body += "|" + lower.substr(hostStart + 8, lower.find("\r\n", hostStart + 8) - hostStart - 8);
+	}
+	return textResponse("200 OK", body);
+}
+
+/* path with every '/' percent-encoded */
+static std::string encodedPath(const std::string &path)
+{
+	std::string encoded;
+	for (char ch: path)
+	{
+		encoded += (ch == '/') ? std::string("%2F") : std::string(1, ch);
+	}
+	return encoded;
+}
+
+TEST(UnixSocketTests, sendsThroughUrlAndOverride)
+{
+	const std::string path = "/tmp/lwhttp-test-" + std::to_string(getpid()) + ".sock";
+	TestServer server(path, keepAliveHandler(requestLineOf));
+	std::shared_ptr<HttpClient> client = HttpClientBuilder::newBuilder().build();
+	for (int i = 0; i < 3; ++i)
+	{
+		HttpRequest request = HttpRequestBuilder::newBuilder()
+				.url(URL("http+unix://" + encodedPath(path) + "/items?n=" + std::to_string(i))).GET().build();
+		HttpResponse response;
+		ASSERT_NE(0U, client->send(request, response));
+		EXPECT_EQ(HttpStatus::OK, response.getStatusCode());
+		EXPECT_EQ("GET /items?n=" + std::to_string(i) + " HTTP/1.1|localhost", bodyOf(response));
+	}
+	/* The pooled connection was reused */
+	EXPECT_EQ(1, server.accepted);
+
+	std::shared_ptr<HttpClient> sidecar = HttpClientBuilder::newBuilder().unixSocket(path).build();
+	HttpRequest request = HttpRequestBuilder::newBuilder().url(URL("http://sidecar.local/status")).GET().build();
+	HttpResponse response;
+	ASSERT_NE(0U, sidecar->send(request, response));
+	EXPECT_EQ("GET /status HTTP/1.1|sidecar.local", bodyOf(response));
+
+	std::mutex doneMutex;
+	std::condition_variable doneSignal;
+	std::string asyncBody;
+	bool done = false;
+	ASSERT_TRUE(sidecar->sendAsync(request, [&](size_t len, HttpResponse &asyncResponse)
+	{
+		std::lock_guard<std::mutex> lock(doneMutex);
+		asyncBody = (len != 0) ? bodyOf(asyncResponse) : "failed";
+		done = true;
+		doneSignal.notify_one();
+	}));
+	std::unique_lock<std::mutex> lock(doneMutex);
+	ASSERT_TRUE(doneSignal.wait_for(lock, std::chrono::seconds(10), [&done]()
+	{ return done; }));
+	EXPECT_EQ("GET /status HTTP/1.1|sidecar.local", asyncBody);
+
+	EXPECT_THROW(HttpClientBuilder::newBuilder().unixSocket(""), std::invalid_argument);
+	EXPECT_THROW(HttpClientBuilder::newBuilder().unixSocket(std::string(200, 's')), std::invalid_argument);
+	HttpRequest missing = HttpRequestBuilder::newBuilder().url(URL("http+unix://%2Fnonexistent.sock/")).GET().build();
+	EXPECT_EQ(0U, client->send(missing, response));
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <http/utils.h>
+
+static const SearchKernel kernels[] = {SearchKernel::SCALAR, SearchKernel::SSE2, SearchKernel::AVX2};
+
+TEST(UtilsTests, findBoundaries)
+{
+	const std::string data = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+	for (SearchKernel kernel: kernels)
+	{
+		if (!isSearchKernelSupported(kernel))
+		{
+			continue;
+		}
+		EXPECT_EQ(findFirstOf(kernel, "\r\n", 2, data.c_str(), data.length()), std::make_pair(true, size_t(15)));
+		EXPECT_EQ(findLastOf(kernel, "\r\n", 2, data.c_str(), data.length()), std::make_pair(true, data.length() - 2));
+		EXPECT_EQ(findFirstOf(kernel, "\r\n\r\n", 4, data.c_str(), data.length()).second, data.length() - 4);
+		EXPECT_EQ(findFirstOf(kernel, "HTTP", 4, data.c_str(), data.length()), std::make_pair(true, size_t(0)));
+		EXPECT_EQ(findLastOf(kernel, "HTTP", 4, data.c_str(), data.length()), std::make_pair(true, size_t(0)));
+		EXPECT_FALSE(findFirstOf(kernel, "0\r\n\r\n\r", 6, data.c_str(), data.length()).first);
+		EXPECT_FALSE(findLastOf(kernel, "chunked", 7, data.c_str(), data.length()).first);
+		EXPECT_FALSE(findFirstOf(kernel, "\r\n", 2, data.c_str(), 1).first);
+	}
+}
+
+/* Every kernel must agree with std::string::find and rfind for all pattern and buffer lengths around the block size */
+TEST(UtilsTests, findMatchesStdString)
+{
+	std::mt19937 random(20231019);
+	std::uniform_int_distribution<int> alphabet(0, 3);
+	const char letters[] = "\r\n0a";
+	for (int round = 0; round < 2000; ++round)
+	{
+		std::string data(random() % 200, ' ');
+		for (auto &ch: data)
+		{
+			ch = letters[alphabet(random)];
+		}
+		std::string target(1 + random() % 6, ' ');
+		for (auto &ch: target)
+		{
+			ch = letters[alphabet(random)];
+		}
+		size_t first = data.find(target);
+		size_t last = data.rfind(target);
+		for (SearchKernel kernel: kernels)
+		{
+			if (!isSearchKernelSupported(kernel))
+			{
+				continue;
+			}
+			auto found = findFirstOf(kernel, target.c_str(), target.length(), data.c_str(), data.length());
+			ASSERT_EQ(found.first, first != std::string::npos);
+			if (found.first)
+			{
+				ASSERT_EQ(found.second, first);
+			}
+			found = findLastOf(kernel, target.c_str(), target.length(), data.c_str(), data.length());
+			ASSERT_EQ(found.first, last != std::string::npos);
+			if (found.first)
+			{
+				ASSERT_EQ(found.second, last);
+			}
+		}
+	}
+}
+
+/* Every kernel must agree with the byte loop of RFC 6455 for all lengths, offsets and alignments */
+TEST(UtilsTests, maskMatchesByteLoop)
+{
+	std::mt19937 random(20231020);
+	for (int round = 0; round < 500; ++round)
+	{
+		std::string data(random() % 300, ' ');
+		for (auto &ch: data)
+		{
+			ch = static_cast<char>(random());
+		}
+		const uint8_t key[4] = {static_cast<uint8_t>(random()), static_cast<uint8_t>(random()),
+		                        static_cast<uint8_t>(random()), static_cast<uint8_t>(random())};
+		size_t start = data.empty() ? 0 : random() % data.length();
+		size_t offset = random() % 8;
+		std::string expected = data;
+		for (size_t i = start; i < expected.length(); ++i)
+		{
+			expected[i] = static_cast<char>(expected[i] ^ key[(offset + i - start) % 4]);
+		}
+		for (SearchKernel kernel: kernels)
+		{
+			if (!isSearchKernelSupported(kernel))
+			{
+				continue;
+			}
+			std::string masked = data;
+			applyMask(kernel, masked.data() + start, masked.length() - start, key, offset);
+			ASSERT_EQ(expected, masked);
+		}
+	}
+}
@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <http/lwhttp.h>
+
+#include "src/http/WebSocketCodec.h"
+#include "TestServer.h"
+
+/* An unmasked frame as a server sends it */
+static std::string serverFrame(uint8_t opcode, const std::string &payload, bool fin = true)
+{
+	std::string frame;
+	frame += static_cast<char>((fin ? 0x80 : 0) | opcode);
+	if (payload.length() < 126)
+	{
+		frame += static_cast<char>(payload.length());
+	}
+	else
+	{
+		frame += static_cast<char>(126);
+		frame += static_cast<char>(payload.length() >> 8);
+		frame += static_cast<char>(payload.length());
+	}
+	return frame + payload;
+}
+
+static void feed(FrameParser &parser, const std::string &data)
+{
+	char *space = parser.space();
+	ASSERT_GE(parser.spaceLen(), data.length());
+	memcpy(space, data.data(), data.length());
+	parser.commit(data.length());
+}
+
+TEST(WebSocketTests, handshakeKeys)
+{
+	/* The example of RFC 6455 */
+	EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", webSocketAccept("dGhlIHNhbXBsZSBub25jZQ=="));
+	EXPECT_EQ(24U, webSocketKey().length());
+	EXPECT_NE(webSocketKey(), webSocketKey());
+
+	EXPECT_TRUE(isValidUtf8("plain ascii text", 16));
+	EXPECT_TRUE(isValidUtf8("\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80", 9));
+	/* Overlong, surrogate, beyond U+10FFFF and truncated */
+	EXPECT_FALSE(isValidUtf8("\xC0\xAF", 2));
+	EXPECT_FALSE(isValidUtf8("\xED\xA0\x80", 3));
+	EXPECT_FALSE(isValidUtf8("\xF4\x90\x80\x80", 4));
+	EXPECT_FALSE(isValidUtf8("abcdefgh\xE2\x82", 10));
+}
+
+TEST(WebSocketTests, encodesAndParsesFrames)
+{
+	const uint8_t key[4] = {0x37, 0xFA, 0x21, 0x3D};
+	Buffer output;
+	encodeFrame(output, WebSocketOpcode::TEXT, false, "Hello", 5, key);
+	/* The masked "Hello" of RFC 6455 */
+	EXPECT_EQ(std::string("\x81\x85\x37\xFA\x21\x3D\x7F\x9F\x4D\x51\x58", 11), std::string(output.data(), output.size()));
+	output.clear();
+	std::string payload(70000, 'p');
+	encodeFrame(output, WebSocketOpcode::BINARY, true, payload.data(), payload.length(), key);
+	EXPECT_EQ(payload.length() + 14, output.size());
+	EXPECT_EQ(static_cast<char>(0xC2), output.data()[0]);
+
+	FrameParser parser(1024, false);
+	WebSocketFrame frame{};
+	std::string data = serverFrame(0x1, "first", false) + serverFrame(0x9, "ping") + serverFrame(0x0, std::string(300, 'x'));
+	/* One byte at a time, a frame appears only once it is whole */
+	size_t frames = 0;
+	for (char ch: data)
+	{
+		feed(parser, std::string(1, ch));
+		if (parser.next(frame))
+		{
+			++frames;
+		}
+	}
+	EXPECT_EQ(3U, frames);
+	EXPECT_EQ(WebSocketOpcode::CONTINUATION, frame.opcode);
+	EXPECT_TRUE(frame.fin);
+	EXPECT_EQ(std::string(300, 'x'), std::string(frame.payload, frame.len));
+
+	feed(parser, serverFrame(0x2, std::string(2000, 'y')));
+	EXPECT_THROW(parser.next(frame), WebSocketError);
+	FrameParser masked(1024, false);
+	feed(masked, std::string("\x81\x80\x00\x00\x00\x00", 6));
+	EXPECT_THROW(masked.next(frame), WebSocketError);
+	FrameParser compressed(1024, false);
+	feed(compressed, std::string("\xC1\x00", 2));
+	EXPECT_THROW(compressed.next(frame), WebSocketError);
+	FrameParser longPing(1024, false);
+	feed(longPing, serverFrame(0x9, std::string(126, 'z')));
+	EXPECT_THROW(longPing.next(frame), WebSocketError);
+}
+
+TEST(WebSocketTests, negotiatesDeflate)
+{
+	PerMessageDeflate::Parameters parameters = PerMessageDeflate::accept(
+			"permessage-deflate; client_max_window_bits=10; server_no_context_takeover");
+	EXPECT_EQ(10U, parameters.clientBits);
+	EXPECT_EQ(15U, parameters.serverBits);
+	EXPECT_TRUE(parameters.serverNoContext);
+	EXPECT_FALSE(parameters.clientNoContext);
+	EXPECT_THROW(PerMessageDeflate::accept("x-webkit-deflate-frame"), std::runtime_error);
+	EXPECT_THROW(PerMessageDeflate::accept("permessage-deflate; client_max_window_bits=16"), std::runtime_error);
+	EXPECT_THROW(PerMessageDeflate::accept("permessage-deflate; server_no_context_takeover; server_no_context_takeover"),
+	             std::runtime_error);
+	EXPECT_THROW(PerMessageDeflate::accept("permessage-deflate, permessage-deflate"), std::runtime_error);
+	if (!PerMessageDeflate::isAvailable())
+	{
+		return;
+	}
+	/* The client's output read back by the same algorithm the server uses, both keep their context */
+	PerMessageDeflate sender(PerMessageDeflate::Parameters{});
+	PerMessageDeflate receiver(PerMessageDeflate::Parameters{});
+	std::string message;
+	for (int i = 0; i < 200; ++i)
+	{
+		message += "repeated text " + std::to_string(i % 7) + " ";
+	}
+	std::string compressed;
+	std::string inflated;
+	for (int round = 0; round < 3; ++round)
+	{
+		ASSERT_TRUE(sender.compress(message.data(), message.length(), compressed));
+		EXPECT_LT(compressed.length(), message.length() / 4);
+		receiver.decompress(compressed.data(), compressed.length(), message.length(), inflated);
+		EXPECT_EQ(message, inflated);
+	}
+	EXPECT_THROW(receiver.decompress(compressed.data(), compressed.length(), 100, inflated), WebSocketError);
+}
+
+#ifndef _WIN32
+
+/* Handler answering one handshake, then running script on the connection */
+template<typename Script>
+static TestServer::Handler scripted(Script script)
+{
+	return [script](TestConnection &connection)
+	{
+		std::string head;
+		std::string body;
+		if (!connection.readRequest(head, body))
+		{
+			return;
+		}
+		std::string lower = head;
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+		size_t keyStart = head.find_first_not_of(' ', lower.find("sec-websocket-key:") + 18);
+		std::string key = head.substr(keyStart, 24);
+		std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+		                    "Connection: Upgrade\r\nSec-WebSocket-Accept: " + webSocketAccept(key) + "\r\n\r\n";
+		script(connection, reply);
+	};
+}
+
+static bool readExactly(TestConnection &connection, void *buffer, size_t len)
+{
+	char *data = static_cast<char *>(buffer);
+	for (size_t offset = 0; offset < len;)
+	{
+		long readLen = connection.read(data + offset, len - offset);
+		if (readLen <= 0)
+		{
+			return false;
+		}
+		offset += readLen;
+	}
+	return true;
+}
+
+/* The payload of the next client frame, unmasked */
+static std::string readFrame(TestConnection &connection, uint8_t &opcode)
+{
+	uint8_t header[2];
+	if (!readExactly(connection, header, 2))
+	{
+		return {};
+	}
+	opcode = header[0] & 0x0F;
+	size_t len = header[1] & 0x7F;
+	if (len == 126)
+	{
+		uint8_t extended[2];
+		readExactly(connection, extended, 2);
+		len = (extended[0] << 8) | extended[1];
+	}
+	uint8_t key[4];
+	readExactly(connection, key, 4);
+	std::string payload(len, '\0');
+	readExactly(connection, payload.data(), len);
+	for (size_t i = 0; i < len; ++i)
+	{
+		payload[i] = static_cast<char>(payload[i] ^ key[i % 4]);
+	}
+	return payload;
+}
+
+/* The whole exchange of receivesAndCloses, over TLS if secure */
+static void receiveAndClose(bool secure)
+{
+	std::string pong;
+	std::string echoed;
+	uint8_t closeOpcode = 0;
+	TestServer server(scripted([&](TestConnection &connection, const std::string &reply)
+	                           {
+		                           /* A message behind the response, then one in fragments with a ping between */
+		                           connection.write(reply + serverFrame(0x1, "greeting") +
+		                                            serverFrame(0x2, "frag", false) +
+		                                            serverFrame(0x9, "are you there") + serverFrame(0x0, "mented"));
+		                           uint8_t opcode;
+		                           pong = readFrame(connection, opcode);
+		                           echoed = readFrame(connection, opcode);
+		                           connection.write(serverFrame(0x8, std::string("\x0F\xA0" "bye", 5)));
+		                           readFrame(connection, closeOpcode);
+	                           }), secure ? newSelfSignedContext() : nullptr);
+	auto socket = WebSocket::connect(std::string(secure ? "wss" : "ws") + "://127.0.0.1:" +
+	                                 std::to_string(server.getPort()) + "/chat");
+	WebSocketMessage message;
+	ASSERT_TRUE(socket->receive(message));
+	EXPECT_EQ("greeting", message.data);
+	EXPECT_TRUE(message.isText());
+	ASSERT_TRUE(socket->receive(message));
+	EXPECT_EQ("fragmented", message.data);
+	EXPECT_FALSE(message.isText());
+	EXPECT_TRUE(socket->sendText(std::string(200, 'e')));
+	EXPECT_FALSE(socket->receive(message));
+	EXPECT_FALSE(socket->isOpen());
+	EXPECT_EQ(4000, socket->getCloseCode());
+	EXPECT_EQ("bye", socket->getCloseReason());
+	EXPECT_FALSE(socket->sendText("late"));
+	socket.reset();
+	server.join();
+	EXPECT_EQ("are you there", pong);
+	EXPECT_EQ(std::string(200, 'e'), echoed);
+	EXPECT_EQ(0x8, closeOpcode);
+}
+
+TEST(WebSocketTests, receivesAndCloses)
+{
+	receiveAndClose(false);
+}
+
+TEST(WebSocketTests, receivesAndClosesOverTls)
+{
+	receiveAndClose(true);
+}
+
+/* Signals the message "after" and the close */
+class SignallingHandler : public WebSocketHandler
+{
+public:
+	void onMessage(WebSocket &socket, WebSocketMessage &message) override
+	{
+		if (message.data == "after")
+		{
+			after.set_value();
+		}
+	}
+
+	void onClose(WebSocket &socket, uint16_t code, std::string_view reason) override
+	{
+		closed.set_value(code);
+	}
+
+	std::promise<void> after;
+	std::promise<uint16_t> closed;
+};
+
+/* Records the messages and the thread they came on, signals the close */
+class RecordingHandler : public WebSocketHandler
+{
+public:
+	void onMessage(WebSocket &socket, WebSocketMessage &message) override
+	{
+		std::lock_guard<std::mutex> lock(recordMutex);
+		messages.push_back(message.data);
+		threads.insert(std::this_thread::get_id());
+		if (message.data == "ping me")
+		{
+			socket.sendText("sent from the handler");
+		}
+	}
+
+	void onClose(WebSocket &socket, uint16_t code, std::string_view reason) override
+	{
+		closed.set_value(code);
+	}
+
+	std::mutex recordMutex;
+	std::vector<std::string> messages;
+	std::set<std::thread::id> threads;
+	std::promise<uint16_t> closed;
+};
+
+TEST(WebSocketTests, wssListenersShareEventLoops)
+{
+	/* More sockets than there are loops */
+	const int SOCKETS = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1U)) + 4;
+	std::vector<std::string> echoed(SOCKETS);
+	TestServer server(scripted([&](TestConnection &connection, const std::string &reply)
+	                           {
+		                           uint8_t opcode;
+		                           connection.write(reply + serverFrame(0x1, "first") + serverFrame(0x9, "p") +
+		                                            serverFrame(0x1, "ping me"));
+		                           /* The pong, the reply of the handler and the index sent by the test, in any
+		                            * order */
+		                           std::string pong;
+		                           std::string text;
+		                           int index = -1;
+		                           for (int i = 0; i < 3; ++i)
+		                           {
+			                           std::string payload = readFrame(connection, opcode);
+			                           if (opcode == 0xA)
+			                           {
+				                           pong = payload;
+			                           }
+			                           else if (!payload.empty() && isdigit(static_cast<unsigned char>(payload[0])))
+			                           {
+				                           index = std::stoi(payload);
+			                           }
+			                           else
+			                           {
+				                           text = payload;
+			                           }
+		                           }
+		                           if ((index >= 0) && (index < SOCKETS))
+		                           {
+			                           echoed[index] = pong + "|" + text;
+		                           }
+		                           connection.write(serverFrame(0x8, std::string("\x03\xE8", 2)));
+		                           readFrame(connection, opcode);
+	                           }), newSelfSignedContext());
+	std::vector<std::shared_ptr<RecordingHandler>> handlers;
+	for (int i = 0; i < SOCKETS; ++i)
+	{
+		auto socket = WebSocket::connect("wss://127.0.0.1:" + std::to_string(server.getPort()) + "/");
+		auto handler = std::make_shared<RecordingHandler>();
+		handlers.push_back(handler);
+		socket->listen(handler);
+		/* A send from another thread while the loop reads */
+		EXPECT_TRUE(socket->sendText(std::to_string(i)) || !socket->isOpen());
+	}
+	std::set<std::thread::id> threads;
+	for (int i = 0; i < SOCKETS; ++i)
+	{
+		std::future<uint16_t> closed = handlers[i]->closed.get_future();
+		ASSERT_EQ(std::future_status::ready, closed.wait_for(std::chrono::seconds(10)));
+		EXPECT_EQ(WS_CLOSE_NORMAL, closed.get());
+		EXPECT_EQ((std::vector<std::string>{"first", "ping me"}), handlers[i]->messages);
+		threads.insert(handlers[i]->threads.begin(), handlers[i]->threads.end());
+	}
+	server.join();
+	for (int i = 0; i < SOCKETS; ++i)
+	{
+		EXPECT_EQ("p|sent from the handler", echoed[i]);
+	}
+	/* The loop threads of the process, not one thread per socket */
+	EXPECT_LE(threads.size(), static_cast<size_t>(SOCKETS - 4));
+}
+
+TEST(WebSocketTests, listenerQueuesControlReplies)
+{
+	auto handler = std::make_shared<SignallingHandler>();
+	std::shared_future<void> delivered = handler->after.get_future().share();
+	std::string pings;
+	for (int i = 0; i < 200000; ++i)
+	{
+		pings += serverFrame(0x9, std::string(125, 'p'));
+	}
+	size_t pongs = 0;
+	uint8_t opcode = 0;
+	TestServer server(scripted([&](TestConnection &connection, const std::string &reply)
+	                           {
+		                           /* Far more pongs than the socket buffers hold while the server does not read */
+		                           connection.write(reply + pings + serverFrame(0x1, "after"));
+		                           delivered.wait_for(std::chrono::seconds(10));
+		                           connection.write(serverFrame(0x8, std::string("\x03\xE8", 2)));
+		                           do
+		                           {
+			                           opcode = 0;
+			                           readFrame(connection, opcode);
+			                           pongs += (opcode == 0xA) ? 1 : 0;
+		                           } while (opcode == 0xA);
+	                           }));
+	auto socket = WebSocket::connect("ws://127.0.0.1:" + std::to_string(server.getPort()) + "/");
+	socket->listen(handler);
+	EXPECT_EQ(std::future_status::ready, delivered.wait_for(std::chrono::seconds(10)));
+	std::future<uint16_t> closed = handler->closed.get_future();
+	ASSERT_EQ(std::future_status::ready, closed.wait_for(std::chrono::seconds(10)));
+	EXPECT_EQ(WS_CLOSE_NORMAL, closed.get());
+	server.join();
+	EXPECT_GE(pongs, 1U);
+	EXPECT_EQ(0x8, opcode);
+}
+
+TEST(WebSocketTests, refusesBadHandshake)
+{
+	TestServer server(scripted([](TestConnection &connection, const std::string &)
+	                           {
+		                           connection.write("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+		                                            "Connection: Upgrade\r\nSec-WebSocket-Accept: xxxx\r\n\r\n");
+	                           }));
+	EXPECT_THROW(WebSocket::connect("ws://127.0.0.1:" + std::to_string(server.getPort()) + "/"), std::runtime_error);
+}
+
+#endif